@@ -0,0 +1,392 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "aggressive_nsec.hh"
+#include "base32.hh"
+#include "dnssecinfra.hh"
+#include "syncres.hh"
+
+size_t AggressiveNSECCache::s_maxEntries;
+
+/* names below a delegation point or a DNAME belong to another zone */
+static bool isCut(const std::set<uint16_t>& types)
+{
+  return (types.count(QType::NS) && !types.count(QType::SOA)) || types.count(QType::DNAME);
+}
+
+void AggressiveNSECCache::insertDenials(time_t now, const vector<DNSRecord>& records)
+{
+  map<DNSName, const DNSRecord*> soas;
+  map<pair<DNSName, uint16_t>, vector<DNSRecord> > signatures;
+  vector<const DNSRecord*> denials;
+
+  for(const auto& rec : records) {
+    if(rec.d_type == QType::SOA && rec.d_place == DNSResourceRecord::AUTHORITY) {
+      soas[rec.d_name] = &rec;
+    }
+    else if((rec.d_type == QType::NSEC || rec.d_type == QType::NSEC3) && rec.d_place == DNSResourceRecord::AUTHORITY) {
+      denials.push_back(&rec);
+    }
+    else if(rec.d_type == QType::RRSIG) {
+      auto rrsig = getRR<RRSIGRecordContent>(rec);
+      if(rrsig)
+        signatures[make_pair(rec.d_name, rrsig->d_type)].push_back(rec);
+    }
+  }
+
+  for(const auto rec : denials) {
+    const auto& sigs = signatures[make_pair(rec->d_name, rec->d_type)];
+    if(sigs.empty())
+      continue;
+    auto rrsig = getRR<RRSIGRecordContent>(sigs.front());
+    // a record synthesized from a wildcard says nothing about the range it was expanded into
+    if(!rrsig || rrsig->d_labels < rec->d_name.countLabels() || !rec->d_name.isPartOf(rrsig->d_signer))
+      continue;
+    const DNSName& zoneName = rrsig->d_signer;
+    auto soaIt = soas.find(zoneName);
+    if(soaIt == soas.end())
+      continue;
+    const DNSRecord& soa = *soaIt->second;
+    auto soaContent = getRR<SOARecordContent>(soa);
+    if(!soaContent)
+      continue;
+
+    uint32_t ttl = std::min(std::min(rec->d_ttl, soa.d_ttl), std::min(soaContent->d_st.minimum, SyncRes::s_maxnegttl));
+    if(!ttl)
+      continue;
+
+    Entry entry;
+    entry.d_record = *rec;
+    entry.d_signatures = sigs;
+    entry.d_ttd = now + ttl;
+
+    std::string hash;
+    if(rec->d_type == QType::NSEC3) {
+      auto nsec3 = getRR<NSEC3RecordContent>(*rec);
+      if(!nsec3 || nsec3->d_algorithm != 1 || nsec3->d_iterations > s_maxNSEC3Iterations || rec->d_name.countLabels() != zoneName.countLabels() + 1)
+        continue;
+      hash = fromBase32Hex(rec->d_name.getRawLabels().front());
+      if(hash.size() != 20 || nsec3->d_nexthash.size() != 20)
+        continue;
+    }
+    else if(!getRR<NSECRecordContent>(*rec)) {
+      continue;
+    }
+
+    auto& zone = d_zones[zoneName];
+    zone.d_lastInsert = now;
+    if(zone.d_soaTTD < now + soa.d_ttl) {
+      zone.d_soa = soa;
+      zone.d_soaSignatures = signatures[make_pair(soa.d_name, QType::SOA)];
+      zone.d_soaTTD = now + soa.d_ttl;
+    }
+
+    if(rec->d_type == QType::NSEC3) {
+      auto nsec3 = getRR<NSEC3RecordContent>(*rec);
+      if(nsec3->d_salt != zone.d_salt || nsec3->d_iterations != zone.d_iterations) {
+        // the zone has been re-salted, the hashes we hold are of no use anymore
+        d_entriesCount -= zone.d_nsec3s.size();
+        zone.d_nsec3s.clear();
+        zone.d_salt = nsec3->d_salt;
+        zone.d_iterations = nsec3->d_iterations;
+      }
+      auto res = zone.d_nsec3s.insert(make_pair(hash, entry));
+      if(res.second)
+        d_entriesCount++;
+      else
+        res.first->second = entry;
+    }
+    else {
+      auto res = zone.d_nsecs.insert(make_pair(rec->d_name, entry));
+      if(res.second)
+        d_entriesCount++;
+      else
+        res.first->second = entry;
+    }
+  }
+}
+
+const AggressiveNSECCache::Entry* AggressiveNSECCache::getCoveringNSEC(time_t now, const ZoneEntry& zone, const DNSName& name) const
+{
+  // the entry with the largest owner name not after name, in canonical order
+  auto it = zone.d_nsecs.upper_bound(name);
+  if(it == zone.d_nsecs.begin())
+    return nullptr;
+  --it;
+  if(it->second.d_ttd <= now)
+    return nullptr;
+
+  auto nsec = getRR<NSECRecordContent>(it->second.d_record);
+  const DNSName& owner = it->first;
+  if(owner == name)
+    return &it->second;
+  // the last NSEC of the chain points back to the apex and covers everything after its owner
+  if(name.canonCompare(nsec->d_next) || !owner.canonCompare(nsec->d_next))
+    return &it->second;
+  return nullptr;
+}
+
+const AggressiveNSECCache::Entry* AggressiveNSECCache::getMatchingNSEC3(time_t now, const ZoneEntry& zone, const std::string& hash) const
+{
+  auto it = zone.d_nsec3s.find(hash);
+  if(it == zone.d_nsec3s.end() || it->second.d_ttd <= now)
+    return nullptr;
+  return &it->second;
+}
+
+const AggressiveNSECCache::Entry* AggressiveNSECCache::getCoveringNSEC3(time_t now, const ZoneEntry& zone, const std::string& hash) const
+{
+  if(zone.d_nsec3s.empty())
+    return nullptr;
+  auto it = zone.d_nsec3s.upper_bound(hash);
+  // hashes before the first owner are covered by the last NSEC3 of the chain, if we have it
+  if(it == zone.d_nsec3s.begin())
+    it = zone.d_nsec3s.end();
+  --it;
+  if(it->second.d_ttd <= now || it->first == hash)
+    return nullptr;
+
+  auto nsec3 = getRR<NSEC3RecordContent>(it->second.d_record);
+  const std::string& owner = it->first;
+  const std::string& next = nsec3->d_nexthash;
+  bool covered;
+  if(owner < next)
+    covered = owner < hash && hash < next;
+  else
+    covered = owner < hash || hash < next;
+  return covered ? &it->second : nullptr;
+}
+
+bool AggressiveNSECCache::getNSECDenial(time_t now, const ZoneEntry& zone, const DNSName& qname, const QType& qtype, std::vector<const Entry*>& proof, int& res) const
+{
+  const Entry* entry = getCoveringNSEC(now, zone, qname);
+  if(!entry)
+    return false;
+  auto nsec = getRR<NSECRecordContent>(entry->d_record);
+  const DNSName& owner = entry->d_record.d_name;
+
+  if(owner == qname) {
+    // NODATA, unless the type or a CNAME exists, or this is a delegation and the type lives in the child
+    if(nsec->d_set.count(qtype.getCode()) || nsec->d_set.count(QType::CNAME))
+      return false;
+    if(isCut(nsec->d_set) && qtype != QType::DS)
+      return false;
+    proof.push_back(entry);
+    res = RCode::NoError;
+    return true;
+  }
+
+  if(qname.isPartOf(owner) && isCut(nsec->d_set))
+    return false;
+
+  if(nsec->d_next.isPartOf(qname)) {
+    // qname is an empty non-terminal
+    proof.push_back(entry);
+    res = RCode::NoError;
+    return true;
+  }
+
+  // the closest encloser is the longest ancestor of qname shared with either end of the range
+  DNSName closestEncloser(qname);
+  while(closestEncloser.chopOff()) {
+    if(owner.isPartOf(closestEncloser) || nsec->d_next.isPartOf(closestEncloser))
+      break;
+  }
+
+  DNSName wildcard = g_wildcarddnsname + closestEncloser;
+  const Entry* wcEntry = getCoveringNSEC(now, zone, wildcard);
+  // a matching wildcard would have to be expanded, leave that to the authoritative servers
+  if(!wcEntry || wcEntry->d_record.d_name == wildcard)
+    return false;
+
+  proof.push_back(entry);
+  if(wcEntry != entry)
+    proof.push_back(wcEntry);
+  res = RCode::NXDomain;
+  return true;
+}
+
+bool AggressiveNSECCache::getNSEC3Denial(time_t now, const ZoneEntry& zone, const DNSName& qname, const QType& qtype, std::vector<const Entry*>& proof, int& res) const
+{
+  if(zone.d_nsec3s.empty())
+    return false;
+
+  const DNSName& zoneName = zone.d_soa.d_name;
+  const Entry* entry = getMatchingNSEC3(now, zone, hashQNameWithSalt(zone.d_salt, zone.d_iterations, qname));
+  if(entry) {
+    auto nsec3 = getRR<NSEC3RecordContent>(entry->d_record);
+    if(nsec3->d_set.count(qtype.getCode()) || nsec3->d_set.count(QType::CNAME))
+      return false;
+    if(isCut(nsec3->d_set) && qtype != QType::DS)
+      return false;
+    proof.push_back(entry);
+    res = RCode::NoError;
+    return true;
+  }
+
+  // closest encloser proof: the closest existing ancestor, and the next closer name not existing
+  DNSName nextCloser(qname);
+  DNSName closestEncloser(qname);
+  const Entry* ceEntry = nullptr;
+  while(closestEncloser != zoneName && closestEncloser.chopOff()) {
+    ceEntry = getMatchingNSEC3(now, zone, hashQNameWithSalt(zone.d_salt, zone.d_iterations, closestEncloser));
+    if(ceEntry)
+      break;
+    nextCloser = closestEncloser;
+  }
+  if(!ceEntry)
+    return false;
+  auto ceContent = getRR<NSEC3RecordContent>(ceEntry->d_record);
+  if(isCut(ceContent->d_set))
+    return false;
+
+  const Entry* ncEntry = getCoveringNSEC3(now, zone, hashQNameWithSalt(zone.d_salt, zone.d_iterations, nextCloser));
+  // an opt-out range may hide unsigned delegations
+  if(!ncEntry || (getRR<NSEC3RecordContent>(ncEntry->d_record)->d_flags & 1))
+    return false;
+
+  const Entry* wcEntry = getCoveringNSEC3(now, zone, hashQNameWithSalt(zone.d_salt, zone.d_iterations, g_wildcarddnsname + closestEncloser));
+  if(!wcEntry)
+    return false;
+
+  proof.push_back(ceEntry);
+  if(ncEntry != ceEntry)
+    proof.push_back(ncEntry);
+  if(wcEntry != ceEntry && wcEntry != ncEntry)
+    proof.push_back(wcEntry);
+  res = RCode::NXDomain;
+  return true;
+}
+
+bool AggressiveNSECCache::getDenial(time_t now, const DNSName& qname, const QType& qtype, vector<DNSRecord>& ret, int& res, bool withProof)
+{
+  if(d_zones.empty())
+    return false;
+
+  // a DS record lives in the parent zone
+  DNSName zoneName(qname);
+  if(qtype == QType::DS && !zoneName.chopOff())
+    return false;
+
+  auto zoneIt = d_zones.end();
+  do {
+    zoneIt = d_zones.find(zoneName);
+  }
+  while(zoneIt == d_zones.end() && zoneName.chopOff());
+
+  if(zoneIt == d_zones.end() || zoneIt->second.d_soaTTD <= now)
+    return false;
+
+  const ZoneEntry& zone = zoneIt->second;
+  std::vector<const Entry*> proof;
+  if(!getNSECDenial(now, zone, qname, qtype, proof, res) && !getNSEC3Denial(now, zone, qname, qtype, proof, res))
+    return false;
+
+  time_t ttd = zone.d_soaTTD;
+  for(const auto entry : proof)
+    ttd = std::min(ttd, entry->d_ttd);
+  uint32_t ttl = ttd - now;
+
+  DNSRecord soa = zone.d_soa;
+  soa.d_ttl = ttl;
+  soa.d_place = DNSResourceRecord::AUTHORITY;
+  ret.push_back(soa);
+  if(withProof) {
+    for(auto sig : zone.d_soaSignatures) {
+      sig.d_ttl = ttl;
+      sig.d_place = DNSResourceRecord::AUTHORITY;
+      ret.push_back(sig);
+    }
+    for(const auto entry : proof) {
+      DNSRecord rec = entry->d_record;
+      rec.d_ttl = ttl;
+      rec.d_place = DNSResourceRecord::AUTHORITY;
+      ret.push_back(rec);
+      for(auto sig : entry->d_signatures) {
+        sig.d_ttl = ttl;
+        sig.d_place = DNSResourceRecord::AUTHORITY;
+        ret.push_back(sig);
+      }
+    }
+  }
+  return true;
+}
+
+void AggressiveNSECCache::eraseZone(std::map<DNSName, ZoneEntry>::iterator it)
+{
+  d_entriesCount -= it->second.d_nsecs.size() + it->second.d_nsec3s.size();
+  d_zones.erase(it);
+}
+
+uint64_t AggressiveNSECCache::wipe(const DNSName& name, bool subtree)
+{
+  uint64_t erased = 0;
+  // the ranges of a zone can deny any name in it, so the whole enclosing zone goes
+  for(auto it = d_zones.begin(); it != d_zones.end(); ) {
+    if(name.isPartOf(it->first) || (subtree && it->first.isPartOf(name))) {
+      erased += it->second.d_nsecs.size() + it->second.d_nsec3s.size();
+      eraseZone(it++);
+    }
+    else
+      ++it;
+  }
+  return erased;
+}
+
+void AggressiveNSECCache::prune(time_t now, size_t maxEntries)
+{
+  for(auto zoneIt = d_zones.begin(); zoneIt != d_zones.end(); ) {
+    auto& zone = zoneIt->second;
+    for(auto it = zone.d_nsecs.begin(); it != zone.d_nsecs.end(); ) {
+      if(it->second.d_ttd <= now) {
+        zone.d_nsecs.erase(it++);
+        d_entriesCount--;
+      }
+      else
+        ++it;
+    }
+    for(auto it = zone.d_nsec3s.begin(); it != zone.d_nsec3s.end(); ) {
+      if(it->second.d_ttd <= now) {
+        zone.d_nsec3s.erase(it++);
+        d_entriesCount--;
+      }
+      else
+        ++it;
+    }
+    if((zone.d_nsecs.empty() && zone.d_nsec3s.empty()) || zone.d_soaTTD <= now)
+      eraseZone(zoneIt++);
+    else
+      ++zoneIt;
+  }
+
+  // still too large, drop the zones that have not been refreshed for the longest time
+  while(d_entriesCount > maxEntries && !d_zones.empty()) {
+    auto oldest = d_zones.begin();
+    for(auto it = d_zones.begin(); it != d_zones.end(); ++it) {
+      if(it->second.d_lastInsert < oldest->second.d_lastInsert)
+        oldest = it;
+    }
+    eraseZone(oldest);
+  }
+}
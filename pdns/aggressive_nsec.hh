@@ -0,0 +1,87 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "dnsname.hh"
+#include "dnsparser.hh"
+#include "qtype.hh"
+
+/* Aggressive use of DNSSEC-validated cache (RFC 8198): the NSEC and NSEC3 records of
+   negative answers that validated as Secure are kept per zone, ordered the way the zone
+   chain is, so that NXDOMAIN and NODATA answers can be synthesized for any name falling
+   in a cached range without asking the authoritative servers again. This is what keeps
+   random-subdomain floods against signed zones from reaching the authoritatives.
+
+   Only records whose signer has a matching SOA in the same answer are kept, since that
+   SOA is needed to build the synthesized answer. */
+
+class AggressiveNSECCache
+{
+public:
+  /* records is a complete answer that validated as Secure */
+  void insertDenials(time_t now, const std::vector<DNSRecord>& records);
+  /* returns true and fills ret and res if qname|qtype is proven not to exist by cached ranges */
+  bool getDenial(time_t now, const DNSName& qname, const QType& qtype, std::vector<DNSRecord>& ret, int& res, bool withProof);
+  /* removes the zones holding name, and those below it if subtree is set */
+  uint64_t wipe(const DNSName& name, bool subtree);
+  void prune(time_t now, size_t maxEntries);
+  size_t size() const
+  {
+    return d_entriesCount;
+  }
+
+  static size_t s_maxEntries;
+  static const uint16_t s_maxNSEC3Iterations = 150;
+
+private:
+  struct Entry
+  {
+    DNSRecord d_record;
+    std::vector<DNSRecord> d_signatures;
+    time_t d_ttd;
+  };
+
+  struct ZoneEntry
+  {
+    DNSRecord d_soa;
+    std::vector<DNSRecord> d_soaSignatures;
+    time_t d_soaTTD{0};
+    time_t d_lastInsert{0};
+    /* NSEC records by owner name, NSEC3 records by raw owner hash */
+    std::map<DNSName, Entry, CanonDNSNameCompare> d_nsecs;
+    std::map<std::string, Entry> d_nsec3s;
+    std::string d_salt;
+    uint16_t d_iterations{0};
+  };
+
+  bool getNSECDenial(time_t now, const ZoneEntry& zone, const DNSName& qname, const QType& qtype, std::vector<const Entry*>& proof, int& res) const;
+  bool getNSEC3Denial(time_t now, const ZoneEntry& zone, const DNSName& qname, const QType& qtype, std::vector<const Entry*>& proof, int& res) const;
+  const Entry* getCoveringNSEC(time_t now, const ZoneEntry& zone, const DNSName& name) const;
+  const Entry* getCoveringNSEC3(time_t now, const ZoneEntry& zone, const std::string& hash) const;
+  const Entry* getMatchingNSEC3(time_t now, const ZoneEntry& zone, const std::string& hash) const;
+  void eraseZone(std::map<DNSName, ZoneEntry>::iterator it);
+
+  std::map<DNSName, ZoneEntry> d_zones;
+  size_t d_entriesCount{0};
+};
@@ -25,6 +25,7 @@
 #include "dolog.hh"
 #include "dnscrypt.hh"
 #include "dnswriter.hh"
+#include "misc.hh"
 
 DnsCryptPrivateKey::DnsCryptPrivateKey()
 {
@@ -60,6 +61,122 @@ DnsCryptPrivateKey::~DnsCryptPrivateKey()
   sodium_munlock(key, sizeof(key));
 }
 
+size_t DnsCryptSharedKeysCache::KeyHasher::operator()(const key_t& key) const
+{
+  /* the public keys are chosen by the clients, so use a random seed */
+  return burtle(key.data(), key.size(), seed);
+}
+
+DnsCryptSharedKeysCache::DnsCryptSharedKeysCache(size_t maxEntries, size_t shardsCount): d_maxEntries(maxEntries)
+{
+  if (shardsCount == 0) {
+    shardsCount = 1;
+  }
+
+  d_hasher.seed = randombytes_random();
+  d_maxEntriesPerShard = (maxEntries + shardsCount - 1) / shardsCount;
+  d_shards.reserve(shardsCount);
+  for (size_t idx = 0; idx < shardsCount; idx++) {
+    d_shards.push_back(std::unique_ptr<Shard>(new Shard(d_hasher)));
+  }
+}
+
+DnsCryptSharedKeysCache::~DnsCryptSharedKeysCache()
+{
+  clear();
+}
+
+DnsCryptSharedKeysCache::key_t DnsCryptSharedKeysCache::makeKey(const unsigned char clientPK[DNSCRYPT_PUBLIC_KEY_SIZE], uint32_t serial, bool oldCert)
+{
+  key_t key;
+  memcpy(key.data(), clientPK, DNSCRYPT_PUBLIC_KEY_SIZE);
+  memcpy(key.data() + DNSCRYPT_PUBLIC_KEY_SIZE, &serial, sizeof(serial));
+  /* several certificates may share the same serial */
+  key[DNSCRYPT_PUBLIC_KEY_SIZE + sizeof(serial)] = oldCert ? 1 : 0;
+  return key;
+}
+
+DnsCryptSharedKeysCache::Shard& DnsCryptSharedKeysCache::getShard(const key_t& key, size_t& hash)
+{
+  hash = d_hasher(key);
+  return *d_shards.at(hash % d_shards.size());
+}
+
+bool DnsCryptSharedKeysCache::get(const unsigned char clientPK[DNSCRYPT_PUBLIC_KEY_SIZE], uint32_t serial, bool oldCert, uint64_t generation, unsigned char sharedKey[DNSCRYPT_BEFORENM_SIZE])
+{
+  if (d_maxEntriesPerShard == 0) {
+    return false;
+  }
+
+  const key_t key = makeKey(clientPK, serial, oldCert);
+  size_t hash = 0;
+  auto& shard = getShard(key, hash);
+  {
+    std::lock_guard<std::mutex> lock(shard.d_lock);
+    const auto it = shard.d_map.find(key);
+    if (it != shard.d_map.end() && it->second.d_generation == generation) {
+      memcpy(sharedKey, it->second.d_sharedKey.data(), DNSCRYPT_BEFORENM_SIZE);
+      d_hits++;
+      return true;
+    }
+  }
+
+  d_misses++;
+  return false;
+}
+
+void DnsCryptSharedKeysCache::insert(const unsigned char clientPK[DNSCRYPT_PUBLIC_KEY_SIZE], uint32_t serial, bool oldCert, uint64_t generation, const unsigned char sharedKey[DNSCRYPT_BEFORENM_SIZE])
+{
+  if (d_maxEntriesPerShard == 0) {
+    return;
+  }
+
+  const key_t key = makeKey(clientPK, serial, oldCert);
+  size_t hash = 0;
+  auto& shard = getShard(key, hash);
+  std::lock_guard<std::mutex> lock(shard.d_lock);
+  /* clear() moves to the next generation before locking the shards, so either we see
+     the new generation here, or our entry will be removed once clear() gets this lock */
+  if (generation != d_generation) {
+    return;
+  }
+
+  auto it = shard.d_map.find(key);
+  if (it == shard.d_map.end()) {
+    if (shard.d_map.size() >= d_maxEntriesPerShard) {
+      /* evict whatever entry comes first, the clients we see the most will be back quickly */
+      auto victim = shard.d_map.begin();
+      sodium_memzero(victim->second.d_sharedKey.data(), victim->second.d_sharedKey.size());
+      shard.d_map.erase(victim);
+    }
+    it = shard.d_map.insert({key, value_t()}).first;
+  }
+  memcpy(it->second.d_sharedKey.data(), sharedKey, DNSCRYPT_BEFORENM_SIZE);
+  it->second.d_generation = generation;
+}
+
+void DnsCryptSharedKeysCache::clear()
+{
+  d_generation++;
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard->d_lock);
+    for (auto& entry : shard->d_map) {
+      sodium_memzero(entry.second.d_sharedKey.data(), entry.second.d_sharedKey.size());
+    }
+    shard->d_map.clear();
+  }
+}
+
+size_t DnsCryptSharedKeysCache::getEntriesCount() const
+{
+  size_t count = 0;
+  for (const auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard->d_lock);
+    count += shard->d_map.size();
+  }
+  return count;
+}
+
 void DnsCryptContext::generateProviderKeys(unsigned char publicKey[DNSCRYPT_PROVIDER_PUBLIC_KEY_SIZE], unsigned char privateKey[DNSCRYPT_PROVIDER_PRIVATE_KEY_SIZE])
 {
   int res = crypto_sign_ed25519_keypair(publicKey, privateKey);
@@ -175,6 +292,14 @@ void DnsCryptContext::setNewCertificate(const DnsCryptCert& newCert, const DnsCr
   hasOldCert = true;
   privateKey = newKey;
   cert = newCert;
+  /* the keys computed for the previous certificate are now either useless or
+     stored as belonging to the current certificate */
+  sharedKeysCache->clear();
+}
+
+void DnsCryptContext::setSharedKeysCacheSize(size_t maxEntries)
+{
+  sharedKeysCache = std::make_shared<DnsCryptSharedKeysCache>(maxEntries);
 }
 
 void DnsCryptContext::loadNewCertificate(const std::string& certFile, const std::string& keyFile)
@@ -292,24 +417,42 @@ void DnsCryptContext::getDecryptedQuery(std::shared_ptr<DnsCryptQuery> query, bo
   memcpy(nonce, &query->header.clientNonce, sizeof(query->header.clientNonce));
   memset(nonce + sizeof(query->header.clientNonce), 0, sizeof(nonce) - sizeof(query->header.clientNonce));
 
-  /* we could compute and store the intermediary shared key, in order to not having to compute it a second
-     time for the response:
-     - crypto_box_beforenm() into an unsigned char[crypto_box_BEFORENMBYTES]
-     - crypto_box_open_easy_afternm()
-     - crypto_box_easy_afternm()
-  */
-  int res = crypto_box_open_easy((unsigned char*) packet,
-                                 (unsigned char*) packet + sizeof(DnsCryptQueryHeader),
-                                 packetSize - sizeof(DnsCryptQueryHeader),
-                                 nonce,
-                                 query->header.clientPK,
-                                 query->useOldCert ? oldPrivateKey.key : privateKey.key);
+  /* the shared key is computed only once per client and certificate, then kept in
+     the cache and in the query, to be reused for the response. The generation is
+     retrieved before reading the keys, so that a key computed from a private key
+     replaced in the meantime by setNewCertificate() does not end up in the cache */
+  const uint64_t generation = sharedKeysCache->getGeneration();
+  const uint32_t serial = query->useOldCert ? oldCert.signedData.serial : cert.signedData.serial;
+  const bool fromCache = sharedKeysCache->get(query->header.clientPK, serial, query->useOldCert, generation, query->sharedKey);
+  if (!fromCache) {
+    int res = crypto_box_beforenm(query->sharedKey,
+                                  query->header.clientPK,
+                                  query->useOldCert ? oldPrivateKey.key : privateKey.key);
+    if (res != 0) {
+      sodium_memzero(query->sharedKey, sizeof(query->sharedKey));
+      vinfolog("Dropping encrypted query we can't decrypt");
+      return;
+    }
+  }
+  query->sharedKeyComputed = true;
+
+  int res = crypto_box_open_easy_afternm((unsigned char*) packet,
+                                         (unsigned char*) packet + sizeof(DnsCryptQueryHeader),
+                                         packetSize - sizeof(DnsCryptQueryHeader),
+                                         nonce,
+                                         query->sharedKey);
 
   if (res != 0) {
     vinfolog("Dropping encrypted query we can't decrypt");
     return;
   }
 
+  /* only cache the keys of clients able to send a valid query, so that random
+     public keys can't be used to evict legitimate entries */
+  if (!fromCache) {
+    sharedKeysCache->insert(query->header.clientPK, serial, query->useOldCert, generation, query->sharedKey);
+  }
+
   *decryptedQueryLen = packetSize - sizeof(DnsCryptQueryHeader) - DNSCRYPT_MAC_SIZE;
   uint16_t pos = *decryptedQueryLen;
   assert(pos < packetSize);
@@ -453,12 +596,22 @@ int DnsCryptContext::encryptResponse(char* response, uint16_t responseLen, uint1
   memset(response + pos, 0, paddingSize - 1);
   pos += (paddingSize - 1);
   /* encrypting */
-  int res = crypto_box_easy((unsigned char*) (response + sizeof(header)),
-                            (unsigned char*) (response + toEncryptPos),
-                            responseLen + paddingSize,
-                            header.nonce,
-                            query->header.clientPK,
-                            query->useOldCert ? oldPrivateKey.key : privateKey.key);
+  int res = -1;
+  if (query->sharedKeyComputed) {
+    res = crypto_box_easy_afternm((unsigned char*) (response + sizeof(header)),
+                                  (unsigned char*) (response + toEncryptPos),
+                                  responseLen + paddingSize,
+                                  header.nonce,
+                                  query->sharedKey);
+  }
+  else {
+    res = crypto_box_easy((unsigned char*) (response + sizeof(header)),
+                          (unsigned char*) (response + toEncryptPos),
+                          responseLen + paddingSize,
+                          header.nonce,
+                          query->header.clientPK,
+                          query->useOldCert ? oldPrivateKey.key : privateKey.key);
+  }
 
   if (res == 0) {
     assert(pos == requiredSize);
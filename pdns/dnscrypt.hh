@@ -24,8 +24,12 @@
 
 #ifdef HAVE_DNSCRYPT
 
+#include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <sodium.h>
 
@@ -54,6 +58,9 @@
 /* "The client must check for new certificates every hour", so let's use one hour TTL */
 #define DNSCRYPT_CERTIFICATE_RESPONSE_TTL (3600)
 
+#define DNSCRYPT_SHARED_KEYS_CACHE_DEFAULT_SIZE (10000)
+#define DNSCRYPT_SHARED_KEYS_CACHE_SHARDS (16)
+
 static_assert(DNSCRYPT_CLIENT_MAGIC_SIZE <= DNSCRYPT_PUBLIC_KEY_SIZE, "Dnscrypt Client Nonce size should be smaller or equal to public key size.");
 
 class DnsCryptContext;
@@ -93,7 +100,16 @@ class DnsCryptQuery
 public:
   static const size_t minUDPLength = 256;
 
+  ~DnsCryptQuery()
+  {
+    if (sharedKeyComputed) {
+      sodium_memzero(sharedKey, sizeof(sharedKey));
+    }
+  }
+
   DnsCryptQueryHeader header;
+  /* computed while decrypting the query, and reused to encrypt the response */
+  unsigned char sharedKey[DNSCRYPT_BEFORENM_SIZE];
   DNSName qname;
   DnsCryptContext* ctx;
   uint16_t id{0};
@@ -102,6 +118,77 @@ public:
   bool useOldCert{false};
   bool encrypted{false};
   bool valid{false};
+  bool sharedKeyComputed{false};
+};
+
+/* A bounded cache of the keys computed by crypto_box_beforenm(), keyed by the client
+   public key and the resolver certificate, so that we don't have to do a scalar
+   multiplication for every query and response of a client we have seen recently.
+   Split in shards, each with its own lock, to reduce contention between threads.
+   Every entry is tagged with the generation of the cache at the time the caller
+   started computing the key, and clear() moves to a new generation, so that a key
+   computed with a private key that has been replaced since is never used. */
+class DnsCryptSharedKeysCache
+{
+public:
+  DnsCryptSharedKeysCache(size_t maxEntries=DNSCRYPT_SHARED_KEYS_CACHE_DEFAULT_SIZE, size_t shardsCount=DNSCRYPT_SHARED_KEYS_CACHE_SHARDS);
+  ~DnsCryptSharedKeysCache();
+
+  bool get(const unsigned char clientPK[DNSCRYPT_PUBLIC_KEY_SIZE], uint32_t serial, bool oldCert, uint64_t generation, unsigned char sharedKey[DNSCRYPT_BEFORENM_SIZE]);
+  /* does nothing if the cache has been cleared since 'generation' was retrieved */
+  void insert(const unsigned char clientPK[DNSCRYPT_PUBLIC_KEY_SIZE], uint32_t serial, bool oldCert, uint64_t generation, const unsigned char sharedKey[DNSCRYPT_BEFORENM_SIZE]);
+  void clear();
+  uint64_t getGeneration() const
+  {
+    return d_generation;
+  }
+  size_t getEntriesCount() const;
+  size_t getMaxEntries() const
+  {
+    return d_maxEntries;
+  }
+  uint64_t getHits() const
+  {
+    return d_hits;
+  }
+  uint64_t getMisses() const
+  {
+    return d_misses;
+  }
+
+private:
+  typedef std::array<unsigned char, DNSCRYPT_PUBLIC_KEY_SIZE + sizeof(uint32_t) + 1> key_t;
+  struct value_t
+  {
+    std::array<unsigned char, DNSCRYPT_BEFORENM_SIZE> d_sharedKey;
+    uint64_t d_generation;
+  };
+
+  struct KeyHasher
+  {
+    uint32_t seed;
+    size_t operator()(const key_t& key) const;
+  };
+
+  struct Shard
+  {
+    Shard(const KeyHasher& hasher): d_map(0, hasher)
+    {
+    }
+    std::unordered_map<key_t, value_t, KeyHasher> d_map;
+    mutable std::mutex d_lock;
+  };
+
+  static key_t makeKey(const unsigned char clientPK[DNSCRYPT_PUBLIC_KEY_SIZE], uint32_t serial, bool oldCert);
+  Shard& getShard(const key_t& key, size_t& hash);
+
+  std::vector<std::unique_ptr<Shard> > d_shards;
+  KeyHasher d_hasher;
+  std::atomic<uint64_t> d_hits{0};
+  std::atomic<uint64_t> d_misses{0};
+  std::atomic<uint64_t> d_generation{0};
+  size_t d_maxEntries;
+  size_t d_maxEntriesPerShard;
 };
 
 struct DnsCryptResponseHeader
@@ -131,14 +218,14 @@ public:
   static std::string certificateDateToStr(uint32_t date);
   static void generateResolverKeyPair(DnsCryptPrivateKey& privK, unsigned char pubK[DNSCRYPT_PUBLIC_KEY_SIZE]);
 
-  DnsCryptContext(const std::string& pName, const std::string& certFile, const std::string& keyFile): providerName(pName)
+  DnsCryptContext(const std::string& pName, const std::string& certFile, const std::string& keyFile): providerName(pName), sharedKeysCache(std::make_shared<DnsCryptSharedKeysCache>())
   {
     loadCertFromFile(certFile, cert);
     privateKey.loadFromFile(keyFile);
     computePublicKeyFromPrivate(privateKey, publicKey);
   }
 
-  DnsCryptContext(const std::string& pName, const DnsCryptCert& certificate, const DnsCryptPrivateKey& pKey): providerName(pName), cert(certificate), privateKey(pKey)
+  DnsCryptContext(const std::string& pName, const DnsCryptCert& certificate, const DnsCryptPrivateKey& pKey): providerName(pName), cert(certificate), privateKey(pKey), sharedKeysCache(std::make_shared<DnsCryptSharedKeysCache>())
   {
     computePublicKeyFromPrivate(privateKey, publicKey);
   }
@@ -152,6 +239,9 @@ public:
   const DnsCryptCert& getOldCertificate() const { return oldCert; };
   bool hadOldCertificate() const { return hasOldCert; };
   const std::string& getProviderName() const { return providerName; }
+  /* 0 disables the cache */
+  void setSharedKeysCacheSize(size_t maxEntries);
+  std::shared_ptr<const DnsCryptSharedKeysCache> getSharedKeysCache() const { return sharedKeysCache; }
   int encryptQuery(char* query, uint16_t queryLen, uint16_t querySize, const unsigned char clientPublicKey[DNSCRYPT_PUBLIC_KEY_SIZE], const DnsCryptPrivateKey& clientPrivateKey, const unsigned char clientNonce[DNSCRYPT_NONCE_SIZE / 2], bool tcp, uint16_t* encryptedResponseLen) const;
 
 
@@ -172,6 +262,8 @@ private:
   DnsCryptPrivateKey privateKey;
   unsigned char publicKey[DNSCRYPT_PUBLIC_KEY_SIZE];
   DnsCryptPrivateKey oldPrivateKey;
+  /* shared between the copies of this context */
+  std::shared_ptr<DnsCryptSharedKeysCache> sharedKeysCache;
   bool hasOldCert{false};
 };
 
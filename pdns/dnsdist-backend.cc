@@ -0,0 +1,61 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "dnsdist.hh"
+#include "dolog.hh"
+#include "iputils.hh"
+
+uint16_t g_maxOutstanding{10240};
+
+DownstreamState::DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf_, size_t numberOfSockets): remote(remote_), sourceAddr(sourceAddr_), sourceItf(sourceItf_)
+{
+  if (!IsAnyAddress(remote)) {
+    if (numberOfSockets == 0) {
+      numberOfSockets = 1;
+    }
+    /* the sockets would all share the same 4-tuple, and responses would be delivered to any of them */
+    if (numberOfSockets > 1 && sourceAddr.sin4.sin_port != 0) {
+      throw std::runtime_error("Using several sockets requires a source address without a port, got " + sourceAddr.toStringWithPort());
+    }
+    sockets.reserve(numberOfSockets);
+    try {
+      for (size_t idx = 0; idx < numberOfSockets; idx++) {
+        int fd = SSocket(remote.sin4.sin_family, SOCK_DGRAM, 0);
+        sockets.push_back(fd);
+        if (!IsAnyAddress(sourceAddr)) {
+          SSetsockopt(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+          SBind(fd, sourceAddr);
+        }
+        SConnect(fd, remote);
+      }
+    }
+    catch(...) {
+      /* the destructor will not be called */
+      for (auto& fd : sockets) {
+        close(fd);
+      }
+      throw;
+    }
+    idStates.resize(numberOfSockets * g_maxOutstanding);
+    sw.start();
+    infolog("Added downstream server %s", remote.toStringWithPort());
+  }
+}
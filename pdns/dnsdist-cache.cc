@@ -23,32 +23,323 @@
 #include "dolog.hh"
 #include "dnsparser.hh"
 #include "dnsdist-cache.hh"
+#include <limits>
 
-DNSDistPacketCache::DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL, uint32_t minTTL, uint32_t servFailTTL, uint32_t staleTTL): d_maxEntries(maxEntries), d_maxTTL(maxTTL), d_servFailTTL(servFailTTL), d_minTTL(minTTL), d_staleTTL(staleTTL)
+/* a refresh query that did not lead to a new entry within that many seconds
+   is assumed to be lost, allowing a new one to be sent */
+static const time_t s_refreshTimeout = 5;
+
+DNSDistPacketCache::DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL, uint32_t minTTL, uint32_t servFailTTL, uint32_t staleTTL, uint32_t shards, uint16_t slabSize, uint8_t prefetchThreshold, uint32_t staleWhileRevalidate, bool ecsScoping): d_maxEntries(maxEntries), d_shardCount(shards), d_maxTTL(maxTTL), d_servFailTTL(servFailTTL), d_minTTL(minTTL), d_staleTTL(staleTTL), d_staleWhileRevalidate(staleWhileRevalidate), d_slabSize(slabSize), d_prefetchThreshold(prefetchThreshold), d_ecsScoping(ecsScoping)
 {
-  pthread_rwlock_init(&d_lock, 0);
-  /* we reserve maxEntries + 1 to avoid rehashing from occuring
-     when we get to maxEntries, as it means a load factor of 1 */
-  d_map.reserve(maxEntries + 1);
+  if (d_prefetchThreshold > 100) {
+    d_prefetchThreshold = 100;
+  }
+  if (d_shardCount == 0) {
+    d_shardCount = 1;
+  }
+  /* a shard needs to be able to hold at least one entry */
+  if (d_maxEntries > 0 && d_shardCount > d_maxEntries) {
+    d_shardCount = d_maxEntries;
+  }
+  d_maxEntriesPerShard = d_maxEntries / d_shardCount;
+
+  if (d_slabSize > 0 && d_slabSize < sizeof(dnsheader)) {
+    d_slabSize = sizeof(dnsheader);
+  }
+
+  d_shards.resize(d_shardCount);
+  for (auto& shard : d_shards) {
+    if (d_slabSize > 0) {
+      shard.setSlabs(d_maxEntriesPerShard, d_slabSize);
+    }
+    else {
+      shard.setSize(d_maxEntriesPerShard);
+    }
+  }
 }
 
 DNSDistPacketCache::~DNSDistPacketCache()
 {
-  WriteLock l(&d_lock);
+  for (auto& shard : d_shards) {
+    WriteLock l(&shard.d_lock);
+  }
+}
+
+/* case-insensitive comparison of two wire-format names of the same length,
+   label lengths are never altered by dns_tolower() */
+static bool wireNamesMatch(const char* a, const char* b, size_t len)
+{
+  for (size_t idx = 0; idx < len; idx++) {
+    if (a[idx] != b[idx] && dns_tolower(a[idx]) != dns_tolower(b[idx])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* the maximum number of slots of slabSize bytes in a page of a slab, pages being made
+   smaller so that a slab has at least s_minSlabPages of them, the maximum number of
+   size classes and the size of the smallest slots */
+static const size_t s_slabPageSlots = 16;
+static const size_t s_minSlabPages = 64;
+static const size_t s_slabSizeClasses = 4;
+static const uint16_t s_minSlabSlotSize = 64;
+static const size_t s_noFreeSlot = std::numeric_limits<size_t>::max();
+
+void DNSDistPacketCache::Slab::init(size_t maxEntries, uint16_t slabSize)
+{
+  d_data.resize(maxEntries * slabSize);
+  d_pageSize = std::min(s_slabPageSlots, std::max(maxEntries / s_minSlabPages, static_cast<size_t>(1))) * slabSize;
+  d_nextPage = 0;
+
+  /* sorted from the smallest to the largest slots, so that allocate() picks the smallest one that fits */
+  d_classes.clear();
+  d_classes.push_back({s_noFreeSlot, slabSize});
+  for (uint16_t size = slabSize / 2; size >= s_minSlabSlotSize && d_classes.size() < s_slabSizeClasses; size /= 2) {
+    d_classes.insert(d_classes.begin(), {s_noFreeSlot, size});
+  }
 }
 
-bool DNSDistPacketCache::cachedValueMatches(const CacheValue& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp)
+/* assign the next unused page to that size class, returns false if there is none left */
+bool DNSDistPacketCache::Slab::addPage(SizeClass& sizeClass)
 {
-  if (cachedValue.tcp != tcp || cachedValue.qtype != qtype || cachedValue.qclass != qclass || cachedValue.qname != qname)
+  if (d_nextPage >= d_data.size()) {
     return false;
+  }
+
+  /* the last page might be shorter */
+  const size_t end = std::min(d_nextPage + d_pageSize, d_data.size());
+  const size_t count = (end - d_nextPage) / sizeClass.slotSize;
+  for (size_t idx = count; idx > 0; idx--) {
+    const size_t offset = d_nextPage + (idx - 1) * sizeClass.slotSize;
+    memcpy(&d_data.at(offset), &sizeClass.firstFree, sizeof(sizeClass.firstFree));
+    sizeClass.firstFree = offset;
+  }
+  d_nextPage = end;
+  return count > 0;
+}
+
+bool DNSDistPacketCache::Slab::allocate(uint16_t len, size_t& offset, uint8_t& sizeClass)
+{
+  /* the smallest size class that fits, or a larger one if it is full and there is no page left */
+  for (size_t idx = 0; idx < d_classes.size(); idx++) {
+    auto& candidate = d_classes[idx];
+    if (candidate.slotSize < len) {
+      continue;
+    }
+    if (candidate.firstFree == s_noFreeSlot && !addPage(candidate)) {
+      continue;
+    }
+    offset = candidate.firstFree;
+    memcpy(&candidate.firstFree, &d_data.at(offset), sizeof(candidate.firstFree));
+    sizeClass = idx;
+    return true;
+  }
+  return false;
+}
+
+void DNSDistPacketCache::Slab::release(size_t offset, uint8_t sizeClass)
+{
+  auto& owner = d_classes.at(sizeClass);
+  memcpy(&d_data.at(offset), &owner.firstFree, sizeof(owner.firstFree));
+  owner.firstFree = offset;
+}
+
+/* Fibonacci hashing: the keys of a shard all have the same remainder modulo the number of
+   shards, so their low bits can not be used as they are */
+static size_t getIndexPosition(uint32_t key, unsigned int shift)
+{
+  return static_cast<uint32_t>(key * 2654435761U) >> shift;
+}
+
+void DNSDistPacketCache::CacheShard::setSlabs(size_t maxSize, uint16_t slabSize)
+{
+  d_slab.init(maxSize, slabSize);
+  d_slabEntries.resize(maxSize);
+  d_freeSlabEntries.reserve(maxSize);
+  for (size_t idx = maxSize; idx > 0; idx--) {
+    d_freeSlabEntries.push_back(idx - 1);
+  }
+
+  /* a power of two, at least twice the number of entries */
+  unsigned int bits = 1;
+  while ((static_cast<size_t>(1) << bits) < maxSize * 2) {
+    bits++;
+  }
+  d_index.assign(static_cast<size_t>(1) << bits, {0, 0});
+  d_indexShift = 32 - bits;
+}
+
+const DNSDistPacketCache::SlabEntry* DNSDistPacketCache::CacheShard::findSlabEntry(uint32_t key) const
+{
+  const size_t mask = d_index.size() - 1;
+  for (size_t pos = getIndexPosition(key, d_indexShift); d_index.at(pos).second != 0; pos = (pos + 1) & mask) {
+    if (d_index[pos].first == key) {
+      return &d_slabEntries.at(d_index[pos].second - 1);
+    }
+  }
+  return nullptr;
+}
+
+DNSDistPacketCache::SlabEntry* DNSDistPacketCache::CacheShard::findSlabEntry(uint32_t key)
+{
+  return const_cast<SlabEntry*>(static_cast<const CacheShard*>(this)->findSlabEntry(key));
+}
+
+/* the key should not be present already */
+DNSDistPacketCache::SlabEntry* DNSDistPacketCache::CacheShard::addSlabEntry(uint32_t key)
+{
+  if (d_freeSlabEntries.empty()) {
+    return nullptr;
+  }
+
+  const size_t mask = d_index.size() - 1;
+  size_t pos = getIndexPosition(key, d_indexShift);
+  while (d_index.at(pos).second != 0) {
+    pos = (pos + 1) & mask;
+  }
+
+  const uint32_t position = d_freeSlabEntries.back();
+  d_freeSlabEntries.pop_back();
+  d_index[pos] = {key, position + 1};
+  SlabEntry& entry = d_slabEntries.at(position);
+  entry = SlabEntry();
+  entry.key = key;
+  return &entry;
+}
+
+void DNSDistPacketCache::CacheShard::removeSlabEntry(const SlabEntry& entry)
+{
+  const size_t mask = d_index.size() - 1;
+  const uint32_t position = &entry - d_slabEntries.data();
+  size_t hole = getIndexPosition(entry.key, d_indexShift);
+  while (d_index.at(hole).second != position + 1) {
+    hole = (hole + 1) & mask;
+  }
+
+  /* backward shift deletion: move back the entries following the hole that can be, instead of
+     leaving a tombstone, so that a lookup for one of them does not stop at the hole */
+  for (size_t pos = (hole + 1) & mask; d_index.at(pos).second != 0; pos = (pos + 1) & mask) {
+    const size_t ideal = getIndexPosition(d_index[pos].first, d_indexShift);
+    if (((pos - ideal) & mask) >= ((pos - hole) & mask)) {
+      d_index[hole] = d_index[pos];
+      hole = pos;
+    }
+  }
+  d_index[hole] = {0, 0};
+
+  d_slabEntries.at(position).len = 0;
+  d_freeSlabEntries.push_back(position);
+}
+
+bool DNSDistPacketCache::cachedValueMatches(const CacheShard& shard, const CacheValue& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp)
+{
+  if (cachedValue.tcp != tcp || cachedValue.qtype != qtype || cachedValue.qclass != qclass)
+    return false;
+  return cachedValue.qname == qname;
+}
+
+bool DNSDistPacketCache::cachedValueMatches(const CacheShard& shard, const SlabEntry& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp)
+{
+  if (cachedValue.tcp != tcp || cachedValue.qtype != qtype || cachedValue.qclass != qclass)
+    return false;
+
+  /* no DNSName is kept when the response lives in a slab,
+     so compare the qname stored right after the header of the response */
+  const auto& storage = qname.getStorage();
+  if (cachedValue.len < (sizeof(dnsheader) + storage.size())) {
+    return false;
+  }
+  return wireNamesMatch(getResponseData(shard, cachedValue) + sizeof(dnsheader), storage.c_str(), storage.size());
+}
+
+const char* DNSDistPacketCache::getResponseData(const CacheShard& shard, const CacheValue& value)
+{
+  return value.value.c_str();
+}
+
+const char* DNSDistPacketCache::getResponseData(const CacheShard& shard, const SlabEntry& value)
+{
+  return shard.d_slab.getData(value.offset);
+}
+
+/* Remove the scope of an ECS-scoped entry, so that a lookup does not find that scope any more
+   instead of a broader one still having an entry. Needs to be called with the shard write lock held */
+template<typename T>
+void DNSDistPacketCache::removeScope(CacheShard& shard, uint32_t key, const T& value)
+{
+  if (!value.isECSScoped()) {
+    return;
+  }
+
+  auto scopesIt = shard.d_ecsScopes.find(value.scopelessKey);
+  if (scopesIt == shard.d_ecsScopes.end()) {
+    return;
+  }
+
+  auto& scopes = scopesIt->second;
+  const Netmask& ecsScope = value.getECSScope();
+  /* unless that scope has been taken over by another entry since */
+  const auto node = scopes.lookup(ecsScope);
+  if (node == nullptr || node->second != key || node->first.getBits() != ecsScope.getBits()) {
+    return;
+  }
+
+  scopes.erase(ecsScope);
+  if (scopes.empty()) {
+    shard.d_ecsScopes.erase(scopesIt);
+  }
+}
+
+/* needs to be called with the shard write lock held, the entry being erased from the map by the caller */
+void DNSDistPacketCache::releaseEntry(CacheShard& shard, uint32_t key, const CacheValue& value)
+{
+  removeScope(shard, key, value);
+  shard.d_entriesCount--;
+}
+
+/* needs to be called with the shard write lock held */
+void DNSDistPacketCache::releaseEntry(CacheShard& shard, const SlabEntry& entry)
+{
+  shard.d_slab.release(entry.offset, entry.sizeClass);
+  removeScope(shard, entry.key, entry);
+  shard.removeSlabEntry(entry);
+  shard.d_entriesCount--;
+}
+
+/* In case of collision, don't override the existing entry except if it has expired.
+   Needs to be called with the shard write lock held */
+template<typename T>
+bool DNSDistPacketCache::canReplace(const CacheShard& shard, const T& value, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp, bool servFail, time_t now, time_t newValidity)
+{
+  bool wasExpired = value.validity <= now;
+
+  if (!wasExpired && !cachedValueMatches(shard, value, qname, qtype, qclass, tcp)) {
+    d_insertCollisions++;
+    return false;
+  }
+
+  /* a refresh should not replace a valid answer by a Server Failure */
+  if (!wasExpired && servFail) {
+    return false;
+  }
+
+  /* if the existing entry had a longer TTD, keep it */
+  if (newValidity <= value.validity) {
+    return false;
+  }
+
   return true;
 }
 
-void DNSDistPacketCache::insert(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, bool servFail)
+void DNSDistPacketCache::insert(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, bool servFail, const Netmask* ecsScope)
 {
   if (responseLen < sizeof(dnsheader))
     return;
 
+  if (d_slabSize > 0 && responseLen > d_slabSize)
+    return;
+
   uint32_t minTTL;
 
   if (servFail) {
@@ -65,21 +356,31 @@ void DNSDistPacketCache::insert(uint32_t key, const DNSName& qname, uint16_t qty
     }
   }
 
-  {
-    TryReadLock r(&d_lock);
-    if (!r.gotIt()) {
-      d_deferredInserts++;
-      return;
-    }
-    if (d_map.size() >= d_maxEntries) {
+  /* the entries of a scoped query live in the shard of the scopeless key, with their scope index */
+  uint32_t shardIndex = getShardIndex(key);
+  CacheShard& shard = d_shards.at(shardIndex);
+  const uint32_t scopelessKey = key;
+  if (ecsScope) {
+    if (!d_ecsScoping) {
       return;
     }
+    key = getScopedKey(key, *ecsScope);
+  }
+
+  if (shard.d_entriesCount >= d_maxEntriesPerShard) {
+    return;
   }
 
   const time_t now = time(NULL);
+  time_t newValidity = now + minTTL;
+
+  if (d_slabSize > 0) {
+    insertIntoSlab(shard, key, scopelessKey, qname, qtype, qclass, response, responseLen, tcp, servFail, ecsScope, now, newValidity);
+    return;
+  }
+
   std::unordered_map<uint32_t,CacheValue>::iterator it;
   bool result;
-  time_t newValidity = now + minTTL;
   CacheValue newValue;
   newValue.qname = qname;
   newValue.qtype = qtype;
@@ -89,101 +390,234 @@ void DNSDistPacketCache::insert(uint32_t key, const DNSName& qname, uint16_t qty
   newValue.added = now;
   newValue.tcp = tcp;
   newValue.value = std::string(response, responseLen);
+  if (ecsScope) {
+    newValue.ecsScope = *ecsScope;
+    newValue.scopelessKey = scopelessKey;
+  }
 
   {
-    TryWriteLock w(&d_lock);
+    TryWriteLock w(&shard.d_lock);
 
     if (!w.gotIt()) {
       d_deferredInserts++;
       return;
     }
 
-    tie(it, result) = d_map.insert({key, newValue});
+    tie(it, result) = shard.d_map.insert({key, newValue});
 
     if (result) {
+      shard.d_entriesCount++;
+      if (ecsScope) {
+        shard.d_ecsScopes[scopelessKey].insert_or_assign(*ecsScope, key);
+      }
       return;
     }
 
-    /* in case of collision, don't override the existing entry
-       except if it has expired */
     CacheValue& value = it->second;
-    bool wasExpired = value.validity <= now;
-
-    if (!wasExpired && !cachedValueMatches(value, qname, qtype, qclass, tcp)) {
-      d_insertCollisions++;
+    if (!canReplace(shard, value, qname, qtype, qclass, tcp, servFail, now, newValidity)) {
       return;
     }
 
-    /* if the existing entry had a longer TTD, keep it */
-    if (newValidity <= value.validity) {
+    /* the expired entry might have been stored for a different query */
+    removeScope(shard, key, value);
+    value = newValue;
+    if (ecsScope) {
+      shard.d_ecsScopes[scopelessKey].insert_or_assign(*ecsScope, key);
+    }
+  }
+}
+
+/* neither the entry nor the response require a memory allocation, the slot of the response being
+   taken from the slab of the shard */
+void DNSDistPacketCache::insertIntoSlab(CacheShard& shard, uint32_t key, uint32_t scopelessKey, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, bool servFail, const Netmask* ecsScope, time_t now, time_t newValidity)
+{
+  TryWriteLock w(&shard.d_lock);
+
+  if (!w.gotIt()) {
+    d_deferredInserts++;
+    return;
+  }
+
+  SlabEntry* entry = shard.findSlabEntry(key);
+  if (entry != nullptr && !canReplace(shard, *entry, qname, qtype, qclass, tcp, servFail, now, newValidity)) {
+    return;
+  }
+
+  /* the existing entry is only replaced once we know we have room for the new response */
+  size_t offset;
+  uint8_t sizeClass;
+  if (!shard.d_slab.allocate(responseLen, offset, sizeClass)) {
+    return;
+  }
+
+  if (entry == nullptr) {
+    entry = shard.addSlabEntry(key);
+    if (entry == nullptr) {
+      shard.d_slab.release(offset, sizeClass);
       return;
     }
+    shard.d_entriesCount++;
+  }
+  else {
+    /* the expired entry might have been stored for a different query */
+    removeScope(shard, key, *entry);
+    shard.d_slab.release(entry->offset, entry->sizeClass);
+  }
 
-    value = newValue;
+  entry->added = now;
+  entry->validity = newValidity;
+  entry->refreshRequested = 0;
+  entry->offset = offset;
+  entry->sizeClass = sizeClass;
+  entry->qtype = qtype;
+  entry->qclass = qclass;
+  entry->len = responseLen;
+  entry->tcp = tcp;
+  entry->scopelessKey = scopelessKey;
+  entry->ecsScoped = ecsScope != nullptr;
+  if (ecsScope) {
+    entry->ecsNetwork = ecsScope->getNetwork();
+    entry->ecsBits = ecsScope->getBits();
+    shard.d_ecsScopes[scopelessKey].insert_or_assign(*ecsScope, key);
+  }
+  memcpy(shard.d_slab.getData(offset), response, responseLen);
+}
+
+/* Copy the response of that entry, if it can be used to answer the query. Needs to be called with the shard lock held */
+template<typename T>
+bool DNSDistPacketCache::readEntry(const CacheShard& shard, const T& value, const DNSQuestion& dq, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t allowExpired, bool refresh, time_t now, time_t& age, bool& needRefresh, bool& revalidating)
+{
+  bool stale = false;
+  if (value.validity < now) {
+    if ((now - value.validity) < static_cast<time_t>(allowExpired)) {
+      stale = true;
+    }
+    else if (refresh && (now - value.validity) < static_cast<time_t>(d_staleWhileRevalidate)) {
+      stale = true;
+      revalidating = true;
+      needRefresh = true;
+    }
+    else {
+      d_misses++;
+      return false;
+    }
+  }
+  else if (refresh && d_prefetchThreshold > 0) {
+    /* is the remaining TTL under d_prefetchThreshold percent of the original one? */
+    needRefresh = (value.validity - now) * 100 <= (value.validity - value.added) * d_prefetchThreshold;
+  }
+
+  if (needRefresh && value.refreshRequested != 0 && (now - value.refreshRequested) < s_refreshTimeout) {
+    /* someone is already taking care of it */
+    needRefresh = false;
+  }
+
+  if (*responseLen < value.len) {
+    return false;
+  }
+
+  /* check for collision */
+  if (!cachedValueMatches(shard, value, *dq.qname, dq.qtype, dq.qclass, dq.tcp)) {
+    d_lookupCollisions++;
+    return false;
+  }
+
+  /* the qname is copied from the query to preserve its case */
+  const auto& dnsQName = dq.qname->getStorage();
+  const size_t dnsQNameLen = dnsQName.length();
+  if (value.len < (sizeof(dnsheader) + dnsQNameLen)) {
+    return false;
+  }
+
+  const char* data = getResponseData(shard, value);
+  memcpy(response, &queryId, sizeof(queryId));
+  memcpy(response + sizeof(queryId), data + sizeof(queryId), sizeof(dnsheader) - sizeof(queryId));
+  memcpy(response + sizeof(dnsheader), dnsQName.c_str(), dnsQNameLen);
+  if (value.len > (sizeof(dnsheader) + dnsQNameLen)) {
+    memcpy(response + sizeof(dnsheader) + dnsQNameLen, data + sizeof(dnsheader) + dnsQNameLen, value.len - (sizeof(dnsheader) + dnsQNameLen));
+  }
+  *responseLen = value.len;
+  if (!stale) {
+    age = now - value.added;
+  }
+  else {
+    age = (value.validity - value.added) - d_staleTTL;
+  }
+  return true;
+}
+
+/* only one caller gets to refresh a given entry, provided it has not been replaced since it was read */
+template<typename T>
+static bool requestRefresh(T& value, time_t added, time_t now)
+{
+  if (value.added != added || (value.refreshRequested != 0 && (now - value.refreshRequested) < s_refreshTimeout)) {
+    return false;
   }
+  value.refreshRequested = now;
+  return true;
 }
 
-bool DNSDistPacketCache::get(const DNSQuestion& dq, uint16_t consumed, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t* keyOut, uint32_t allowExpired, bool skipAging)
+bool DNSDistPacketCache::get(const DNSQuestion& dq, uint16_t consumed, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t* keyOut, uint32_t allowExpired, bool skipAging, bool* refresh, const Netmask* ecsSource, uint16_t ecsOffset)
 {
-  uint32_t key = getKey(*dq.qname, consumed, (const unsigned char*)dq.dh, dq.len, dq.tcp);
+  const bool scoped = d_ecsScoping && ecsSource != nullptr && ecsOffset >= (sizeof(dnsheader) + consumed) && ecsOffset <= dq.len;
+  /* for a scoped query, the key of the query without the ECS option, the entry key coming from its scopes */
+  uint32_t key = getKey(*dq.qname, consumed, (const unsigned char*)dq.dh, scoped ? ecsOffset : dq.len, dq.tcp);
   if (keyOut)
     *keyOut = key;
 
+  uint32_t shardIndex = getShardIndex(key);
+  CacheShard& shard = d_shards.at(shardIndex);
   time_t now = time(NULL);
-  time_t age;
-  bool stale = false;
+  time_t age = 0;
+  bool needRefresh = false;
+  bool revalidating = false;
+  time_t added = 0;
+  if (refresh) {
+    *refresh = false;
+  }
   {
-    TryReadLock r(&d_lock);
+    TryReadLock r(&shard.d_lock);
     if (!r.gotIt()) {
       d_deferredLookups++;
       return false;
     }
 
-    std::unordered_map<uint32_t,CacheValue>::const_iterator it = d_map.find(key);
-    if (it == d_map.end()) {
-      d_misses++;
-      return false;
-    }
-
-    const CacheValue& value = it->second;
-    if (value.validity < now) {
-      if ((now - value.validity) >= static_cast<time_t>(allowExpired)) {
+    if (scoped) {
+      const auto scopesIt = shard.d_ecsScopes.find(key);
+      if (scopesIt == shard.d_ecsScopes.end()) {
         d_misses++;
         return false;
       }
-      else {
-        stale = true;
+      /* the most specific scope covering the source we sent */
+      const auto node = scopesIt->second.lookup(ecsSource->getNetwork(), ecsSource->getBits());
+      if (node == nullptr) {
+        d_misses++;
+        return false;
       }
+      key = node->second;
     }
 
-    if (*responseLen < value.len) {
-      return false;
-    }
-
-    /* check for collision */
-    if (!cachedValueMatches(value, *dq.qname, dq.qtype, dq.qclass, dq.tcp)) {
-      d_lookupCollisions++;
-      return false;
-    }
-
-    string dnsQName(dq.qname->toDNSString());
-    const size_t dnsQNameLen = dnsQName.length();
-    if (value.len < (sizeof(dnsheader) + dnsQNameLen)) {
-      return false;
-    }
-
-    memcpy(response, &queryId, sizeof(queryId));
-    memcpy(response + sizeof(queryId), value.value.c_str() + sizeof(queryId), sizeof(dnsheader) - sizeof(queryId));
-    memcpy(response + sizeof(dnsheader), dnsQName.c_str(), dnsQNameLen);
-    if (value.len > (sizeof(dnsheader) + dnsQNameLen)) {
-      memcpy(response + sizeof(dnsheader) + dnsQNameLen, value.value.c_str() + sizeof(dnsheader) + dnsQNameLen, value.len - (sizeof(dnsheader) + dnsQNameLen));
-    }
-    *responseLen = value.len;
-    if (!stale) {
-      age = now - value.added;
+    if (d_slabSize > 0) {
+      const SlabEntry* entry = shard.findSlabEntry(key);
+      if (entry == nullptr) {
+        d_misses++;
+        return false;
+      }
+      added = entry->added;
+      if (!readEntry(shard, *entry, dq, queryId, response, responseLen, allowExpired, refresh != nullptr, now, age, needRefresh, revalidating)) {
+        return false;
+      }
     }
     else {
-      age = (value.validity - value.added) - d_staleTTL;
+      std::unordered_map<uint32_t,CacheValue>::const_iterator it = shard.d_map.find(key);
+      if (it == shard.d_map.end()) {
+        d_misses++;
+        return false;
+      }
+      added = it->second.added;
+      if (!readEntry(shard, it->second, dq, queryId, response, responseLen, allowExpired, refresh != nullptr, now, age, needRefresh, revalidating)) {
+        return false;
+      }
     }
   }
 
@@ -191,30 +625,71 @@ bool DNSDistPacketCache::get(const DNSQuestion& dq, uint16_t consumed, uint16_t
     ageDNSPacket(response, *responseLen, age);
   }
 
+  if (needRefresh) {
+    TryWriteLock w(&shard.d_lock);
+    if (w.gotIt()) {
+      bool requested = false;
+      if (d_slabSize > 0) {
+        SlabEntry* entry = shard.findSlabEntry(key);
+        requested = entry != nullptr && requestRefresh(*entry, added, now);
+      }
+      else {
+        auto it = shard.d_map.find(key);
+        requested = it != shard.d_map.end() && requestRefresh(it->second, added, now);
+      }
+      if (requested) {
+        *refresh = true;
+        d_refreshes++;
+      }
+    }
+  }
+
+  if (revalidating) {
+    d_staleHits++;
+  }
+
   d_hits++;
   return true;
 }
 
 /* Remove expired entries, until the cache has at most
    upTo entries in it.
+   The target is split evenly between the shards.
 */
 void DNSDistPacketCache::purgeExpired(size_t upTo)
 {
   time_t now = time(NULL);
-  WriteLock w(&d_lock);
-  if (upTo >= d_map.size()) {
-    return;
-  }
+  const size_t maxPerShard = upTo / d_shardCount;
+
+  for (auto& shard : d_shards) {
+    WriteLock w(&shard.d_lock);
+    if (maxPerShard >= shard.d_entriesCount) {
+      continue;
+    }
 
-  size_t toRemove = d_map.size() - upTo;
-  for(auto it = d_map.begin(); toRemove > 0 && it != d_map.end(); ) {
-    const CacheValue& value = it->second;
+    size_t toRemove = shard.d_entriesCount - maxPerShard;
+    if (d_slabSize > 0) {
+      for (auto it = shard.d_slabEntries.cbegin(); toRemove > 0 && it != shard.d_slabEntries.cend(); ++it) {
+        /* keep the entries that can still be served while being refreshed */
+        if (it->len > 0 && (it->validity + static_cast<time_t>(d_staleWhileRevalidate)) < now) {
+          releaseEntry(shard, *it);
+          --toRemove;
+        }
+      }
+      continue;
+    }
 
-    if (value.validity < now) {
-        it = d_map.erase(it);
+    for(auto it = shard.d_map.begin(); toRemove > 0 && it != shard.d_map.end(); ) {
+      const CacheValue& value = it->second;
+
+      /* keep the entries that can still be served while being refreshed */
+      if ((value.validity + static_cast<time_t>(d_staleWhileRevalidate)) < now) {
+        releaseEntry(shard, it->first, value);
+        it = shard.d_map.erase(it);
         --toRemove;
-    } else {
-      ++it;
+      } else {
+        ++it;
+      }
     }
   }
 }
@@ -223,41 +698,85 @@ void DNSDistPacketCache::purgeExpired(size_t upTo)
    entries in the cache */
 void DNSDistPacketCache::expunge(size_t upTo)
 {
-  WriteLock w(&d_lock);
+  const size_t maxPerShard = upTo / d_shardCount;
 
-  if (upTo >= d_map.size()) {
-    return;
-  }
+  for (auto& shard : d_shards) {
+    WriteLock w(&shard.d_lock);
 
-  size_t toRemove = d_map.size() - upTo;
-  auto beginIt = d_map.begin();
-  auto endIt = beginIt;
-  std::advance(endIt, toRemove);
-  d_map.erase(beginIt, endIt);
+    if (maxPerShard >= shard.d_entriesCount) {
+      continue;
+    }
+
+    size_t toRemove = shard.d_entriesCount - maxPerShard;
+    if (d_slabSize > 0) {
+      for (auto it = shard.d_slabEntries.cbegin(); toRemove > 0 && it != shard.d_slabEntries.cend(); ++it) {
+        if (it->len > 0) {
+          releaseEntry(shard, *it);
+          --toRemove;
+        }
+      }
+      continue;
+    }
+
+    auto beginIt = shard.d_map.begin();
+    auto endIt = beginIt;
+    for (; toRemove > 0; --toRemove, ++endIt) {
+      releaseEntry(shard, endIt->first, endIt->second);
+    }
+    shard.d_map.erase(beginIt, endIt);
+  }
 }
 
 void DNSDistPacketCache::expungeByName(const DNSName& name, uint16_t qtype)
 {
-  WriteLock w(&d_lock);
-
-  for(auto it = d_map.begin(); it != d_map.end(); ) {
-    const CacheValue& value = it->second;
-    uint16_t cqtype = 0;
-    uint16_t cqclass = 0;
-    DNSName cqname(value.value.c_str(), value.len, sizeof(dnsheader), false, &cqtype, &cqclass, nullptr);
+  for (auto& shard : d_shards) {
+    WriteLock w(&shard.d_lock);
+
+    if (d_slabSize > 0) {
+      for (const auto& entry : shard.d_slabEntries) {
+        if (entry.len == 0) {
+          continue;
+        }
+        uint16_t cqtype = 0;
+        uint16_t cqclass = 0;
+        DNSName cqname(getResponseData(shard, entry), entry.len, sizeof(dnsheader), false, &cqtype, &cqclass, nullptr);
+        if (cqname == name && (qtype == QType::ANY || qtype == cqtype)) {
+          releaseEntry(shard, entry);
+        }
+      }
+      continue;
+    }
 
-    if (cqname == name && (qtype == QType::ANY || qtype == cqtype)) {
-        it = d_map.erase(it);
-    } else {
-      ++it;
+    for(auto it = shard.d_map.begin(); it != shard.d_map.end(); ) {
+      const CacheValue& value = it->second;
+      uint16_t cqtype = 0;
+      uint16_t cqclass = 0;
+      DNSName cqname(getResponseData(shard, value), value.len, sizeof(dnsheader), false, &cqtype, &cqclass, nullptr);
+
+      if (cqname == name && (qtype == QType::ANY || qtype == cqtype)) {
+        releaseEntry(shard, it->first, value);
+        it = shard.d_map.erase(it);
+      } else {
+        ++it;
+      }
     }
   }
 }
 
 bool DNSDistPacketCache::isFull()
 {
-    ReadLock r(&d_lock);
-    return (d_map.size() >= d_maxEntries);
+  return (getSize() >= d_maxEntries);
+}
+
+uint64_t DNSDistPacketCache::getSize() const
+{
+  uint64_t count = 0;
+
+  for (const auto& shard : d_shards) {
+    count += shard.d_entriesCount;
+  }
+
+  return count;
 }
 
 uint32_t DNSDistPacketCache::getMinTTL(const char* packet, uint16_t length)
@@ -265,6 +784,20 @@ uint32_t DNSDistPacketCache::getMinTTL(const char* packet, uint16_t length)
   return getDNSPacketMinTTL(packet, length);
 }
 
+uint32_t DNSDistPacketCache::getScopedKey(uint32_t key, const Netmask& scope)
+{
+  const ComboAddress network = scope.getMaskedNetwork();
+  const uint8_t scopeDesc[2] = { static_cast<uint8_t>(network.sin4.sin_family == AF_INET ? 4 : 6), static_cast<uint8_t>(scope.getBits()) };
+  uint32_t result = burtle(scopeDesc, sizeof(scopeDesc), key);
+  if (network.sin4.sin_family == AF_INET) {
+    result = burtle(reinterpret_cast<const unsigned char*>(&network.sin4.sin_addr.s_addr), sizeof(network.sin4.sin_addr.s_addr), result);
+  }
+  else {
+    result = burtle(reinterpret_cast<const unsigned char*>(&network.sin6.sin6_addr.s6_addr), sizeof(network.sin6.sin6_addr.s6_addr), result);
+  }
+  return result;
+}
+
 uint32_t DNSDistPacketCache::getKey(const DNSName& qname, uint16_t consumed, const unsigned char* packet, uint16_t packetLen, bool tcp)
 {
   uint32_t result = 0;
@@ -272,8 +805,14 @@ uint32_t DNSDistPacketCache::getKey(const DNSName& qname, uint16_t consumed, con
   if (packetLen < sizeof(dnsheader))
     throw std::range_error("Computing packet cache key for an invalid packet size");
   result = burtle(packet + 2, sizeof(dnsheader) - 2, result);
-  string lc(qname.toDNSStringLC());
-  result = burtle((const unsigned char*) lc.c_str(), lc.length(), result);
+  /* lower-case the wire name on the stack, label lengths are always < 'A' */
+  const auto& storage = qname.getStorage();
+  unsigned char lc[256];
+  const size_t lcLen = std::min(storage.size(), sizeof(lc));
+  for (size_t idx = 0; idx < lcLen; idx++) {
+    lc[idx] = dns_tolower(storage[idx]);
+  }
+  result = burtle(lc, lcLen, result);
   if (packetLen < sizeof(dnsheader) + consumed) {
     throw std::range_error("Computing packet cache key for an invalid packet");
   }
@@ -284,14 +823,24 @@ uint32_t DNSDistPacketCache::getKey(const DNSName& qname, uint16_t consumed, con
   return result;
 }
 
+uint32_t DNSDistPacketCache::getShardIndex(uint32_t key) const
+{
+  return key % d_shardCount;
+}
+
 string DNSDistPacketCache::toString()
 {
-  ReadLock r(&d_lock);
-  return std::to_string(d_map.size()) + "/" + std::to_string(d_maxEntries);
+  return std::to_string(getSize()) + "/" + std::to_string(d_maxEntries);
 }
 
 uint64_t DNSDistPacketCache::getEntriesCount()
 {
-  ReadLock r(&d_lock);
-  return d_map.size();
+  uint64_t count = 0;
+
+  for (auto& shard : d_shards) {
+    ReadLock r(&shard.d_lock);
+    count += d_slabSize > 0 ? shard.d_slabEntries.size() - shard.d_freeSlabEntries.size() : shard.d_map.size();
+  }
+
+  return count;
 }
@@ -23,6 +23,8 @@
 
 #include <atomic>
 #include <unordered_map>
+#include <vector>
+#include "iputils.hh"
 #include "lock.hh"
 
 struct DNSQuestion;
@@ -30,17 +32,25 @@ struct DNSQuestion;
 class DNSDistPacketCache : boost::noncopyable
 {
 public:
-  DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL=86400, uint32_t minTTL=0, uint32_t servFailTTL=60, uint32_t staleTTL=60);
+  DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL=86400, uint32_t minTTL=0, uint32_t servFailTTL=60, uint32_t staleTTL=60, uint32_t shards=1, uint16_t slabSize=0, uint8_t prefetchThreshold=0, uint32_t staleWhileRevalidate=0, bool ecsScoping=false);
   ~DNSDistPacketCache();
 
-  void insert(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, bool servFail=false);
-  bool get(const DNSQuestion& dq, uint16_t consumed, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t* keyOut, uint32_t allowExpired=0, bool skipAging=false);
+  /* if ecsScope is not null, the response is stored for the clients of that netmask,
+     'key' being the one returned by a scoped get() */
+  void insert(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, bool servFail=false, const Netmask* ecsScope=nullptr);
+  /* if refresh is not null, it is set to true when the caller should send the query to a backend to refresh
+     the entry, which is the case for at most one caller at a time when the entry is close to its expiration
+     (prefetch) or has expired for less than staleWhileRevalidate seconds.
+     If ECS scoping is enabled and ecsSource is not null, the query holds an ECS option for that source added
+     by us at ecsOffset, and the entry stored for the most specific scope covering it is returned. keyOut is
+     then set to the key of the query without that option, to be passed to insert() with the response scope */
+  bool get(const DNSQuestion& dq, uint16_t consumed, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t* keyOut, uint32_t allowExpired=0, bool skipAging=false, bool* refresh=nullptr, const Netmask* ecsSource=nullptr, uint16_t ecsOffset=0);
   void purgeExpired(size_t upTo=0);
   void expunge(size_t upTo=0);
   void expungeByName(const DNSName& name, uint16_t qtype=QType::ANY);
   bool isFull();
   string toString();
-  uint64_t getSize() const { return d_map.size(); }
+  uint64_t getSize() const;
   uint64_t getHits() const { return d_hits; }
   uint64_t getMisses() const { return d_misses; }
   uint64_t getDeferredLookups() const { return d_deferredLookups; }
@@ -49,6 +59,13 @@ public:
   uint64_t getInsertCollisions() const { return d_insertCollisions; }
   uint64_t getMaxEntries() const { return d_maxEntries; }
   uint64_t getTTLTooShorts() const { return d_ttlTooShorts; }
+  uint64_t getRefreshes() const { return d_refreshes; }
+  uint64_t getStaleHits() const { return d_staleHits; }
+  uint8_t getPrefetchThreshold() const { return d_prefetchThreshold; }
+  uint32_t getStaleWhileRevalidate() const { return d_staleWhileRevalidate; }
+  bool isECSScoping() const { return d_ecsScoping; }
+  uint64_t getShardsCount() const { return d_shardCount; }
+  uint16_t getSlabSize() const { return d_slabSize; }
   uint64_t getEntriesCount();
 
   static uint32_t getMinTTL(const char* packet, uint16_t length);
@@ -58,21 +75,155 @@ private:
   struct CacheValue
   {
     time_t getTTD() const { return validity; }
+    const Netmask& getECSScope() const { return ecsScope; }
+    bool isECSScoped() const { return !ecsScope.empty(); }
     std::string value;
     DNSName qname;
     uint16_t qtype{0};
     uint16_t qclass{0};
     time_t added{0};
     time_t validity{0};
+    /* when a query to refresh this entry was last requested, if any */
+    time_t refreshRequested{0};
+    /* for an ECS-scoped entry, its scope and the key of the query without the ECS option,
+       so that the scope can be removed from d_ecsScopes along with the entry */
+    Netmask ecsScope;
+    uint32_t scopelessKey{0};
     uint16_t len{0};
     bool tcp{false};
   };
 
+  /* An entry whose response is stored in the slab of its shard. It does not own any memory,
+     so that all the entries of a shard can be preallocated along with the slab */
+  struct SlabEntry
+  {
+    time_t getTTD() const { return validity; }
+    Netmask getECSScope() const { return Netmask(ecsNetwork, ecsBits); }
+    bool isECSScoped() const { return ecsScoped; }
+    time_t added{0};
+    time_t validity{0};
+    /* when a query to refresh this entry was last requested, if any */
+    time_t refreshRequested{0};
+    /* where the response is stored in the slab */
+    size_t offset{0};
+    /* for an ECS-scoped entry */
+    ComboAddress ecsNetwork;
+    uint32_t key{0};
+    uint32_t scopelessKey{0};
+    uint16_t qtype{0};
+    uint16_t qclass{0};
+    /* 0 for an unused entry */
+    uint16_t len{0};
+    uint8_t sizeClass{0};
+    uint8_t ecsBits{0};
+    bool ecsScoped{false};
+    bool tcp{false};
+  };
+
+  /* The preallocated memory holding the responses of a shard, split in pages of
+     up to 16 slots of slabSize bytes. A page is assigned to a size class, from
+     slabSize down to a few times smaller, the first time that class runs out of free
+     slots, and is then divided in slots of that size. Free slots are chained through
+     their first bytes, so allocating or releasing a slot never allocates memory. */
+  class Slab
+  {
+  public:
+    void init(size_t maxEntries, uint16_t slabSize);
+    /* returns false if no slot of at least len bytes is available */
+    bool allocate(uint16_t len, size_t& offset, uint8_t& sizeClass);
+    void release(size_t offset, uint8_t sizeClass);
+    char* getData(size_t offset)
+    {
+      return &d_data.at(offset);
+    }
+    const char* getData(size_t offset) const
+    {
+      return &d_data.at(offset);
+    }
+    uint16_t getSlotSize(uint8_t sizeClass) const
+    {
+      return d_classes.at(sizeClass).slotSize;
+    }
+
+  private:
+    struct SizeClass
+    {
+      size_t firstFree;
+      uint16_t slotSize;
+    };
+    bool addPage(SizeClass& sizeClass);
+
+    std::vector<char> d_data;
+    std::vector<SizeClass> d_classes;
+    size_t d_pageSize{0};
+    size_t d_nextPage{0};
+  };
+
+  /* each shard has its own lock and map, so that threads working
+     on entries located in different shards do not contend */
+  class CacheShard
+  {
+  public:
+    CacheShard()
+    {
+      pthread_rwlock_init(&d_lock, 0);
+    }
+    CacheShard(const CacheShard& old)
+    {
+      pthread_rwlock_init(&d_lock, 0);
+    }
+    ~CacheShard()
+    {
+      pthread_rwlock_destroy(&d_lock);
+    }
+
+    void setSize(size_t maxSize)
+    {
+      /* we reserve maxSize + 1 to avoid rehashing from occuring
+         when we get to maxSize, as it means a load factor of 1 */
+      d_map.reserve(maxSize + 1);
+    }
+
+    /* preallocate the entries, their index and the memory for maxSize responses of up to slabSize bytes */
+    void setSlabs(size_t maxSize, uint16_t slabSize);
+    SlabEntry* findSlabEntry(uint32_t key);
+    const SlabEntry* findSlabEntry(uint32_t key) const;
+    /* returns nullptr if all the entries are in use */
+    SlabEntry* addSlabEntry(uint32_t key);
+    void removeSlabEntry(const SlabEntry& entry);
+
+    /* used when there is no slab */
+    std::unordered_map<uint32_t,CacheValue> d_map;
+    /* for each ECS-scoped query, the key of the entry stored for each scope. A scope is removed
+       with its entry, so there are never more scopes than entries */
+    std::unordered_map<uint32_t,NetmaskTree<uint32_t> > d_ecsScopes;
+    /* used instead of d_map with a slab: an open-addressing index of the entries, using linear
+       probing and at most half full, each slot holding the key and the position of the entry
+       plus one, 0 for an empty slot */
+    std::vector<std::pair<uint32_t, uint32_t> > d_index;
+    std::vector<SlabEntry> d_slabEntries;
+    std::vector<uint32_t> d_freeSlabEntries;
+    Slab d_slab;
+    unsigned int d_indexShift{0};
+    pthread_rwlock_t d_lock;
+    std::atomic<uint64_t> d_entriesCount{0};
+  };
+
   static uint32_t getKey(const DNSName& qname, uint16_t consumed, const unsigned char* packet, uint16_t packetLen, bool tcp);
-  static bool cachedValueMatches(const CacheValue& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp);
+  static uint32_t getScopedKey(uint32_t key, const Netmask& scope);
+  template<typename T> void removeScope(CacheShard& shard, uint32_t key, const T& value);
+  static bool cachedValueMatches(const CacheShard& shard, const CacheValue& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp);
+  static bool cachedValueMatches(const CacheShard& shard, const SlabEntry& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp);
+  template<typename T> bool canReplace(const CacheShard& shard, const T& value, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp, bool servFail, time_t now, time_t newValidity);
+  template<typename T> bool readEntry(const CacheShard& shard, const T& value, const DNSQuestion& dq, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t allowExpired, bool refresh, time_t now, time_t& age, bool& needRefresh, bool& revalidating);
+  uint32_t getShardIndex(uint32_t key) const;
+  static const char* getResponseData(const CacheShard& shard, const CacheValue& value);
+  static const char* getResponseData(const CacheShard& shard, const SlabEntry& value);
+  void releaseEntry(CacheShard& shard, uint32_t key, const CacheValue& value);
+  void releaseEntry(CacheShard& shard, const SlabEntry& entry);
+  void insertIntoSlab(CacheShard& shard, uint32_t key, uint32_t scopelessKey, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, bool servFail, const Netmask* ecsScope, time_t now, time_t newValidity);
 
-  pthread_rwlock_t d_lock;
-  std::unordered_map<uint32_t,CacheValue> d_map;
+  std::vector<CacheShard> d_shards;
   std::atomic<uint64_t> d_deferredLookups{0};
   std::atomic<uint64_t> d_deferredInserts{0};
   std::atomic<uint64_t> d_hits{0};
@@ -80,9 +231,18 @@ private:
   std::atomic<uint64_t> d_insertCollisions{0};
   std::atomic<uint64_t> d_lookupCollisions{0};
   std::atomic<uint64_t> d_ttlTooShorts{0};
+  std::atomic<uint64_t> d_refreshes{0};
+  std::atomic<uint64_t> d_staleHits{0};
   size_t d_maxEntries;
+  size_t d_maxEntriesPerShard;
+  uint32_t d_shardCount;
   uint32_t d_maxTTL;
   uint32_t d_servFailTTL;
   uint32_t d_minTTL;
   uint32_t d_staleTTL;
+  uint32_t d_staleWhileRevalidate;
+  uint16_t d_slabSize;
+  /* percentage of the TTL of an entry under which it gets refreshed, 0 to disable */
+  uint8_t d_prefetchThreshold;
+  bool d_ecsScoping;
 };
@@ -37,6 +37,19 @@ uint64_t uptimeOfProcess(const std::string& str)
   return time(0) - s_start;
 }
 
+/* the suffixes are chosen by whoever sends us queries, so only keep what can
+   safely be used as a component of a metric path */
+static std::string sanitizeMetricComponent(const DNSName& name)
+{
+  std::string result = name.toStringNoDot();
+  for (auto& c : result) {
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '-') {
+      c = '_';
+    }
+  }
+  return result;
+}
+
 void* carbonDumpThread()
 try
 {
@@ -123,6 +136,25 @@ try
             str<<base<<"cache-lookup-collisions" << " " << cache->getLookupCollisions() << " " << now << "\r\n";
             str<<base<<"cache-insert-collisions" << " " << cache->getInsertCollisions() << " " << now << "\r\n";
             str<<base<<"cache-ttl-too-shorts" << " " << cache->getTTLTooShorts() << " " << now << "\r\n";
+            str<<base<<"cache-refreshes" << " " << cache->getRefreshes() << " " << now << "\r\n";
+            str<<base<<"cache-stale-hits" << " " << cache->getStaleHits() << " " << now << "\r\n";
+          }
+        }
+
+        if (conf.topEntries > 0) {
+          /* queries per second over the covered period */
+          uint64_t total = 0;
+          double elapsed = 0;
+          for (const auto& entry : g_rings.getTopClients(conf.topEntries, total, elapsed)) {
+            string client = entry.first.toString();
+            boost::replace_all(client, ".", "_");
+            boost::replace_all(client, ":", "_");
+            str<<"dnsdist."<<hostname<<".main.top-clients."<<client<<' '<<(elapsed > 0 ? entry.second/elapsed : 0)<<' '<<now<<"\r\n";
+          }
+          /* the full names are not exported, as a random subdomain attack would
+             create new metrics every time */
+          for (const auto& entry : g_rings.getTopQueries(conf.topEntries, true, total, elapsed)) {
+            str<<"dnsdist."<<hostname<<".main.top-suffixes."<<sanitizeMetricComponent(entry.first)<<' '<<(elapsed > 0 ? entry.second/elapsed : 0)<<' '<<now<<"\r\n";
           }
         }
 
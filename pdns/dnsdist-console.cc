@@ -255,7 +255,7 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "addDomainBlock", true, "domain", "block queries within this domain" },
   { "addDomainSpoof", true, "domain, ip[, ip6]", "generate answers for A/AAAA/ANY queries using the ip parameters" },
   { "addDynBlocks", true, "addresses, message[, seconds]", "block the set of addresses with message `msg`, for `seconds` seconds (10 by default)" },
-  { "addLocal", true, "netmask, [true], [false], [TCP Fast Open queue size]", "add to addresses we listen on. Second optional parameter sets TCP or not. Third optional parameter sets SO_REUSEPORT when available. Last parameter sets the TCP Fast Open queue size, enabling TCP Fast Open when available and the value is larger than 0" },
+  { "addLocal", true, "netmask, [true], [false], [TCP Fast Open queue size], [UDP batch size]", "add to addresses we listen on. Second optional parameter sets TCP or not. Third optional parameter sets SO_REUSEPORT when available. Fourth parameter sets the TCP Fast Open queue size, enabling TCP Fast Open when available and the value is larger than 0. Last parameter sets the maximum number of UDP datagrams received and answered in a single system call, when recvmmsg() and sendmmsg() are available and the value is larger than 1" },
   { "addLuaAction", true, "x, func", "where 'x' is all the combinations from `addPoolRule`, and func is a function with the parameter `dq`, which returns an action to be taken on this packet. Good for rare packets but where you want to do a lot of processing" },
   { "addNoRecurseRule", true, "domain", "clear the RD flag for all queries matching the specified domain" },
   { "addPoolRule", true, "domain, pool", "send queries to this domain to that pool" },
@@ -267,7 +267,8 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "AllRule", true, "", "matches all traffic" },
   { "AndRule", true, "list of DNS rules", "matches if all sub-rules matches" },
   { "benchRule", true, "DNS Rule [, iterations [, suffix]]", "bench the specified DNS rule" },
-  { "carbonServer", true, "serverIP, [ourname], [interval]", "report statistics to serverIP using our hostname, or 'ourname' if provided, every 'interval' seconds" },
+  { "carbonServer", true, "serverIP, [ourname], [interval], [topEntries]", "report statistics to serverIP using our hostname, or 'ourname' if provided, every 'interval' seconds, including the `topEntries` top clients and suffixes if set" },
+  { "chashed", false, "", "Consistent hashed ('sticky') distribution over available servers, also based on the server 'weight' parameter" },
   { "controlSocket", true, "addr", "open a control socket on this address / connect to this address in client mode" },
   { "clearDynBlocks", true, "", "clear all dynamic blocks" },
   { "clearQueryCounters", true, "", "clears the query counter buffer" },
@@ -276,6 +277,8 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "DelayResponseAction", true, "milliseconds", "delay the response by the specified amount of milliseconds (UDP-only)" },
   { "delta", true, "", "shows all commands entered that changed the configuration" },
   { "DisableValidationAction", true, "", "set the CD bit in the question, let it go through" },
+  { "DnstapLogAction", true, "identity, FrameStreamLogger", "send the content of this query to a FrameStreamLogger as dnstap" },
+  { "DnstapLogResponseAction", true, "identity, FrameStreamLogger", "send the content of this response to a FrameStreamLogger as dnstap" },
   { "DropAction", true, "", "drop these packets" },
   { "DropResponseAction", true, "", "drop these packets" },
   { "dumpStats", true, "", "print all statistics we gather" },
@@ -302,16 +305,21 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "mvResponseRule", true, "from, to", "move response rule 'from' to a position where it is in front of 'to'. 'to' can be one larger than the largest rule" },
   { "mvRule", true, "from, to", "move rule 'from' to a position where it is in front of 'to'. 'to' can be one larger than the largest rule, in which case the rule will be moved to the last position" },
   { "newDNSName", true, "name", "make a DNSName based on this .-terminated name" },
+  { "newFrameStreamFileLogger", true, "path [, maxQueuedEntries=100]", "create a Frame Streams logger writing to that file, to use with `DnstapLogAction()` and `DnstapLogResponseAction()`" },
+  { "newFrameStreamUnixLogger", true, "path [, maxQueuedEntries=100, reconnectWaitTime=1]", "create a Frame Streams logger writing to that unix socket, to use with `DnstapLogAction()` and `DnstapLogResponseAction()`" },
   { "newQPSLimiter", true, "rate, burst", "configure a QPS limiter with that rate and that burst capacity" },
   { "newRemoteLogger", true, "address:port [, timeout=2, maxQueuedEntries=100, reconnectWaitTime=1]", "create a Remote Logger object, to use with `RemoteLogAction()` and `RemoteLogResponseAction()`" },
   { "newRuleAction", true, "DNS rule, DNS action", "return a pair of DNS Rule and DNS Action, to be used with `setRules()`" },
-  { "newServer", true, "{address=\"ip:port\", qps=1000, order=1, weight=10, pool=\"abuse\", retries=5, tcpSendTimeout=30, tcpRecvTimeout=30, checkName=\"a.root-servers.net.\", checkType=\"A\", maxCheckFailures=1, mustResolve=false, useClientSubnet=true, source=\"address|interface name|address@interface\"", "instantiate a server" },
+  { "newServer", true, "{address=\"ip:port\", qps=1000, order=1, weight=10, pool=\"abuse\", retries=5, tcpSendTimeout=30, tcpRecvTimeout=30, checkName=\"a.root-servers.net.\", checkType=\"A\", maxCheckFailures=1, mustResolve=false, useClientSubnet=true, source=\"address|interface name|address@interface\", sockets=1", "instantiate a server" },
   { "newServerPolicy", true, "name, function", "create a policy object from a Lua function" },
   { "newSuffixMatchNode", true, "", "returns a new SuffixMatchNode" },
   { "NoRecurseAction", true, "", "strip RD bit from the question, let it go through" },
   { "PoolAction", true, "poolname", "set the packet into the specified pool" },
+  { "powerOfTwoChoices", false, "", "Send traffic to the best of two random servers, based on their recent latency multiplied by their number of outstanding queries" },
   { "printDNSCryptProviderFingerprint", true, "\"/path/to/providerPublic.key\"", "display the fingerprint of the provided resolver public key" },
   { "RegexRule", true, "regex", "matches the query name against the supplied regex" },
+  { "RegexSetRule", true, "{regex, regex...}", "matches the query name against all the supplied regexes in a single pass, and matches if any of them does. Unlike RE2Rule, the regexes are not anchored and are case insensitive" },
+  { "RegexSetRules", true, "{regex, regex...}", "returns a table of rules, one for each of the supplied regexes, sharing a single pass over the query name" },
   { "registerDynBPFFilter", true, "DynBPFFilter", "register this dynamic BPF filter into the web interface so that its counters are displayed" },
   { "RemoteLogAction", true, "RemoteLogger", "send the content of this query to a remote logger via Protocol Buffer" },
   { "RemoteLogResponseAction", true, "RemoteLogger", "send the content of this response to a remote logger via Protocol Buffer" },
@@ -325,20 +333,29 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "RCodeRule", true, "rcode", "matches responses with the specified rcode" },
   { "setACL", true, "{netmask, netmask}", "replace the ACL set with these netmasks. Use `setACL({})` to reset the list, meaning no one can use us" },
   { "setAPIWritable", true, "bool, dir", "allow modifications via the API. if `dir` is set, it must be a valid directory where the configuration files will be written by the API" },
+  { "setConsistentHashingBalancingFactor", true, "factor", "skip servers having more than `factor` times the average number of outstanding queries when using the `chashed` policy. 0, the default, disables this" },
+  { "setDNSCryptSharedKeysCacheSize", true, "n", "set the maximum number of client shared keys cached by each of the DNSCrypt binds, including the ones defined before, 0 disables the cache" },
   { "setDNSSECPool", true, "pool name", "move queries requesting DNSSEC processing to this pool" },
   { "setECSOverride", true, "bool", "whether to override an existing EDNS Client Subnet value in the query" },
   { "setECSSourcePrefixV4", true, "prefix-length", "the EDNS Client Subnet prefix-length used for IPv4 queries" },
   { "setECSSourcePrefixV6", true, "prefix-length", "the EDNS Client Subnet prefix-length used for IPv6 queries" },
   { "setKey", true, "key", "set access key to that key" },
-  { "setLocal", true, "netmask, [true], [false], [TCP Fast Open queue size]", "reset list of addresses we listen on to this address. Second optional parameter sets TCP or not. Third optional parameter sets SO_REUSEPORT when available. Last parameter sets the TCP Fast Open queue size, enabling TCP Fast Open when available and the value is larger than 0." },
+  { "setLocal", true, "netmask, [true], [false], [TCP Fast Open queue size], [UDP batch size]", "reset list of addresses we listen on to this address. Second optional parameter sets TCP or not. Third optional parameter sets SO_REUSEPORT when available. Fourth parameter sets the TCP Fast Open queue size, enabling TCP Fast Open when available and the value is larger than 0. Last parameter sets the maximum number of UDP datagrams received and answered in a single system call, when recvmmsg() and sendmmsg() are available and the value is larger than 1." },
+  { "setMaxIdleTCPConnectionsPerDownstream", true, "n", "set the maximum number of idle TCP connections to a given backend kept open by each TCP thread" },
   { "setMaxTCPClientThreads", true, "n", "set the maximum of TCP client threads, handling TCP connections" },
+  { "setMaxTCPPipelinedQueries", true, "n", "set the maximum number of queries in flight over a single TCP connection to a backend" },
   { "setMaxTCPQueuedConnections", true, "n", "set the maximum number of TCP connections queued (waiting to be picked up by a client thread)" },
   { "setMaxUDPOutstanding", true, "n", "set the maximum number of outstanding UDP queries to a given backend server. This can only be set at configuration time and defaults to 10240" },
+  { "setQueryCoalescing", true, "enabled [, maxWaiters]", "set whether identical UDP queries missing in the packet cache should wait for the response to the first one instead of being sent to a backend, and the maximum number of queries waiting for the same response" },
   { "setQueryCount", true, "bool", "set whether queries should be counted" },
   { "setQueryCountFilter", true, "func", "filter queries that would be counted, where `func` is a function with parameter `dq` which decides whether a query should and how it should be counted" },
+  { "setRingBuffersCountersWindow", true, "seconds [, maxEntries]", "set the number of seconds covered by the per-client counters used by the `exceed*()` functions, and optionally their total number of entries" },
+  { "setRingBuffersHeavyHitters", true, "capacity [, period [, suffixLabels]]", "set the number of entries of the summaries tracking the top clients, queries and suffixes in each shard of the ring buffers, the length of the period they cover and the number of labels of the suffixes" },
+  { "setRingBuffersSize", true, "n [, numberOfShards]", "set the capacity of the ring buffers used for live traffic inspection to `n`, split between the shards, and optionally the number of shards" },
   { "setRules", true, "list of rules", "replace the current rules with the supplied list of pairs of DNS Rules and DNS Actions (see `newRuleAction()`)" },
   { "setServerPolicy", true, "policy", "set server selection policy to that policy" },
   { "setServerPolicyLua", true, "name, function", "set server selection policy to one named 'name' and provided by 'function'" },
+  { "setTCPDownstreamMaxIdleTime", true, "seconds", "set the number of seconds after which an idle TCP connection to a backend is closed, 0 to keep it open until the backend closes it" },
   { "setTCPRecvTimeout", true, "n", "set the read timeout on TCP connections from the client, in seconds" },
   { "setTCPSendTimeout", true, "n", "set the write timeout on TCP connections from the client, in seconds" },
   { "setVerboseHealthChecks", true, "bool", "set whether health check errors will be logged" },
@@ -357,8 +374,8 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "SpoofAction", true, "{ip, ...} ", "forge a response with the specified IPv4 (for an A query) or IPv6 (for an AAAA). If you specify multiple addresses, all that match the query type (A, AAAA or ANY) will get spoofed in" },
   { "TCAction", true, "", "create answer to query with TC and RD bits set, to move to TCP" },
   { "testCrypto", true, "", "test of the crypto all works" },
-  { "topBandwidth", true, "top", "show top-`top` clients that consume the most bandwidth over length of ringbuffer" },
-  { "topClients", true, "n", "show top-`n` clients sending the most queries over length of ringbuffer" },
+  { "topBandwidth", true, "top", "show top-`top` clients that consume the most bandwidth over the last one to two minutes" },
+  { "topClients", true, "n", "show top-`n` clients sending the most queries over the last one to two minutes" },
   { "topQueries", true, "n[, labels]", "show top 'n' queries, as grouped when optionally cut down to 'labels' labels" },
   { "topResponses", true, "n, kind[, labels]", "show top 'n' responses with RCODE=kind (0=NO Error, 2=ServFail, 3=ServFail), as grouped when optionally cut down to 'labels' labels" },
   { "topResponseRule", true, "", "move the last response rule to the first position" },
@@ -125,6 +125,42 @@ int rewriteResponseWithoutEDNS(const char * packet, const size_t len, vector<uin
   return 0;
 }
 
+/* skip the (possibly compressed) name starting at 'pos', without decompressing it.
+   If 'minPointerTarget' is not null, returns false if the name contains a compression
+   pointer targeting an offset greater or equal to it. */
+static bool skipWireName(const char* packet, const size_t len, size_t& pos, size_t minPointerTarget=0)
+{
+  while (pos < len) {
+    const uint8_t labelLen = static_cast<uint8_t>(packet[pos]);
+    if (labelLen == 0) {
+      pos++;
+      return true;
+    }
+    if ((labelLen & 0xc0) == 0xc0) {
+      if (pos + 2 > len) {
+        return false;
+      }
+      const size_t target = ((labelLen & 0x3f) << 8) | static_cast<uint8_t>(packet[pos + 1]);
+      if (minPointerTarget != 0 && target >= minPointerTarget) {
+        return false;
+      }
+      pos += 2;
+      return true;
+    }
+    if (labelLen & 0xc0) {
+      /* extended label types */
+      return false;
+    }
+    pos += labelLen + 1;
+  }
+  return false;
+}
+
+static uint16_t getWireUInt16(const char* packet, const size_t pos)
+{
+  return (static_cast<uint8_t>(packet[pos]) << 8) | static_cast<uint8_t>(packet[pos + 1]);
+}
+
 int locateEDNSOptRR(char * packet, const size_t len, char ** optStart, size_t * optLen, bool * last)
 {
   assert(packet != NULL);
@@ -133,64 +169,135 @@ int locateEDNSOptRR(char * packet, const size_t len, char ** optStart, size_t *
   assert(last != NULL);
   const struct dnsheader* dh = (const struct dnsheader*) packet;
 
-  if (ntohs(dh->arcount) == 0)
+  if (len < sizeof(dnsheader) || ntohs(dh->arcount) == 0)
     return ENOENT;
 
-  vector<uint8_t> content(len - sizeof(dnsheader));
-  copy(packet + sizeof(dnsheader), packet + len, content.begin());
-  PacketReader pr(content);
-  size_t idx = 0;
-  DNSName rrname;
+  /* walk the packet in place, skipping the names instead of parsing them */
+  size_t pos = sizeof(dnsheader);
   uint16_t qdcount = ntohs(dh->qdcount);
   uint16_t ancount = ntohs(dh->ancount);
   uint16_t nscount = ntohs(dh->nscount);
   uint16_t arcount = ntohs(dh->arcount);
-  uint16_t rrtype;
-  uint16_t rrclass;
-  struct dnsrecordheader ah;
+  size_t idx = 0;
 
   /* consume qd */
   for(idx = 0; idx < qdcount; idx++) {
-    rrname = pr.getName();
-    rrtype = pr.get16BitInt();
-    rrclass = pr.get16BitInt();
-    (void) rrtype;
-    (void) rrclass;
+    if (!skipWireName(packet, len, pos) || (len - pos) < (DNS_TYPE_SIZE + DNS_CLASS_SIZE)) {
+      return EINVAL;
+    }
+    pos += DNS_TYPE_SIZE + DNS_CLASS_SIZE;
   }
 
-  /* consume AN and NS */
-  for (idx = 0; idx < ancount + nscount; idx++) {
-    rrname = pr.getName();
-    pr.getDnsrecordheader(ah);
-    pr.d_pos += ah.d_clen;
+  /* consume AN and NS, then AR looking for OPT */
+  for (idx = 0; idx < (size_t) ancount + nscount + arcount; idx++) {
+    const size_t start = pos;
+    if (!skipWireName(packet, len, pos) || (len - pos) < (DNS_TYPE_SIZE + DNS_CLASS_SIZE + DNS_TTL_SIZE + DNS_RDLENGTH_SIZE)) {
+      return EINVAL;
+    }
+    const uint16_t type = getWireUInt16(packet, pos);
+    pos += DNS_TYPE_SIZE + DNS_CLASS_SIZE + DNS_TTL_SIZE;
+    const uint16_t rdLen = getWireUInt16(packet, pos);
+    pos += DNS_RDLENGTH_SIZE;
+
+    if ((len - pos) < rdLen) {
+      return EINVAL;
+    }
+    pos += rdLen;
+
+    if (idx >= (size_t) ancount + nscount && type == QType::OPT) {
+      *optStart = packet + start;
+      *optLen = pos - start;
+      *last = (idx == ((size_t) ancount + nscount + arcount - 1));
+      return 0;
+    }
   }
 
-  /* consume AR, looking for OPT */
-  for (idx = 0; idx < arcount; idx++) {
-    uint16_t start = pr.d_pos;
-    rrname = pr.getName();
-    pr.getDnsrecordheader(ah);
+  return ENOENT;
+}
 
-    if (ah.d_type == QType::OPT) {
-      *optStart = packet + sizeof(dnsheader) + start;
-      *optLen = (pr.d_pos - start) + ah.d_clen;
+/* Whether the records between 'pos' and the end of the packet can be moved backwards without
+   breaking their compressed names, meaning that none of them points to 'minPointerTarget' or after it.
+   Only the owner names and records types whose RDATA can not contain compressed names are accepted. */
+static bool trailingRecordsCanBeMoved(const char* packet, const size_t len, size_t pos, const size_t minPointerTarget)
+{
+  while (pos < len) {
+    if (!skipWireName(packet, len, pos, minPointerTarget) || (len - pos) < (DNS_TYPE_SIZE + DNS_CLASS_SIZE + DNS_TTL_SIZE + DNS_RDLENGTH_SIZE)) {
+      return false;
+    }
+    const uint16_t type = getWireUInt16(packet, pos);
+    pos += DNS_TYPE_SIZE + DNS_CLASS_SIZE + DNS_TTL_SIZE;
+    const uint16_t rdLen = getWireUInt16(packet, pos);
+    pos += DNS_RDLENGTH_SIZE;
+
+    switch (type) {
+    case QType::A:
+    case QType::AAAA:
+    case QType::TXT:
+    case QType::OPT:
+    case QType::DS:
+    case QType::DNSKEY:
+    case QType::RRSIG:
+    case QType::NSEC:
+    case QType::NSEC3:
+      break;
+    default:
+      return false;
+    }
 
-      if ((packet + len) < (*optStart + *optLen)) {
-        throw std::range_error("Opt record overflow");
-      }
+    if ((len - pos) < rdLen) {
+      return false;
+    }
+    pos += rdLen;
+  }
+  return pos == len;
+}
 
-      if (idx == ((size_t) arcount - 1)) {
-        *last = true;
-      }
-      else {
-        *last = false;
-      }
-      return 0;
+int removeEDNSOptRRInPlace(char* packet, uint16_t* len, char* optStart, size_t optLen)
+{
+  struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(packet);
+  const size_t optOffset = optStart - packet;
+  const size_t trailingOffset = optOffset + optLen;
+
+  if (ntohs(dh->arcount) == 0 || trailingOffset > *len) {
+    return EINVAL;
+  }
+
+  if (trailingOffset < *len) {
+    if (!trailingRecordsCanBeMoved(packet, *len, trailingOffset, optOffset)) {
+      return ENOTSUP;
     }
-    pr.d_pos += ah.d_clen;
+    memmove(optStart, packet + trailingOffset, *len - trailingOffset);
   }
 
-  return ENOENT;
+  *len -= optLen;
+  dh->arcount = htons(ntohs(dh->arcount) - 1);
+  return 0;
+}
+
+int removeEDNSOptionInPlace(char* packet, uint16_t* len, char* optStart, size_t optLen, const uint16_t optionCodeToRemove)
+{
+  const size_t optOffset = optStart - packet;
+  const size_t trailingOffset = optOffset + optLen;
+
+  if (trailingOffset > *len) {
+    return EINVAL;
+  }
+
+  if (trailingOffset < *len && !trailingRecordsCanBeMoved(packet, *len, trailingOffset, optOffset)) {
+    return ENOTSUP;
+  }
+
+  size_t newOptLen = optLen;
+  int res = removeEDNSOptionFromOPT(optStart, &newOptLen, optionCodeToRemove);
+  if (res != 0) {
+    return res;
+  }
+
+  if (trailingOffset < *len) {
+    memmove(optStart + newOptLen, packet + trailingOffset, *len - trailingOffset);
+  }
+  *len -= (optLen - newOptLen);
+  return 0;
 }
 
 /* extract the start of the OPT RR in a QUERY packet if any */
@@ -231,13 +338,36 @@ static int getEDNSOptionsStart(char* packet, const size_t offset, const size_t l
   return 0;
 }
 
-static void generateECSOption(const ComboAddress& source, string& res, uint16_t ECSPrefixLength)
+/* ECS option code (2), option length (2), family (2), source and scope prefix lengths (1 + 1), up to 16 bytes of address */
+static const size_t s_maxECSOptionSize = 24;
+/* root label (1), type (2), class (2), TTL (4), RDLen (2) */
+static const size_t s_optRRHeaderSize = 11;
+static_assert(s_EDNSClientSubnetRoom >= s_optRRHeaderSize + s_maxECSOptionSize, "s_EDNSClientSubnetRoom should be able to hold an OPT RR with an ECS option");
+
+/* write the ECS option for the source address truncated to ECSPrefixLength bits to 'out', which should
+   be able to hold s_maxECSOptionSize bytes, without allocating. Returns the size of the option */
+static size_t generateECSOption(const ComboAddress& source, char* out, uint16_t ECSPrefixLength)
 {
-  Netmask sourceNetmask(source, ECSPrefixLength);
-  EDNSSubnetOpts ecsOpts;
-  ecsOpts.source = sourceNetmask;
-  string payload = makeEDNSSubnetOptsString(ecsOpts);
-  generateEDNSOption(EDNSOptionCode::ECS, payload, res);
+  const bool v4 = source.sin4.sin_family == AF_INET;
+  const uint8_t sourceBits = std::min(ECSPrefixLength, static_cast<uint16_t>(v4 ? 32 : 128));
+  const size_t octets = (sourceBits + 7) / 8;
+  const uint16_t payloadLen = 4 + octets;
+  const unsigned char* addr = v4 ? reinterpret_cast<const unsigned char*>(&source.sin4.sin_addr.s_addr) : reinterpret_cast<const unsigned char*>(&source.sin6.sin6_addr.s6_addr);
+
+  out[0] = EDNSOptionCode::ECS / 256;
+  out[1] = EDNSOptionCode::ECS % 256;
+  out[2] = payloadLen / 256;
+  out[3] = payloadLen % 256;
+  out[4] = 0;
+  out[5] = v4 ? 1 : 2;
+  out[6] = sourceBits;
+  out[7] = 0;
+  memcpy(out + 8, addr, octets);
+  if (sourceBits % 8) {
+    /* the bits beyond the source prefix length must be zero */
+    out[8 + octets - 1] &= static_cast<char>(0xff << (8 - (sourceBits % 8)));
+  }
+  return 4 + payloadLen;
 }
 
 void generateOptRR(const std::string& optRData, string& res)
@@ -259,57 +389,46 @@ void generateOptRR(const std::string& optRData, string& res)
   res.append(optRData.c_str(), optRData.length());
 }
 
-static void replaceEDNSClientSubnetOption(char * const packet, const size_t packetSize, uint16_t * const len, string& largerPacket, const ComboAddress& remote, char * const oldEcsOptionStart, size_t const oldEcsOptionSize, unsigned char * const optRDLen, uint16_t ECSPrefixLength)
+static bool replaceEDNSClientSubnetOption(char * const packet, const size_t packetSize, uint16_t * const len, const ComboAddress& remote, char * const oldEcsOptionStart, size_t const oldEcsOptionSize, unsigned char * const optRDLen, uint16_t ECSPrefixLength)
 {
   assert(packet != NULL);
   assert(len != NULL);
   assert(oldEcsOptionStart != NULL);
   assert(optRDLen != NULL);
-  string ECSOption;
-  generateECSOption(remote, ECSOption, ECSPrefixLength);
+  char ECSOption[s_maxECSOptionSize];
+  const size_t ECSOptionSize = generateECSOption(remote, ECSOption, ECSPrefixLength);
 
-  if (ECSOption.size() == oldEcsOptionSize) {
+  if (ECSOptionSize == oldEcsOptionSize) {
     /* same size as the existing option */
-    memcpy(oldEcsOptionStart, ECSOption.c_str(), oldEcsOptionSize);
+    memcpy(oldEcsOptionStart, ECSOption, oldEcsOptionSize);
   }
   else {
     /* different size than the existing option */
-    const unsigned int newPacketLen = *len + (ECSOption.length() - oldEcsOptionSize);
+    const unsigned int newPacketLen = *len + (ECSOptionSize - oldEcsOptionSize);
     const size_t beforeOptionLen = oldEcsOptionStart - packet;
     const size_t dataBehindSize = *len - beforeOptionLen - oldEcsOptionSize;
-          
+
+    if (newPacketLen > packetSize) {
+      return false;
+    }
+
     /* fix the size of ECS Option RDLen */
     uint16_t newRDLen = (optRDLen[0] * 256) + optRDLen[1];
-    newRDLen += (ECSOption.size() - oldEcsOptionSize);
+    newRDLen += (ECSOptionSize - oldEcsOptionSize);
     optRDLen[0] = newRDLen / 256;
     optRDLen[1] = newRDLen % 256;
-    
-    if (newPacketLen <= packetSize) {
-      /* it fits in the existing buffer */
-      if (dataBehindSize > 0) {
-        memmove(oldEcsOptionStart, oldEcsOptionStart + oldEcsOptionSize, dataBehindSize);
-      }
-      memcpy(oldEcsOptionStart + dataBehindSize, ECSOption.c_str(), ECSOption.size());
-      *len = newPacketLen;
-    }
-    else {
-      /* We need a larger packet */
-      if (newPacketLen > largerPacket.capacity()) {
-        largerPacket.reserve(newPacketLen);
-      }
-      /* copy data before the existing option */
-      largerPacket.append(packet, beforeOptionLen);
-      /* copy the new option */
-      largerPacket.append(ECSOption);
-      /* copy data that where behind the existing option */
-      if (dataBehindSize > 0) {
-        largerPacket.append(oldEcsOptionStart + oldEcsOptionSize, dataBehindSize);
-      }
+
+    /* the OPT RR is the last one, so the new option can go after the remaining ones */
+    if (dataBehindSize > 0) {
+      memmove(oldEcsOptionStart, oldEcsOptionStart + oldEcsOptionSize, dataBehindSize);
     }
+    memcpy(oldEcsOptionStart + dataBehindSize, ECSOption, ECSOptionSize);
+    *len = newPacketLen;
   }
+  return true;
 }
 
-void handleEDNSClientSubnet(char* const packet, const size_t packetSize, const unsigned int consumed, uint16_t* const len, string& largerPacket, bool* const ednsAdded, bool* const ecsAdded, const ComboAddress& remote, bool overrideExisting, uint16_t ecsPrefixLength)
+bool handleEDNSClientSubnet(char* const packet, const size_t packetSize, const unsigned int consumed, uint16_t* const len, bool* const ednsAdded, bool* const ecsAdded, const ComboAddress& remote, bool overrideExisting, uint16_t ecsPrefixLength)
 {
   assert(packet != NULL);
   assert(len != NULL);
@@ -320,73 +439,73 @@ void handleEDNSClientSubnet(char* const packet, const size_t packetSize, const u
   size_t remaining = 0;
 
   int res = getEDNSOptionsStart(packet, consumed, *len, (char**) &optRDLen, &remaining);
-        
+
   if (res == 0) {
     char * ecsOptionStart = NULL;
     size_t ecsOptionSize = 0;
-    
+
     res = getEDNSOption((char*)optRDLen, remaining, EDNSOptionCode::ECS, &ecsOptionStart, &ecsOptionSize);
-    
+
     if (res == 0) {
       /* there is already an ECS value */
       if (overrideExisting) {
-        replaceEDNSClientSubnetOption(packet, packetSize, len, largerPacket, remote, ecsOptionStart, ecsOptionSize, optRDLen, ecsPrefixLength);
+        return replaceEDNSClientSubnetOption(packet, packetSize, len, remote, ecsOptionStart, ecsOptionSize, optRDLen, ecsPrefixLength);
       }
     } else {
       /* we need to add one EDNS0 ECS option, fixing the size of EDNS0 RDLENGTH */
       /* getEDNSOptionsStart has already checked that there is exactly one AR,
          no NS and no AN */
-      string ECSOption;
-      generateECSOption(remote, ECSOption, ecsPrefixLength);
-      const size_t ECSOptionSize = ECSOption.size();
-      
+      char ECSOption[s_maxECSOptionSize];
+      const size_t ECSOptionSize = generateECSOption(remote, ECSOption, ecsPrefixLength);
+
+      if (packetSize - *len < ECSOptionSize) {
+        return false;
+      }
+
       uint16_t newRDLen = (optRDLen[0] * 256) + optRDLen[1];
       newRDLen += ECSOptionSize;
       optRDLen[0] = newRDLen / 256;
       optRDLen[1] = newRDLen % 256;
 
-      if (packetSize - *len > ECSOptionSize) {
-        /* if the existing buffer is large enough */
-        memcpy(packet + *len, ECSOption.c_str(), ECSOptionSize);
-        *len += ECSOptionSize;
-      }
-      else {
-        if (*len + ECSOptionSize > largerPacket.capacity()) {
-          largerPacket.reserve(*len + ECSOptionSize);
-        }
-        
-        largerPacket.append(packet, *len);
-        largerPacket.append(ECSOption);
-      }
+      memcpy(packet + *len, ECSOption, ECSOptionSize);
+      *len += ECSOptionSize;
       *ecsAdded = true;
     }
   }
   else {
     /* we need to add a EDNS0 RR with one EDNS0 ECS option, fixing the AR count */
-    string EDNSRR;
     struct dnsheader* dh = (struct dnsheader*) packet;
-    string optRData;
-    generateECSOption(remote, optRData, ecsPrefixLength);
-    generateOptRR(optRData, EDNSRR);
+
+    if (packetSize - *len < s_optRRHeaderSize + s_maxECSOptionSize) {
+      return false;
+    }
+
+    /* write the ECS option directly after the OPT RR header, then the header itself */
+    char* optRR = packet + *len;
+    const size_t ECSOptionSize = generateECSOption(remote, optRR + s_optRRHeaderSize, ecsPrefixLength);
+
+    dnsrecordheader drh;
+    EDNS0Record edns0;
+    edns0.extRCode = 0;
+    edns0.version = 0;
+    edns0.Z = 0;
+    drh.d_type = htons(QType::OPT);
+    drh.d_class = htons(g_EdnsUDPPayloadSize);
+    static_assert(sizeof(EDNS0Record) == sizeof(drh.d_ttl), "sizeof(EDNS0Record) must match sizeof(dnsrecordheader.d_ttl)");
+    memcpy(&drh.d_ttl, &edns0, sizeof edns0);
+    drh.d_clen = htons((uint16_t) ECSOptionSize);
+    optRR[0] = 0;
+    memcpy(optRR + 1, &drh, sizeof drh);
+
     uint16_t arcount = ntohs(dh->arcount);
     arcount++;
     dh->arcount = htons(arcount);
     *ednsAdded = true;
 
-    /* does it fit in the existing buffer? */
-    if (packetSize - *len > EDNSRR.size()) {
-      memcpy(packet + *len, EDNSRR.c_str(), EDNSRR.size());
-      *len += EDNSRR.size();
-    }
-    else {
-      if (*len + EDNSRR.size() > largerPacket.capacity()) {
-        largerPacket.reserve(*len + EDNSRR.size());
-      }
-      
-      largerPacket.append(packet, *len);
-      largerPacket.append(EDNSRR);
-    }
+    *len += s_optRRHeaderSize + ECSOptionSize;
   }
+
+  return true;
 }
 
 static int removeEDNSOptionFromOptions(unsigned char* optionsStart, const uint16_t optionsLen, const uint16_t optionCodeToRemove, uint16_t* newOptionsLen)
@@ -442,6 +561,39 @@ int removeEDNSOptionFromOPT(char* optStart, size_t* optLen, const uint16_t optio
   return 0;
 }
 
+int getECSScopeFromResponse(char* packet, const size_t len, uint8_t* scope)
+{
+  assert(scope != NULL);
+  char* optStart = NULL;
+  size_t optLen = 0;
+  bool last = false;
+
+  int res = locateEDNSOptRR(packet, len, &optStart, &optLen, &last);
+  if (res != 0) {
+    return res;
+  }
+
+  /* root label (1), type (2), class (2), ttl (4) */
+  if (optLen < 11) {
+    return EINVAL;
+  }
+
+  char* ecsOptionStart = NULL;
+  size_t ecsOptionSize = 0;
+  res = getEDNSOption(optStart + 9, optLen - 9, EDNSOptionCode::ECS, &ecsOptionStart, &ecsOptionSize);
+  if (res != 0) {
+    return res;
+  }
+
+  /* code (2), length (2), family (2), source prefix length (1), scope prefix length (1) */
+  if (ecsOptionSize < 8) {
+    return EINVAL;
+  }
+
+  *scope = static_cast<uint8_t>(ecsOptionStart[7]);
+  return 0;
+}
+
 int rewriteResponseWithoutEDNSOption(const char * packet, const size_t len, const uint16_t optionCodeToSkip, vector<uint8_t>& newContent)
 {
   assert(packet != NULL);
@@ -23,7 +23,19 @@
 
 int rewriteResponseWithoutEDNS(const char * packet, size_t len, vector<uint8_t>& newContent);
 int locateEDNSOptRR(char * packet, size_t len, char ** optStart, size_t * optLen, bool * last);
-void handleEDNSClientSubnet(char * packet, size_t packetSize, unsigned int consumed, uint16_t * len, string& largerPacket, bool* ednsAdded, bool* ecsAdded, const ComboAddress& remote, bool overrideExisting, uint16_t ecsPrefixLength);
+/* room needed after a query to add an OPT RR (11) holding an ECS option for a full IPv6 address (4 + 4 + 16),
+   which also covers adding that option to an existing OPT RR or replacing a smaller one */
+static const size_t s_EDNSClientSubnetRoom = 35;
+
+/* add or replace the ECS option in place, returns false if the packet is too small to hold it,
+   leaving the query untouched */
+bool handleEDNSClientSubnet(char * packet, size_t packetSize, unsigned int consumed, uint16_t * len, bool* ednsAdded, bool* ecsAdded, const ComboAddress& remote, bool overrideExisting, uint16_t ecsPrefixLength);
 void generateOptRR(const std::string& optRData, string& res);
 int removeEDNSOptionFromOPT(char* optStart, size_t* optLen, const uint16_t optionCodeToRemove);
 int rewriteResponseWithoutEDNSOption(const char * packet, const size_t len, const uint16_t optionCodeToSkip, vector<uint8_t>& newContent);
+/* remove the OPT RR, or an option from it, without rewriting the response. Returns ENOTSUP
+   if the records following the OPT RR can not be moved, the response needing to be rewritten */
+int removeEDNSOptRRInPlace(char* packet, uint16_t* len, char* optStart, size_t optLen);
+int removeEDNSOptionInPlace(char* packet, uint16_t* len, char* optStart, size_t optLen, const uint16_t optionCodeToRemove);
+/* the scope prefix length of the ECS option of a response, ENOENT if there is none */
+int getECSScopeFromResponse(char* packet, size_t len, uint8_t* scope);
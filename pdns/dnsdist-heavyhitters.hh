@@ -0,0 +1,273 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <algorithm>
+#include <ctime>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+/* Space-Saving (Metwally, Agrawal, El Abbadi) summary of the most frequent keys of a stream,
+   using at most 'capacity' entries. When the summary is full, a new key replaces the entry
+   with the lowest count and inherits that count, so counts are over-estimated by at most
+   the count of the evicted entry, and any key seen more than total/capacity times is
+   guaranteed to be present. The entries are kept in a min-heap, so updates are O(log capacity).
+   Not thread-safe. */
+template<typename T, typename Hash=std::hash<T>, typename KeyEqual=std::equal_to<T> >
+class SpaceSaving
+{
+public:
+  typedef std::unordered_map<T, uint64_t, Hash, KeyEqual> counts_t;
+
+  explicit SpaceSaving(size_t capacity): d_capacity(capacity)
+  {
+  }
+
+  void add(const T& key, uint64_t weight=1)
+  {
+    if (d_capacity == 0) {
+      return;
+    }
+
+    auto it = d_positions.find(key);
+    if (it != d_positions.end()) {
+      d_total += weight;
+      d_heap[it->second].count += weight;
+      siftDown(it->second);
+      return;
+    }
+
+    if (d_heap.size() < d_capacity) {
+      d_total += weight;
+      d_heap.push_back({key, weight});
+      d_positions.insert({key, d_heap.size() - 1});
+      siftUp(d_heap.size() - 1);
+      return;
+    }
+
+    replaceMin(key, weight);
+  }
+
+  /* The two methods below allow a caller to bound the number of entries of several summaries
+     together, instead of relying on the capacity of each of them. */
+
+  /* 'key' replaces the entry with the lowest count and inherits that count, whether the summary is full or not.
+     The key should not already be present, and the summary should not be empty */
+  void replaceMin(const T& key, uint64_t weight=1)
+  {
+    d_total += weight;
+    Entry& min = d_heap.front();
+    d_positions.erase(min.key);
+    min.key = key;
+    min.count += weight;
+    d_positions.insert({key, 0});
+    siftDown(0);
+  }
+
+  /* drop the entry with the lowest count, the summary should not be empty */
+  void removeMin()
+  {
+    d_positions.erase(d_heap.front().key);
+    if (d_heap.size() > 1) {
+      d_heap.front() = std::move(d_heap.back());
+      d_positions[d_heap.front().key] = 0;
+    }
+    d_heap.pop_back();
+    if (!d_heap.empty()) {
+      siftDown(0);
+    }
+  }
+
+  bool contains(const T& key) const
+  {
+    return d_positions.count(key) > 0;
+  }
+
+  /* add the count of every entry to 'counts', returns the total weight seen */
+  uint64_t addTo(counts_t& counts) const
+  {
+    for (const auto& entry : d_heap) {
+      counts[entry.key] += entry.count;
+    }
+    return d_total;
+  }
+
+  void clear()
+  {
+    d_heap.clear();
+    d_positions.clear();
+    d_total = 0;
+  }
+
+  size_t size() const
+  {
+    return d_heap.size();
+  }
+
+  size_t getCapacity() const
+  {
+    return d_capacity;
+  }
+
+  uint64_t getTotal() const
+  {
+    return d_total;
+  }
+
+private:
+  struct Entry
+  {
+    T key;
+    uint64_t count;
+  };
+
+  void swapEntries(size_t a, size_t b)
+  {
+    std::swap(d_heap[a], d_heap[b]);
+    d_positions[d_heap[a].key] = a;
+    d_positions[d_heap[b].key] = b;
+  }
+
+  void siftUp(size_t pos)
+  {
+    while (pos > 0) {
+      size_t parent = (pos - 1) / 2;
+      if (d_heap[parent].count <= d_heap[pos].count) {
+        break;
+      }
+      swapEntries(parent, pos);
+      pos = parent;
+    }
+  }
+
+  void siftDown(size_t pos)
+  {
+    const size_t size = d_heap.size();
+    for (;;) {
+      size_t smallest = pos;
+      size_t left = 2 * pos + 1;
+      size_t right = left + 1;
+      if (left < size && d_heap[left].count < d_heap[smallest].count) {
+        smallest = left;
+      }
+      if (right < size && d_heap[right].count < d_heap[smallest].count) {
+        smallest = right;
+      }
+      if (smallest == pos) {
+        break;
+      }
+      swapEntries(pos, smallest);
+      pos = smallest;
+    }
+  }
+
+  std::vector<Entry> d_heap;
+  std::unordered_map<T, size_t, Hash, KeyEqual> d_positions;
+  size_t d_capacity;
+  uint64_t d_total{0};
+};
+
+/* Two Space-Saving summaries covering consecutive periods of 'period' seconds, so that
+   the reported heavy hitters are those of the last one to two periods instead of those
+   seen since the start. Not thread-safe. */
+template<typename T, typename Hash=std::hash<T>, typename KeyEqual=std::equal_to<T> >
+class HeavyHitters
+{
+public:
+  typedef typename SpaceSaving<T, Hash, KeyEqual>::counts_t counts_t;
+
+  HeavyHitters(size_t capacity, time_t period): d_current(capacity), d_previous(capacity), d_period(period > 0 ? period : 1)
+  {
+  }
+
+  void add(const T& key, uint64_t weight, time_t now)
+  {
+    const time_t generation = now / d_period;
+    if (generation > d_generation) {
+      if (generation == d_generation + 1) {
+        std::swap(d_current, d_previous);
+      }
+      else {
+        d_previous.clear();
+      }
+      d_current.clear();
+      d_generation = generation;
+    }
+    else if (generation < d_generation) {
+      /* late insertion for a period we already rotated away from */
+      if (generation + 1 == d_generation) {
+        d_previous.add(key, weight);
+      }
+      return;
+    }
+
+    d_current.add(key, weight);
+  }
+
+  /* whether 'key' is present in the summary of the current or of the previous period */
+  bool contains(const T& key) const
+  {
+    return d_current.contains(key) || d_previous.contains(key);
+  }
+
+  /* add the counts of the entries seen during the previous and the current periods to 'counts',
+     returns the total weight seen during these periods */
+  uint64_t addTo(counts_t& counts, time_t now) const
+  {
+    const time_t generation = now / d_period;
+    uint64_t total = 0;
+    if (d_generation == generation) {
+      total += d_previous.addTo(counts);
+      total += d_current.addTo(counts);
+    }
+    else if (d_generation + 1 == generation) {
+      total += d_current.addTo(counts);
+    }
+    return total;
+  }
+
+  /* number of seconds covered by addTo() */
+  double getCoveredPeriod(const struct timespec& now) const
+  {
+    return (now.tv_sec - ((now.tv_sec / d_period) - 1) * d_period) + (now.tv_nsec / 1000000000.0);
+  }
+
+private:
+  SpaceSaving<T, Hash, KeyEqual> d_current;
+  SpaceSaving<T, Hash, KeyEqual> d_previous;
+  time_t d_period;
+  time_t d_generation{0};
+};
+
+/* the 'top' entries with the highest counts, in decreasing order */
+template<typename T, typename Hash, typename KeyEqual>
+std::vector<std::pair<T, uint64_t> > getTopEntries(const std::unordered_map<T, uint64_t, Hash, KeyEqual>& counts, size_t top)
+{
+  std::vector<std::pair<T, uint64_t> > result(counts.cbegin(), counts.cend());
+  top = std::min(top, result.size());
+  std::partial_sort(result.begin(), result.begin() + top, result.end(), [](const std::pair<T, uint64_t>& a, const std::pair<T, uint64_t>& b) {
+      return a.second > b.second;
+    });
+  result.resize(top);
+  return result;
+}
@@ -0,0 +1,125 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "dnsdist-inflight.hh"
+
+InFlightQueries::InFlightQueries(size_t shardsCount, size_t maxWaiters, time_t timeout): d_maxWaiters(maxWaiters), d_timeout(timeout)
+{
+  if (shardsCount == 0) {
+    shardsCount = 1;
+  }
+
+  d_shards.reserve(shardsCount);
+  for (size_t idx = 0; idx < shardsCount; idx++) {
+    d_shards.push_back(std::unique_ptr<Shard>(new Shard()));
+  }
+}
+
+InFlightQueries::Status InFlightQueries::add(const DNSDistPacketCache* cache, uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool ednsAdded, bool ecsAdded, InFlightWaiter&& waiter, uint64_t* leaderId)
+{
+  auto& shard = getShard(key);
+  const time_t now = time(nullptr);
+  std::lock_guard<std::mutex> lock(shard.d_lock);
+
+  auto it = shard.d_map.find(key);
+  if (it != shard.d_map.end() && (now - it->second.added) < d_timeout) {
+    Entry& entry = it->second;
+    /* the EDNS flags have to match as well, since they alter the way the response is fixed up */
+    if (entry.cache != cache || entry.qtype != qtype || entry.qclass != qclass || entry.ednsAdded != ednsAdded || entry.ecsAdded != ecsAdded || !(entry.qname == qname)) {
+      return Status::Independent;
+    }
+
+    if (entry.waiters.size() >= d_maxWaiters) {
+      return Status::Independent;
+    }
+
+    entry.waiters.push_back(std::move(waiter));
+    return Status::Waiting;
+  }
+
+  /* new entry, or the response to the previous leader has been lost */
+  Entry& entry = shard.d_map[key];
+  entry.qname = qname;
+  entry.waiters.clear();
+  entry.cache = cache;
+  entry.added = now;
+  entry.qtype = qtype;
+  entry.qclass = qclass;
+  entry.ednsAdded = ednsAdded;
+  entry.ecsAdded = ecsAdded;
+  entry.leaderId = ++d_leaderIds;
+  if (leaderId != nullptr) {
+    *leaderId = entry.leaderId;
+  }
+  return Status::Leader;
+}
+
+std::vector<InFlightWaiter> InFlightQueries::release(const DNSDistPacketCache* cache, uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, uint64_t leaderId)
+{
+  std::vector<InFlightWaiter> result;
+  auto& shard = getShard(key);
+  std::lock_guard<std::mutex> lock(shard.d_lock);
+
+  auto it = shard.d_map.find(key);
+  if (it == shard.d_map.end()) {
+    return result;
+  }
+
+  const Entry& entry = it->second;
+  if (entry.cache != cache || entry.qtype != qtype || entry.qclass != qclass || !(entry.qname == qname)) {
+    return result;
+  }
+
+  if (leaderId != 0 && entry.leaderId != leaderId) {
+    return result;
+  }
+
+  result = std::move(it->second.waiters);
+  shard.d_map.erase(it);
+  return result;
+}
+
+void InFlightQueries::purgeExpired()
+{
+  const time_t now = time(nullptr);
+
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard->d_lock);
+    for (auto it = shard->d_map.begin(); it != shard->d_map.end(); ) {
+      if ((now - it->second.added) >= d_timeout) {
+        it = shard->d_map.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+}
+
+size_t InFlightQueries::size() const
+{
+  size_t result = 0;
+  for (const auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard->d_lock);
+    result += shard->d_map.size();
+  }
+  return result;
+}
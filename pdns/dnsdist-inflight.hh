@@ -0,0 +1,117 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "config.h"
+#include "dnscrypt.hh"
+#include "dnsname.hh"
+#include "iputils.hh"
+
+class DNSDistPacketCache;
+
+/* a client query waiting for the response to an identical query already sent to a backend */
+struct InFlightWaiter
+{
+  DNSName qname; // as sent by the client, to restore its case
+  ComboAddress origRemote;
+  ComboAddress origDest;
+#ifdef HAVE_DNSCRYPT
+  std::shared_ptr<DnsCryptQuery> dnsCryptQuery{nullptr};
+#endif
+  int origFD{-1};
+  int delayMsec{0};
+  uint16_t origID{0};
+  uint16_t origFlags{0};
+  bool destHarvested{false};
+};
+
+/* Queries missing in the packet cache, indexed by their cache key. While one of them is being
+   processed by a backend, identical queries for the same cache arriving on UDP wait for its
+   response instead of being sent to a backend as well. The first query is the leader, and
+   gets the waiters back when its response arrives. */
+class InFlightQueries
+{
+public:
+  enum class Status : uint8_t { Leader, Waiting, Independent };
+
+  InFlightQueries(size_t shardsCount=16, size_t maxWaiters=100, time_t timeout=2);
+
+  /* Leader if there was no identical query in flight (or it timed out) and this one should be sent to a
+     backend, then release() called when its response arrives, or as soon as it is known that it will not get
+     a usable one. 'leaderId' is then set to a non-zero value identifying this leader. Waiting if the waiter
+     was added to an existing entry, Independent if the query should be sent but without calling release() */
+  Status add(const DNSDistPacketCache* cache, uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool ednsAdded, bool ecsAdded, InFlightWaiter&& waiter, uint64_t* leaderId=nullptr);
+  /* remove the entry, returning its waiters. If 'leaderId' is not 0, only if that leader is still the one of the entry,
+     and not a more recent one that replaced it after a timeout */
+  std::vector<InFlightWaiter> release(const DNSDistPacketCache* cache, uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, uint64_t leaderId=0);
+  /* remove the entries whose leader did not get a response in time */
+  void purgeExpired();
+  size_t size() const;
+
+  void setMaxWaiters(size_t maxWaiters)
+  {
+    d_maxWaiters = maxWaiters;
+  }
+
+  size_t getMaxWaiters() const
+  {
+    return d_maxWaiters;
+  }
+
+  std::atomic<bool> d_enabled{false};
+
+private:
+  struct Entry
+  {
+    DNSName qname;
+    std::vector<InFlightWaiter> waiters;
+    const DNSDistPacketCache* cache{nullptr};
+    time_t added{0};
+    uint64_t leaderId{0};
+    uint16_t qtype{0};
+    uint16_t qclass{0};
+    bool ednsAdded{false};
+    bool ecsAdded{false};
+  };
+
+  struct Shard
+  {
+    std::unordered_map<uint32_t, Entry> d_map;
+    mutable std::mutex d_lock;
+  };
+
+  Shard& getShard(uint32_t key)
+  {
+    return *d_shards[key % d_shards.size()];
+  }
+
+  std::vector<std::unique_ptr<Shard> > d_shards;
+  std::atomic<size_t> d_maxWaiters;
+  std::atomic<uint64_t> d_leaderIds{0};
+  time_t d_timeout;
+};
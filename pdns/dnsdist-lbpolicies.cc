@@ -0,0 +1,308 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <limits>
+
+#include "dnsdist.hh"
+#include "dolog.hh"
+
+std::shared_ptr<DownstreamState> ServerPolicy::getSelectedBackend(const ServerPool& pool, const DNSQuestion* dq) const
+{
+  if (poolPolicy) {
+    return poolPolicy(pool, dq);
+  }
+  return policy(pool.servers, dq);
+}
+
+shared_ptr<DownstreamState> firstAvailable(const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  for(auto& d : servers) {
+    if(d.second->isUp() && d.second->qps.check())
+      return d.second;
+  }
+  return leastOutstanding(servers, dq);
+}
+
+// get server with least outstanding queries, and within those, with the lowest order, and within those: the fastest
+shared_ptr<DownstreamState> leastOutstanding(const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  if (servers.size() == 1 && servers[0].second->isUp()) {
+    return servers[0].second;
+  }
+
+  vector<pair<tuple<int,int,double>, shared_ptr<DownstreamState>>> poss;
+  /* so you might wonder, why do we go through this trouble? The data on which we sort could change during the sort,
+     which would suck royally and could even lead to crashes. So first we snapshot on what we sort, and then we sort */
+  poss.reserve(servers.size());
+  for(auto& d : servers) {
+    if(d.second->isUp()) {
+      poss.push_back({make_tuple(d.second->outstanding.load(), d.second->order, d.second->latencyUsec), d.second});
+    }
+  }
+  if(poss.empty())
+    return shared_ptr<DownstreamState>();
+  nth_element(poss.begin(), poss.begin(), poss.end(), [](const decltype(poss)::value_type& a, const decltype(poss)::value_type& b) { return a.first < b.first; });
+  return poss.begin()->second;
+}
+
+/* among the servers that are up and have the lowest order, as leastOutstanding() does,
+   pick two distinct ones at random and keep the one with the lowest latency score,
+   so that slower or busier servers get less traffic without sorting the whole pool */
+shared_ptr<DownstreamState> powerOfTwoChoices(const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  vector<size_t> candidates;
+  int lowestOrder = std::numeric_limits<int>::max();
+  for (size_t idx = 0; idx < servers.size(); idx++) {
+    const auto& server = servers[idx].second;
+    if (!server->isUp() || server->order > lowestOrder) {
+      continue;
+    }
+    if (server->order < lowestOrder) {
+      lowestOrder = server->order;
+      candidates.clear();
+    }
+    candidates.push_back(idx);
+  }
+
+  const size_t count = candidates.size();
+  if (count == 0) {
+    return shared_ptr<DownstreamState>();
+  }
+  if (count == 1) {
+    return servers[candidates[0]].second;
+  }
+
+  const size_t firstIdx = random() % count;
+  const size_t secondIdx = (firstIdx + 1 + random() % (count - 1)) % count;
+  const auto& first = servers[candidates[firstIdx]].second;
+  const auto& second = servers[candidates[secondIdx]].second;
+  return first->getLatencyScore() <= second->getLatencyScore() ? first : second;
+}
+
+shared_ptr<DownstreamState> valrandom(unsigned int val, const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  vector<pair<int, shared_ptr<DownstreamState>>> poss;
+  int sum=0;
+  for(auto& d : servers) {      // w=1, w=10 -> 1, 11
+    if(d.second->isUp()) {
+      sum+=d.second->weight;
+      poss.push_back({sum, d.second});
+    }
+  }
+
+  // Catch poss & sum are empty to avoid SIGFPE
+  if(poss.empty())
+    return shared_ptr<DownstreamState>();
+
+  int r = val % sum;
+  auto p = upper_bound(poss.begin(), poss.end(),r, [](int r, const decltype(poss)::value_type& a) { return  r < a.first;});
+  if(p==poss.end())
+    return shared_ptr<DownstreamState>();
+  return p->second;
+}
+
+shared_ptr<DownstreamState> wrandom(const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  return valrandom(random(), servers, dq);
+}
+
+uint32_t g_hashperturb;
+shared_ptr<DownstreamState> whashed(const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  return valrandom(dq->qname->hash(g_hashperturb), servers, dq);
+}
+
+double g_consistentHashBalancingFactor{0};
+static const int s_consistentHashPointsPerWeight{100};
+
+ConsistentHashRing::ConsistentHashRing(const NumberedServerVector& servers): d_servers(servers)
+{
+  for (size_t serverIdx = 0; serverIdx < d_servers.size(); serverIdx++) {
+    /* the points only depend on the address of the server and its weight, so they
+       are the same after a restart and on every dnsdist instance */
+    const auto& server = d_servers[serverIdx].second;
+    const int weight = server->weight;
+    if (weight <= 0) {
+      continue;
+    }
+    const string id = server->remote.toStringWithPort();
+    for (int idx = 0; idx < weight * s_consistentHashPointsPerWeight; idx++) {
+      const string key = id + "-" + std::to_string(idx);
+      d_points.push_back({burtle(reinterpret_cast<const unsigned char*>(key.c_str()), key.size(), 0), serverIdx});
+    }
+  }
+  std::sort(d_points.begin(), d_points.end());
+  vinfolog("Computed %d consistent hashing points for %d servers", d_points.size(), d_servers.size());
+}
+
+/* consistent hashing: every server owns points on a ring, and a qname goes to the
+   server owning the first point after the hash of that qname. Adding or removing a
+   server only moves the qnames owned by that server. With a balancing factor, servers
+   having more than factor times the average number of outstanding queries are skipped */
+static shared_ptr<DownstreamState> getConsistentHashServer(const ConsistentHashRing& ring, const DNSQuestion* dq)
+{
+  const auto& servers = ring.getServers();
+  double targetLoad = std::numeric_limits<double>::max();
+
+  if (g_consistentHashBalancingFactor > 0) {
+    /* count this query as well, so that the target is never 0 */
+    uint64_t totalLoad = 1;
+    size_t upServers = 0;
+    for (const auto& d : servers) {
+      if (d.second->isUp()) {
+        totalLoad += d.second->outstanding.load();
+        upServers++;
+      }
+    }
+    if (upServers > 0) {
+      targetLoad = (static_cast<double>(totalLoad) / upServers) * g_consistentHashBalancingFactor;
+    }
+  }
+
+  return ring.getServer(dq->qname->hash(g_hashperturb), [targetLoad](const DownstreamState& server) {
+      return server.isUp() && server.outstanding.load() <= targetLoad;
+    });
+}
+
+/* for custom Lua policies calling chashed directly, with a list of servers that
+   might not be the one of a pool, so the ring has to be built every time */
+shared_ptr<DownstreamState> chashed(const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  return getConsistentHashServer(ConsistentHashRing(servers), dq);
+}
+
+/* the ring of a pool is built whenever its servers change */
+shared_ptr<DownstreamState> chashedFromPool(const ServerPool& pool, const DNSQuestion* dq)
+{
+  const auto ring = pool.getHashRing();
+  if (!ring) {
+    return shared_ptr<DownstreamState>();
+  }
+  return getConsistentHashServer(*ring, dq);
+}
+
+shared_ptr<DownstreamState> roundrobin(const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  NumberedServerVector poss;
+
+  for(auto& d : servers) {
+    if(d.second->isUp()) {
+      poss.push_back(d);
+    }
+  }
+
+  const auto *res=&poss;
+  if(poss.empty())
+    res = &servers;
+
+  if(res->empty())
+    return shared_ptr<DownstreamState>();
+
+  static unsigned int counter;
+ 
+  return (*res)[(counter++) % res->size()].second;
+}
+
+std::shared_ptr<ServerPool> createPoolIfNotExists(pools_t& pools, const string& poolName)
+{
+  std::shared_ptr<ServerPool> pool;
+  pools_t::iterator it = pools.find(poolName);
+  if (it != pools.end()) {
+    pool = it->second;
+  }
+  else {
+    if (!poolName.empty())
+      vinfolog("Creating pool %s", poolName);
+    pool = std::make_shared<ServerPool>();
+    pools.insert(std::pair<std::string,std::shared_ptr<ServerPool> >(poolName, pool));
+  }
+  return pool;
+}
+
+void addServerToPool(pools_t& pools, const string& poolName, std::shared_ptr<DownstreamState> server)
+{
+  std::shared_ptr<ServerPool> pool = createPoolIfNotExists(pools, poolName);
+  unsigned int count = (unsigned int) pool->servers.size();
+  if (!poolName.empty()) {
+    vinfolog("Adding server to pool %s", poolName);
+  } else {
+    vinfolog("Adding server to default pool");
+  }
+  pool->servers.push_back(make_pair(++count, server));
+  /* we need to reorder based on the server 'order' */
+  std::stable_sort(pool->servers.begin(), pool->servers.end(), [](const std::pair<unsigned int,std::shared_ptr<DownstreamState> >& a, const std::pair<unsigned int,std::shared_ptr<DownstreamState> >& b) {
+      return a.second->order < b.second->order;
+    });
+  /* and now we need to renumber for Lua (custom policies) */
+  size_t idx = 1;
+  for (auto& server : pool->servers) {
+    server.first = idx++;
+  }
+  pool->updateHashRing();
+}
+
+void removeServerFromPool(pools_t& pools, const string& poolName, std::shared_ptr<DownstreamState> server)
+{
+  std::shared_ptr<ServerPool> pool = getPool(pools, poolName);
+
+  if (!poolName.empty()) {
+    vinfolog("Removing server from pool %s", poolName);
+  }
+  else {
+    vinfolog("Removing server from default pool");
+  }
+
+  size_t idx = 1;
+  bool found = false;
+  for (NumberedVector<shared_ptr<DownstreamState> >::iterator it = pool->servers.begin(); it != pool->servers.end();) {
+    if (found) {
+      /* we need to renumber the servers placed
+         after the removed one, for Lua (custom policies) */
+      it->first = idx++;
+      it++;
+    }
+    else if (it->second == server) {
+      it = pool->servers.erase(it);
+      found = true;
+    } else {
+      idx++;
+      it++;
+    }
+  }
+  pool->updateHashRing();
+}
+
+std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName)
+{
+  pools_t::const_iterator it = pools.find(poolName);
+
+  if (it == pools.end()) {
+    throw std::out_of_range("No pool named " + poolName);
+  }
+
+  return it->second;
+}
+
+const NumberedServerVector& getDownstreamCandidates(const pools_t& pools, const std::string& poolName)
+{
+  std::shared_ptr<ServerPool> pool = getPool(pools, poolName);
+  return pool->servers;
+}
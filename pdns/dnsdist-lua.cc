@@ -99,28 +99,25 @@ std::unordered_map<int, vector<boost::variant<string,double>>> getGenResponses(u
   setLuaNoSideEffect();
   map<DNSName, int> counts;
   unsigned int total=0;
-  {
-    std::lock_guard<std::mutex> lock(g_rings.respMutex);
-    if(!labels) {
-      for(const auto& a : g_rings.respRing) {
+  if(!labels) {
+    g_rings.forEachResponse([&counts, &total, &pred](const Rings::Response& a) {
         if(!pred(a))
-          continue;
+          return;
         counts[a.name]++;
         total++;
-      }
-    }
-    else {
-      unsigned int lab = *labels;
-      for(auto a : g_rings.respRing) {
+      });
+  }
+  else {
+    unsigned int lab = *labels;
+    g_rings.forEachResponse([&counts, &total, &pred, lab](const Rings::Response& a) {
         if(!pred(a))
-          continue;
-        
-        a.name.trimToLabels(lab);
-        counts[a.name]++;
+          return;
+
+        DNSName name(a.name);
+        name.trimToLabels(lab);
+        counts[name]++;
         total++;
-      }
-      
-    }
+      });
   }
   //      cout<<"Looked at "<<total<<" responses, "<<counts.size()<<" different ones"<<endl;
   vector<pair<int, DNSName>> rcounts;
@@ -253,11 +250,11 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
 			  if(g_launchWork) {
 			    g_launchWork->push_back([ret]() {
-				ret->tid = move(thread(responderThread, ret));
+				startResponderThreads(ret);
 			      });
 			  }
 			  else {
-			    ret->tid = move(thread(responderThread, ret));
+			    startResponderThreads(ret);
 			  }
 
 			  return ret;
@@ -310,6 +307,15 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 			  }
 			}
 
+			size_t numberOfSockets = 1;
+			if(vars.count("sockets")) {
+			  numberOfSockets = std::stoul(boost::get<string>(vars["sockets"]));
+			  if(numberOfSockets == 0) {
+			    warnlog("Dismissing invalid number of sockets '%s', using 1 instead", boost::get<string>(vars["sockets"]));
+			    numberOfSockets = 1;
+			  }
+			}
+
 			std::shared_ptr<DownstreamState> ret;
 			ComboAddress address(boost::get<string>(vars["address"]), 53);
 			if(IsAnyAddress(address)) {
@@ -318,7 +324,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 			  return ret;
 			}
 			try {
-			  ret=std::make_shared<DownstreamState>(address, sourceAddr, sourceItf);
+			  ret=std::make_shared<DownstreamState>(address, sourceAddr, sourceItf, numberOfSockets);
 			}
 			catch(std::exception& e) {
 			  g_outputBuffer="Error creating new server: "+string(e.what());
@@ -331,24 +337,6 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 			  ret->qps=QPSLimiter(qps, qps);
 			}
 
-			auto localPools = g_pools.getCopy();
-			if(vars.count("pool")) {
-			  if(auto* pool = boost::get<string>(&vars["pool"]))
-			    ret->pools.insert(*pool);
-			  else {
-			    auto* pools = boost::get<vector<pair<int, string> > >(&vars["pool"]);
-			    for(auto& p : *pools)
-			      ret->pools.insert(p.second);
-			  }
-			  for(const auto& poolName: ret->pools) {
-			    addServerToPool(localPools, poolName, ret);
-			  }
-			}
-			else {
-			  addServerToPool(localPools, "", ret);
-			}
-			g_pools.setState(localPools);
-
 			if(vars.count("order")) {
 			  ret->order=std::stoi(boost::get<string>(vars["order"]));
 			}
@@ -397,13 +385,32 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 			  ret->maxCheckFailures=std::stoi(boost::get<string>(vars["maxCheckFailures"]));
 			}
 
+			/* once the order and weight are known, since the pools depend on them */
+			auto localPools = g_pools.getCopy();
+			if(vars.count("pool")) {
+			  if(auto* pool = boost::get<string>(&vars["pool"]))
+			    ret->pools.insert(*pool);
+			  else {
+			    auto* pools = boost::get<vector<pair<int, string> > >(&vars["pool"]);
+			    for(auto& p : *pools)
+			      ret->pools.insert(p.second);
+			  }
+			  for(const auto& poolName: ret->pools) {
+			    addServerToPool(localPools, poolName, ret);
+			  }
+			}
+			else {
+			  addServerToPool(localPools, "", ret);
+			}
+			g_pools.setState(localPools);
+
 			if(g_launchWork) {
 			  g_launchWork->push_back([ret]() {
-			      ret->tid = move(thread(responderThread, ret));
+			      startResponderThreads(ret);
 			    });
 			}
 			else {
-			  ret->tid = move(thread(responderThread, ret));
+			  startResponderThreads(ret);
 			}
 
 			auto states = g_dstates.getCopy();
@@ -542,13 +549,15 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
   g_lua.writeVariable("roundrobin", ServerPolicy{"roundrobin", roundrobin});
   g_lua.writeVariable("wrandom", ServerPolicy{"wrandom", wrandom});
   g_lua.writeVariable("whashed", ServerPolicy{"whashed", whashed});
+  g_lua.writeVariable("chashed", ServerPolicy{"chashed", chashed, chashedFromPool});
   g_lua.writeVariable("leastOutstanding", ServerPolicy{"leastOutstanding", leastOutstanding});
+  g_lua.writeVariable("powerOfTwoChoices", ServerPolicy{"powerOfTwoChoices", powerOfTwoChoices});
   g_lua.writeFunction("addACL", [](const std::string& domain) {
       setLuaSideEffect();
       g_ACL.modify([domain](NetmaskGroup& nmg) { nmg.addMask(domain); });
     });
 
-  g_lua.writeFunction("setLocal", [client](const std::string& addr, boost::optional<bool> doTCP, boost::optional<bool> reusePort, boost::optional<int> tcpFastOpenQueueSize) {
+  g_lua.writeFunction("setLocal", [client](const std::string& addr, boost::optional<bool> doTCP, boost::optional<bool> reusePort, boost::optional<int> tcpFastOpenQueueSize, boost::optional<int> udpBatchSize) {
       setLuaSideEffect();
       if(client)
 	return;
@@ -559,14 +568,14 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       try {
 	ComboAddress loc(addr, 53);
 	g_locals.clear();
-	g_locals.push_back(std::make_tuple(loc, doTCP ? *doTCP : true, reusePort ? *reusePort : false, tcpFastOpenQueueSize ? *tcpFastOpenQueueSize : 0)); /// only works pre-startup, so no sync necessary
+	g_locals.push_back(std::make_tuple(loc, doTCP ? *doTCP : true, reusePort ? *reusePort : false, tcpFastOpenQueueSize ? *tcpFastOpenQueueSize : 0, udpBatchSize ? *udpBatchSize : 0)); /// only works pre-startup, so no sync necessary
       }
       catch(std::exception& e) {
 	g_outputBuffer="Error: "+string(e.what())+"\n";
       }
     });
 
-  g_lua.writeFunction("addLocal", [client](const std::string& addr, boost::optional<bool> doTCP, boost::optional<bool> reusePort, boost::optional<int> tcpFastOpenQueueSize) {
+  g_lua.writeFunction("addLocal", [client](const std::string& addr, boost::optional<bool> doTCP, boost::optional<bool> reusePort, boost::optional<int> tcpFastOpenQueueSize, boost::optional<int> udpBatchSize) {
       setLuaSideEffect();
       if(client)
 	return;
@@ -576,7 +585,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       }
       try {
 	ComboAddress loc(addr, 53);
-	g_locals.push_back(std::make_tuple(loc, doTCP ? *doTCP : true, reusePort ? *reusePort : false, tcpFastOpenQueueSize ? *tcpFastOpenQueueSize : 0)); /// only works pre-startup, so no sync necessary
+	g_locals.push_back(std::make_tuple(loc, doTCP ? *doTCP : true, reusePort ? *reusePort : false, tcpFastOpenQueueSize ? *tcpFastOpenQueueSize : 0, udpBatchSize ? *udpBatchSize : 0)); /// only works pre-startup, so no sync necessary
       }
       catch(std::exception& e) {
 	g_outputBuffer="Error: "+string(e.what())+"\n";
@@ -814,6 +823,29 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
   g_lua.writeFunction("RE2Rule", [](const std::string& str) {
       return std::shared_ptr<DNSRule>(new RE2Rule(str));
     });
+
+  g_lua.writeFunction("RegexSetRule", [](const vector<pair<int, std::string> >& patterns) {
+      std::vector<std::string> regexes;
+      for(const auto& pattern : patterns) {
+        regexes.push_back(pattern.second);
+      }
+      return std::shared_ptr<DNSRule>(new RegexSetRule(std::make_shared<const RegexSet>(regexes)));
+    });
+
+  g_lua.writeFunction("RegexSetRules", [](vector<pair<int, std::string> > patterns) {
+      /* the n-th rule returned matches the n-th pattern */
+      std::sort(patterns.begin(), patterns.end());
+      std::vector<std::string> regexes;
+      for(const auto& pattern : patterns) {
+        regexes.push_back(pattern.second);
+      }
+      auto set = std::make_shared<const RegexSet>(regexes);
+      vector<pair<int, std::shared_ptr<DNSRule> > > rules;
+      for(size_t idx = 0; idx < regexes.size(); idx++) {
+        rules.push_back({static_cast<int>(idx + 1), std::shared_ptr<DNSRule>(new RegexSetRule(set, static_cast<int>(idx)))});
+      }
+      return rules;
+    });
 #endif
 
   g_lua.writeFunction("SuffixMatchNodeRule", [](const SuffixMatchNode& smn, boost::optional<bool> quiet) {
@@ -1066,7 +1098,18 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
   g_lua.registerFunction("getName", &DownstreamState::getName);
   g_lua.registerFunction("getNameWithAddr", &DownstreamState::getNameWithAddr);
   g_lua.registerMember("upStatus", &DownstreamState::upStatus);
-  g_lua.registerMember("weight", &DownstreamState::weight);
+  g_lua.registerMember<int (DownstreamState::*)>("weight", [](const DownstreamState& s) -> int { return s.weight; }, [](DownstreamState& s, int newWeight) {
+      s.weight = newWeight;
+      /* the consistent hashing rings depend on the weights */
+      for (const auto& pool : g_pools.getCopy()) {
+        for (const auto& server : pool.second->servers) {
+          if (server.second.get() == &s) {
+            pool.second->updateHashRing();
+            break;
+          }
+        }
+      }
+    });
   g_lua.registerMember("order", &DownstreamState::order);
   g_lua.registerMember("name", &DownstreamState::name);
   
@@ -1135,10 +1178,10 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
   g_lua.registerFunction("check",(bool (SuffixMatchNode::*)(const DNSName&) const) &SuffixMatchNode::check);
 
   g_lua.writeFunction("carbonServer", [](const std::string& address, boost::optional<string> ourName,
-					 boost::optional<unsigned int> interval) {
+					 boost::optional<unsigned int> interval, boost::optional<unsigned int> topEntries) {
                         setLuaSideEffect();
 			auto ours = g_carbon.getCopy();
-			ours.push_back({ComboAddress(address, 2003), ourName ? *ourName : "", interval ? *interval : 30});
+			ours.push_back({ComboAddress(address, 2003), ourName ? *ourName : "", interval ? *interval : 30, topEntries ? *topEntries : 0});
 			g_carbon.setState(ours);
 		      });
 
@@ -1201,55 +1244,46 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
   g_lua.writeFunction("topClients", [](boost::optional<unsigned int> top_) {
       setLuaNoSideEffect();
       auto top = top_.get_value_or(10);
-      map<ComboAddress, int,ComboAddress::addressOnlyLessThan > counts;
-      unsigned int total=0;
-      {
-        ReadLock rl(&g_rings.queryLock);
-        for(const auto& c : g_rings.queryRing) {
-          counts[c.requestor]++;
-          total++;
-        }
-      }
-      vector<pair<int, ComboAddress>> rcounts;
-      rcounts.reserve(counts.size());
-      for(const auto& c : counts) 
-	rcounts.push_back(make_pair(c.second, c.first));
-
-      sort(rcounts.begin(), rcounts.end(), [](const decltype(rcounts)::value_type& a, 
-					      const decltype(rcounts)::value_type& b) {
-	     return b.first < a.first;
-	   });
-      unsigned int count=1, rest=0;
+      uint64_t total=0;
+      double elapsed=0;
+      const auto rcounts = g_rings.getTopClients(top, total, elapsed);
+      unsigned int count=1;
+      uint64_t rest=total;
       boost::format fmt("%4d  %-40s %4d %4.1f%%\n");
       for(const auto& rc : rcounts) {
-	if(count==top+1)
-	  rest+=rc.first;
-	else
-	  g_outputBuffer += (fmt % (count++) % rc.second.toString() % rc.first % (100.0*rc.first/total)).str();
+        g_outputBuffer += (fmt % (count++) % rc.first.toString() % rc.second % (100.0*rc.second/total)).str();
+        rest -= std::min(rest, rc.second);
       }
       g_outputBuffer += (fmt % (count) % "Rest" % rest % (total > 0 ? 100.0*rest/total : 100.0)).str();
     });
 
   g_lua.writeFunction("getTopQueries", [](unsigned int top, boost::optional<int> labels) {
       setLuaNoSideEffect();
+      if(!labels || *labels == static_cast<int>(g_rings.getHeavyHittersSuffixLabels())) {
+        uint64_t total=0;
+        double elapsed=0;
+        const auto rcounts = g_rings.getTopQueries(top, labels ? true : false, total, elapsed);
+        std::unordered_map<int, vector<boost::variant<string,double>>> ret;
+        unsigned int count=1;
+        uint64_t rest=total;
+        for(const auto& rc : rcounts) {
+          ret.insert({count++, {rc.first.toString(), rc.second, 100.0*rc.second/total}});
+          rest -= std::min(rest, rc.second);
+        }
+        ret.insert({count, {"Rest", rest, total > 0 ? 100.0*rest/total : 100.0}});
+        return ret;
+      }
+
+      /* any other number of labels requires going over the ring */
       map<DNSName, int> counts;
       unsigned int total=0;
-      if(!labels) {
-	ReadLock rl(&g_rings.queryLock);
-	for(const auto& a : g_rings.queryRing) {
-	  counts[a.name]++;
-	  total++;
-	}
-      }
-      else {
-	unsigned int lab = *labels;
-	ReadLock rl(&g_rings.queryLock);
-	for(auto a : g_rings.queryRing) {
-	  a.name.trimToLabels(lab);
-	  counts[a.name]++;
-	  total++;
-	}
-      }
+      unsigned int lab = *labels;
+      g_rings.forEachQuery([&counts, &total, lab](const Rings::Query& a) {
+          DNSName name(a.name);
+          name.trimToLabels(lab);
+          counts[name]++;
+          total++;
+        });
       // cout<<"Looked at "<<total<<" queries, "<<counts.size()<<" different ones"<<endl;
       vector<pair<int, DNSName>> rcounts;
       rcounts.reserve(counts.size());
@@ -1311,21 +1345,15 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
   g_lua.writeFunction("getResponseRing", []() {
       setLuaNoSideEffect();
-      decltype(g_rings.respRing) ring;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	ring = g_rings.respRing;
-      }
       vector<std::unordered_map<string, boost::variant<string, unsigned int> > > ret;
-      ret.reserve(ring.size());
       decltype(ret)::value_type item;
-      for(const auto& r : ring) {
-	item["name"]=r.name.toString();
-	item["qtype"]=r.qtype;
-	item["rcode"]=r.dh.rcode;
-	item["usec"]=r.usec;
-	ret.push_back(item);
-      }
+      g_rings.forEachResponse([&ret, &item](const Rings::Response& r) {
+	  item["name"]=r.name.toString();
+	  item["qtype"]=r.qtype;
+	  item["rcode"]=r.dh.rcode;
+	  item["usec"]=r.usec;
+	  ret.push_back(item);
+	});
       return ret;
     });
 
@@ -1355,9 +1383,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
       double totlat=0;
       int size=0;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	for(const auto& r : g_rings.respRing) {
+      g_rings.forEachResponse([&histo, &size, &totlat](const Rings::Response& r) {
 	  ++size;
 	  auto iter = histo.lower_bound(r.usec);
 	  if(iter != histo.end())
@@ -1365,8 +1391,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 	  else
 	    histo.rbegin()++;
 	  totlat+=r.usec;
-	}
-      }
+	});
 
       if (size == 0) {
         g_outputBuffer = "No traffic yet.\n";
@@ -1466,6 +1491,36 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       }
     });
 
+  g_lua.writeFunction("setRingBuffersSize", [](size_t capacity, boost::optional<size_t> numberOfShards) {
+      setLuaSideEffect();
+      if (g_configurationDone) {
+        errlog("setRingBuffersSize() cannot be used at runtime!");
+        g_outputBuffer="setRingBuffersSize() cannot be used at runtime!\n";
+        return;
+      }
+      g_rings.setCapacity(capacity, numberOfShards ? *numberOfShards : g_rings.getNumberOfShards());
+    });
+
+  g_lua.writeFunction("setRingBuffersHeavyHitters", [](size_t capacity, boost::optional<unsigned int> period, boost::optional<unsigned int> suffixLabels) {
+      setLuaSideEffect();
+      if (g_configurationDone) {
+        errlog("setRingBuffersHeavyHitters() cannot be used at runtime!");
+        g_outputBuffer="setRingBuffersHeavyHitters() cannot be used at runtime!\n";
+        return;
+      }
+      g_rings.setHeavyHittersParameters(capacity, period ? *period : 60, suffixLabels ? *suffixLabels : 2);
+    });
+
+  g_lua.writeFunction("setRingBuffersCountersWindow", [](size_t seconds, boost::optional<size_t> maxEntries) {
+      setLuaSideEffect();
+      if (g_configurationDone) {
+        errlog("setRingBuffersCountersWindow() cannot be used at runtime!");
+        g_outputBuffer="setRingBuffersCountersWindow() cannot be used at runtime!\n";
+        return;
+      }
+      g_rings.setCountersParameters(seconds, maxEntries ? *maxEntries : g_rings.getMaxCountersEntries());
+    });
+
   /* DNSQuestion bindings */
   /* PowerDNS DNSQuestion compat */
   g_lua.registerMember<const ComboAddress (DNSQuestion::*)>("localaddr", [](const DNSQuestion& dq) -> const ComboAddress { return *dq.local; }, [](DNSQuestion& dq, const ComboAddress newLocal) { (void) newLocal; });
@@ -1515,6 +1570,26 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       }
     });
 
+  g_lua.writeFunction("setMaxTCPPipelinedQueries", [](uint16_t max) {
+      if (max == 0) {
+        g_outputBuffer="The maximum number of pipelined TCP queries should be at least 1!\n";
+        return;
+      }
+      g_maxTCPPipelinedQueries = max;
+    });
+
+  g_lua.writeFunction("setMaxIdleTCPConnectionsPerDownstream", [](uint16_t max) {
+      g_maxIdleTCPConnectionsPerDownstream = max;
+    });
+
+  g_lua.writeFunction("setTCPDownstreamMaxIdleTime", [](int seconds) {
+      if (seconds < 0) {
+        g_outputBuffer="The maximum idle time of TCP connections to a backend should be positive, or 0 to disable it!\n";
+        return;
+      }
+      g_tcpDownstreamMaxIdleTime = seconds;
+    });
+
   g_lua.writeFunction("showTCPStats", [] {
       setLuaNoSideEffect();
       boost::format fmt("%-10d %-10d %-10d %-10d\n");
@@ -22,6 +22,7 @@
 #include "dnsdist.hh"
 #include "dnsdist-cache.hh"
 #include "dnsrulactions.hh"
+#include <limits>
 #include <thread>
 #include "dolog.hh"
 #include "sodcrypto.hh"
@@ -65,10 +66,9 @@ void resetLuaSideEffect()
   g_noLuaSideEffect = boost::logic::indeterminate;
 }
 
-map<ComboAddress,int> filterScore(const map<ComboAddress, unsigned int,ComboAddress::addressOnlyLessThan >& counts, 
-				  double delta, int rate)
+map<ComboAddress,int> filterScore(const Rings::counters_t& counts, double delta, int rate)
 {
-  std::multimap<unsigned int,ComboAddress> score;
+  std::multimap<uint64_t,ComboAddress> score;
   for(const auto& e : counts) 
     score.insert({e.second, e.first});
 
@@ -86,12 +86,10 @@ typedef std::function<void(const StatNode&, const StatNode::Stat&, const StatNod
 
 void statNodeRespRing(statvisitor_t visitor)
 {
-  std::lock_guard<std::mutex> lock(g_rings.respMutex);
-  
   StatNode root;
-  for(const auto& c : g_rings.respRing) {
-    root.submit(c.name, c.dh.rcode, c.requestor);
-  }
+  g_rings.forEachResponse([&root](const Rings::Response& c) {
+      root.submit(c.name, c.dh.rcode, c.requestor);
+    });
   StatNode::Stat node;
 
   root.visit([&visitor](const StatNode* node, const StatNode::Stat& self, const StatNode::Stat& children) {
@@ -103,87 +101,53 @@ vector<pair<unsigned int, std::unordered_map<string,string> > > getRespRing(boos
 {
   typedef std::unordered_map<string,string>  entry_t;
   vector<pair<unsigned int, entry_t > > ret;
-  std::lock_guard<std::mutex> lock(g_rings.respMutex);
-  
   entry_t e;
   unsigned int count=1;
-  for(const auto& c : g_rings.respRing) {
-    if(rcode && (rcode.get() != c.dh.rcode))
-      continue;
-    e["qname"]=c.name.toString();
-    e["rcode"]=std::to_string(c.dh.rcode);
-    ret.push_back(std::make_pair(count,e));
-    count++;
-  }
+  g_rings.forEachResponse([&ret, &e, &count, &rcode](const Rings::Response& c) {
+      if(rcode && (rcode.get() != c.dh.rcode))
+        return;
+      e["qname"]=c.name.toString();
+      e["rcode"]=std::to_string(c.dh.rcode);
+      ret.push_back(std::make_pair(count,e));
+      count++;
+    });
   return ret;
 }
 
-typedef   map<ComboAddress, unsigned int,ComboAddress::addressOnlyLessThan > counts_t;
-map<ComboAddress,int> exceedRespGen(int rate, int seconds, std::function<void(counts_t&, const Rings::Response&)> T) 
+map<ComboAddress,int> exceedCounter(Rings::Counter counter, uint16_t value, int rate, int seconds)
 {
-  counts_t counts;
-  struct timespec cutoff, mintime, now;
-  gettime(&now);
-  cutoff = mintime = now;
-  cutoff.tv_sec -= seconds;
-
-  std::lock_guard<std::mutex> lock(g_rings.respMutex);
-  for(const auto& c : g_rings.respRing) {
-    if(seconds && c.when < cutoff)
-      continue;
-    if(now < c.when)
-      continue;
-
-    T(counts, c);
-    if(c.when < mintime)
-      mintime = c.when;
+  /* warn once for a given period, since these functions are usually called every second */
+  static std::atomic<int> s_lastClampedPeriod{0};
+  if (seconds > 0 && static_cast<size_t>(seconds) > g_rings.getCountersWindow() && s_lastClampedPeriod.exchange(seconds) != seconds) {
+    warnlog("A period of %d seconds has been requested, but the counters only cover the last %d seconds. Use setRingBuffersCountersWindow() to increase it", seconds, g_rings.getCountersWindow());
   }
-  double delta = seconds ? seconds : DiffTime(now, mintime);
-  return filterScore(counts, delta, rate);
-}
 
-map<ComboAddress,int> exceedQueryGen(int rate, int seconds, std::function<void(counts_t&, const Rings::Query&)> T) 
-{
-  counts_t counts;
-  struct timespec cutoff, mintime, now;
-  gettime(&now);
-  cutoff = mintime = now;
-  cutoff.tv_sec -= seconds;
-
-  ReadLock rl(&g_rings.queryLock);
-  for(const auto& c : g_rings.queryRing) {
-    if(seconds && c.when < cutoff)
-      continue;
-    if(now < c.when)
-      continue;
-    T(counts, c);
-    if(c.when < mintime)
-      mintime = c.when;
-  }
-  double delta = seconds ? seconds : DiffTime(now, mintime);
+  double delta = 0;
+  const auto counts = g_rings.getCounters(counter, value, seconds > 0 ? seconds : 0, delta);
   return filterScore(counts, delta, rate);
 }
 
-
 map<ComboAddress,int> exceedRCode(int rate, int seconds, int rcode) 
 {
-  return exceedRespGen(rate, seconds, [rcode](counts_t& counts, const Rings::Response& r) 
-		   {
-		     if(r.dh.rcode == rcode)
-		       counts[r.requestor]++;
-		   });
+  return exceedCounter(Rings::Counter::RCode, rcode, rate, seconds);
 }
 
 map<ComboAddress,int> exceedRespByterate(int rate, int seconds) 
 {
-  return exceedRespGen(rate, seconds, [](counts_t& counts, const Rings::Response& r) 
-		   {
-		     counts[r.requestor]+=r.size;
-		   });
+  return exceedCounter(Rings::Counter::ResponseBytes, 0, rate, seconds);
 }
 
 
 
+static std::string getBatchedLoggerStats(const BatchedLogger& logger)
+{
+  std::string result = "Queued: " + std::to_string(logger.getQueued()) + "\n";
+  result += "Sent: " + std::to_string(logger.getSent()) + "\n";
+  result += "Dropped: " + std::to_string(logger.getDropped()) + "\n";
+  result += "Reconnections: " + std::to_string(logger.getReconnects()) + "\n";
+  return result;
+}
+
 void moreLua(bool client)
 {
   typedef NetmaskTree<DynBlock> nmts_t;
@@ -329,17 +293,12 @@ void moreLua(bool client)
 
   g_lua.writeFunction("exceedQTypeRate", [](uint16_t type, unsigned int rate, int seconds) {
       setLuaNoSideEffect();
-      return exceedQueryGen(rate, seconds, [type](counts_t& counts, const Rings::Query& q) {
-	  if(q.qtype==type)
-	    counts[q.requestor]++;
-	});
+      return exceedCounter(Rings::Counter::QType, type, rate, seconds);
     });
 
   g_lua.writeFunction("exceedQRate", [](unsigned int rate, int seconds) {
       setLuaNoSideEffect();
-      return exceedQueryGen(rate, seconds, [](counts_t& counts, const Rings::Query& q) {
-          counts[q.requestor]++;
-	});
+      return exceedCounter(Rings::Counter::Queries, 0, rate, seconds);
     });
 
   g_lua.writeFunction("getRespRing", getRespRing);
@@ -412,19 +371,17 @@ void moreLua(bool client)
         }
       }
 
-      decltype(g_rings.queryRing) qr;
-      decltype(g_rings.respRing) rr;
-      {
-        ReadLock rl(&g_rings.queryLock);
-        qr=g_rings.queryRing;
-      }
+      std::vector<Rings::Query> qr;
+      std::vector<Rings::Response> rr;
+      g_rings.forEachQuery([&qr](const Rings::Query& q) {
+          qr.push_back(q);
+        });
       sort(qr.begin(), qr.end(), [](const decltype(qr)::value_type& a, const decltype(qr)::value_type& b) {
         return b.when < a.when;
       });
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-        rr=g_rings.respRing;
-      }
+      g_rings.forEachResponse([&rr](const Rings::Response& r) {
+          rr.push_back(r);
+        });
 
       sort(rr.begin(), rr.end(), [](const decltype(rr)::value_type& a, const decltype(rr)::value_type& b) {
         return b.when < a.when;
@@ -489,6 +446,11 @@ void moreLua(bool client)
       }
     });
 
+#ifdef HAVE_DNSCRYPT
+  /* applied to the binds added after setDNSCryptSharedKeysCacheSize() as well */
+  static size_t s_dnscryptSharedKeysCacheSize{DNSCRYPT_SHARED_KEYS_CACHE_DEFAULT_SIZE};
+#endif
+
   g_lua.writeFunction("addDNSCryptBind", [](const std::string& addr, const std::string& providerName, const std::string& certFile, const std::string keyFile, boost::optional<bool> reusePort, boost::optional<int> tcpFastOpenQueueSize) {
       if (g_configurationDone) {
         g_outputBuffer="addDNSCryptBind cannot be used at runtime!\n";
@@ -497,6 +459,9 @@ void moreLua(bool client)
 #ifdef HAVE_DNSCRYPT
       try {
         DnsCryptContext ctx(providerName, certFile, keyFile);
+        if (s_dnscryptSharedKeysCacheSize != DNSCRYPT_SHARED_KEYS_CACHE_DEFAULT_SIZE) {
+          ctx.setSharedKeysCacheSize(s_dnscryptSharedKeysCacheSize);
+        }
         g_dnsCryptLocals.push_back(std::make_tuple(ComboAddress(addr, 443), ctx, reusePort ? *reusePort : false, tcpFastOpenQueueSize ? *tcpFastOpenQueueSize : 0));
       }
       catch(std::exception& e) {
@@ -508,6 +473,22 @@ void moreLua(bool client)
 #endif
     });
 
+  g_lua.writeFunction("setDNSCryptSharedKeysCacheSize", [](uint64_t maxEntries) {
+      setLuaSideEffect();
+      if (g_configurationDone) {
+        g_outputBuffer="setDNSCryptSharedKeysCacheSize cannot be used at runtime!\n";
+        return;
+      }
+#ifdef HAVE_DNSCRYPT
+      s_dnscryptSharedKeysCacheSize = maxEntries;
+      for (auto& local : g_dnsCryptLocals) {
+        std::get<1>(local).setSharedKeysCacheSize(maxEntries);
+      }
+#else
+      g_outputBuffer="Error: DNSCrypt support is not enabled.\n";
+#endif
+    });
+
   g_lua.writeFunction("showDNSCryptBinds", []() {
       setLuaNoSideEffect();
 #ifdef HAVE_DNSCRYPT
@@ -666,8 +647,37 @@ void moreLua(bool client)
         }
     });
 
-    g_lua.writeFunction("newPacketCache", [client](size_t maxEntries, boost::optional<uint32_t> maxTTL, boost::optional<uint32_t> minTTL, boost::optional<uint32_t> servFailTTL, boost::optional<uint32_t> staleTTL) {
-        return std::make_shared<DNSDistPacketCache>(maxEntries, maxTTL ? *maxTTL : 86400, minTTL ? *minTTL : 0, servFailTTL ? *servFailTTL : 60, staleTTL ? *staleTTL : 60);
+    typedef std::unordered_map<std::string, boost::variant<bool, std::string> > packetcache_opts_t;
+    g_lua.writeFunction("newPacketCache", [client](size_t maxEntries, boost::optional<uint32_t> maxTTL, boost::optional<uint32_t> minTTL, boost::optional<uint32_t> servFailTTL, boost::optional<uint32_t> staleTTL, boost::optional<packetcache_opts_t> vars) {
+        uint32_t shards = 1;
+        uint16_t slabSize = 0;
+        if (vars && vars->count("shards")) {
+          unsigned long value = std::stoul(boost::get<string>((*vars)["shards"]));
+          if (value == 0 || value > std::max(maxEntries, static_cast<size_t>(1))) {
+            throw std::runtime_error("Invalid number of shards " + std::to_string(value) + ", it should be between 1 and the maximum number of entries (" + std::to_string(maxEntries) + ")");
+          }
+          shards = value;
+        }
+        if (vars && vars->count("slabSize")) {
+          unsigned long value = std::stoul(boost::get<string>((*vars)["slabSize"]));
+          if (value > std::numeric_limits<uint16_t>::max()) {
+            throw std::runtime_error("Invalid slab size " + std::to_string(value) + ", the maximum is " + std::to_string(std::numeric_limits<uint16_t>::max()));
+          }
+          slabSize = value;
+        }
+        uint8_t prefetchThreshold = 0;
+        uint32_t staleWhileRevalidate = 0;
+        if (vars && vars->count("prefetchThreshold")) {
+          prefetchThreshold = std::min(std::stoul(boost::get<string>((*vars)["prefetchThreshold"])), 100UL);
+        }
+        if (vars && vars->count("staleWhileRevalidate")) {
+          staleWhileRevalidate = std::stoul(boost::get<string>((*vars)["staleWhileRevalidate"]));
+        }
+        bool ecsScoping = false;
+        if (vars && vars->count("ecsScoping")) {
+          ecsScoping = boost::get<bool>((*vars)["ecsScoping"]);
+        }
+        return std::make_shared<DNSDistPacketCache>(maxEntries, maxTTL ? *maxTTL : 86400, minTTL ? *minTTL : 0, servFailTTL ? *servFailTTL : 60, staleTTL ? *staleTTL : 60, shards, slabSize, prefetchThreshold, staleWhileRevalidate, ecsScoping);
       });
     g_lua.registerFunction("toString", &DNSDistPacketCache::toString);
     g_lua.registerFunction("isFull", &DNSDistPacketCache::isFull);
@@ -681,6 +691,13 @@ void moreLua(bool client)
     g_lua.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)()>("printStats", [](const std::shared_ptr<DNSDistPacketCache> cache) {
         if (cache) {
           g_outputBuffer="Entries: " + std::to_string(cache->getEntriesCount()) + "/" + std::to_string(cache->getMaxEntries()) + "\n";
+          g_outputBuffer+="Shards: " + std::to_string(cache->getShardsCount()) + "\n";
+          if (cache->getSlabSize() > 0) {
+            g_outputBuffer+="Slab size: " + std::to_string(cache->getSlabSize()) + "\n";
+          }
+          if (cache->isECSScoping()) {
+            g_outputBuffer+="ECS scoping: enabled\n";
+          }
           g_outputBuffer+="Hits: " + std::to_string(cache->getHits()) + "\n";
           g_outputBuffer+="Misses: " + std::to_string(cache->getMisses()) + "\n";
           g_outputBuffer+="Deferred inserts: " + std::to_string(cache->getDeferredInserts()) + "\n";
@@ -688,6 +705,10 @@ void moreLua(bool client)
           g_outputBuffer+="Lookup Collisions: " + std::to_string(cache->getLookupCollisions()) + "\n";
           g_outputBuffer+="Insert Collisions: " + std::to_string(cache->getInsertCollisions()) + "\n";
           g_outputBuffer+="TTL Too Shorts: " + std::to_string(cache->getTTLTooShorts()) + "\n";
+          if (cache->getPrefetchThreshold() > 0 || cache->getStaleWhileRevalidate() > 0) {
+            g_outputBuffer+="Refreshes: " + std::to_string(cache->getRefreshes()) + "\n";
+            g_outputBuffer+="Stale hits: " + std::to_string(cache->getStaleHits()) + "\n";
+          }
         }
       });
 
@@ -704,6 +725,23 @@ void moreLua(bool client)
     g_lua.writeFunction("setVerboseHealthChecks", [](bool verbose) { g_verboseHealthChecks=verbose; });
     g_lua.writeFunction("setStaleCacheEntriesTTL", [](uint32_t ttl) { g_staleCacheEntriesTTL = ttl; });
 
+    g_lua.writeFunction("setQueryCoalescing", [](bool enabled, boost::optional<uint64_t> maxWaiters) {
+        setLuaSideEffect();
+        if (maxWaiters) {
+          g_inFlightQueries.setMaxWaiters(*maxWaiters);
+        }
+        g_inFlightQueries.d_enabled = enabled;
+      });
+
+    g_lua.writeFunction("setConsistentHashingBalancingFactor", [](double factor) {
+        if (factor != 0 && factor < 1.0) {
+          g_outputBuffer="The balancing factor should be 0 (disabled) or at least 1.0\n";
+          errlog("The balancing factor should be 0 (disabled) or at least 1.0");
+          return;
+        }
+        g_consistentHashBalancingFactor = factor;
+      });
+
     g_lua.writeFunction("DropResponseAction", []() {
         return std::shared_ptr<DNSResponseAction>(new DropResponseAction);
       });
@@ -755,6 +793,44 @@ void moreLua(bool client)
     g_lua.writeFunction("newRemoteLogger", [client](const std::string& remote, boost::optional<uint16_t> timeout, boost::optional<uint64_t> maxQueuedEntries, boost::optional<uint8_t> reconnectWaitTime) {
         return std::make_shared<RemoteLogger>(ComboAddress(remote), timeout ? *timeout : 2, maxQueuedEntries ? *maxQueuedEntries : 100, reconnectWaitTime ? *reconnectWaitTime : 1);
       });
+    g_lua.registerFunction<void(std::shared_ptr<RemoteLogger>::*)()>("printStats", [](const std::shared_ptr<RemoteLogger> logger) {
+        if (logger) {
+          g_outputBuffer=getBatchedLoggerStats(*logger);
+        }
+      });
+
+    g_lua.writeFunction("newFrameStreamUnixLogger", [client](const std::string& path, boost::optional<uint64_t> maxQueuedEntries, boost::optional<uint8_t> reconnectWaitTime) {
+        if (client) {
+          return std::shared_ptr<FrameStreamLogger>(nullptr);
+        }
+        return std::make_shared<FrameStreamLogger>(path, false, "protobuf:dnstap.Dnstap", 2, maxQueuedEntries ? *maxQueuedEntries : 100, reconnectWaitTime ? *reconnectWaitTime : 1);
+      });
+    g_lua.writeFunction("newFrameStreamFileLogger", [client](const std::string& path, boost::optional<uint64_t> maxQueuedEntries) {
+        if (client) {
+          return std::shared_ptr<FrameStreamLogger>(nullptr);
+        }
+        return std::make_shared<FrameStreamLogger>(path, true, "protobuf:dnstap.Dnstap", 2, maxQueuedEntries ? *maxQueuedEntries : 100);
+      });
+    g_lua.registerFunction<void(std::shared_ptr<FrameStreamLogger>::*)()>("printStats", [](const std::shared_ptr<FrameStreamLogger> logger) {
+        if (logger) {
+          g_outputBuffer=getBatchedLoggerStats(*logger);
+        }
+      });
+
+    g_lua.writeFunction("DnstapLogAction", [](const std::string& identity, std::shared_ptr<FrameStreamLogger> logger) {
+#ifdef HAVE_PROTOBUF
+        return std::shared_ptr<DNSAction>(new DnstapLogAction(identity, logger));
+#else
+        throw std::runtime_error("Protobuf support is required to use DnstapLogAction");
+#endif
+      });
+    g_lua.writeFunction("DnstapLogResponseAction", [](const std::string& identity, std::shared_ptr<FrameStreamLogger> logger) {
+#ifdef HAVE_PROTOBUF
+        return std::shared_ptr<DNSResponseAction>(new DnstapLogResponseAction(identity, logger));
+#else
+        throw std::runtime_error("Protobuf support is required to use DnstapLogResponseAction");
+#endif
+      });
 
     g_lua.writeFunction("TeeAction", [](const std::string& remote, boost::optional<bool> addECS) {
         return std::shared_ptr<DNSAction>(new TeeAction(ComboAddress(remote, 53), addECS ? *addECS : false));
@@ -0,0 +1,70 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "dnsdist-mmsg.hh"
+#include "misc.hh"
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+UDPMessagesBatch::UDPMessagesBatch(size_t batchSize, int family, size_t receiveSize, size_t queryBufferSize, size_t responseBufferSize): d_msgVec(batchSize), d_outMsgVec(batchSize), d_iovs(batchSize), d_respIOVs(batchSize), d_remotes(batchSize), d_dests(batchSize), d_queries(batchSize * queryBufferSize), d_responses(batchSize * responseBufferSize), d_cbufs(batchSize * s_cbufSize), d_respCBufs(batchSize * s_cbufSize), d_queryBufferSize(queryBufferSize), d_responseBufferSize(responseBufferSize)
+{
+  for (size_t idx = 0; idx < batchSize; idx++) {
+    d_remotes[idx].sin4.sin_family = family;
+    fillMSGHdr(&d_msgVec[idx].msg_hdr, &d_iovs[idx], &d_cbufs[idx * s_cbufSize], s_cbufSize, getQuery(idx), std::min(receiveSize, queryBufferSize), &d_remotes[idx]);
+  }
+}
+
+int UDPMessagesBatch::receive(int fd)
+{
+  /* reset the values that might have been altered by the previous call */
+  for (size_t idx = 0; idx < d_msgVec.size(); idx++) {
+    d_msgVec[idx].msg_hdr.msg_namelen = d_remotes[idx].getSocklen();
+    d_msgVec[idx].msg_hdr.msg_controllen = s_cbufSize;
+    d_msgVec[idx].msg_hdr.msg_flags = 0;
+    d_msgVec[idx].msg_len = 0;
+  }
+  d_queued = 0;
+
+  return recvmmsg(fd, d_msgVec.data(), d_msgVec.size(), MSG_WAITFORONE, nullptr);
+}
+
+void UDPMessagesBatch::queueResponse(size_t idx, const char* response, uint16_t responseLen)
+{
+  struct mmsghdr& outMsg = d_outMsgVec.at(d_queued);
+  outMsg.msg_len = 0;
+  fillMSGHdr(&outMsg.msg_hdr, &d_respIOVs.at(idx), nullptr, 0, const_cast<char*>(response), responseLen, &d_remotes.at(idx));
+
+  const ComboAddress& dest = d_dests.at(idx);
+  if (dest.sin4.sin_family != 0) {
+    addCMsgSrcAddr(&outMsg.msg_hdr, &d_respCBufs.at(idx * s_cbufSize), &dest, 0);
+  }
+  d_queued++;
+}
+
+int UDPMessagesBatch::sendQueued(int fd)
+{
+  if (d_queued == 0) {
+    return 0;
+  }
+  int sent = sendmmsg(fd, d_outMsgVec.data(), d_queued, 0);
+  d_queued = 0;
+  return sent;
+}
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
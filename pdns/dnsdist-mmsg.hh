@@ -0,0 +1,111 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <vector>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "iputils.hh"
+
+class UDPMessagesBatch;
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+/* The buffers used by a batched UDP frontend: up to batchSize datagrams are received with a
+   single recvmmsg() call, and the immediate responses queued while processing them are sent
+   back with a single sendmmsg() call. Each datagram has its own query and response buffers,
+   so a queued response stays valid until the next call to sendQueued(). */
+class UDPMessagesBatch
+{
+public:
+  /* datagrams are received into the first receiveSize bytes of a queryBufferSize buffer, the remaining
+     room being available to grow the query */
+  UDPMessagesBatch(size_t batchSize, int family, size_t receiveSize, size_t queryBufferSize, size_t responseBufferSize);
+
+  /* blocks until at least one datagram is available, then gets as many as possible without blocking.
+     Returns the number of datagrams received, or -1 on error with errno set */
+  int receive(int fd);
+  /* sends the queued responses, returns the number of responses sent or -1 on error with errno set */
+  int sendQueued(int fd);
+  /* queues response to the sender of datagram idx, from the destination address of that datagram if set */
+  void queueResponse(size_t idx, const char* response, uint16_t responseLen);
+
+  const struct msghdr* getMessageHeader(size_t idx) const
+  {
+    return &d_msgVec.at(idx).msg_hdr;
+  }
+  uint16_t getQueryLength(size_t idx) const
+  {
+    return static_cast<uint16_t>(d_msgVec.at(idx).msg_len);
+  }
+  char* getQuery(size_t idx)
+  {
+    return &d_queries.at(idx * d_queryBufferSize);
+  }
+  size_t getQueryBufferSize() const
+  {
+    return d_queryBufferSize;
+  }
+  char* getResponse(size_t idx)
+  {
+    return &d_responses.at(idx * d_responseBufferSize);
+  }
+  size_t getResponseBufferSize() const
+  {
+    return d_responseBufferSize;
+  }
+  const ComboAddress& getRemote(size_t idx) const
+  {
+    return d_remotes.at(idx);
+  }
+  ComboAddress& getDest(size_t idx)
+  {
+    return d_dests.at(idx);
+  }
+  unsigned int getQueuedCount() const
+  {
+    return d_queued;
+  }
+  size_t size() const
+  {
+    return d_msgVec.size();
+  }
+
+private:
+  /* large enough for the IP_PKTINFO / IPV6_PKTINFO control messages */
+  static const size_t s_cbufSize{256};
+
+  std::vector<struct mmsghdr> d_msgVec;
+  std::vector<struct mmsghdr> d_outMsgVec;
+  std::vector<struct iovec> d_iovs;
+  std::vector<struct iovec> d_respIOVs;
+  std::vector<ComboAddress> d_remotes;
+  std::vector<ComboAddress> d_dests;
+  std::vector<char> d_queries;
+  std::vector<char> d_responses;
+  std::vector<char> d_cbufs;
+  std::vector<char> d_respCBufs;
+  size_t d_queryBufferSize;
+  size_t d_responseBufferSize;
+  unsigned int d_queued{0};
+};
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
@@ -20,57 +20,309 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #include "dnsdist.hh"
+#include "dolog.hh"
 #include "lock.hh"
 
+void Rings::setCapacity(size_t capacity, size_t numberOfShards)
+{
+  if (numberOfShards == 0) {
+    numberOfShards = 1;
+  }
+
+  d_capacity = capacity;
+  /* a thread only ever inserts into one shard, so with fewer inserting threads than shards
+     the part of the capacity given to the unused shards is wasted */
+  d_shardCapacity = capacity / numberOfShards;
+  if (d_shardCapacity == 0 && capacity > 0) {
+    d_shardCapacity = 1;
+  }
+  d_shards.clear();
+  d_shards.reserve(numberOfShards);
+  for (size_t idx = 0; idx < numberOfShards; idx++) {
+    std::unique_ptr<Shard> shard(new Shard(d_heavyHittersCapacity, d_heavyHittersPeriod));
+    shard->queryRing.set_capacity(d_shardCapacity);
+    shard->respRing.set_capacity(d_shardCapacity);
+    d_shards.push_back(std::move(shard));
+  }
+  setCountersParameters(d_countersWindow, d_maxCountersEntries);
+}
+
+void Rings::setCountersParameters(size_t seconds, size_t maxEntries)
+{
+  if (seconds == 0) {
+    seconds = 1;
+  }
+
+  d_countersWindow = seconds;
+  d_maxCountersEntries = maxEntries;
+  /* one more bucket for the current, partial, second */
+  d_countersBucketCapacity = maxEntries / (d_shards.size() * (seconds + 1));
+  if (d_countersBucketCapacity == 0) {
+    d_countersBucketCapacity = 1;
+  }
+  for (auto& shard : d_shards) {
+    shard->queryCounters.clear();
+    shard->queryCounters.resize(seconds + 1);
+    shard->respCounters.clear();
+    shard->respCounters.resize(seconds + 1);
+  }
+}
+
+void Rings::setHeavyHittersParameters(size_t capacity, time_t period, unsigned int suffixLabels)
+{
+  d_heavyHittersCapacity = capacity;
+  d_heavyHittersPeriod = period > 0 ? period : 1;
+  d_heavyHittersSuffixLabels = suffixLabels;
+  setCapacity(d_capacity, d_shards.size());
+}
+
+void Rings::addToCounters(std::vector<CountersBucket>& buckets, time_t second, Counter counter, uint16_t value, const ComboAddress& requestor, uint64_t count)
+{
+  auto& bucket = buckets[second % buckets.size()];
+  if (bucket.second != second) {
+    if (bucket.second > second) {
+      /* this bucket has already been reused for a more recent second */
+      return;
+    }
+    bucket.second = second;
+    bucket.entries = 0;
+    bucket.counters.clear();
+  }
+
+  const uint32_t key = (static_cast<uint32_t>(counter) << 16) | value;
+  auto it = bucket.counters.find(key);
+  if (it == bucket.counters.end()) {
+    it = bucket.counters.insert({key, clientsss_t(d_countersBucketCapacity)}).first;
+  }
+  auto& summary = it->second;
+
+  if (bucket.entries < d_countersBucketCapacity || summary.contains(requestor)) {
+    const size_t before = summary.size();
+    summary.add(requestor, count);
+    bucket.entries += summary.size() - before;
+    return;
+  }
+
+  /* The bucket is full. Rather than ignoring this new requestor, which would let a client
+     go unnoticed as long as enough other ones were seen first, it takes the place of the
+     requestor with the lowest count of this counter and inherits that count, Space-Saving
+     style. Counts might then be over-estimated by that lowest count, but any requestor
+     above total / capacity is guaranteed to be present. */
+  if (summary.size() > 0) {
+    summary.replaceMin(requestor, count);
+    return;
+  }
+
+  /* first time this counter is seen during this second, make room in the largest summary */
+  auto largest = bucket.counters.end();
+  for (auto other = bucket.counters.begin(); other != bucket.counters.end(); ++other) {
+    if (largest == bucket.counters.end() || other->second.size() > largest->second.size()) {
+      largest = other;
+    }
+  }
+  largest->second.removeMin();
+  summary.add(requestor, count);
+}
+
+Rings::counters_t Rings::getCounters(Counter counter, uint16_t value, size_t seconds, double& elapsed) const
+{
+  counters_t result;
+  struct timespec now;
+  gettime(&now);
+
+  const bool wholeWindow = seconds == 0;
+  if (seconds == 0 || seconds > d_countersWindow) {
+    seconds = d_countersWindow;
+  }
+
+  const uint32_t key = (static_cast<uint32_t>(counter) << 16) | value;
+  const time_t cutoff = now.tv_sec - seconds;
+  time_t oldest = now.tv_sec;
+
+  for (const auto& shard : d_shards) {
+    const bool queries = counter == Counter::Queries || counter == Counter::QType;
+    std::lock_guard<std::mutex> lock(queries ? shard->queryLock : shard->respLock);
+    const auto& buckets = queries ? shard->queryCounters : shard->respCounters;
+
+    for (const auto& bucket : buckets) {
+      if (bucket.second < cutoff || bucket.second > now.tv_sec) {
+        continue;
+      }
+      bool found = false;
+      if (counter == Counter::Queries) {
+        /* not counted on insertion, every query being counted once in the QType counters */
+        for (const auto& entry : bucket.counters) {
+          if ((entry.first >> 16) == static_cast<uint32_t>(Counter::QType) && entry.second.size() > 0) {
+            entry.second.addTo(result);
+            found = true;
+          }
+        }
+      }
+      else {
+        const auto& it = bucket.counters.find(key);
+        if (it != bucket.counters.end() && it->second.size() > 0) {
+          it->second.addTo(result);
+          found = true;
+        }
+      }
+      if (found && bucket.second < oldest) {
+        oldest = bucket.second;
+      }
+    }
+  }
+
+  /* the oldest bucket is a full one, the current one is partial */
+  elapsed = (wholeWindow ? (now.tv_sec - oldest) : seconds) + (now.tv_nsec / 1000000000.0);
+  return result;
+}
+
+size_t Rings::getThreadNumber()
+{
+  static std::atomic<size_t> s_threadsCount{0};
+  const size_t number = s_threadsCount++;
+  if (number == d_shards.size()) {
+    /* the UDP and TCP workers, the responder threads of every backend and the health checks thread all insert */
+    warnlog("More threads are recording into the ring buffers than there are shards (%d), some of them will be sharing a shard and its locks. Consider raising the number of shards with setRingBuffersSize()", d_shards.size());
+  }
+  return number;
+}
+
+Rings::Shard& Rings::getShard()
+{
+  /* threads get a number the first time they insert something, and stick to the
+     corresponding shard from then on */
+  static thread_local size_t t_threadNumber = getThreadNumber();
+  return *d_shards[t_threadNumber % d_shards.size()];
+}
+
+uint64_t Rings::getSuffixKey(const DNSName& name, unsigned int labels)
+{
+  const auto& storage = name.getStorage();
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(storage.data());
+  size_t pos = 0;
+  for (unsigned int count = name.countLabels(); count > labels; --count) {
+    pos += data[pos] + 1;
+  }
+  const uint32_t length = storage.size() - pos;
+  /* two 32-bit hashes, so that two suffixes are very unlikely to be counted together */
+  return (static_cast<uint64_t>(burtleCI(data + pos, length, 0)) << 32) | burtleCI(data + pos, length, length);
+}
+
+/* called with the query lock of the shard held */
+void Rings::addSuffix(Shard& shard, uint64_t key, const DNSName& name, time_t now)
+{
+  if (!shard.topSuffixes.contains(key)) {
+    /* two summaries of d_heavyHittersCapacity entries, forget the names of the suffixes
+       evicted from them once there are twice as many names */
+    if (shard.suffixNames.size() >= 4 * d_heavyHittersCapacity) {
+      for (auto it = shard.suffixNames.begin(); it != shard.suffixNames.end(); ) {
+        if (shard.topSuffixes.contains(it->first)) {
+          ++it;
+        }
+        else {
+          it = shard.suffixNames.erase(it);
+        }
+      }
+    }
+    shard.suffixNames.insert({key, name.getLastLabels(d_heavyHittersSuffixLabels)});
+  }
+  shard.topSuffixes.add(key, 1, now);
+}
+
 size_t Rings::numDistinctRequestors()
 {
   std::set<ComboAddress, ComboAddress::addressOnlyLessThan> s;
-  ReadLock rl(&queryLock);
-  for(const auto& q : queryRing)
-    s.insert(q.requestor);
+  forEachQuery([&s](const Query& q) {
+      s.insert(q.requestor);
+    });
   return s.size();
 }
 
-std::unordered_map<int, vector<boost::variant<string,double>>> Rings::getTopBandwidth(unsigned int numentries)
+std::vector<std::pair<ComboAddress, uint64_t> > Rings::getTopClients(size_t top, uint64_t& total, double& elapsed) const
 {
-  map<ComboAddress, unsigned int, ComboAddress::addressOnlyLessThan> counts;
-  uint64_t total=0;
-  {
-    ReadLock rl(&queryLock);
-    for(const auto& q : queryRing) {
-      counts[q.requestor]+=q.size;
-      total+=q.size;
+  clientshh_t::counts_t counts;
+  struct timespec now;
+  gettime(&now);
+  total = 0;
+  elapsed = 0;
+
+  for (const auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard->queryLock);
+    total += shard->topClients.addTo(counts, now.tv_sec);
+    /* the counts of all the shards are added together, so report the longest period */
+    elapsed = std::max(elapsed, shard->topClients.getCoveredPeriod(now));
+  }
+
+  return getTopEntries(counts, top);
+}
+
+std::vector<std::pair<DNSName, uint64_t> > Rings::getTopQueries(size_t top, bool suffixes, uint64_t& total, double& elapsed) const
+{
+  struct timespec now;
+  gettime(&now);
+  total = 0;
+  elapsed = 0;
+
+  if (!suffixes) {
+    nameshh_t::counts_t counts;
+    for (const auto& shard : d_shards) {
+      std::lock_guard<std::mutex> lock(shard->queryLock);
+      total += shard->topQNames.addTo(counts, now.tv_sec);
+      elapsed = std::max(elapsed, shard->topQNames.getCoveredPeriod(now));
+    }
+    return getTopEntries(counts, top);
+  }
+
+  suffixeshh_t::counts_t counts;
+  std::unordered_map<uint64_t, DNSName> names;
+  for (const auto& shard : d_shards) {
+    suffixeshh_t::counts_t shardCounts;
+    std::lock_guard<std::mutex> lock(shard->queryLock);
+    total += shard->topSuffixes.addTo(shardCounts, now.tv_sec);
+    elapsed = std::max(elapsed, shard->topSuffixes.getCoveredPeriod(now));
+    for (const auto& entry : shardCounts) {
+      counts[entry.first] += entry.second;
+      if (names.count(entry.first) == 0) {
+        const auto name = shard->suffixNames.find(entry.first);
+        if (name != shard->suffixNames.end()) {
+          names.insert({entry.first, name->second});
+        }
+      }
     }
   }
 
-  {
-    std::lock_guard<std::mutex> lock(respMutex);
-    for(const auto& r : respRing) {
-      counts[r.requestor]+=r.size;
-      total+=r.size;
+  std::vector<std::pair<DNSName, uint64_t> > result;
+  for (const auto& entry : getTopEntries(counts, top)) {
+    result.push_back({names[entry.first], entry.second});
+  }
+  return result;
+}
+
+std::unordered_map<int, vector<boost::variant<string,double>>> Rings::getTopBandwidth(unsigned int numentries)
+{
+  clientshh_t::counts_t counts;
+  uint64_t total=0;
+  struct timespec now;
+  gettime(&now);
+
+  for (const auto& shard : d_shards) {
+    {
+      std::lock_guard<std::mutex> lock(shard->queryLock);
+      total += shard->topQueryBytes.addTo(counts, now.tv_sec);
+    }
+    {
+      std::lock_guard<std::mutex> lock(shard->respLock);
+      total += shard->topResponseBytes.addTo(counts, now.tv_sec);
     }
   }
 
-  typedef vector<pair<unsigned int, ComboAddress>> ret_t;
-  ret_t rcounts;
-  rcounts.reserve(counts.size());
-  for(const auto& p : counts)
-    rcounts.push_back({p.second, p.first});
-  numentries = rcounts.size() < numentries ? rcounts.size() : numentries;
-  partial_sort(rcounts.begin(), rcounts.begin()+numentries, rcounts.end(), [](const ret_t::value_type&a, const ret_t::value_type&b)
-	       {
-		 return(b.first < a.first);
-	       });
+  const auto rcounts = getTopEntries(counts, numentries);
   std::unordered_map<int, vector<boost::variant<string,double>>> ret;
-  uint64_t rest = 0;
+  uint64_t rest = total;
   unsigned int count = 1;
   for(const auto& rc : rcounts) {
-    if(count==numentries+1) {
-      rest+=rc.first;
-    }
-    else {
-      ret.insert({count++, {rc.second.toString(), rc.first, 100.0*rc.first/total}});
-    }
+    ret.insert({count++, {rc.first.toString(), rc.second, 100.0*rc.second/total}});
+    rest -= std::min(rest, rc.second);
   }
   ret.insert({count, {"Rest", rest, total > 0 ? 100.0*rest/total : 100.0}});
   return ret;
@@ -0,0 +1,326 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <algorithm>
+#include <mutex>
+
+#include "dnsdist-rulechain.hh"
+#include "dnsrulactions.hh"
+
+static void collectSuffixes(const SuffixMatchNode& node, const DNSName& name, std::vector<DNSName>& suffixes)
+{
+  if (node.endNode) {
+    suffixes.push_back(name);
+  }
+
+  for (const auto& child : node.children) {
+    DNSName childName(name);
+    childName.prependRawLabel(child.name);
+    collectSuffixes(child, childName, suffixes);
+  }
+}
+
+static void sortAndDedup(std::vector<size_t>& indexes)
+{
+  std::sort(indexes.begin(), indexes.end());
+  indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+}
+
+CompiledRuleChain::CompiledRuleChain(const rulactions_t& rulactions): d_rulactions(rulactions)
+{
+  d_program.reserve(d_rulactions.size());
+
+  for (size_t idx = 0; idx < d_rulactions.size(); ) {
+    const DNSRule* rule = d_rulactions[idx].first.get();
+
+    if (dynamic_cast<const SuffixMatchNodeRule*>(rule)) {
+      size_t last = idx + 1;
+      while (last < d_rulactions.size() && dynamic_cast<const SuffixMatchNodeRule*>(d_rulactions[last].first.get())) {
+        last++;
+      }
+      compileSuffixGroup(idx, last);
+      idx = last;
+      continue;
+    }
+
+    if (const auto nmgRule = dynamic_cast<const NetmaskGroupRule*>(rule)) {
+      const bool source = nmgRule->isSource();
+      size_t last = idx + 1;
+      while (last < d_rulactions.size()) {
+        const auto next = dynamic_cast<const NetmaskGroupRule*>(d_rulactions[last].first.get());
+        if (!next || next->isSource() != source) {
+          break;
+        }
+        last++;
+      }
+      compileNetmaskGroup(idx, last, source);
+      idx = last;
+      continue;
+    }
+
+#ifdef HAVE_RE2
+    if (const auto setRule = dynamic_cast<const RegexSetRule*>(rule)) {
+      size_t last = idx + 1;
+      while (last < d_rulactions.size()) {
+        const auto next = dynamic_cast<const RegexSetRule*>(d_rulactions[last].first.get());
+        if (!next || next->getRegexSet() != setRule->getRegexSet()) {
+          break;
+        }
+        last++;
+      }
+      compileRegexSetGroup(idx, last);
+      idx = last;
+      continue;
+    }
+#endif /* HAVE_RE2 */
+
+    Instruction ins;
+    ins.index = idx;
+
+    if (dynamic_cast<const AllRule*>(rule)) {
+      ins.op = Op::All;
+    }
+    else if (const auto qtypeRule = dynamic_cast<const QTypeRule*>(rule)) {
+      ins.op = Op::QType;
+      ins.value = qtypeRule->getQType();
+    }
+    else if (const auto qclassRule = dynamic_cast<const QClassRule*>(rule)) {
+      ins.op = Op::QClass;
+      ins.value = qclassRule->getQClass();
+    }
+    else if (const auto opcodeRule = dynamic_cast<const OpcodeRule*>(rule)) {
+      ins.op = Op::Opcode;
+      ins.value = opcodeRule->getOpcode();
+    }
+    else if (const auto tcpRule = dynamic_cast<const TCPRule*>(rule)) {
+      ins.op = Op::TCP;
+      ins.flag = tcpRule->getTCP();
+    }
+    else if (const auto countRule = dynamic_cast<const RecordsCountRule*>(rule)) {
+      ins.op = Op::RecordsCount;
+      ins.section = countRule->getSection();
+      ins.min = countRule->getMinCount();
+      ins.max = countRule->getMaxCount();
+    }
+    else if (const auto labelsRule = dynamic_cast<const QNameLabelsCountRule*>(rule)) {
+      ins.op = Op::QNameLabelsCount;
+      ins.min = labelsRule->getMin();
+      ins.max = labelsRule->getMax();
+      d_needsLabelsCount = true;
+    }
+    else if (const auto lengthRule = dynamic_cast<const QNameWireLengthRule*>(rule)) {
+      ins.op = Op::QNameWireLength;
+      ins.min = lengthRule->getMin();
+      ins.max = lengthRule->getMax();
+    }
+    else {
+      ins.op = Op::Generic;
+    }
+
+    d_program.push_back(ins);
+    idx++;
+  }
+}
+
+void CompiledRuleChain::compileSuffixGroup(size_t first, size_t last)
+{
+  std::unordered_map<DNSName, std::vector<size_t> > exact;
+  std::vector<DNSName> suffixes;
+
+  for (size_t idx = first; idx < last; idx++) {
+    const auto rule = std::dynamic_pointer_cast<const SuffixMatchNodeRule>(d_rulactions[idx].first);
+    suffixes.clear();
+    collectSuffixes(rule->getSuffixMatchNode(), DNSName("."), suffixes);
+    for (const auto& suffix : suffixes) {
+      exact[suffix].push_back(idx);
+    }
+  }
+
+  /* a qname matching a suffix matches all its parents as well, so
+     a single lookup of the longest suffix is enough */
+  std::unordered_map<DNSName, std::vector<size_t> > group;
+  for (const auto& entry : exact) {
+    auto& indexes = group[entry.first];
+    indexes = entry.second;
+    DNSName parent(entry.first);
+    while (parent.chopOff()) {
+      const auto it = exact.find(parent);
+      if (it != exact.end()) {
+        indexes.insert(indexes.end(), it->second.begin(), it->second.end());
+      }
+    }
+    sortAndDedup(indexes);
+  }
+
+  Instruction ins;
+  ins.op = Op::SuffixGroup;
+  ins.index = first;
+  ins.group = d_suffixGroups.size();
+  d_suffixGroups.push_back(std::move(group));
+  d_program.push_back(ins);
+}
+
+void CompiledRuleChain::compileNetmaskGroup(size_t first, size_t last, bool source)
+{
+  NetmaskTree<std::vector<size_t> > exact;
+  std::vector<std::string> masks;
+
+  for (size_t idx = first; idx < last; idx++) {
+    const auto rule = std::dynamic_pointer_cast<const NetmaskGroupRule>(d_rulactions[idx].first);
+    masks.clear();
+    rule->getNetmaskGroup().toStringVector(&masks);
+    for (const auto& mask : masks) {
+      exact.insert(Netmask(mask)).second.push_back(idx);
+    }
+  }
+
+  /* the netmasks containing an address are all parents of the most specific one,
+     so a single best match lookup is enough */
+  NetmaskTree<std::vector<size_t> > group;
+  for (const auto node : exact) {
+    std::vector<size_t> indexes = node->second;
+    int bits = node->first.getBits();
+    while (bits > 0) {
+      const auto parent = exact.lookup(node->first.getNetwork(), bits - 1);
+      if (!parent) {
+        break;
+      }
+      indexes.insert(indexes.end(), parent->second.begin(), parent->second.end());
+      bits = parent->first.getBits();
+    }
+    sortAndDedup(indexes);
+    group.insert(node->first).second = std::move(indexes);
+  }
+
+  Instruction ins;
+  ins.op = Op::NetmaskGroup;
+  ins.index = first;
+  ins.flag = source;
+  ins.group = d_netmaskGroups.size();
+  d_netmaskGroups.push_back(group);
+  d_program.push_back(ins);
+}
+
+void CompiledRuleChain::compileRegexSetGroup(size_t first, size_t last)
+{
+#ifdef HAVE_RE2
+  RegexSetGroup group;
+  group.first = first;
+  for (size_t idx = first; idx < last; idx++) {
+    const auto rule = std::dynamic_pointer_cast<const RegexSetRule>(d_rulactions[idx].first);
+    group.set = rule->getRegexSet();
+    group.patterns.push_back(rule->getIndex());
+  }
+
+  Instruction ins;
+  ins.op = Op::RegexSetGroup;
+  ins.index = first;
+  ins.group = d_regexSetGroups.size();
+  d_regexSetGroups.push_back(std::move(group));
+  d_program.push_back(ins);
+#endif /* HAVE_RE2 */
+}
+
+const std::vector<size_t>* CompiledRuleChain::lookupSuffixGroup(size_t group, const DNSName& qname) const
+{
+  const auto& suffixes = d_suffixGroups[group];
+  if (suffixes.empty()) {
+    return nullptr;
+  }
+
+  DNSName suffix(qname);
+  do {
+    const auto it = suffixes.find(suffix);
+    if (it != suffixes.end()) {
+      return &it->second;
+    }
+  }
+  while (suffix.chopOff());
+
+  return nullptr;
+}
+
+const std::vector<size_t>* CompiledRuleChain::lookupNetmaskGroup(size_t group, const ComboAddress& addr) const
+{
+  const auto node = d_netmaskGroups[group].lookup(addr);
+  if (!node) {
+    return nullptr;
+  }
+  return &node->second;
+}
+
+bool CompiledRuleChain::lookupRegexSetGroup(size_t group, const DNSName& qname, std::vector<size_t>& matching) const
+{
+  matching.clear();
+#ifdef HAVE_RE2
+  /* only used until we return */
+  static thread_local std::vector<int> hits;
+
+  const auto& regexSetGroup = d_regexSetGroups[group];
+  regexSetGroup.set->match(qname, hits);
+  if (hits.empty()) {
+    return false;
+  }
+
+  for (size_t idx = 0; idx < regexSetGroup.patterns.size(); idx++) {
+    const int pattern = regexSetGroup.patterns[idx];
+    if (pattern < 0 || std::binary_search(hits.begin(), hits.end(), pattern)) {
+      matching.push_back(regexSetGroup.first + idx);
+    }
+  }
+#endif /* HAVE_RE2 */
+  return !matching.empty();
+}
+
+static std::mutex s_compiledLock;
+static std::shared_ptr<const CompiledRuleChain> s_compiled;
+static unsigned int s_compiledGeneration{0};
+
+std::shared_ptr<const CompiledRuleChain> getCompiledRuleChain(LocalStateHolder<CompiledRuleChain::rulactions_t>& localRulactions)
+{
+  static thread_local std::shared_ptr<const CompiledRuleChain> t_compiled;
+  static thread_local unsigned int t_generation{0};
+
+  /* refreshes the local copy if needed, so this has to be done before looking at the generation */
+  const auto& rulactions = *localRulactions;
+  const unsigned int generation = localRulactions.getGeneration();
+
+  if (t_compiled && generation == t_generation) {
+    return t_compiled;
+  }
+
+  std::lock_guard<std::mutex> lock(s_compiledLock);
+  if (!s_compiled || generation != s_compiledGeneration) {
+    auto compiled = std::make_shared<const CompiledRuleChain>(rulactions);
+    /* a thread lagging behind should not evict a more recent version */
+    if (generation < s_compiledGeneration) {
+      t_compiled = compiled;
+      t_generation = generation;
+      return t_compiled;
+    }
+    s_compiled = compiled;
+    s_compiledGeneration = generation;
+  }
+
+  t_compiled = s_compiled;
+  t_generation = generation;
+  return t_compiled;
+}
@@ -0,0 +1,195 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "dnsdist.hh"
+
+class RegexSet;
+
+/* The rule set, compiled into a flat program once per change of g_rulactions and
+   shared by all threads. Simple rules (qtype, qclass, opcode, TCP, records count,
+   qname labels count and wire length) are evaluated directly from the query and a
+   few facts decoded once per query, without a virtual call. Runs of adjacent
+   SuffixMatchNodeRule (resp. NetmaskGroupRule on the same side, RegexSetRule
+   sharing the same set) are merged into a single hash (resp. tree, automaton)
+   lookup returning all the matching rules at once.
+   Any other rule is evaluated through its matches() method, in order. */
+class CompiledRuleChain
+{
+public:
+  typedef std::pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > rulaction_t;
+  typedef std::vector<rulaction_t> rulactions_t;
+
+  CompiledRuleChain(const rulactions_t& rulactions);
+
+  /* calls visitor(rulaction) for every rule matching this query, in order,
+     until it returns false */
+  template<typename T>
+  void forEachMatchingRule(const DNSQuestion& dq, T visitor) const
+  {
+    if (d_program.empty()) {
+      return;
+    }
+
+    const Facts facts(dq, d_needsLabelsCount);
+
+    for (const auto& ins : d_program) {
+      if (ins.op == Op::SuffixGroup || ins.op == Op::NetmaskGroup || ins.op == Op::RegexSetGroup) {
+        const std::vector<size_t>* matching = nullptr;
+        /* the visitor might evaluate rules as well, so this one can't be shared */
+        std::vector<size_t> regexSetMatching;
+        if (ins.op == Op::SuffixGroup) {
+          matching = lookupSuffixGroup(ins.group, *dq.qname);
+        }
+        else if (ins.op == Op::NetmaskGroup) {
+          matching = lookupNetmaskGroup(ins.group, ins.flag ? *dq.remote : *dq.local);
+        }
+        else if (lookupRegexSetGroup(ins.group, *dq.qname, regexSetMatching)) {
+          matching = &regexSetMatching;
+        }
+
+        if (matching) {
+          for (const auto idx : *matching) {
+            if (!visitor(d_rulactions[idx])) {
+              return;
+            }
+          }
+        }
+      }
+      else if (matches(ins, dq, facts) && !visitor(d_rulactions[ins.index])) {
+        return;
+      }
+    }
+  }
+
+  size_t getProgramSize() const
+  {
+    return d_program.size();
+  }
+
+private:
+  enum class Op : uint8_t { All, QType, QClass, Opcode, TCP, RecordsCount, QNameLabelsCount, QNameWireLength, SuffixGroup, NetmaskGroup, RegexSetGroup, Generic };
+
+  struct Instruction
+  {
+    size_t index{0};  // position of the rule in d_rulactions
+    size_t group{0};  // position of the merged lookup, for SuffixGroup, NetmaskGroup and RegexSetGroup
+    size_t min{0};
+    size_t max{0};
+    uint16_t value{0};
+    uint8_t section{0};
+    bool flag{false}; // TCP for TCP, source for NetmaskGroup
+    Op op{Op::Generic};
+  };
+
+  /* what we need to know about the query that is not directly available in DNSQuestion,
+     decoded once */
+  struct Facts
+  {
+    Facts(const DNSQuestion& dq, bool needsLabelsCount): qnameLabelsCount(needsLabelsCount ? dq.qname->countLabels() : 0), qnameWireLength(dq.qname->wirelength())
+    {
+    }
+    const unsigned int qnameLabelsCount;
+    const size_t qnameWireLength;
+  };
+
+  static uint16_t getSectionCount(const struct dnsheader* dh, uint8_t section)
+  {
+    switch(section) {
+    case 0:
+      return ntohs(dh->qdcount);
+    case 1:
+      return ntohs(dh->ancount);
+    case 2:
+      return ntohs(dh->nscount);
+    case 3:
+      return ntohs(dh->arcount);
+    }
+    return 0;
+  }
+
+  bool matches(const Instruction& ins, const DNSQuestion& dq, const Facts& facts) const
+  {
+    switch(ins.op) {
+    case Op::All:
+      return true;
+    case Op::QType:
+      return dq.qtype == ins.value;
+    case Op::QClass:
+      return dq.qclass == ins.value;
+    case Op::Opcode:
+      return dq.dh->opcode == ins.value;
+    case Op::TCP:
+      return dq.tcp == ins.flag;
+    case Op::RecordsCount: {
+      const uint16_t count = getSectionCount(dq.dh, ins.section);
+      return count >= ins.min && count <= ins.max;
+    }
+    case Op::QNameLabelsCount:
+      return facts.qnameLabelsCount < ins.min || facts.qnameLabelsCount > ins.max;
+    case Op::QNameWireLength:
+      return facts.qnameWireLength < ins.min || facts.qnameWireLength > ins.max;
+    case Op::SuffixGroup:
+    case Op::NetmaskGroup:
+    case Op::RegexSetGroup:
+      /* handled by the caller */
+      return false;
+    case Op::Generic:
+      return d_rulactions[ins.index].first->matches(&dq);
+    }
+    return false;
+  }
+
+  const std::vector<size_t>* lookupSuffixGroup(size_t group, const DNSName& qname) const;
+  const std::vector<size_t>* lookupNetmaskGroup(size_t group, const ComboAddress& addr) const;
+  /* fills matching with the indexes of the rules matching, returns false if there is none */
+  bool lookupRegexSetGroup(size_t group, const DNSName& qname, std::vector<size_t>& matching) const;
+
+  void compileSuffixGroup(size_t first, size_t last);
+  void compileNetmaskGroup(size_t first, size_t last, bool source);
+  void compileRegexSetGroup(size_t first, size_t last);
+
+  struct RegexSetGroup
+  {
+    std::shared_ptr<const RegexSet> set;
+    size_t first;
+    /* for each rule of the group, the index of its pattern, negative for any */
+    std::vector<int> patterns;
+  };
+
+  rulactions_t d_rulactions;
+  std::vector<Instruction> d_program;
+  /* for each suffix, the indexes of the rules matching it or one of its parents */
+  std::vector<std::unordered_map<DNSName, std::vector<size_t> > > d_suffixGroups;
+  /* for each netmask, the indexes of the rules matching it or a larger one */
+  std::vector<NetmaskTree<std::vector<size_t> > > d_netmaskGroups;
+  std::vector<RegexSetGroup> d_regexSetGroups;
+  bool d_needsLabelsCount{false};
+};
+
+/* returns the compiled version of the current rules, compiling them at most once
+   per change of the rule set */
+std::shared_ptr<const CompiledRuleChain> getCompiledRuleChain(LocalStateHolder<CompiledRuleChain::rulactions_t>& localRulactions);
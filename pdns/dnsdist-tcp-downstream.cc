@@ -0,0 +1,366 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "dnsdist-tcp-downstream.hh"
+#include "dolog.hh"
+#include "iputils.hh"
+#include "misc.hh"
+
+uint16_t g_maxTCPPipelinedQueries{20};
+uint16_t g_maxIdleTCPConnectionsPerDownstream{10};
+int g_tcpDownstreamMaxIdleTime{300};
+
+/* an fd can only be in one of the multiplexer's lists at a time */
+void updateTCPIOState(FDMultiplexer& mplexer, int fd, TCPIOState& current, TCPIOState wanted, tcpiocallback_t* callback, const FDMultiplexer::funcparam_t& param)
+{
+  if (current == wanted) {
+    return;
+  }
+
+  if (current == TCPIOState::NeedRead) {
+    mplexer.removeReadFD(fd);
+  }
+  else if (current == TCPIOState::NeedWrite) {
+    mplexer.removeWriteFD(fd);
+  }
+  current = TCPIOState::Idle;
+
+  if (wanted == TCPIOState::NeedRead) {
+    mplexer.addReadFD(fd, callback, param);
+  }
+  else if (wanted == TCPIOState::NeedWrite) {
+    mplexer.addWriteFD(fd, callback, param);
+  }
+  current = wanted;
+}
+
+/* returns false if we need to wait for the socket to become readable again,
+   throws on error and if the connection has been closed by the remote end */
+bool readFromTCPSocket(int fd, std::vector<uint8_t>& buffer, size_t& pos, size_t toRead)
+{
+  while (pos < toRead) {
+    ssize_t got = recv(fd, reinterpret_cast<char*>(&buffer.at(pos)), toRead - pos, 0);
+    if (got == 0) {
+      throw std::runtime_error("EOF");
+    }
+    if (got < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return false;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("reading from TCP socket: " + stringerror());
+    }
+    pos += got;
+  }
+  return true;
+}
+
+std::shared_ptr<DownstreamTCPConnection> getDownstreamConnection(FDMultiplexer& mplexer, downstreamtcpconnections_t& pool, const std::shared_ptr<DownstreamState>& ds, bool reusable, const struct timeval& now)
+{
+  if (reusable) {
+    std::shared_ptr<DownstreamTCPConnection> best{nullptr};
+    for (const auto& conn : pool[ds.get()]) {
+      if (conn->canAcceptQuery() && (!best || conn->getPendingCount() < best->getPendingCount())) {
+        best = conn;
+      }
+    }
+    if (best) {
+      return best;
+    }
+  }
+
+  auto conn = std::make_shared<DownstreamTCPConnection>(mplexer, pool, ds, reusable);
+  conn->connect(now);
+  if (reusable) {
+    pool[ds.get()].push_back(conn);
+  }
+  return conn;
+}
+
+void DownstreamTCPConnection::connect(const struct timeval& now)
+{
+  vinfolog("TCP connecting to downstream %s", d_ds->remote.toStringWithPort());
+  d_fd = SSocket(d_ds->remote.sin4.sin_family, SOCK_STREAM, 0);
+  try {
+    if (!IsAnyAddress(d_ds->sourceAddr)) {
+      SSetsockopt(d_fd, SOL_SOCKET, SO_REUSEADDR, 1);
+      SBind(d_fd, d_ds->sourceAddr);
+    }
+    if (!setNonBlocking(d_fd)) {
+      throw std::runtime_error("setting the socket to non-blocking: " + stringerror());
+    }
+    if (::connect(d_fd, reinterpret_cast<const struct sockaddr*>(&d_ds->remote), d_ds->remote.getSocklen()) < 0 && errno != EINPROGRESS) {
+      throw std::runtime_error("connecting to " + d_ds->remote.toStringWithPort() + ": " + stringerror());
+    }
+  }
+  catch(...) {
+    close(d_fd);
+    d_fd = -1;
+    throw;
+  }
+  /* we will know that the connection has been established once the socket becomes writable */
+  d_connecting = true;
+  d_readBuffer.resize(sizeof(uint16_t));
+  updateIO(now);
+}
+
+void DownstreamTCPConnection::queueQuery(std::shared_ptr<TCPQuerySender> client, const std::vector<uint8_t>& query, const struct timeval& now)
+{
+  if (query.size() < (sizeof(uint16_t) + sizeof(dnsheader))) {
+    throw std::runtime_error("Trying to send a query that is too small to " + d_ds->getName());
+  }
+
+  while (d_pending.count(d_nextID)) {
+    d_nextID++;
+  }
+  uint16_t id = d_nextID++;
+
+  d_writeQueue.push_back(query);
+  struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(&d_writeQueue.back().at(sizeof(uint16_t)));
+  d_pending[id] = { client, static_cast<uint16_t>(dh->id) };
+  dh->id = id;
+
+  /* we don't write right away, to keep the callers from being called back
+     from here if the connection fails */
+  updateIO(now);
+}
+
+void DownstreamTCPConnection::updateIO(const struct timeval& now)
+{
+  if (d_fd < 0) {
+    return;
+  }
+
+  auto self = shared_from_this();
+  if (d_connecting || !d_writeQueue.empty()) {
+    updateTCPIOState(d_mplexer, d_fd, d_ioState, TCPIOState::NeedWrite, &DownstreamTCPConnection::handleIO, self);
+    d_mplexer.setWriteTTD(d_fd, now, d_ds->tcpSendTimeout);
+  }
+  else {
+    /* even idle connections are watched, so we notice when the downstream server closes them */
+    updateTCPIOState(d_mplexer, d_fd, d_ioState, TCPIOState::NeedRead, &DownstreamTCPConnection::handleIO, self);
+    if (!d_pending.empty()) {
+      d_mplexer.setReadTTD(d_fd, now, d_ds->tcpRecvTimeout);
+    }
+    else if (g_tcpDownstreamMaxIdleTime > 0) {
+      /* closed by handleTimeout() if nothing is sent over it until then */
+      d_mplexer.setReadTTD(d_fd, now, g_tcpDownstreamMaxIdleTime);
+    }
+  }
+}
+
+ssize_t DownstreamTCPConnection::send(const uint8_t* buffer, size_t len)
+{
+  if (d_ds->sourceItf == 0) {
+    return ::send(d_fd, buffer, len, 0);
+  }
+
+  struct msghdr msgh;
+  struct iovec iov;
+  char cbuf[256];
+  ComboAddress remote(d_ds->remote);
+  fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), const_cast<char*>(reinterpret_cast<const char*>(buffer)), len, &remote);
+  addCMsgSrcAddr(&msgh, cbuf, &d_ds->sourceAddr, d_ds->sourceItf);
+  return sendmsg(d_fd, &msgh, 0);
+}
+
+void DownstreamTCPConnection::handleWritable(const struct timeval& now)
+{
+  if (d_connecting) {
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if (getsockopt(d_fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+      throw std::runtime_error("connecting: " + stringerror());
+    }
+    if (err != 0) {
+      throw std::runtime_error("connecting: " + string(strerror(err)));
+    }
+    d_connecting = false;
+  }
+
+  while (!d_writeQueue.empty()) {
+    const auto& buffer = d_writeQueue.front();
+    ssize_t sent = send(&buffer.at(d_writePos), buffer.size() - d_writePos);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("writing: " + stringerror());
+    }
+
+    d_writePos += sent;
+    if (d_writePos == buffer.size()) {
+      d_writeQueue.pop_front();
+      d_writePos = 0;
+    }
+  }
+
+  updateIO(now);
+}
+
+void DownstreamTCPConnection::handleReadable(const struct timeval& now)
+{
+  for (;;) {
+    try {
+      if (!readFromTCPSocket(d_fd, d_readBuffer, d_readPos, d_readBuffer.size())) {
+        break;
+      }
+    }
+    catch(const std::runtime_error& e) {
+      if (d_pending.empty() && d_readingLength && d_readPos == 0) {
+        /* the downstream server closed an idle connection, that's fine */
+        vinfolog("Idle TCP connection to %s closed: %s", d_ds->getName(), e.what());
+        release();
+        return;
+      }
+      throw;
+    }
+
+    if (d_readingLength) {
+      uint16_t responseLen = (d_readBuffer.at(0) << 8) | d_readBuffer.at(1);
+      d_readingLength = false;
+      d_readBuffer.resize(responseLen);
+      d_readPos = 0;
+      if (responseLen > 0) {
+        continue;
+      }
+    }
+
+    handleResponse(now);
+    d_readingLength = true;
+    d_readBuffer.resize(sizeof(uint16_t));
+    d_readPos = 0;
+    if (d_fd < 0) {
+      /* the connection has been released */
+      return;
+    }
+  }
+
+  updateIO(now);
+}
+
+void DownstreamTCPConnection::handleResponse(const struct timeval& now)
+{
+  if (d_readBuffer.size() < sizeof(dnsheader)) {
+    throw std::runtime_error("Got a response of size " + std::to_string(d_readBuffer.size()) + " from " + d_ds->getName());
+  }
+
+  struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(d_readBuffer.data());
+  auto it = d_pending.find(dh->id);
+  if (it == d_pending.end()) {
+    vinfolog("Got an unexpected response with ID %d from %s", ntohs(dh->id), d_ds->getName());
+    return;
+  }
+
+  /* don't keep a reference into d_pending, the client might be gone once we are done */
+  auto client = it->second.client;
+  dh->id = it->second.origID;
+  if (client->handleDownstreamResponse(d_readBuffer, now)) {
+    d_pending.erase(it);
+  }
+
+  if (d_pending.empty() && (!d_reusable || getIdleCount() > g_maxIdleTCPConnectionsPerDownstream)) {
+    release();
+  }
+}
+
+/* number of connections of the pool to our downstream server, this one included, without any query in flight */
+size_t DownstreamTCPConnection::getIdleCount() const
+{
+  const auto& conns = d_pool[d_ds.get()];
+  return std::count_if(conns.cbegin(), conns.cend(), [](const std::shared_ptr<DownstreamTCPConnection>& conn) {
+      return conn->d_fd >= 0 && !conn->d_connecting && conn->d_pending.empty();
+    });
+}
+
+/* stops watching and closes the connection, and removes it from the pool */
+void DownstreamTCPConnection::release()
+{
+  if (d_fd < 0) {
+    return;
+  }
+
+  auto self = shared_from_this();
+  updateTCPIOState(d_mplexer, d_fd, d_ioState, TCPIOState::Idle, &DownstreamTCPConnection::handleIO, self);
+  close(d_fd);
+  d_fd = -1;
+
+  if (d_reusable) {
+    auto& conns = d_pool[d_ds.get()];
+    conns.erase(std::remove(conns.begin(), conns.end(), self), conns.end());
+  }
+}
+
+void DownstreamTCPConnection::fail(const std::string& reason, const struct timeval& now)
+{
+  vinfolog("Downstream connection to %s died on us (%s), getting a new one!", d_ds->getName(), reason);
+  release();
+
+  auto pending = std::move(d_pending);
+  d_pending.clear();
+  d_writeQueue.clear();
+  for (auto& entry : pending) {
+    entry.second.client->handleDownstreamFailure(now);
+  }
+}
+
+void DownstreamTCPConnection::handleTimeout(const struct timeval& now)
+{
+  if (d_pending.empty() && !d_connecting && d_writeQueue.empty()) {
+    if (g_tcpDownstreamMaxIdleTime > 0) {
+      vinfolog("Closing TCP connection to %s, idle for more than %d seconds", d_ds->getName(), g_tcpDownstreamMaxIdleTime);
+      release();
+      return;
+    }
+    /* idle now, clear the TTD by registering again */
+    auto self = shared_from_this();
+    updateTCPIOState(d_mplexer, d_fd, d_ioState, TCPIOState::Idle, &DownstreamTCPConnection::handleIO, self);
+    updateIO(now);
+    return;
+  }
+
+  fail("timeout", now);
+}
+
+void DownstreamTCPConnection::handleIO(int fd, FDMultiplexer::funcparam_t& param)
+{
+  /* param is invalidated as soon as the fd is removed from the multiplexer */
+  auto conn = boost::any_cast<std::shared_ptr<DownstreamTCPConnection> >(param);
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  try {
+    if (conn->d_ioState == TCPIOState::NeedWrite) {
+      conn->handleWritable(now);
+    }
+    else {
+      conn->handleReadable(now);
+    }
+  }
+  catch(const std::exception& e) {
+    conn->fail(e.what(), now);
+  }
+}
@@ -0,0 +1,126 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "dnsdist.hh"
+#include "mplexer.hh"
+
+enum class TCPIOState { Idle, NeedRead, NeedWrite };
+
+typedef void tcpiocallback_t(int fd, FDMultiplexer::funcparam_t& param);
+
+/* an fd can only be in one of the multiplexer's lists at a time */
+void updateTCPIOState(FDMultiplexer& mplexer, int fd, TCPIOState& current, TCPIOState wanted, tcpiocallback_t* callback, const FDMultiplexer::funcparam_t& param);
+/* returns false if we need to wait for the socket to become readable again,
+   throws on error and if the connection has been closed by the remote end */
+bool readFromTCPSocket(int fd, std::vector<uint8_t>& buffer, size_t& pos, size_t toRead);
+
+/* the side of a TCP exchange waiting for the responses to the queries it sent downstream */
+class TCPQuerySender
+{
+public:
+  virtual ~TCPQuerySender()
+  {
+  }
+
+  /* returns true if this response was the last one we were waiting for */
+  virtual bool handleDownstreamResponse(std::vector<uint8_t>& response, const struct timeval& now) = 0;
+  virtual void handleDownstreamFailure(const struct timeval& now) = 0;
+};
+
+class DownstreamTCPConnection;
+
+/* reusable connections to downstream servers, owned by a single thread. The raw pointer is fine
+   as a key since each connection holds a shared pointer to its DownstreamState */
+typedef std::map<const DownstreamState*, std::vector<std::shared_ptr<DownstreamTCPConnection> > > downstreamtcpconnections_t;
+
+class DownstreamTCPConnection : public std::enable_shared_from_this<DownstreamTCPConnection>
+{
+public:
+  DownstreamTCPConnection(FDMultiplexer& mplexer, downstreamtcpconnections_t& pool, std::shared_ptr<DownstreamState> ds, bool reusable): d_mplexer(mplexer), d_pool(pool), d_ds(ds), d_reusable(reusable)
+  {
+  }
+
+  ~DownstreamTCPConnection()
+  {
+    if (d_fd >= 0) {
+      close(d_fd);
+    }
+  }
+
+  bool canAcceptQuery() const
+  {
+    return d_reusable && d_fd >= 0 && d_pending.size() < g_maxTCPPipelinedQueries;
+  }
+
+  size_t getPendingCount() const
+  {
+    return d_pending.size();
+  }
+
+  void connect(const struct timeval& now);
+  /* query holds the two bytes length followed by the query itself */
+  void queueQuery(std::shared_ptr<TCPQuerySender> client, const std::vector<uint8_t>& query, const struct timeval& now);
+  void handleTimeout(const struct timeval& now);
+
+  static void handleIO(int fd, FDMultiplexer::funcparam_t& param);
+
+private:
+  struct PendingQuery
+  {
+    std::shared_ptr<TCPQuerySender> client;
+    uint16_t origID;
+  };
+
+  void handleReadable(const struct timeval& now);
+  void handleWritable(const struct timeval& now);
+  void handleResponse(const struct timeval& now);
+  void updateIO(const struct timeval& now);
+  void release();
+  size_t getIdleCount() const;
+  void fail(const std::string& reason, const struct timeval& now);
+  ssize_t send(const uint8_t* buffer, size_t len);
+
+  FDMultiplexer& d_mplexer;
+  downstreamtcpconnections_t& d_pool;
+  std::shared_ptr<DownstreamState> d_ds;
+  std::map<uint16_t, PendingQuery> d_pending;
+  std::deque<std::vector<uint8_t> > d_writeQueue;
+  std::vector<uint8_t> d_readBuffer;
+  size_t d_writePos{0};
+  size_t d_readPos{0};
+  int d_fd{-1};
+  TCPIOState d_ioState{TCPIOState::Idle};
+  uint16_t d_nextID{0};
+  bool d_reusable;
+  bool d_connecting{false};
+  bool d_readingLength{true};
+};
+
+/* returns the least busy reusable connection to ds from pool if one can take another query,
+   and a new connected one otherwise */
+std::shared_ptr<DownstreamTCPConnection> getDownstreamConnection(FDMultiplexer& mplexer, downstreamtcpconnections_t& pool, const std::shared_ptr<DownstreamState>& ds, bool reusable, const struct timeval& now);
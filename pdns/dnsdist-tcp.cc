@@ -21,44 +21,36 @@
  */
 #include "dnsdist.hh"
 #include "dnsdist-ecs.hh"
+#include "dnsdist-tcp-downstream.hh"
 #include "dnsparser.hh"
 #include "ednsoptions.hh"
 #include "dolog.hh"
 #include "lock.hh"
 #include "gettime.hh"
+#include "mplexer.hh"
 #include <thread>
 #include <atomic>
 
 using std::thread;
 using std::atomic;
 
-/* TCP: the grand design. 
-   We forward 'messages' between clients and downstream servers. Messages are 65k bytes large, tops. 
-   An answer might theoretically consist of multiple messages (for example, in the case of AXFR), initially 
-   we will not go there.
+/* TCP: the grand design.
+   We forward 'messages' between clients and downstream servers. Messages are 65k bytes large, tops.
+   An answer might consist of multiple messages, in the case of AXFR and IXFR.
 
-   In a sense there is a strong symmetry between UDP and TCP, once a connection to a downstream has been setup.
-   This symmetry is broken because of head-of-line blocking within TCP though, necessitating additional connections
-   to guarantee performance.
+   Each TCP client thread runs an event loop around a FDMultiplexer (epoll, kqueue or select), and
+   handles as many client connections as it gets. A client connection reads one query at a time,
+   processes it and either answers directly (self-answered, cache hit) or hands it over to a
+   connection to the selected downstream server, then waits for the answer before reading the next
+   query. Nothing blocks, so a slow client only costs a file descriptor and a few buffers.
 
-   So the idea is to have a 'pool' of available downstream connections, and forward messages to/from them and never queue.
-   So whenever an answer comes in, we know where it needs to go.
-
-   Let's start naively.
+   Every thread also keeps a pool of persistent connections per downstream server. Queries from
+   different clients are pipelined over these connections, up to g_maxTCPPipelinedQueries at a time
+   per connection, with the query ID rewritten so that out-of-order answers can be matched back.
+   {A,I}XFR queries get a dedicated connection that is closed once the transfer is done.
 */
 
-static int setupTCPDownstream(shared_ptr<DownstreamState> ds)
-{  
-  vinfolog("TCP connecting to downstream %s", ds->remote.toStringWithPort());
-  int sock = SSocket(ds->remote.sin4.sin_family, SOCK_STREAM, 0);
-  if (!IsAnyAddress(ds->sourceAddr)) {
-    SSetsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 1);
-    SBind(sock, ds->sourceAddr);
-  }
-  SConnect(sock, ds->remote);
-  setNonBlocking(sock);
-  return sock;
-}
+static const uint16_t s_headroomForSmallQueries = 512;
 
 struct ConnectionInfo
 {
@@ -96,410 +88,619 @@ void TCPClientCollection::addTCPClientThread()
   t1.detach();
 }
 
-static bool getNonBlockingMsgLen(int fd, uint16_t* len, int timeout)
-try
+std::shared_ptr<TCPClientCollection> g_tcpclientthreads;
+
+static FDMultiplexer* getTCPMultiplexer()
 {
-  uint16_t raw;
-  size_t ret = readn2WithTimeout(fd, &raw, sizeof raw, timeout);
-  if(ret != sizeof raw)
-    return false;
-  *len = ntohs(raw);
-  return true;
-}
-catch(...) {
-  return false;
+  for(const auto& entry : FDMultiplexer::getMultiplexerMap()) {
+    try {
+      return entry.second();
+    }
+    catch(const FDMultiplexerException& e) {
+      warnlog("Non-fatal error initializing possible multiplexer (%s), falling back", e.what());
+    }
+  }
+  throw std::runtime_error("No working multiplexer found for the TCP client thread");
 }
 
-static bool putNonBlockingMsgLen(int fd, uint16_t len, int timeout)
-try
+struct TCPClientThreadData
 {
-  uint16_t raw = htons(len);
-  size_t ret = writen2WithTimeout(fd, &raw, sizeof raw, timeout);
-  return ret == sizeof raw;
-}
-catch(...) {
-  return false;
-}
+  TCPClientThreadData(): policy(g_policy.getLocal()), rulactions(g_rulactions.getLocal()), respRulactions(g_resprulactions.getLocal()), dynNMGBlock(g_dynblockNMG.getLocal()), dynSMTBlock(g_dynblockSMT.getLocal()), pools(g_pools.getLocal()), mplexer(getTCPMultiplexer())
+  {
+  }
 
-static bool sendNonBlockingMsgLen(int fd, uint16_t len, int timeout, ComboAddress& dest, ComboAddress& local, unsigned int localItf)
-try
+  LocalStateHolder<ServerPolicy> policy;
+  LocalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > > > rulactions;
+  LocalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSResponseAction> > > > respRulactions;
+  LocalStateHolder<NetmaskTree<DynBlock> > dynNMGBlock;
+  LocalStateHolder<SuffixMatchTree<DynBlock> > dynSMTBlock;
+  LocalStateHolder<pools_t> pools;
+  blockfilter_t blockFilter{0};
+  std::unique_ptr<FDMultiplexer> mplexer;
+  downstreamtcpconnections_t downstreamConnections;
+  std::vector<uint8_t> rewrittenResponse;
+#ifdef HAVE_PROTOBUF
+  boost::uuids::random_generator uuidGenerator;
+#endif
+};
+
+class IncomingTCPConnection : public TCPQuerySender, public std::enable_shared_from_this<IncomingTCPConnection>
 {
-  if (localItf == 0)
-    return putNonBlockingMsgLen(fd, len, timeout);
+public:
+  IncomingTCPConnection(TCPClientThreadData& data, const ConnectionInfo& ci): d_data(data), d_remote(ci.remote), d_cs(ci.cs), d_fd(ci.fd)
+  {
+    memset(&d_dest, 0, sizeof(d_dest));
+    d_dest.sin4.sin_family = d_remote.sin4.sin_family;
+    socklen_t len = d_dest.getSocklen();
+    if (getsockname(d_fd, reinterpret_cast<sockaddr*>(&d_dest), &len)) {
+      d_dest = d_cs->local;
+    }
+  }
+
+  ~IncomingTCPConnection()
+  {
+    closeConnection();
+  }
+
+  void start(const struct timeval& now)
+  {
+    prepareForNewQuery();
+    updateIO(now);
+  }
+
+  bool handleDownstreamResponse(std::vector<uint8_t>& response, const struct timeval& now) override;
+  void handleDownstreamFailure(const struct timeval& now) override;
+  void handleTimeout();
+
+  static void handleIO(int fd, FDMultiplexer::funcparam_t& param);
+
+private:
+  void handleReadable(const struct timeval& now);
+  void handleWritable(const struct timeval& now);
+  void processQuery(const struct timeval& now);
+  void sendQueryToDownstream(const struct timeval& now);
+  void queueResponse(const char* response, uint16_t responseLen);
+  void prepareForNewQuery();
+  void updateIO(const struct timeval& now);
+  void closeConnection();
+
+  TCPClientThreadData& d_data;
+  ComboAddress d_remote;
+  ComboAddress d_dest;
+  ClientState* d_cs;
+  std::vector<uint8_t> d_buffer;
+  std::deque<std::vector<uint8_t> > d_responses;
+  size_t d_readPos{0};
+  size_t d_writePos{0};
+  int d_fd;
+  uint16_t d_queryLen{0};
+  TCPIOState d_ioState{TCPIOState::Idle};
+  bool d_readingLength{true};
+  bool d_waitingForDownstream{false};
+  bool d_closeOnceWritten{false};
+
+  /* state of the query being processed */
+  std::vector<uint8_t> d_downstreamQuery;
+  std::shared_ptr<DownstreamState> d_ds{nullptr};
+  std::shared_ptr<DNSDistPacketCache> d_packetCache{nullptr};
+#ifdef HAVE_DNSCRYPT
+  std::shared_ptr<DnsCryptQuery> d_dnsCryptQuery{nullptr};
+#endif
+#ifdef HAVE_PROTOBUF
+  boost::uuids::uuid d_uniqueId;
+#endif
+  DNSName d_qname;
+  struct timespec d_queryTime;
+  /* we need this one to be accurate ("real") for the protobuf message */
+  struct timespec d_queryRealTime;
+  uint32_t d_cacheKey{0};
+  int d_delayMsec{0};
+  uint16_t d_qtype{0};
+  uint16_t d_qclass{0};
+  uint16_t d_origFlags{0};
+  uint16_t d_downstreamFailures{0};
+  bool d_ednsAdded{false};
+  bool d_ecsAdded{false};
+  bool d_skipCache{false};
+  bool d_isXFR{false};
+  bool d_xfrStarted{false};
+  bool d_outstanding{false};
+};
 
-  uint16_t raw = htons(len);
-  ssize_t ret = sendMsgWithTimeout(fd, (char*) &raw, sizeof raw, timeout, dest, local, localItf);
-  return ret == sizeof raw;
+void IncomingTCPConnection::prepareForNewQuery()
+{
+  d_readingLength = true;
+  d_buffer.resize(sizeof(uint16_t));
+  d_readPos = 0;
+  d_waitingForDownstream = false;
+  d_downstreamQuery.clear();
+  d_ds = nullptr;
+  d_packetCache = nullptr;
+#ifdef HAVE_DNSCRYPT
+  d_dnsCryptQuery = nullptr;
+#endif
+  d_cacheKey = 0;
+  d_delayMsec = 0;
+  d_downstreamFailures = 0;
+  d_ednsAdded = false;
+  d_ecsAdded = false;
+  d_skipCache = false;
+  d_isXFR = false;
+  d_xfrStarted = false;
 }
-catch(...) {
-  return false;
+
+void IncomingTCPConnection::updateIO(const struct timeval& now)
+{
+  if (d_fd < 0) {
+    return;
+  }
+
+  auto self = shared_from_this();
+  if (!d_responses.empty()) {
+    updateTCPIOState(*d_data.mplexer, d_fd, d_ioState, TCPIOState::NeedWrite, &IncomingTCPConnection::handleIO, self);
+    d_data.mplexer->setWriteTTD(d_fd, now, g_tcpSendTimeout);
+  }
+  else if (d_waitingForDownstream) {
+    /* the downstream connection takes care of the timeouts */
+    updateTCPIOState(*d_data.mplexer, d_fd, d_ioState, TCPIOState::Idle, &IncomingTCPConnection::handleIO, self);
+  }
+  else {
+    updateTCPIOState(*d_data.mplexer, d_fd, d_ioState, TCPIOState::NeedRead, &IncomingTCPConnection::handleIO, self);
+    d_data.mplexer->setReadTTD(d_fd, now, g_tcpRecvTimeout);
+  }
 }
 
-static bool sendResponseToClient(int fd, const char* response, uint16_t responseLen)
+void IncomingTCPConnection::closeConnection()
 {
-  if (!putNonBlockingMsgLen(fd, responseLen, g_tcpSendTimeout))
-    return false;
+  if (d_fd < 0) {
+    return;
+  }
 
-  writen2WithTimeout(fd, response, responseLen, g_tcpSendTimeout);
-  return true;
+  vinfolog("Closing TCP client connection with %s", d_remote.toStringWithPort());
+  if (d_ioState == TCPIOState::NeedRead) {
+    d_data.mplexer->removeReadFD(d_fd);
+  }
+  else if (d_ioState == TCPIOState::NeedWrite) {
+    d_data.mplexer->removeWriteFD(d_fd);
+  }
+  d_ioState = TCPIOState::Idle;
+  close(d_fd);
+  d_fd = -1;
+
+  if (d_ds && d_outstanding) {
+    d_outstanding = false;
+    --d_ds->outstanding;
+  }
 }
 
-std::shared_ptr<TCPClientCollection> g_tcpclientthreads;
+void IncomingTCPConnection::queueResponse(const char* response, uint16_t responseLen)
+{
+  std::vector<uint8_t> buffer(sizeof(uint16_t) + responseLen);
+  buffer.at(0) = responseLen / 256;
+  buffer.at(1) = responseLen % 256;
+  memcpy(&buffer.at(sizeof(uint16_t)), response, responseLen);
+  d_responses.push_back(std::move(buffer));
+}
 
-void* tcpClientThread(int pipefd)
+void IncomingTCPConnection::handleReadable(const struct timeval& now)
 {
-  /* we get launched with a pipe on which we receive file descriptors from clients that we own
-     from that point on */
-     
-  bool outstanding = false;
-  blockfilter_t blockFilter = 0;
-  
-  {
-    std::lock_guard<std::mutex> lock(g_luamutex);
-    auto candidate = g_lua.readVariable<boost::optional<blockfilter_t> >("blockFilter");
-    if(candidate)
-      blockFilter = *candidate;
-  }     
-     
-  auto localPolicy = g_policy.getLocal();
-  auto localRulactions = g_rulactions.getLocal();
-  auto localRespRulactions = g_resprulactions.getLocal();
-  auto localDynBlockNMG = g_dynblockNMG.getLocal();
-  auto localDynBlockSMT = g_dynblockSMT.getLocal();
-  auto localPools = g_pools.getLocal();
-#ifdef HAVE_PROTOBUF
-  boost::uuids::random_generator uuidGenerator;
-#endif
+  if (d_readingLength) {
+    if (!readFromTCPSocket(d_fd, d_buffer, d_readPos, sizeof(uint16_t))) {
+      updateIO(now);
+      return;
+    }
 
-  map<ComboAddress,int> sockets;
-  for(;;) {
-    ConnectionInfo* citmp, ci;
+    d_queryLen = (d_buffer.at(0) << 8) | d_buffer.at(1);
+    d_cs->queries++;
+    g_stats.queries++;
 
-    try {
-      readn2(pipefd, &citmp, sizeof(citmp));
+    if (d_queryLen < sizeof(dnsheader)) {
+      g_stats.nonCompliantQueries++;
+      closeConnection();
+      return;
     }
-    catch(const std::runtime_error& e) {
-      throw std::runtime_error("Error reading from TCP acceptor pipe (" + std::to_string(pipefd) + ") in " + std::string(isNonBlocking(pipefd) ? "non-blocking" : "blocking") + " mode: " + e.what());
+
+    /* if the query is small, allocate a bit more
+       memory to be able to spoof the content,
+       and always enough to add ECS without allocating a new buffer */
+    d_buffer.resize(d_queryLen + (d_queryLen <= 4096 ? s_headroomForSmallQueries : s_EDNSClientSubnetRoom));
+    d_readingLength = false;
+    d_readPos = 0;
+  }
+
+  if (!readFromTCPSocket(d_fd, d_buffer, d_readPos, d_queryLen)) {
+    updateIO(now);
+    return;
+  }
+
+  processQuery(now);
+  updateIO(now);
+}
+
+void IncomingTCPConnection::handleWritable(const struct timeval& now)
+{
+  while (!d_responses.empty()) {
+    const auto& buffer = d_responses.front();
+    ssize_t sent = send(d_fd, &buffer.at(d_writePos), buffer.size() - d_writePos, 0);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("writing to TCP client: " + stringerror());
     }
 
-    --g_tcpclientthreads->d_queued;
-    ci=*citmp;
-    delete citmp;    
-
-    uint16_t qlen, rlen;
-    string largerQuery;
-    vector<uint8_t> rewrittenResponse;
-    shared_ptr<DownstreamState> ds;
-    ComboAddress dest;
-    memset(&dest, 0, sizeof(dest));
-    dest.sin4.sin_family = ci.remote.sin4.sin_family;
-    socklen_t len = dest.getSocklen();
-    if (!setNonBlocking(ci.fd))
-      goto drop;
-
-    if (getsockname(ci.fd, (sockaddr*)&dest, &len)) {
-      dest = ci.cs->local;
+    d_writePos += sent;
+    if (d_writePos == buffer.size()) {
+      d_responses.pop_front();
+      d_writePos = 0;
     }
+  }
 
-    try {
-      for(;;) {
-        ds = nullptr;
-        outstanding = false;
-
-        if(!getNonBlockingMsgLen(ci.fd, &qlen, g_tcpRecvTimeout))
-          break;
-
-        ci.cs->queries++;
-        g_stats.queries++;
-
-        if (qlen < sizeof(dnsheader)) {
-          g_stats.nonCompliantQueries++;
-          break;
-        }
-
-        bool ednsAdded = false;
-        bool ecsAdded = false;
-        /* if the query is small, allocate a bit more
-           memory to be able to spoof the content,
-           or to add ECS without allocating a new buffer */
-        size_t querySize = qlen <= 4096 ? qlen + 512 : qlen;
-        char queryBuffer[querySize];
-        const char* query = queryBuffer;
-        readn2WithTimeout(ci.fd, queryBuffer, qlen, g_tcpRecvTimeout);
+  if (d_responses.empty() && d_closeOnceWritten) {
+    closeConnection();
+    return;
+  }
+
+  updateIO(now);
+}
+
+void IncomingTCPConnection::processQuery(const struct timeval& now)
+{
+  char* queryBuffer = reinterpret_cast<char*>(d_buffer.data());
+  const char* query = queryBuffer;
+  uint16_t qlen = d_queryLen;
 
 #ifdef HAVE_DNSCRYPT
-        std::shared_ptr<DnsCryptQuery> dnsCryptQuery = 0;
-
-        if (ci.cs->dnscryptCtx) {
-          dnsCryptQuery = std::make_shared<DnsCryptQuery>();
-          uint16_t decryptedQueryLen = 0;
-          vector<uint8_t> response;
-          bool decrypted = handleDnsCryptQuery(ci.cs->dnscryptCtx, queryBuffer, qlen, dnsCryptQuery, &decryptedQueryLen, true, response);
-
-          if (!decrypted) {
-            if (response.size() > 0) {
-              sendResponseToClient(ci.fd, reinterpret_cast<char*>(response.data()), (uint16_t) response.size());
-            }
-            break;
-          }
-          qlen = decryptedQueryLen;
-        }
+  if (d_cs->dnscryptCtx) {
+    d_dnsCryptQuery = std::make_shared<DnsCryptQuery>();
+    uint16_t decryptedQueryLen = 0;
+    vector<uint8_t> response;
+    bool decrypted = handleDnsCryptQuery(d_cs->dnscryptCtx, queryBuffer, qlen, d_dnsCryptQuery, &decryptedQueryLen, true, response);
+
+    if (!decrypted) {
+      if (response.size() > 0) {
+        queueResponse(reinterpret_cast<char*>(response.data()), (uint16_t) response.size());
+        d_closeOnceWritten = true;
+      }
+      else {
+        closeConnection();
+      }
+      return;
+    }
+    qlen = decryptedQueryLen;
+  }
 #endif
-        struct dnsheader* dh = (struct dnsheader*) query;
-
-        if(dh->qr) {   // don't respond to responses
-          g_stats.nonCompliantQueries++;
-          goto drop;
-        }
-
-        if(dh->qdcount == 0) {
-          g_stats.emptyQueries++;
-          goto drop;
-        }
-
-        if (dh->rd) {
-          g_stats.rdQueries++;
-        }
-
-	const uint16_t* flags = getFlagsFromDNSHeader(dh);
-	uint16_t origFlags = *flags;
-	uint16_t qtype, qclass;
-	unsigned int consumed = 0;
-	DNSName qname(query, qlen, sizeof(dnsheader), false, &qtype, &qclass, &consumed);
-	DNSQuestion dq(&qname, qtype, qclass, &dest, &ci.remote, (dnsheader*)query, querySize, qlen, true);
+  struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(queryBuffer);
+
+  if(dh->qr) {   // don't respond to responses
+    g_stats.nonCompliantQueries++;
+    closeConnection();
+    return;
+  }
+
+  if(dh->qdcount == 0) {
+    g_stats.emptyQueries++;
+    closeConnection();
+    return;
+  }
+
+  if (dh->rd) {
+    g_stats.rdQueries++;
+  }
+
+  const uint16_t* flags = getFlagsFromDNSHeader(dh);
+  d_origFlags = *flags;
+  unsigned int consumed = 0;
+  d_qname = DNSName(query, qlen, sizeof(dnsheader), false, &d_qtype, &d_qclass, &consumed);
+  DNSQuestion dq(&d_qname, d_qtype, d_qclass, &d_dest, &d_remote, dh, d_buffer.size(), qlen, true);
 #ifdef HAVE_PROTOBUF
-        dq.uniqueId = uuidGenerator();
+  dq.uniqueId = d_data.uuidGenerator();
+  d_uniqueId = dq.uniqueId;
 #endif
 
-	string poolname;
-	int delayMsec=0;
-	/* we need this one to be accurate ("real") for the protobuf message */
-	struct timespec queryRealTime;
-	struct timespec now;
-	gettime(&now);
-	gettime(&queryRealTime, true);
+  string poolname;
+  gettime(&d_queryTime);
+  gettime(&d_queryRealTime, true);
 
-	if (!processQuery(localDynBlockNMG, localDynBlockSMT, localRulactions, blockFilter, dq, poolname, &delayMsec, now)) {
-	  goto drop;
-	}
+  if (!::processQuery(d_data.dynNMGBlock, d_data.dynSMTBlock, d_data.rulactions, d_data.blockFilter, dq, poolname, &d_delayMsec, d_queryTime)) {
+    closeConnection();
+    return;
+  }
 
-	if(dq.dh->qr) { // something turned it into a response
-          restoreFlags(dh, origFlags);
+  if(dq.dh->qr) { // something turned it into a response
+    restoreFlags(dh, d_origFlags);
 #ifdef HAVE_DNSCRYPT
-          if (!encryptResponse(queryBuffer, &dq.len, dq.size, true, dnsCryptQuery)) {
-            goto drop;
-          }
+    if (!encryptResponse(queryBuffer, &dq.len, dq.size, true, d_dnsCryptQuery)) {
+      closeConnection();
+      return;
+    }
 #endif
-          sendResponseToClient(ci.fd, query, dq.len);
-	  g_stats.selfAnswered++;
-	  goto drop;
-	}
-
-        std::shared_ptr<ServerPool> serverPool = getPool(*localPools, poolname);
-        std::shared_ptr<DNSDistPacketCache> packetCache = nullptr;
-	{
-	  std::lock_guard<std::mutex> lock(g_luamutex);
-	  ds = localPolicy->policy(serverPool->servers, &dq);
-	  packetCache = serverPool->packetCache;
-	}
-
-        if (dq.useECS && ds && ds->useECS) {
-          uint16_t newLen = dq.len;
-          handleEDNSClientSubnet(queryBuffer, dq.size, consumed, &newLen, largerQuery, &ednsAdded, &ecsAdded, ci.remote, dq.ecsOverride, dq.ecsPrefixLength);
-          if (largerQuery.empty() == false) {
-            query = largerQuery.c_str();
-            dq.len = (uint16_t) largerQuery.size();
-            dq.size = largerQuery.size();
-          } else {
-            dq.len = newLen;
-          }
-        }
-
-        uint32_t cacheKey = 0;
-        if (packetCache && !dq.skipCache) {
-          char cachedResponse[4096];
-          uint16_t cachedResponseSize = sizeof cachedResponse;
-          uint32_t allowExpired = ds ? 0 : g_staleCacheEntriesTTL;
-          if (packetCache->get(dq, (uint16_t) consumed, dq.dh->id, cachedResponse, &cachedResponseSize, &cacheKey, allowExpired)) {
+    queueResponse(query, dq.len);
+    g_stats.selfAnswered++;
+    prepareForNewQuery();
+    return;
+  }
+
+  std::shared_ptr<ServerPool> serverPool = getPool(*d_data.pools, poolname);
+  std::shared_ptr<DownstreamState> ds;
+  {
+    std::lock_guard<std::mutex> lock(g_luamutex);
+    ds = d_data.policy->getSelectedBackend(*serverPool, &dq);
+    d_packetCache = serverPool->packetCache;
+  }
+
+  if (dq.useECS && ds && ds->useECS) {
+    uint16_t newLen = dq.len;
+    if (handleEDNSClientSubnet(queryBuffer, dq.size, consumed, &newLen, &d_ednsAdded, &d_ecsAdded, d_remote, dq.ecsOverride, dq.ecsPrefixLength)) {
+      dq.len = newLen;
+    }
+    else {
+      vinfolog("Not enough room to add ECS to the query from %s", d_remote.toStringWithPort());
+    }
+  }
+
+  if (d_packetCache && !dq.skipCache) {
+    char cachedResponse[4096];
+    uint16_t cachedResponseSize = sizeof cachedResponse;
+    uint32_t allowExpired = ds ? 0 : g_staleCacheEntriesTTL;
+    if (d_packetCache->get(dq, (uint16_t) consumed, dq.dh->id, cachedResponse, &cachedResponseSize, &d_cacheKey, allowExpired)) {
 #ifdef HAVE_DNSCRYPT
-            if (!encryptResponse(cachedResponse, &cachedResponseSize, sizeof cachedResponse, true, dnsCryptQuery)) {
-              goto drop;
-            }
+      if (!encryptResponse(cachedResponse, &cachedResponseSize, sizeof cachedResponse, true, d_dnsCryptQuery)) {
+        closeConnection();
+        return;
+      }
 #endif
-            sendResponseToClient(ci.fd, cachedResponse, cachedResponseSize);
-            g_stats.cacheHits++;
-            goto drop;
-          }
-          g_stats.cacheMisses++;
-        }
-
-	if(!ds) {
-	  g_stats.noPolicy++;
-	  break;
-	}
-
-	int dsock = -1;
-	if(sockets.count(ds->remote) == 0) {
-	  dsock=sockets[ds->remote]=setupTCPDownstream(ds);
-	}
-	else
-	  dsock=sockets[ds->remote];
-
-        ds->queries++;
-        ds->outstanding++;
-        outstanding = true;
-
-        uint16_t downstream_failures=0;
-      retry:; 
-        if (dsock < 0) {
-          sockets.erase(ds->remote);
-          break;
-        }
-
-        if (ds->retries > 0 && downstream_failures > ds->retries) {
-          vinfolog("Downstream connection to %s failed %d times in a row, giving up.", ds->getName(), downstream_failures);
-          close(dsock);
-          dsock=-1;
-          sockets.erase(ds->remote);
-          break;
-        }
-
-        if(!sendNonBlockingMsgLen(dsock, dq.len, ds->tcpSendTimeout, ds->remote, ds->sourceAddr, ds->sourceItf)) {
-	  vinfolog("Downstream connection to %s died on us, getting a new one!", ds->getName());
-          close(dsock);
-          dsock=-1;
-          sockets.erase(ds->remote);
-          sockets[ds->remote]=dsock=setupTCPDownstream(ds);
-          downstream_failures++;
-          goto retry;
-        }
-
-        try {
-          if (ds->sourceItf == 0) {
-            writen2WithTimeout(dsock, query, dq.len, ds->tcpSendTimeout);
-          }
-          else {
-            sendMsgWithTimeout(dsock, query, dq.len, ds->tcpSendTimeout, ds->remote, ds->sourceAddr, ds->sourceItf);
-          }
-        }
-        catch(const runtime_error& e) {
-          vinfolog("Downstream connection to %s died on us, getting a new one!", ds->getName());
-          close(dsock);
-          dsock=-1;
-          sockets.erase(ds->remote);
-          sockets[ds->remote]=dsock=setupTCPDownstream(ds);
-          downstream_failures++;
-          goto retry;
-        }
-
-        bool xfrStarted = false;
-        bool isXFR = (dq.qtype == QType::AXFR || dq.qtype == QType::IXFR);
-        if (isXFR) {
-          dq.skipCache = true;
-        }
-
-      getpacket:;
-
-        if(!getNonBlockingMsgLen(dsock, &rlen, ds->tcpRecvTimeout)) {
-	  vinfolog("Downstream connection to %s died on us phase 2, getting a new one!", ds->getName());
-          close(dsock);
-          dsock=-1;
-          sockets.erase(ds->remote);
-          sockets[ds->remote]=dsock=setupTCPDownstream(ds);
-          downstream_failures++;
-          if(xfrStarted) {
-            goto drop;
-          }
-          goto retry;
-        }
-
-        size_t responseSize = rlen;
-        uint16_t addRoom = 0;
+      queueResponse(cachedResponse, cachedResponseSize);
+      g_stats.cacheHits++;
+      prepareForNewQuery();
+      return;
+    }
+    g_stats.cacheMisses++;
+  }
+
+  if(!ds) {
+    g_stats.noPolicy++;
+    closeConnection();
+    return;
+  }
+
+  d_isXFR = (dq.qtype == QType::AXFR || dq.qtype == QType::IXFR);
+  if (d_isXFR) {
+    dq.skipCache = true;
+  }
+  d_skipCache = dq.skipCache;
+
+  d_downstreamQuery.resize(sizeof(uint16_t) + dq.len);
+  d_downstreamQuery.at(0) = dq.len / 256;
+  d_downstreamQuery.at(1) = dq.len % 256;
+  memcpy(&d_downstreamQuery.at(sizeof(uint16_t)), query, dq.len);
+
+  d_ds = ds;
+  d_ds->queries++;
+  d_ds->outstanding++;
+  d_outstanding = true;
+  d_waitingForDownstream = true;
+
+  sendQueryToDownstream(now);
+}
+
+void IncomingTCPConnection::sendQueryToDownstream(const struct timeval& now)
+{
+  try {
+    auto conn = getDownstreamConnection(*d_data.mplexer, d_data.downstreamConnections, d_ds, !d_isXFR, now);
+    conn->queueQuery(shared_from_this(), d_downstreamQuery, now);
+  }
+  catch(const std::exception& e) {
+    vinfolog("Error sending a TCP query to %s: %s", d_ds->getName(), e.what());
+    closeConnection();
+  }
+}
+
+void IncomingTCPConnection::handleDownstreamFailure(const struct timeval& now)
+{
+  if (d_fd < 0) {
+    return;
+  }
+
+  d_downstreamFailures++;
+  if (d_xfrStarted || d_downstreamFailures > d_ds->retries) {
+    vinfolog("Downstream connection to %s failed %d times in a row, giving up.", d_ds->getName(), d_downstreamFailures);
+    closeConnection();
+    return;
+  }
+
+  sendQueryToDownstream(now);
+}
+
+bool IncomingTCPConnection::handleDownstreamResponse(std::vector<uint8_t>& responseBuffer, const struct timeval& now)
+{
+  if (d_fd < 0) {
+    return true;
+  }
+
+  if (d_outstanding) {
+    /* might be false for {A,I}XFR */
+    --d_ds->outstanding;
+    d_outstanding = false;
+  }
+
+  uint16_t responseLen = responseBuffer.size();
+  if (responseLen < sizeof(dnsheader)) {
+    closeConnection();
+    return true;
+  }
+
+  uint16_t addRoom = 0;
 #ifdef HAVE_DNSCRYPT
-        if (dnsCryptQuery && (UINT16_MAX - rlen) > (uint16_t) DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE) {
-          addRoom = DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE;
-        }
+  if (d_dnsCryptQuery && (UINT16_MAX - responseLen) > (uint16_t) DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE) {
+    addRoom = DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE;
+  }
 #endif
-        responseSize += addRoom;
-        char answerbuffer[responseSize];
-        readn2WithTimeout(dsock, answerbuffer, rlen, ds->tcpRecvTimeout);
-        char* response = answerbuffer;
-        uint16_t responseLen = rlen;
-        if (outstanding) {
-          /* might be false for {A,I}XFR */
-          --ds->outstanding;
-          outstanding = false;
-        }
-
-        if (rlen < sizeof(dnsheader)) {
-          break;
-        }
-
-        if (!responseContentMatches(response, responseLen, qname, qtype, qclass, ds->remote)) {
-          break;
-        }
-
-        if (!fixUpResponse(&response, &responseLen, &responseSize, qname, origFlags, ednsAdded, ecsAdded, rewrittenResponse, addRoom)) {
-          break;
-        }
-
-        dh = (struct dnsheader*) response;
-        DNSResponse dr(&qname, qtype, qclass, &dest, &ci.remote, dh, responseSize, responseLen, true, &queryRealTime);
+  responseBuffer.resize(responseLen + addRoom);
+  char* response = reinterpret_cast<char*>(responseBuffer.data());
+  size_t responseSize = responseBuffer.size();
+
+  if (!responseContentMatches(response, responseLen, d_qname, d_qtype, d_qclass, d_ds->remote)) {
+    closeConnection();
+    return true;
+  }
+
+  if (!fixUpResponse(&response, &responseLen, &responseSize, d_qname, d_origFlags, d_ednsAdded, d_ecsAdded, d_data.rewrittenResponse, addRoom)) {
+    closeConnection();
+    return true;
+  }
+
+  struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(response);
+  DNSResponse dr(&d_qname, d_qtype, d_qclass, &d_dest, &d_remote, dh, responseSize, responseLen, true, &d_queryRealTime);
 #ifdef HAVE_PROTOBUF
-        dr.uniqueId = dq.uniqueId;
+  dr.uniqueId = d_uniqueId;
 #endif
-        if (!processResponse(localRespRulactions, dr, &delayMsec)) {
-          break;
-        }
+  if (!processResponse(d_data.respRulactions, dr, &d_delayMsec)) {
+    closeConnection();
+    return true;
+  }
+
+  if (d_packetCache && !d_skipCache) {
+    d_packetCache->insert(d_cacheKey, d_qname, d_qtype, d_qclass, response, responseLen, true, dh->rcode == RCode::ServFail);
+  }
+
+  bool done = true;
+  if (d_isXFR && dh->rcode == 0 && dh->ancount != 0) {
+    if (d_xfrStarted == false) {
+      d_xfrStarted = true;
+      if (getRecordsOfTypeCount(response, responseLen, 1, QType::SOA) == 1) {
+        done = false;
+      }
+    }
+    else if (getRecordsOfTypeCount(response, responseLen, 1, QType::SOA) == 0) {
+      done = false;
+    }
+  }
 
-	if (packetCache && !dq.skipCache) {
-	  packetCache->insert(cacheKey, qname, qtype, qclass, response, responseLen, true, dh->rcode == RCode::ServFail);
-	}
+  if (done) {
+    g_stats.responses++;
+    struct timespec answertime;
+    gettime(&answertime);
+    unsigned int udiff = 1000000.0*DiffTime(d_queryTime, answertime);
+    g_rings.insertResponse(answertime, d_remote, d_qname, d_qtype, udiff, (unsigned int)responseLen, *dh, d_ds->remote);
+  }
 
 #ifdef HAVE_DNSCRYPT
-        if (!encryptResponse(response, &responseLen, responseSize, true, dnsCryptQuery)) {
-          goto drop;
-        }
+  if (!encryptResponse(response, &responseLen, responseSize, true, d_dnsCryptQuery)) {
+    closeConnection();
+    return true;
+  }
 #endif
-        if (!sendResponseToClient(ci.fd, response, responseLen)) {
-          break;
-        }
-
-        if (isXFR && dh->rcode == 0 && dh->ancount != 0) {
-          if (xfrStarted == false) {
-            xfrStarted = true;
-            if (getRecordsOfTypeCount(response, responseLen, 1, QType::SOA) == 1) {
-              goto getpacket;
-            }
-          }
-          else if (getRecordsOfTypeCount(response, responseLen, 1, QType::SOA) == 0) {
-            goto getpacket;
-          }
-        }
-
-        g_stats.responses++;
-        struct timespec answertime;
-        gettime(&answertime);
-        unsigned int udiff = 1000000.0*DiffTime(now,answertime);
-        {
-          std::lock_guard<std::mutex> lock(g_rings.respMutex);
-          g_rings.respRing.push_back({answertime, ci.remote, qname, dq.qtype, (unsigned int)udiff, (unsigned int)responseLen, *dh, ds->remote});
-        }
-
-        largerQuery.clear();
-        rewrittenResponse.clear();
-      }
+  queueResponse(response, responseLen);
+  d_data.rewrittenResponse.clear();
+
+  if (done) {
+    prepareForNewQuery();
+  }
+  updateIO(now);
+  return done;
+}
+
+void IncomingTCPConnection::handleTimeout()
+{
+  vinfolog("Timeout while %s TCP client %s", d_ioState == TCPIOState::NeedWrite ? "writing to" : "reading from", d_remote.toStringWithPort());
+  closeConnection();
+}
+
+void IncomingTCPConnection::handleIO(int fd, FDMultiplexer::funcparam_t& param)
+{
+  /* param is invalidated as soon as the fd is removed from the multiplexer */
+  auto conn = boost::any_cast<std::shared_ptr<IncomingTCPConnection> >(param);
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  try {
+    if (conn->d_ioState == TCPIOState::NeedWrite) {
+      conn->handleWritable(now);
     }
-    catch(...){}
+    else {
+      conn->handleReadable(now);
+    }
+  }
+  catch(const std::exception& e) {
+    vinfolog("Error while handling TCP connection from %s: %s", conn->d_remote.toStringWithPort(), e.what());
+    conn->closeConnection();
+  }
+}
+
+static void handleNewTCPConnection(int pipefd, FDMultiplexer::funcparam_t& param)
+{
+  TCPClientThreadData* data = boost::any_cast<TCPClientThreadData*>(param);
+  ConnectionInfo* citmp;
+
+  try {
+    readn2(pipefd, &citmp, sizeof(citmp));
+  }
+  catch(const std::runtime_error& e) {
+    throw std::runtime_error("Error reading from TCP acceptor pipe (" + std::to_string(pipefd) + ") in " + std::string(isNonBlocking(pipefd) ? "non-blocking" : "blocking") + " mode: " + e.what());
+  }
+
+  --g_tcpclientthreads->d_queued;
+  ConnectionInfo ci = *citmp;
+  delete citmp;
 
-  drop:;
-    
+  if (!setNonBlocking(ci.fd)) {
     vinfolog("Closing TCP client connection with %s", ci.remote.toStringWithPort());
-    close(ci.fd); 
-    ci.fd=-1;
-    if (ds && outstanding) {
-      outstanding = false;
-      --ds->outstanding;
+    close(ci.fd);
+    return;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, 0);
+  auto conn = std::make_shared<IncomingTCPConnection>(*data, ci);
+  conn->start(now);
+}
+
+static void handleTCPTimeouts(TCPClientThreadData& data, const struct timeval& now)
+{
+  for (bool writes : { false, true }) {
+    auto expired = data.mplexer->getTimeouts(now, writes);
+    for (auto& entry : expired) {
+      if (auto* client = boost::any_cast<std::shared_ptr<IncomingTCPConnection> >(&entry.second)) {
+        /* keep it alive, the multiplexer's copy goes away */
+        auto conn = *client;
+        conn->handleTimeout();
+      }
+      else if (auto* downstream = boost::any_cast<std::shared_ptr<DownstreamTCPConnection> >(&entry.second)) {
+        auto conn = *downstream;
+        conn->handleTimeout(now);
+      }
+    }
+  }
+}
+
+void* tcpClientThread(int pipefd)
+{
+  /* we get launched with a pipe on which we receive file descriptors from clients that we own
+     from that point on */
+  TCPClientThreadData data;
+
+  {
+    std::lock_guard<std::mutex> lock(g_luamutex);
+    auto candidate = g_lua.readVariable<boost::optional<blockfilter_t> >("blockFilter");
+    if(candidate)
+      data.blockFilter = *candidate;
+  }
+
+  data.mplexer->addReadFD(pipefd, handleNewTCPConnection, &data);
+
+  struct timeval now;
+  gettimeofday(&now, 0);
+  time_t lastTimeoutScan = now.tv_sec;
+  for(;;) {
+    data.mplexer->run(&now);
+
+    if (now.tv_sec > lastTimeoutScan) {
+      lastTimeoutScan = now.tv_sec;
+      handleTCPTimeouts(data, now);
     }
   }
   return 0;
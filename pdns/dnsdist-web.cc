@@ -295,6 +295,41 @@ static void connectionThread(int sock, ComboAddress remote, string password, str
         resp.body=my_json.dump();
         resp.headers["Content-Type"] = "application/json";
       }
+      else if(command=="topclients" || command=="topqueries" || command=="topsuffixes") {
+        size_t top = 10;
+        if (!req.getvars["top"].empty()) {
+          top = pdns_stou(req.getvars["top"]);
+        }
+        uint64_t total = 0;
+        double elapsed = 0;
+        Json::array entries;
+        auto addEntry = [&entries, &total](const std::string& name, uint64_t count) {
+          entries.push_back(Json::object{
+              {"name", name},
+              {"queries", (double)count},
+              {"percentage", total > 0 ? 100.0*count/total : 0.0}
+            });
+        };
+
+        if (command=="topclients") {
+          for (const auto& entry : g_rings.getTopClients(top, total, elapsed)) {
+            addEntry(entry.first.toString(), entry.second);
+          }
+        }
+        else {
+          for (const auto& entry : g_rings.getTopQueries(top, command=="topsuffixes", total, elapsed)) {
+            addEntry(entry.first.toString(), entry.second);
+          }
+        }
+
+        Json my_json = Json::object{
+          {"total", (double)total},
+          {"seconds", elapsed},
+          {"entries", entries}
+        };
+        resp.body=my_json.dump();
+        resp.headers["Content-Type"] = "application/json";
+      }
       else if(command=="ebpfblocklist") {
         Json::object obj;
 #ifdef HAVE_EBPF
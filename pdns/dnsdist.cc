@@ -21,6 +21,8 @@
  */
 #include "dnsdist.hh"
 #include "dnsdist-ecs.hh"
+#include "dnsdist-mmsg.hh"
+#include "dnsdist-rulechain.hh"
 #include "sstuff.hh"
 #include "misc.hh"
 #include <netinet/tcp.h>
@@ -70,7 +72,6 @@ using std::thread;
 bool g_verbose;
 
 struct DNSDistStats g_stats;
-uint16_t g_maxOutstanding{10240};
 bool g_console;
 bool g_verboseHealthChecks{false};
 uint32_t g_staleCacheEntriesTTL{0};
@@ -78,7 +79,7 @@ bool g_syslog{true};
 
 GlobalStateHolder<NetmaskGroup> g_ACL;
 string g_outputBuffer;
-vector<std::tuple<ComboAddress, bool, bool, int>> g_locals;
+vector<std::tuple<ComboAddress, bool, bool, int, int>> g_locals;
 #ifdef HAVE_DNSCRYPT
 std::vector<std::tuple<ComboAddress,DnsCryptContext,bool, int>> g_dnsCryptLocals;
 #endif
@@ -125,6 +126,7 @@ GlobalStateHolder<pools_t> g_pools;
 GlobalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > > > g_rulactions;
 GlobalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSResponseAction> > > > g_resprulactions;
 Rings g_rings;
+InFlightQueries g_inFlightQueries;
 QueryCount g_qcount;
 
 GlobalStateHolder<servers_t> g_dstates;
@@ -136,6 +138,10 @@ int g_tcpSendTimeout{2};
 
 bool g_truncateTC{1};
 bool g_fixupCase{0};
+
+/* largest UDP query we accept */
+static const size_t s_udpIncomingBufferSize{1500};
+
 static void truncateTC(const char* packet, uint16_t* len)
 try
 {
@@ -186,6 +192,31 @@ static void doLatencyAverages(double udiff)
   doAvg(g_stats.latencyAvg1000000, udiff, 1000000);
 }
 
+/* compare the first question of the response, on the wire, with the wire
+   representation of the query we sent, without allocating. Label lengths are
+   lower than 'A', so comparing each byte case-insensitively is enough. */
+static bool responseQuestionMatches(const char* response, const uint16_t responseLen, const DNSName& qname, const uint16_t qtype, const uint16_t qclass)
+{
+  const auto& storage = qname.getStorage();
+  const size_t nameLen = storage.size();
+
+  if (nameLen == 0 || responseLen < (sizeof(dnsheader) + nameLen + DNS_TYPE_SIZE + DNS_CLASS_SIZE)) {
+    return false;
+  }
+
+  const char* wire = response + sizeof(dnsheader);
+  for (size_t idx = 0; idx < nameLen; idx++) {
+    if (dns2_tolower(wire[idx]) != dns2_tolower(storage[idx])) {
+      return false;
+    }
+  }
+
+  const unsigned char* typeAndClass = reinterpret_cast<const unsigned char*>(wire + nameLen);
+  const uint16_t rqtype = (typeAndClass[0] << 8) | typeAndClass[1];
+  const uint16_t rqclass = (typeAndClass[2] << 8) | typeAndClass[3];
+  return rqtype == qtype && rqclass == qclass;
+}
+
 bool responseContentMatches(const char* response, const uint16_t responseLen, const DNSName& qname, const uint16_t qtype, const uint16_t qclass, const ComboAddress& remote)
 {
   uint16_t rqtype, rqclass;
@@ -197,6 +228,11 @@ bool responseContentMatches(const char* response, const uint16_t responseLen, co
     return false;
   }
 
+  if (ntohs(dh->qdcount) > 0 && responseQuestionMatches(response, responseLen, qname, qtype, qclass)) {
+    return true;
+  }
+
+  /* not the same question, or a compressed one: parse it to know which */
   try {
     rqname=DNSName(response, responseLen, sizeof(dnsheader), false, &rqtype, &rqclass, &consumed);
   }
@@ -237,9 +273,9 @@ bool fixUpResponse(char** response, uint16_t* responseLen, size_t* responseSize,
   }
 
   if(g_fixupCase) {
-    string realname = qname.toDNSString();
+    const auto& realname = qname.getStorage();
     if (*responseLen >= (sizeof(dnsheader) + realname.length())) {
-      memcpy(*response + sizeof(dnsheader), realname.c_str(), realname.length());
+      memcpy(*response + sizeof(dnsheader), realname.data(), realname.length());
     }
   }
 
@@ -256,15 +292,9 @@ bool fixUpResponse(char** response, uint16_t* responseLen, size_t* responseSize,
       if (ednsAdded) {
         /* we added the entire OPT RR,
            therefore we need to remove it entirely */
-        if (last) {
-          /* simply remove the last AR */
-          *responseLen -= optLen;
-          uint16_t arcount = ntohs(dh->arcount);
-          arcount--;
-          dh->arcount = htons(arcount);
-        }
-        else {
-          /* Removing an intermediary RR could lead to compression error */
+        res = removeEDNSOptRRInPlace(*response, responseLen, optStart, optLen);
+        if (res == ENOTSUP) {
+          /* moving the records after the OPT RR could lead to compression error */
           if (rewriteResponseWithoutEDNS(*response, *responseLen, rewrittenResponse) == 0) {
             *responseLen = rewrittenResponse.size();
             if (addRoom && (UINT16_MAX - *responseLen) > addRoom) {
@@ -281,15 +311,9 @@ bool fixUpResponse(char** response, uint16_t* responseLen, size_t* responseSize,
       else {
         /* the OPT RR was already present, but without ECS,
            we need to remove the ECS option if any */
-        if (last) {
-          /* nothing after the OPT RR, we can simply remove the
-             ECS option */
-          size_t existingOptLen = optLen;
-          removeEDNSOptionFromOPT(optStart, &optLen, EDNSOptionCode::ECS);
-          *responseLen -= (existingOptLen - optLen);
-        }
-        else {
-          /* Removing an intermediary RR could lead to compression error */
+        res = removeEDNSOptionInPlace(*response, responseLen, optStart, optLen, EDNSOptionCode::ECS);
+        if (res == ENOTSUP) {
+          /* moving the records after the OPT RR could lead to compression error */
           if (rewriteResponseWithoutEDNSOption(*response, *responseLen, EDNSOptionCode::ECS, rewrittenResponse) == 0) {
             *responseLen = rewrittenResponse.size();
             if (addRoom && (UINT16_MAX - *responseLen) > addRoom) {
@@ -351,8 +375,77 @@ static bool sendUDPResponse(int origFD, char* response, uint16_t responseLen, in
 }
 
 // listens on a dedicated socket, lobs answers from downstream servers to original requestors
-void* responderThread(std::shared_ptr<DownstreamState> state)
+/* send a copy of the response to every query that was waiting for it, with its own ID, flags and qname case */
+static void sendResponseToInFlightWaiters(std::vector<InFlightWaiter>& waiters, const char* response, uint16_t responseLen, uint16_t qtype, const DownstreamState& state, unsigned int udiff)
+{
+  vector<uint8_t> waiterResponse;
+
+  for (auto& waiter : waiters) {
+    size_t waiterResponseSize = responseLen;
+#ifdef HAVE_DNSCRYPT
+    if (waiter.dnsCryptQuery) {
+      waiterResponseSize += DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE;
+    }
+#endif
+    waiterResponse.resize(waiterResponseSize);
+    memcpy(waiterResponse.data(), response, responseLen);
+    uint16_t waiterResponseLen = responseLen;
+
+    struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(waiterResponse.data());
+    dh->id = waiter.origID;
+    restoreFlags(dh, waiter.origFlags);
+
+    /* the qnames only differ by their case, so they have the same length */
+    const auto& wireQName = waiter.qname.getStorage();
+    if (responseLen >= sizeof(dnsheader) + wireQName.size()) {
+      memcpy(waiterResponse.data() + sizeof(dnsheader), wireQName.data(), wireQName.size());
+    }
+
+#ifdef HAVE_DNSCRYPT
+    if (!encryptResponse(reinterpret_cast<char*>(waiterResponse.data()), &waiterResponseLen, waiterResponseSize, false, waiter.dnsCryptQuery)) {
+      continue;
+    }
+#endif
+    ComboAddress empty;
+    empty.sin4.sin_family = 0;
+    sendUDPResponse(waiter.origFD, reinterpret_cast<char*>(waiterResponse.data()), waiterResponseLen, waiter.delayMsec, waiter.destHarvested ? waiter.origDest : empty, waiter.origRemote);
+
+    g_stats.responses++;
+
+    struct timespec ts;
+    gettime(&ts);
+    g_rings.insertResponse(ts, waiter.origRemote, waiter.qname, qtype, udiff, responseLen, *dh, state.remote);
+  }
+}
+
+/* The leader 'ids' will not get a usable response, so remove its in-flight entry right away, instead of queuing
+   new identical queries behind it until it times out. The queries already waiting are answered with a ServFail
+   so they can retry, or dropped when the leader's response has been dropped on purpose. */
+static void releaseInFlightWaiters(IDState& ids, const DownstreamState& state, bool servFail)
+{
+  if (ids.inFlightLeaderId == 0) {
+    return;
+  }
+
+  /* a more recent leader might have replaced this one after a timeout, and should not be released */
+  auto waiters = g_inFlightQueries.release(ids.packetCache.get(), ids.cacheKey, ids.qname, ids.qtype, ids.qclass, ids.inFlightLeaderId);
+  ids.inFlightLeaderId = 0;
+  if (waiters.empty() || !servFail) {
+    return;
+  }
+
+  vector<uint8_t> response;
+  DNSPacketWriter pw(response, ids.qname, ids.qtype, ids.qclass);
+  pw.getHeader()->qr = 1;
+  pw.getHeader()->rcode = RCode::ServFail;
+  sendResponseToInFlightWaiters(waiters, reinterpret_cast<const char*>(response.data()), response.size(), ids.qtype, state, (unsigned int) ids.sentTime.udiff());
+}
+
+void* responderThread(std::shared_ptr<DownstreamState> state, size_t socketIdx)
 {
+  const int fd = state->sockets.at(socketIdx);
+  const size_t idsPerSocket = state->idStates.size() / state->sockets.size();
+  IDState* const socketIDStates = &state->idStates.at(socketIdx * idsPerSocket);
   auto localRespRulactions = g_resprulactions.getLocal();
 #ifdef HAVE_DNSCRYPT
   char packet[4096 + DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE];
@@ -364,7 +457,7 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
 
   struct dnsheader* dh = (struct dnsheader*)packet;
   for(;;) {
-    ssize_t got = recv(state->fd, packet, sizeof(packet), 0);
+    ssize_t got = recv(fd, packet, sizeof(packet), 0);
     char * response = packet;
     size_t responseSize = sizeof(packet);
 
@@ -373,10 +466,10 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
 
     uint16_t responseLen = (uint16_t) got;
 
-    if(dh->id >= state->idStates.size())
+    if(dh->id >= idsPerSocket)
       continue;
 
-    IDState* ids = &state->idStates[dh->id];
+    IDState* ids = &socketIDStates[dh->id];
     int origFD = ids->origFD;
 
     if(origFD < 0) // duplicate
@@ -389,6 +482,8 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
     */
     ids->age = 0;
 
+    /* a late or spoofed response does not tell us anything about the one we are still waiting for,
+       so the coalesced queries keep waiting for it */
     if (!responseContentMatches(response, responseLen, ids->qname, ids->qtype, ids->qclass, state->remote)) {
       continue;
     }
@@ -407,6 +502,7 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
     dr.uniqueId = ids->uniqueId;
 #endif
     if (!processResponse(localRespRulactions, dr, &ids->delayMsec)) {
+      releaseInFlightWaiters(*ids, *state, false);
       continue;
     }
 
@@ -415,26 +511,47 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
       addRoom = DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE;
     }
 #endif
+    /* the scope has to be read before fixUpResponse removes the ECS option, no option meaning a scope of 0 */
+    uint8_t ecsScopeBits = 0;
+    if (ids->ecsScoped) {
+      getECSScopeFromResponse(response, responseLen, &ecsScopeBits);
+      ecsScopeBits = std::min(ecsScopeBits, ids->ecsSourceBits);
+    }
+
     if (!fixUpResponse(&response, &responseLen, &responseSize, ids->qname, ids->origFlags, ids->ednsAdded, ids->ecsAdded, rewrittenResponse, addRoom)) {
+      releaseInFlightWaiters(*ids, *state, true);
       continue;
     }
 
     if (ids->packetCache && !ids->skipCache) {
-      ids->packetCache->insert(ids->cacheKey, ids->qname, ids->qtype, ids->qclass, response, responseLen, false, dh->rcode == RCode::ServFail);
+      const Netmask ecsScope(ids->origRemote, ecsScopeBits);
+      ids->packetCache->insert(ids->cacheKey, ids->qname, ids->qtype, ids->qclass, response, responseLen, false, dh->rcode == RCode::ServFail, ids->ecsScoped ? &ecsScope : nullptr);
+
+      if (ids->inFlightLeaderId != 0) {
+        /* before the response is encrypted for the leader */
+        auto waiters = g_inFlightQueries.release(ids->packetCache.get(), ids->cacheKey, ids->qname, ids->qtype, ids->qclass);
+        ids->inFlightLeaderId = 0;
+        if (!waiters.empty()) {
+          sendResponseToInFlightWaiters(waiters, response, responseLen, ids->qtype, *state, (unsigned int) ids->sentTime.udiff());
+        }
+      }
     }
 
+    /* the client has already been answered from the cache if this was only a refresh */
+    if (!ids->cacheRefresh) {
 #ifdef HAVE_DNSCRYPT
-    if (!encryptResponse(response, &responseLen, responseSize, false, ids->dnsCryptQuery)) {
-      continue;
-    }
+      if (!encryptResponse(response, &responseLen, responseSize, false, ids->dnsCryptQuery)) {
+        continue;
+      }
 #endif
-    ComboAddress empty;
-    empty.sin4.sin_family = 0;
-    /* if ids->destHarvested is false, origDest holds the listening address.
-       We don't want to use that as a source since it could be 0.0.0.0 for example. */
-    sendUDPResponse(origFD, response, responseLen, ids->delayMsec, ids->destHarvested ? ids->origDest : empty, ids->origRemote);
+      ComboAddress empty;
+      empty.sin4.sin_family = 0;
+      /* if ids->destHarvested is false, origDest holds the listening address.
+         We don't want to use that as a source since it could be 0.0.0.0 for example. */
+      sendUDPResponse(origFD, response, responseLen, ids->delayMsec, ids->destHarvested ? ids->origDest : empty, ids->origRemote);
 
-    g_stats.responses++;
+      g_stats.responses++;
+    }
 
     double udiff = ids->sentTime.udiff();
     vinfolog("Got answer from %s, relayed to %s, took %f usec", state->remote.toStringWithPort(), ids->origRemote.toStringWithPort(), udiff);
@@ -442,8 +559,7 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
     {
       struct timespec ts;
       gettime(&ts);
-      std::lock_guard<std::mutex> lock(g_rings.respMutex);
-      g_rings.respRing.push_back({ts, ids->origRemote, ids->qname, ids->qtype, (unsigned int)udiff, (unsigned int)got, *dh, state->remote});
+      g_rings.insertResponse(ts, ids->origRemote, ids->qname, ids->qtype, (unsigned int)udiff, (unsigned int)got, *dh, state->remote);
     }
     if(dh->rcode == RCode::ServFail)
       g_stats.servfailResponses++;
@@ -470,18 +586,10 @@ void* responderThread(std::shared_ptr<DownstreamState> state)
   return 0;
 }
 
-DownstreamState::DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf_): remote(remote_), sourceAddr(sourceAddr_), sourceItf(sourceItf_)
+void startResponderThreads(std::shared_ptr<DownstreamState> state)
 {
-  if (!IsAnyAddress(remote)) {
-    fd = SSocket(remote.sin4.sin_family, SOCK_DGRAM, 0);
-    if (!IsAnyAddress(sourceAddr)) {
-      SSetsockopt(fd, SOL_SOCKET, SO_REUSEADDR, 1);
-      SBind(fd, sourceAddr);
-    }
-    SConnect(fd, remote);
-    idStates.resize(g_maxOutstanding);
-    sw.start();
-    infolog("Added downstream server %s", remote.toStringWithPort());
+  for (size_t idx = 0; idx < state->sockets.size(); idx++) {
+    state->threads.push_back(thread(responderThread, state, idx));
   }
 }
 
@@ -490,93 +598,6 @@ LuaContext g_lua;
 
 GlobalStateHolder<ServerPolicy> g_policy;
 
-shared_ptr<DownstreamState> firstAvailable(const NumberedServerVector& servers, const DNSQuestion* dq)
-{
-  for(auto& d : servers) {
-    if(d.second->isUp() && d.second->qps.check())
-      return d.second;
-  }
-  return leastOutstanding(servers, dq);
-}
-
-// get server with least outstanding queries, and within those, with the lowest order, and within those: the fastest
-shared_ptr<DownstreamState> leastOutstanding(const NumberedServerVector& servers, const DNSQuestion* dq)
-{
-  if (servers.size() == 1 && servers[0].second->isUp()) {
-    return servers[0].second;
-  }
-
-  vector<pair<tuple<int,int,double>, shared_ptr<DownstreamState>>> poss;
-  /* so you might wonder, why do we go through this trouble? The data on which we sort could change during the sort,
-     which would suck royally and could even lead to crashes. So first we snapshot on what we sort, and then we sort */
-  poss.reserve(servers.size());
-  for(auto& d : servers) {
-    if(d.second->isUp()) {
-      poss.push_back({make_tuple(d.second->outstanding.load(), d.second->order, d.second->latencyUsec), d.second});
-    }
-  }
-  if(poss.empty())
-    return shared_ptr<DownstreamState>();
-  nth_element(poss.begin(), poss.begin(), poss.end(), [](const decltype(poss)::value_type& a, const decltype(poss)::value_type& b) { return a.first < b.first; });
-  return poss.begin()->second;
-}
-
-shared_ptr<DownstreamState> valrandom(unsigned int val, const NumberedServerVector& servers, const DNSQuestion* dq)
-{
-  vector<pair<int, shared_ptr<DownstreamState>>> poss;
-  int sum=0;
-  for(auto& d : servers) {      // w=1, w=10 -> 1, 11
-    if(d.second->isUp()) {
-      sum+=d.second->weight;
-      poss.push_back({sum, d.second});
-    }
-  }
-
-  // Catch poss & sum are empty to avoid SIGFPE
-  if(poss.empty())
-    return shared_ptr<DownstreamState>();
-
-  int r = val % sum;
-  auto p = upper_bound(poss.begin(), poss.end(),r, [](int r, const decltype(poss)::value_type& a) { return  r < a.first;});
-  if(p==poss.end())
-    return shared_ptr<DownstreamState>();
-  return p->second;
-}
-
-shared_ptr<DownstreamState> wrandom(const NumberedServerVector& servers, const DNSQuestion* dq)
-{
-  return valrandom(random(), servers, dq);
-}
-
-static uint32_t g_hashperturb;
-shared_ptr<DownstreamState> whashed(const NumberedServerVector& servers, const DNSQuestion* dq)
-{
-  return valrandom(dq->qname->hash(g_hashperturb), servers, dq);
-}
-
-
-shared_ptr<DownstreamState> roundrobin(const NumberedServerVector& servers, const DNSQuestion* dq)
-{
-  NumberedServerVector poss;
-
-  for(auto& d : servers) {
-    if(d.second->isUp()) {
-      poss.push_back(d);
-    }
-  }
-
-  const auto *res=&poss;
-  if(poss.empty())
-    res = &servers;
-
-  if(res->empty())
-    return shared_ptr<DownstreamState>();
-
-  static unsigned int counter;
- 
-  return (*res)[(counter++) % res->size()].second;
-}
-
 static void writepid(string pidfile) {
   if (!pidfile.empty()) {
     // Clean up possible stale file
@@ -614,90 +635,6 @@ static void daemonize(void)
 
 ComboAddress g_serverControl{"127.0.0.1:5199"};
 
-std::shared_ptr<ServerPool> createPoolIfNotExists(pools_t& pools, const string& poolName)
-{
-  std::shared_ptr<ServerPool> pool;
-  pools_t::iterator it = pools.find(poolName);
-  if (it != pools.end()) {
-    pool = it->second;
-  }
-  else {
-    if (!poolName.empty())
-      vinfolog("Creating pool %s", poolName);
-    pool = std::make_shared<ServerPool>();
-    pools.insert(std::pair<std::string,std::shared_ptr<ServerPool> >(poolName, pool));
-  }
-  return pool;
-}
-
-void addServerToPool(pools_t& pools, const string& poolName, std::shared_ptr<DownstreamState> server)
-{
-  std::shared_ptr<ServerPool> pool = createPoolIfNotExists(pools, poolName);
-  unsigned int count = (unsigned int) pool->servers.size();
-  if (!poolName.empty()) {
-    vinfolog("Adding server to pool %s", poolName);
-  } else {
-    vinfolog("Adding server to default pool");
-  }
-  pool->servers.push_back(make_pair(++count, server));
-  /* we need to reorder based on the server 'order' */
-  std::stable_sort(pool->servers.begin(), pool->servers.end(), [](const std::pair<unsigned int,std::shared_ptr<DownstreamState> >& a, const std::pair<unsigned int,std::shared_ptr<DownstreamState> >& b) {
-      return a.second->order < b.second->order;
-    });
-  /* and now we need to renumber for Lua (custom policies) */
-  size_t idx = 1;
-  for (auto& server : pool->servers) {
-    server.first = idx++;
-  }
-}
-
-void removeServerFromPool(pools_t& pools, const string& poolName, std::shared_ptr<DownstreamState> server)
-{
-  std::shared_ptr<ServerPool> pool = getPool(pools, poolName);
-
-  if (!poolName.empty()) {
-    vinfolog("Removing server from pool %s", poolName);
-  }
-  else {
-    vinfolog("Removing server from default pool");
-  }
-
-  size_t idx = 1;
-  bool found = false;
-  for (NumberedVector<shared_ptr<DownstreamState> >::iterator it = pool->servers.begin(); it != pool->servers.end();) {
-    if (found) {
-      /* we need to renumber the servers placed
-         after the removed one, for Lua (custom policies) */
-      it->first = idx++;
-      it++;
-    }
-    else if (it->second == server) {
-      it = pool->servers.erase(it);
-      found = true;
-    } else {
-      idx++;
-      it++;
-    }
-  }
-}
-
-std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName)
-{
-  pools_t::const_iterator it = pools.find(poolName);
-
-  if (it == pools.end()) {
-    throw std::out_of_range("No pool named " + poolName);
-  }
-
-  return it->second;
-}
-
-const NumberedServerVector& getDownstreamCandidates(const pools_t& pools, const std::string& poolName)
-{
-  std::shared_ptr<ServerPool> pool = getPool(pools, poolName);
-  return pool->servers;
-}
-
 // goal in life - if you send us a reasonably normal packet, we'll get Z for you, otherwise 0
 int getEDNSZ(const char* packet, unsigned int len)
 try
@@ -749,10 +686,7 @@ bool processQuery(LocalStateHolder<NetmaskTree<DynBlock> >& localDynNMGBlock,
                   LocalStateHolder<SuffixMatchTree<DynBlock> >& localDynSMTBlock,
                   LocalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > > >& localRulactions, blockfilter_t blockFilter, DNSQuestion& dq, string& poolname, int* delayMsec, const struct timespec& now)
 {
-  {
-    WriteLock wl(&g_rings.queryLock);
-    g_rings.queryRing.push_back({now,*dq.remote,*dq.qname,dq.len,dq.qtype,*dq.dh});
-  }
+  g_rings.insertQuery(now, *dq.remote, *dq.qname, dq.qtype, dq.len, *dq.dh);
 
   if(g_qcount.enabled) {
     string qname = (*dq.qname).toString(".");
@@ -816,41 +750,43 @@ bool processQuery(LocalStateHolder<NetmaskTree<DynBlock> >& localDynNMGBlock,
 
   DNSAction::Action action=DNSAction::Action::None;
   string ruleresult;
-  for(const auto& lr : *localRulactions) {
-    if(lr.first->matches(&dq)) {
+  bool result = true;
+  const auto compiledRules = getCompiledRuleChain(localRulactions);
+  compiledRules->forEachMatchingRule(dq, [&](const CompiledRuleChain::rulaction_t& lr) -> bool {
       lr.first->d_matches++;
       action=(*lr.second)(&dq, &ruleresult);
 
       switch(action) {
       case DNSAction::Action::Allow:
-        return true;
+        return false;
         break;
       case DNSAction::Action::Drop:
         g_stats.ruleDrop++;
+        result = false;
         return false;
         break;
       case DNSAction::Action::Nxdomain:
         dq.dh->rcode = RCode::NXDomain;
         dq.dh->qr=true;
         g_stats.ruleNXDomain++;
-        return true;
+        return false;
         break;
       case DNSAction::Action::Refused:
         dq.dh->rcode = RCode::Refused;
         dq.dh->qr=true;
         g_stats.ruleRefused++;
-        return true;
+        return false;
         break;
       case DNSAction::Action::Spoof:
         spoofResponseFromString(dq, ruleresult);
-        return true;
+        return false;
         break;
       case DNSAction::Action::HeaderModify:
-        return true;
+        return false;
         break;
       case DNSAction::Action::Pool:
         poolname=ruleresult;
-        return true;
+        return false;
         break;
         /* non-terminal actions follow */
       case DNSAction::Action::Delay:
@@ -859,10 +795,10 @@ bool processQuery(LocalStateHolder<NetmaskTree<DynBlock> >& localDynNMGBlock,
       case DNSAction::Action::None:
         break;
       }
-    }
-  }
+      return true;
+    });
 
-  return true;
+  return result;
 }
 
 bool processResponse(LocalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSResponseAction> > > >& localRespRulactions, DNSResponse& dr, int* delayMsec)
@@ -910,258 +846,382 @@ static ssize_t udpClientSendRequestToBackend(DownstreamState* ss, const int sd,
   return sendmsg(sd, &msgh, 0);
 }
 
-// listens to incoming queries, sends out to downstream servers, noting the intended return path 
-static void* udpClientThread(ClientState* cs)
-try
+/* the Lua state holders used by a UDP client thread */
+struct LocalHolders
 {
-  ComboAddress remote;
-  remote.sin4.sin_family = cs->local.sin4.sin_family;
-  char packet[1500];
-  string largerQuery;
-  uint16_t qtype, qclass;
+  LocalHolders(): acl(g_ACL.getLocal()), policy(g_policy.getLocal()), rulactions(g_rulactions.getLocal()), servers(g_dstates.getLocal()), dynNMGBlock(g_dynblockNMG.getLocal()), dynSMTBlock(g_dynblockSMT.getLocal()), pools(g_pools.getLocal())
+  {
+  }
+
+  LocalStateHolder<NetmaskGroup> acl;
+  LocalStateHolder<ServerPolicy> policy;
+  LocalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > > > rulactions;
+  LocalStateHolder<servers_t> servers;
+  LocalStateHolder<NetmaskTree<DynBlock> > dynNMGBlock;
+  LocalStateHolder<SuffixMatchTree<DynBlock> > dynSMTBlock;
+  LocalStateHolder<pools_t> pools;
+  blockfilter_t blockFilter{0};
 #ifdef HAVE_PROTOBUF
   boost::uuids::random_generator uuidGenerator;
 #endif
+};
 
-  blockfilter_t blockFilter = 0;
-  {
-    std::lock_guard<std::mutex> lock(g_luamutex);
-    auto candidate = g_lua.readVariable<boost::optional<blockfilter_t> >("blockFilter");
-    if(candidate)
-      blockFilter = *candidate;
-  }
-  auto acl = g_ACL.getLocal();
-  auto localPolicy = g_policy.getLocal();
-  auto localRulactions = g_rulactions.getLocal();
-  auto localServers = g_dstates.getLocal();
-  auto localDynNMGBlock = g_dynblockNMG.getLocal();
-  auto localDynSMTBlock = g_dynblockSMT.getLocal();
-  auto localPools = g_pools.getLocal();
-  struct msghdr msgh;
-  struct iovec iov;
+/* if batch is not null, immediate responses (self-answered and cache hits) are queued there
+   to be sent later in a single sendmmsg() call instead of being sent right away, in which case they
+   need to be written to a buffer that outlives this call, hence responseBuffer */
+static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct msghdr* msgh, const ComboAddress& remote, ComboAddress& dest, char* query, uint16_t len, size_t queryBufferSize, char* responseBuffer, size_t responseBufferSize, UDPMessagesBatch* batch, size_t batchIdx)
+{
   uint16_t queryId = 0;
-  /* used by HarvestDestinationAddress */
-  char cbuf[256];
-  remote.sin6.sin6_family=cs->local.sin6.sin6_family;
-  fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), packet, sizeof(packet), &remote);
 
-  for(;;) {
-    try {
+  try {
 #ifdef HAVE_DNSCRYPT
-      std::shared_ptr<DnsCryptQuery> dnsCryptQuery = 0;
+    std::shared_ptr<DnsCryptQuery> dnsCryptQuery = 0;
 #endif
-      char* query = packet;
-      ssize_t ret = recvmsg(cs->udpFD, &msgh, 0);
-      queryId = 0;
-
-      if(!acl->match(remote)) {
-	vinfolog("Query from %s dropped because of ACL", remote.toStringWithPort());
-	g_stats.aclDrops++;
-	continue;
-      }
+    uint16_t qtype, qclass;
 
-      cs->queries++;
-      g_stats.queries++;
+    if(!holders.acl->match(remote)) {
+      vinfolog("Query from %s dropped because of ACL", remote.toStringWithPort());
+      g_stats.aclDrops++;
+      return;
+    }
 
-      if(ret < (int)sizeof(struct dnsheader)) {
-	g_stats.nonCompliantQueries++;
-	continue;
-      }
+    cs.queries++;
+    g_stats.queries++;
 
-      if (msgh.msg_flags & MSG_TRUNC) {
-        /* message was too large for our buffer */
-        vinfolog("Dropping message too large for our buffer");
-        g_stats.nonCompliantQueries++;
-        continue;
-      }
+    if(len < sizeof(struct dnsheader)) {
+      g_stats.nonCompliantQueries++;
+      return;
+    }
 
-      uint16_t len = (uint16_t) ret;
-      ComboAddress dest;
-      if (!HarvestDestinationAddress(&msgh, &dest)) {
-        dest.sin4.sin_family = 0;
-      }
+    if (msgh->msg_flags & MSG_TRUNC) {
+      /* message was too large for our buffer */
+      vinfolog("Dropping message too large for our buffer");
+      g_stats.nonCompliantQueries++;
+      return;
+    }
+
+    if (!HarvestDestinationAddress(const_cast<struct msghdr*>(msgh), &dest)) {
+      dest.sin4.sin_family = 0;
+    }
 
 #ifdef HAVE_DNSCRYPT
-      if (cs->dnscryptCtx) {
-        vector<uint8_t> response;
-        uint16_t decryptedQueryLen = 0;
-        dnsCryptQuery = std::make_shared<DnsCryptQuery>();
+    if (cs.dnscryptCtx) {
+      vector<uint8_t> response;
+      uint16_t decryptedQueryLen = 0;
+      dnsCryptQuery = std::make_shared<DnsCryptQuery>();
 
-        bool decrypted = handleDnsCryptQuery(cs->dnscryptCtx, query, len, dnsCryptQuery, &decryptedQueryLen, false, response);
+      bool decrypted = handleDnsCryptQuery(cs.dnscryptCtx, query, len, dnsCryptQuery, &decryptedQueryLen, false, response);
 
-        if (!decrypted) {
-          if (response.size() > 0) {
-            sendUDPResponse(cs->udpFD, reinterpret_cast<char*>(response.data()), (uint16_t) response.size(), 0, dest, remote);
-          }
-          continue;
+      if (!decrypted) {
+        if (response.size() > 0) {
+          sendUDPResponse(cs.udpFD, reinterpret_cast<char*>(response.data()), (uint16_t) response.size(), 0, dest, remote);
         }
-        len = decryptedQueryLen;
+        return;
       }
+      len = decryptedQueryLen;
+    }
 #endif
 
-      struct dnsheader* dh = (struct dnsheader*) query;
-      queryId = ntohs(dh->id);
+    struct dnsheader* dh = (struct dnsheader*) query;
+    queryId = ntohs(dh->id);
 
-      if(dh->qr) {   // don't respond to responses
-	g_stats.nonCompliantQueries++;
-	continue;
-      }
+    if(dh->qr) {   // don't respond to responses
+      g_stats.nonCompliantQueries++;
+      return;
+    }
 
-      if(dh->qdcount == 0) {
-        g_stats.emptyQueries++;
-        continue;
-      }
+    if(dh->qdcount == 0) {
+      g_stats.emptyQueries++;
+      return;
+    }
 
-      if (dh->rd) {
-        g_stats.rdQueries++;
-      }
+    if (dh->rd) {
+      g_stats.rdQueries++;
+    }
 
-      const uint16_t * flags = getFlagsFromDNSHeader(dh);
-      const uint16_t origFlags = *flags;
-      unsigned int consumed = 0;
-      DNSName qname(query, len, sizeof(dnsheader), false, &qtype, &qclass, &consumed);
-      DNSQuestion dq(&qname, qtype, qclass, dest.sin4.sin_family != 0 ? &dest : &cs->local, &remote, dh, sizeof(packet), len, false);
+    const uint16_t * flags = getFlagsFromDNSHeader(dh);
+    const uint16_t origFlags = *flags;
+    unsigned int consumed = 0;
+    DNSName qname(query, len, sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+    DNSQuestion dq(&qname, qtype, qclass, dest.sin4.sin_family != 0 ? &dest : &cs.local, &remote, dh, queryBufferSize, len, false);
 #ifdef HAVE_PROTOBUF
-      dq.uniqueId = uuidGenerator();
+    dq.uniqueId = holders.uuidGenerator();
 #endif
 
-      string poolname;
-      int delayMsec=0;
-      struct timespec now;
-      gettime(&now);
+    string poolname;
+    int delayMsec=0;
+    struct timespec now;
+    gettime(&now);
 
-      if (!processQuery(localDynNMGBlock, localDynSMTBlock, localRulactions, blockFilter, dq, poolname, &delayMsec, now))
-      {
-        continue;
-      }
+    if (!processQuery(holders.dynNMGBlock, holders.dynSMTBlock, holders.rulactions, holders.blockFilter, dq, poolname, &delayMsec, now))
+    {
+      return;
+    }
 
-      if(dq.dh->qr) { // something turned it into a response
-        char* response = query;
-        uint16_t responseLen = dq.len;
-        g_stats.selfAnswered++;
+    if(dq.dh->qr) { // something turned it into a response
+      char* response = query;
+      uint16_t responseLen = dq.len;
+      g_stats.selfAnswered++;
 
-        restoreFlags(dh, origFlags);
+      restoreFlags(dh, origFlags);
 
 #ifdef HAVE_DNSCRYPT
-        if (!encryptResponse(response, &responseLen, dq.size, false, dnsCryptQuery)) {
-          continue;
-        }
+      if (!encryptResponse(response, &responseLen, dq.size, false, dnsCryptQuery)) {
+        return;
+      }
 #endif
-        sendUDPResponse(cs->udpFD, response, responseLen, 0, dest, remote);
-        continue;
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+      if (batch != nullptr) {
+        batch->queueResponse(batchIdx, response, responseLen);
+        return;
       }
+#endif
+      sendUDPResponse(cs.udpFD, response, responseLen, 0, dest, remote);
+      return;
+    }
 
-      DownstreamState* ss = nullptr;
-      std::shared_ptr<ServerPool> serverPool = getPool(*localPools, poolname);
-      std::shared_ptr<DNSDistPacketCache> packetCache = nullptr;
-      auto policy=localPolicy->policy;
-      {
-	std::lock_guard<std::mutex> lock(g_luamutex);
-	ss = policy(serverPool->servers, &dq).get();
-	packetCache = serverPool->packetCache;
-      }
+    DownstreamState* ss = nullptr;
+    std::shared_ptr<ServerPool> serverPool = getPool(*holders.pools, poolname);
+    std::shared_ptr<DNSDistPacketCache> packetCache = nullptr;
+    const auto& policy = *holders.policy;
+    {
+      std::lock_guard<std::mutex> lock(g_luamutex);
+      ss = policy.getSelectedBackend(*serverPool, &dq).get();
+      packetCache = serverPool->packetCache;
+    }
 
-      bool ednsAdded = false;
-      bool ecsAdded = false;
-      if (dq.useECS && ss && ss->useECS) {
-        handleEDNSClientSubnet(query, dq.size, consumed, &dq.len, largerQuery, &(ednsAdded), &(ecsAdded), remote, dq.ecsOverride, dq.ecsPrefixLength);
+    bool ednsAdded = false;
+    bool ecsAdded = false;
+    const uint16_t lenBeforeECS = dq.len;
+    if (dq.useECS && ss && ss->useECS) {
+      /* the receive buffer has room for the ECS option after the largest query we accept */
+      if (!handleEDNSClientSubnet(query, dq.size, consumed, &dq.len, &(ednsAdded), &(ecsAdded), remote, dq.ecsOverride, dq.ecsPrefixLength)) {
+        vinfolog("Not enough room to add ECS to the query from %s", remote.toStringWithPort());
       }
+    }
 
-      uint32_t cacheKey = 0;
-      if (packetCache && !dq.skipCache) {
-        char cachedResponse[4096];
-        uint16_t cachedResponseSize = sizeof cachedResponse;
-        uint32_t allowExpired = ss ? 0 : g_staleCacheEntriesTTL;
-        if (packetCache->get(dq, consumed, dh->id, cachedResponse, &cachedResponseSize, &cacheKey, allowExpired)) {
+    uint32_t cacheKey = 0;
+    bool cacheRefresh = false;
+    /* when we added the ECS option ourselves, the response can be shared by the clients of the scope it returns */
+    const bool ecsScoped = packetCache && !dq.skipCache && packetCache->isECSScoping() && (ednsAdded || ecsAdded);
+    const Netmask ecsSource(remote, std::min(dq.ecsPrefixLength, static_cast<uint16_t>(remote.sin4.sin_family == AF_INET ? 32 : 128)));
+    if (packetCache && !dq.skipCache) {
+      char* cachedResponse = responseBuffer;
+      uint16_t cachedResponseSize = responseBufferSize;
+      uint32_t allowExpired = ss ? 0 : g_staleCacheEntriesTTL;
+      if (packetCache->get(dq, consumed, dh->id, cachedResponse, &cachedResponseSize, &cacheKey, allowExpired, false, ss ? &cacheRefresh : nullptr, ecsScoped ? &ecsSource : nullptr, lenBeforeECS)) {
 #ifdef HAVE_DNSCRYPT
-          if (!encryptResponse(cachedResponse, &cachedResponseSize, sizeof cachedResponse, false, dnsCryptQuery)) {
-            continue;
-          }
+        if (!encryptResponse(cachedResponse, &cachedResponseSize, responseBufferSize, false, dnsCryptQuery)) {
+          return;
+        }
+#endif
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+        if (batch != nullptr) {
+          batch->queueResponse(batchIdx, cachedResponse, cachedResponseSize);
+        }
+        else
 #endif
-          sendUDPResponse(cs->udpFD, cachedResponse, cachedResponseSize, 0, dest, remote);
-          g_stats.cacheHits++;
-          g_stats.latency0_1++;  // we're not going to measure this
-          doLatencyAverages(0);  // same
-          continue;
+        {
+          sendUDPResponse(cs.udpFD, cachedResponse, cachedResponseSize, 0, dest, remote);
         }
+        g_stats.cacheHits++;
+        g_stats.latency0_1++;  // we're not going to measure this
+        doLatencyAverages(0);  // same
+        if (!cacheRefresh) {
+          return;
+        }
+        /* the client has its answer, but we still send the query to refresh the cache entry */
+      }
+      else {
         g_stats.cacheMisses++;
       }
+    }
 
-      if(!ss) {
-	g_stats.noPolicy++;
-	continue;
-      }
+    if(!ss) {
+      g_stats.noPolicy++;
+      return;
+    }
 
-      ss->queries++;
+    uint64_t inFlightLeaderId = 0;
+    /* scoped queries from different clients might not get the same response */
+    if (packetCache && !dq.skipCache && !cacheRefresh && !ecsScoped && g_inFlightQueries.d_enabled) {
+      InFlightWaiter waiter;
+      waiter.qname = qname;
+      waiter.origRemote = remote;
+      waiter.origDest = dest.sin4.sin_family != 0 ? dest : cs.local;
+      waiter.destHarvested = dest.sin4.sin_family != 0;
+#ifdef HAVE_DNSCRYPT
+      waiter.dnsCryptQuery = dnsCryptQuery;
+#endif
+      waiter.origFD = cs.udpFD;
+      waiter.delayMsec = delayMsec;
+      waiter.origID = dh->id;
+      waiter.origFlags = origFlags;
+
+      auto status = g_inFlightQueries.add(packetCache.get(), cacheKey, qname, dq.qtype, dq.qclass, ednsAdded, ecsAdded, std::move(waiter), &inFlightLeaderId);
+      if (status == InFlightQueries::Status::Waiting) {
+        /* an identical query has already been sent, we will get its response */
+        g_stats.coalescedQueries++;
+        return;
+      }
+    }
 
-      unsigned int idOffset = (ss->idOffset++) % ss->idStates.size();
-      IDState* ids = &ss->idStates[idOffset];
-      ids->age = 0;
+    ss->queries++;
 
-      if(ids->origFD < 0) // if we are reusing, no change in outstanding
-        ss->outstanding++;
-      else {
-        ss->reuseds++;
-        g_stats.downstreamTimeouts++;
-      }
+    /* spread consecutive queries over the sockets, each socket
+       owning a contiguous range of idsPerSocket IDStates */
+    const size_t socketsCount = ss->sockets.size();
+    const size_t idsPerSocket = ss->idStates.size() / socketsCount;
+    const uint64_t counter = ss->idOffset++;
+    const size_t socketIdx = counter % socketsCount;
+    unsigned int idOffset = (counter / socketsCount) % idsPerSocket;
+    IDState* ids = &ss->idStates[socketIdx * idsPerSocket + idOffset];
+    ids->age = 0;
 
-      ids->origFD = cs->udpFD;
-      ids->origID = dh->id;
-      ids->origRemote = remote;
-      ids->sentTime.start();
-      ids->qname = qname;
-      ids->qtype = dq.qtype;
-      ids->qclass = dq.qclass;
-      ids->delayMsec = delayMsec;
-      ids->origFlags = origFlags;
-      ids->cacheKey = cacheKey;
-      ids->skipCache = dq.skipCache;
-      ids->packetCache = packetCache;
-      ids->ednsAdded = ednsAdded;
-      ids->ecsAdded = ecsAdded;
-
-      /* If we couldn't harvest the real dest addr, still
-         write down the listening addr since it will be useful
-         (especially if it's not an 'any' one).
-         We need to keep track of which one it is since we may
-         want to use the real but not the listening addr to reply.
-      */
-      if (dest.sin4.sin_family != 0) {
-        ids->origDest = dest;
-        ids->destHarvested = true;
-      }
-      else {
-        ids->origDest = cs->local;
-        ids->destHarvested = false;
-      }
+    if(ids->origFD < 0) // if we are reusing, no change in outstanding
+      ss->outstanding++;
+    else {
+      ss->reuseds++;
+      g_stats.downstreamTimeouts++;
+    }
+    /* the previous query sent with this state will not be answered, nor will the queries waiting for it */
+    releaseInFlightWaiters(*ids, *ss, true);
+
+    ids->origFD = cs.udpFD;
+    ids->origID = dh->id;
+    ids->origRemote = remote;
+    ids->sentTime.start();
+    ids->qname = qname;
+    ids->qtype = dq.qtype;
+    ids->qclass = dq.qclass;
+    ids->delayMsec = delayMsec;
+    ids->origFlags = origFlags;
+    ids->cacheKey = cacheKey;
+    ids->skipCache = dq.skipCache;
+    ids->cacheRefresh = cacheRefresh;
+    ids->inFlightLeaderId = inFlightLeaderId;
+    ids->ecsScoped = ecsScoped;
+    ids->ecsSourceBits = ecsSource.getBits();
+    ids->packetCache = packetCache;
+    ids->ednsAdded = ednsAdded;
+    ids->ecsAdded = ecsAdded;
+
+    /* If we couldn't harvest the real dest addr, still
+       write down the listening addr since it will be useful
+       (especially if it's not an 'any' one).
+       We need to keep track of which one it is since we may
+       want to use the real but not the listening addr to reply.
+    */
+    if (dest.sin4.sin_family != 0) {
+      ids->origDest = dest;
+      ids->destHarvested = true;
+    }
+    else {
+      ids->origDest = cs.local;
+      ids->destHarvested = false;
+    }
 #ifdef HAVE_DNSCRYPT
-      ids->dnsCryptQuery = dnsCryptQuery;
+    ids->dnsCryptQuery = cacheRefresh ? nullptr : dnsCryptQuery;
 #endif
 #ifdef HAVE_PROTOBUF
-      ids->uniqueId = dq.uniqueId;
+    ids->uniqueId = dq.uniqueId;
 #endif
 
-      dh->id = idOffset;
+    dh->id = idOffset;
 
-      if (largerQuery.empty()) {
-        ret = udpClientSendRequestToBackend(ss, ss->fd, query, dq.len);
-      }
-      else {
-        ret = udpClientSendRequestToBackend(ss, ss->fd, largerQuery.c_str(), largerQuery.size());
-        largerQuery.clear();
-      }
+    ssize_t ret = udpClientSendRequestToBackend(ss, ss->sockets[socketIdx], query, dq.len);
 
-      if(ret < 0) {
-	ss->sendErrors++;
-	g_stats.downstreamSendErrors++;
-      }
+    if(ret < 0) {
+      ss->sendErrors++;
+      g_stats.downstreamSendErrors++;
+      releaseInFlightWaiters(*ids, *ss, true);
+    }
 
-      vinfolog("Got query from %s, relayed to %s", remote.toStringWithPort(), ss->getName());
+    vinfolog("Got query from %s, relayed to %s", remote.toStringWithPort(), ss->getName());
+  }
+  catch(std::exception& e){
+    vinfolog("Got an error in UDP question thread while parsing a query from %s, id %d: %s", remote.toStringWithPort(), queryId, e.what());
+  }
+}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+static void MultipleMessagesUDPClientThread(ClientState* cs, LocalHolders& holders)
+{
+  /* room for the ECS option after the largest query we accept */
+#ifdef HAVE_DNSCRYPT
+  UDPMessagesBatch batch(cs->udpBatchSize, cs->local.sin4.sin_family, s_udpIncomingBufferSize, s_udpIncomingBufferSize + s_EDNSClientSubnetRoom, 4096 + DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE);
+#else
+  UDPMessagesBatch batch(cs->udpBatchSize, cs->local.sin4.sin_family, s_udpIncomingBufferSize, s_udpIncomingBufferSize + s_EDNSClientSubnetRoom, 4096);
+#endif
+
+  for(;;) {
+    /* block until at least one message is available, then get as many as we can without blocking */
+    int msgsGot = batch.receive(cs->udpFD);
+
+    if (msgsGot <= 0) {
+      vinfolog("Getting UDP messages via recvmmsg() failed with: %s", strerror(errno));
+      continue;
+    }
+
+    for (int msgIdx = 0; msgIdx < msgsGot; msgIdx++) {
+      processUDPQuery(*cs, holders, batch.getMessageHeader(msgIdx), batch.getRemote(msgIdx), batch.getDest(msgIdx), batch.getQuery(msgIdx), batch.getQueryLength(msgIdx), batch.getQueryBufferSize(), batch.getResponse(msgIdx), batch.getResponseBufferSize(), &batch, msgIdx);
     }
-    catch(std::exception& e){
-      vinfolog("Got an error in UDP question thread while parsing a query from %s, id %d: %s", remote.toStringWithPort(), queryId, e.what());
+
+    /* immediate (not delayed or forwarded) responses are sent in a single call */
+    const unsigned int msgsToSend = batch.getQueuedCount();
+    if (msgsToSend > 0) {
+      int sent = batch.sendQueued(cs->udpFD);
+
+      if (sent < 0 || static_cast<unsigned int>(sent) != msgsToSend) {
+        vinfolog("Error sending responses with sendmmsg() (%d on %u): %s", sent, msgsToSend, strerror(errno));
+      }
     }
   }
+}
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
+
+// listens to incoming queries, sends out to downstream servers, noting the intended return path 
+static void* udpClientThread(ClientState* cs)
+try
+{
+  LocalHolders holders;
+  {
+    std::lock_guard<std::mutex> lock(g_luamutex);
+    auto candidate = g_lua.readVariable<boost::optional<blockfilter_t> >("blockFilter");
+    if(candidate)
+      holders.blockFilter = *candidate;
+  }
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+  if (cs->udpBatchSize > 1) {
+    MultipleMessagesUDPClientThread(cs, holders);
+    return 0;
+  }
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
+
+  /* room for the ECS option after the largest query we accept */
+  char packet[s_udpIncomingBufferSize + s_EDNSClientSubnetRoom];
+  char cachedResponse[4096];
+  struct msghdr msgh;
+  struct iovec iov;
+  /* used by HarvestDestinationAddress */
+  char cbuf[256];
+  ComboAddress remote;
+  ComboAddress dest;
+  remote.sin4.sin_family = cs->local.sin4.sin_family;
+  fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), packet, s_udpIncomingBufferSize, &remote);
+
+  for(;;) {
+    ssize_t got = recvmsg(cs->udpFD, &msgh, 0);
+
+    if (got < 0) {
+      /* processUDPQuery() takes care of the other invalid sizes */
+      got = 0;
+    }
+
+    processUDPQuery(*cs, holders, &msgh, remote, dest, packet, static_cast<uint16_t>(got), sizeof(packet), cachedResponse, sizeof(cachedResponse), nullptr, 0);
+  }
+
   return 0;
 }
 catch(std::exception &e)
@@ -1302,6 +1362,10 @@ void* maintThread()
       }
     }
 
+    if (g_inFlightQueries.d_enabled) {
+      g_inFlightQueries.purgeExpired();
+    }
+
     counter++;
     if (counter >= g_cacheCleaningDelay) {
       const auto localPools = g_pools.getCopy();
@@ -1384,8 +1448,7 @@ void* healthChecksThread()
           memset(&fake, 0, sizeof(fake));
           fake.id = ids.origID;
 
-          std::lock_guard<std::mutex> lock(g_rings.respMutex);
-          g_rings.respRing.push_back({ts, ids.origRemote, ids.qname, ids.qtype, std::numeric_limits<unsigned int>::max(), 0, fake, dss->remote});
+          g_rings.insertResponse(ts, ids.origRemote, ids.qname, ids.qtype, std::numeric_limits<unsigned int>::max(), 0, fake, dss->remote);
         }          
       }
     }
@@ -1468,7 +1531,12 @@ static void checkFileDescriptorsLimits(size_t udpBindsCount, size_t tcpBindsCoun
 {
   /* stdin, stdout, stderr */
   size_t requiredFDsCount = 3;
-  size_t backendsCount = g_dstates.getCopy().size();
+  const auto backends = g_dstates.getCopy();
+  size_t backendsCount = backends.size();
+  size_t backendsUDPSocketsCount = 0;
+  for (const auto& backend : backends) {
+    backendsUDPSocketsCount += backend->sockets.size();
+  }
   /* listening sockets */
   requiredFDsCount += udpBindsCount;
   requiredFDsCount += tcpBindsCount;
@@ -1477,7 +1545,7 @@ static void checkFileDescriptorsLimits(size_t udpBindsCount, size_t tcpBindsCoun
   /* max pipes for communicatin between TCP acceptors and client threads */
   requiredFDsCount += (g_maxTCPClientThreads * 2);
   /* UDP sockets to backends */
-  requiredFDsCount += backendsCount;
+  requiredFDsCount += backendsUDPSocketsCount;
   /* TCP sockets to backends */
   requiredFDsCount += (backendsCount * g_maxTCPClientThreads);
   /* max TCP queued connections */
@@ -1737,11 +1805,11 @@ try
   if(g_cmdLine.locals.size()) {
     g_locals.clear();
     for(auto loc : g_cmdLine.locals)
-      g_locals.push_back(std::make_tuple(ComboAddress(loc, 53), true, false, 0));
+      g_locals.push_back(std::make_tuple(ComboAddress(loc, 53), true, false, 0, 0));
   }
   
   if(g_locals.empty())
-    g_locals.push_back(std::make_tuple(ComboAddress("127.0.0.1", 53), true, false, 0));
+    g_locals.push_back(std::make_tuple(ComboAddress("127.0.0.1", 53), true, false, 0, 0));
   
 
   g_configurationDone = true;
@@ -1751,6 +1819,13 @@ try
     ClientState* cs = new ClientState;
     cs->local= std::get<0>(local);
     cs->udpFD = SSocket(cs->local.sin4.sin_family, SOCK_DGRAM, 0);
+    if (std::get<4>(local) > 1) {
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+      cs->udpBatchSize = std::get<4>(local);
+#else
+      warnlog("Batched UDP processing has been configured on local address '%s' but recvmmsg() and sendmmsg() are not supported", std::get<0>(local).toStringWithPort());
+#endif
+    }
     if(cs->local.sin4.sin_family == AF_INET6) {
       SSetsockopt(cs->udpFD, IPPROTO_IPV6, IPV6_V6ONLY, 1);
     }
@@ -1958,7 +2033,7 @@ try
     for(const auto& address : g_cmdLine.remotes) {
       auto ret=std::make_shared<DownstreamState>(ComboAddress(address, 53));
       addServerToPool(localPools, "", ret);
-      ret->tid = move(thread(responderThread, ret));
+      startResponderThreads(ret);
       g_dstates.modify([ret](servers_t& servers) { servers.push_back(ret); });
     }
   }
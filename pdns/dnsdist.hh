@@ -35,6 +35,8 @@
 #include "sholder.hh"
 #include "dnscrypt.hh"
 #include "dnsdist-cache.hh"
+#include "dnsdist-heavyhitters.hh"
+#include "dnsdist-inflight.hh"
 #include "gettime.hh"
 #include "dnsdist-dynbpf.hh"
 #include "bpf-filter.hh"
@@ -91,6 +93,7 @@ struct DNSDistStats
   stat_t noPolicy{0};
   stat_t cacheHits{0};
   stat_t cacheMisses{0};
+  stat_t coalescedQueries{0};
   stat_t latency0_1{0}, latency1_10{0}, latency10_50{0}, latency50_100{0}, latency100_1000{0}, latencySlow{0};
   
   double latencyAvg100{0}, latencyAvg1000{0}, latencyAvg10000{0}, latencyAvg1000000{0};
@@ -128,6 +131,7 @@ struct DNSDistStats
     {"empty-queries", &emptyQueries},
     {"cache-hits", &cacheHits},
     {"cache-misses", &cacheMisses},
+    {"coalesced-queries", &coalescedQueries},
     {"cpu-user-msec", getCPUTimeUser},
     {"cpu-sys-msec", getCPUTimeSystem},
     {"fd-usage", getOpenFileDescriptors},
@@ -266,19 +270,21 @@ struct IDState
   uint16_t origID;                                            // 2
   uint16_t origFlags;                                         // 2
   int delayMsec;
+  uint8_t ecsSourceBits{0}; // the source prefix length of the ECS option we added, if the cache entry is scoped
   bool ednsAdded{false};
   bool ecsAdded{false};
   bool skipCache{false};
+  bool cacheRefresh{false}; // if true, the query was only sent to refresh a cache entry and nobody is waiting for the response
+  uint64_t inFlightLeaderId{0}; // if not 0, identical queries might be waiting for the response in g_inFlightQueries
+  bool ecsScoped{false}; // if true, the response is cached for the ECS scope it returns
   bool destHarvested{false}; // if true, origDest holds the original dest addr, otherwise the listening addr
 };
 
+/* The rings are split in shards, each with its own locks, and a given thread
+   always inserts into the same shard. As long as there are at least as many
+   shards as threads inserting, these locks are only ever contended while the
+   rings are being read, and readers only hold them one shard at a time. */
 struct Rings {
-  Rings()
-  {
-    queryRing.set_capacity(10000);
-    respRing.set_capacity(10000);
-    pthread_rwlock_init(&queryLock, 0);
-  }
   struct Query
   {
     struct timespec when;
@@ -288,7 +294,6 @@ struct Rings {
     uint16_t qtype;
     struct dnsheader dh;
   };
-  boost::circular_buffer<Query> queryRing;
   struct Response
   {
     struct timespec when;
@@ -300,15 +305,188 @@ struct Rings {
     struct dnsheader dh;
     ComboAddress ds; // who handled it
   };
-  boost::circular_buffer<Response> respRing;
-  std::mutex respMutex;
-  pthread_rwlock_t queryLock;
 
+  /* Per-requestor counters, updated as queries and responses are inserted and aggregated
+     in one-second buckets, so that the rates used by the dynamic blocks can be computed
+     without going over the rings. QType and RCode counters are per value, the Queries
+     one is not updated on insertion but computed from the QType ones when read. */
+  enum class Counter : uint8_t { Queries, QType, RCode, ResponseBytes };
+  typedef std::unordered_map<ComboAddress, uint64_t, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> counters_t;
+
+  Rings(size_t capacity=10000, size_t numberOfShards=10, size_t countersWindow=60, size_t maxCountersEntries=100000)
+  {
+    d_countersWindow = countersWindow;
+    d_maxCountersEntries = maxCountersEntries;
+    setCapacity(capacity, numberOfShards);
+  }
+
+  /* capacity is the total number of queries, and of responses, kept in the rings, each shard getting
+     an equal part of it. Not thread-safe, should only be called before any insertion */
+  void setCapacity(size_t capacity, size_t numberOfShards);
+  /* number of seconds covered by the counters, and total number of entries of the query counters, and of
+     the response counters, split between the shards and the one-second buckets. Not thread-safe either */
+  void setCountersParameters(size_t seconds, size_t maxEntries);
+  /* number of entries of the heavy hitters summaries, per shard, the duration of their period and the number
+     of labels of the suffixes. A capacity of 0 disables them. Not thread-safe either */
+  void setHeavyHittersParameters(size_t capacity, time_t period, unsigned int suffixLabels);
+
+  void insertQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, uint16_t size, const struct dnsheader& dh)
+  {
+    /* hashed before taking the lock, the suffix itself is only built the first time it is seen */
+    const uint64_t suffixKey = d_heavyHittersCapacity > 0 ? getSuffixKey(name, d_heavyHittersSuffixLabels) : 0;
+    auto& shard = getShard();
+    std::lock_guard<std::mutex> lock(shard.queryLock);
+    shard.queryRing.push_back({when, requestor, name, size, qtype, dh});
+    addToCounters(shard.queryCounters, when.tv_sec, Counter::QType, qtype, requestor, 1);
+    if (d_heavyHittersCapacity > 0) {
+      shard.topClients.add(requestor, 1, when.tv_sec);
+      shard.topQueryBytes.add(requestor, size, when.tv_sec);
+      shard.topQNames.add(name, 1, when.tv_sec);
+      addSuffix(shard, suffixKey, name, when.tv_sec);
+    }
+  }
+
+  void insertResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh, const ComboAddress& backend)
+  {
+    auto& shard = getShard();
+    std::lock_guard<std::mutex> lock(shard.respLock);
+    shard.respRing.push_back({when, requestor, name, qtype, usec, size, dh, backend});
+    addToCounters(shard.respCounters, when.tv_sec, Counter::RCode, dh.rcode, requestor, 1);
+    addToCounters(shard.respCounters, when.tv_sec, Counter::ResponseBytes, 0, requestor, size);
+    if (d_heavyHittersCapacity > 0) {
+      shard.topResponseBytes.add(requestor, size, when.tv_sec);
+    }
+  }
+
+  /* Sum, per requestor, of the counter over the last 'seconds' seconds, or over the whole
+     window if 'seconds' is 0 or larger than the window. 'elapsed' is set to the period
+     actually covered, in seconds. The cost depends on the number of distinct requestors
+     seen during that period, not on the number of queries. */
+  counters_t getCounters(Counter counter, uint16_t value, size_t seconds, double& elapsed) const;
+
+  /* visit all the entries, one shard after the other, in no particular order */
+  template<typename T> void forEachQuery(T visitor) const
+  {
+    for (const auto& shard : d_shards) {
+      std::lock_guard<std::mutex> lock(shard->queryLock);
+      for (const auto& q : shard->queryRing) {
+        visitor(q);
+      }
+    }
+  }
+
+  template<typename T> void forEachResponse(T visitor) const
+  {
+    for (const auto& shard : d_shards) {
+      std::lock_guard<std::mutex> lock(shard->respLock);
+      for (const auto& r : shard->respRing) {
+        visitor(r);
+      }
+    }
+  }
+
+  size_t getNumberOfShards() const
+  {
+    return d_shards.size();
+  }
+
+  size_t getCapacity() const
+  {
+    return d_capacity;
+  }
+
+  size_t getShardCapacity() const
+  {
+    return d_shardCapacity;
+  }
+
+  size_t getCountersWindow() const
+  {
+    return d_countersWindow;
+  }
+
+  size_t getMaxCountersEntries() const
+  {
+    return d_maxCountersEntries;
+  }
+
+  size_t getCountersBucketCapacity() const
+  {
+    return d_countersBucketCapacity;
+  }
+
+  /* The heavy hitters are computed from Space-Saving summaries updated on insertion, covering the last one to
+     two periods, so their cost does not depend on the size of the rings. 'total' is set to the number of
+     queries seen during that time, 'elapsed' to its duration in seconds. */
+  std::vector<std::pair<ComboAddress, uint64_t> > getTopClients(size_t top, uint64_t& total, double& elapsed) const;
+  std::vector<std::pair<DNSName, uint64_t> > getTopQueries(size_t top, bool suffixes, uint64_t& total, double& elapsed) const;
   std::unordered_map<int, vector<boost::variant<string,double> > > getTopBandwidth(unsigned int numentries);
   size_t numDistinctRequestors();
+
+  unsigned int getHeavyHittersSuffixLabels() const
+  {
+    return d_heavyHittersSuffixLabels;
+  }
+
+private:
+  typedef SpaceSaving<ComboAddress, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> clientsss_t;
+
+  struct CountersBucket
+  {
+    time_t second{0};
+    /* total number of entries of the summaries of this bucket, bounded by d_countersBucketCapacity */
+    size_t entries{0};
+    /* indexed by the type of counter in the upper 16 bits, the value in the lower ones */
+    std::unordered_map<uint32_t, clientsss_t> counters;
+  };
+
+  typedef HeavyHitters<ComboAddress, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> clientshh_t;
+  typedef HeavyHitters<DNSName> nameshh_t;
+  /* keyed by a hash of the lowercase wire representation of the suffix */
+  typedef HeavyHitters<uint64_t> suffixeshh_t;
+
+  struct Shard
+  {
+    Shard(size_t heavyHittersCapacity, time_t heavyHittersPeriod): topClients(heavyHittersCapacity, heavyHittersPeriod), topQueryBytes(heavyHittersCapacity, heavyHittersPeriod), topQNames(heavyHittersCapacity, heavyHittersPeriod), topSuffixes(heavyHittersCapacity, heavyHittersPeriod), topResponseBytes(heavyHittersCapacity, heavyHittersPeriod)
+    {
+    }
+
+    boost::circular_buffer<Query> queryRing;
+    boost::circular_buffer<Response> respRing;
+    /* protected by queryLock */
+    std::vector<CountersBucket> queryCounters;
+    clientshh_t topClients;
+    clientshh_t topQueryBytes;
+    nameshh_t topQNames;
+    suffixeshh_t topSuffixes;
+    /* the names of the suffixes present in topSuffixes, and maybe of a few evicted ones */
+    std::unordered_map<uint64_t, DNSName> suffixNames;
+    /* protected by respLock */
+    std::vector<CountersBucket> respCounters;
+    clientshh_t topResponseBytes;
+    mutable std::mutex queryLock;
+    mutable std::mutex respLock;
+  };
+
+  size_t getThreadNumber();
+  Shard& getShard();
+  static uint64_t getSuffixKey(const DNSName& name, unsigned int labels);
+  void addSuffix(Shard& shard, uint64_t key, const DNSName& name, time_t now);
+  void addToCounters(std::vector<CountersBucket>& buckets, time_t second, Counter counter, uint16_t value, const ComboAddress& requestor, uint64_t count);
+
+  std::vector<std::unique_ptr<Shard> > d_shards;
+  size_t d_capacity{0};
+  size_t d_shardCapacity{0};
+  size_t d_countersWindow{0};
+  size_t d_maxCountersEntries{0};
+  size_t d_countersBucketCapacity{0};
+  size_t d_heavyHittersCapacity{1000};
+  time_t d_heavyHittersPeriod{60};
+  unsigned int d_heavyHittersSuffixLabels{2};
 };
 
 extern Rings g_rings;
+extern InFlightQueries g_inFlightQueries;
 
 typedef std::unordered_map<string, unsigned int> QueryCountRecords;
 typedef std::function<std::tuple<bool, string>(DNSQuestion dq)> QueryCountFilter;
@@ -334,6 +512,8 @@ struct ClientState
   std::atomic<uint64_t> queries{0};
   int udpFD{-1};
   int tcpFD{-1};
+  /* maximum number of datagrams received (recvmmsg) and answered (sendmmsg) in one call, 0 or 1 to disable */
+  int udpBatchSize{0};
 
   int getSocket() const
   {
@@ -387,16 +567,20 @@ extern std::shared_ptr<TCPClientCollection> g_tcpclientthreads;
 
 struct DownstreamState
 {
-  DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf);
-  DownstreamState(const ComboAddress& remote_): DownstreamState(remote_, ComboAddress(), 0) {}
+  DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf, size_t numberOfSockets);
+  DownstreamState(const ComboAddress& remote_): DownstreamState(remote_, ComboAddress(), 0, 1) {}
   ~DownstreamState()
   {
-    if (fd >= 0)
-      close(fd);
+    for (auto& fd : sockets) {
+      if (fd >= 0)
+        close(fd);
+    }
   }
 
-  int fd{-1};
-  std::thread tid;
+  /* each socket gets its own responder thread and its own range of
+     g_maxOutstanding IDStates, idStates[socket * g_maxOutstanding + id] */
+  std::vector<int> sockets;
+  std::vector<std::thread> threads;
   ComboAddress remote;
   QPSLimiter qps;
   vector<IDState> idStates;
@@ -440,6 +624,12 @@ struct DownstreamState
       return true;
     return upStatus;
   }
+  /* lower is better: the latency, which is a moving average decaying over the last
+     responses, times the number of queries currently in the air */
+  double getLatencyScore() const
+  {
+    return (latencyUsec + 1.0) * (outstanding.load() + 1);
+  }
   void setUp() { availability = Availability::Up; }
   void setDown() { availability = Availability::Down; }
   void setAuto() { availability = Availability::Auto; }
@@ -455,7 +645,6 @@ struct DownstreamState
     }
     return name + " (" + remote.toStringWithPort()+ ")";
   }
-
 };
 using servers_t =vector<std::shared_ptr<DownstreamState>>;
 
@@ -495,7 +684,8 @@ struct DNSResponse : DNSQuestion
 typedef std::function<bool(const DNSQuestion*)> blockfilter_t;
 template <class T> using NumberedVector = std::vector<std::pair<unsigned int, T> >;
 
-void* responderThread(std::shared_ptr<DownstreamState> state);
+void* responderThread(std::shared_ptr<DownstreamState> state, size_t socketIdx);
+void startResponderThreads(std::shared_ptr<DownstreamState> state);
 extern std::mutex g_luamutex;
 extern LuaContext g_lua;
 extern std::string g_outputBuffer; // locking for this is ok, as locked by g_luamutex
@@ -540,18 +730,84 @@ public:
 using NumberedServerVector = NumberedVector<shared_ptr<DownstreamState>>;
 typedef std::function<shared_ptr<DownstreamState>(const NumberedServerVector& servers, const DNSQuestion*)> policyfunc_t;
 
+struct ServerPool;
+/* for the built-in policies needing more than the list of servers */
+typedef std::function<shared_ptr<DownstreamState>(const ServerPool& pool, const DNSQuestion*)> poolpolicyfunc_t;
+
 struct ServerPolicy
 {
   string name;
   policyfunc_t policy;
+  /* used instead of policy when set */
+  poolpolicyfunc_t poolPolicy;
+
+  shared_ptr<DownstreamState> getSelectedBackend(const ServerPool& pool, const DNSQuestion* dq) const;
+};
+
+/* the points of all the servers of a pool on the consistent hashing ring, sorted, see chashed() */
+class ConsistentHashRing
+{
+public:
+  ConsistentHashRing(const NumberedServerVector& servers);
+
+  /* the server owning the first point at or after this hash, wrapping around, skipping
+     the servers for which usable(server) is false. The cost only depends on the number of
+     points to skip, not on the number of servers */
+  template<typename T>
+  shared_ptr<DownstreamState> getServer(uint32_t hash, T usable) const
+  {
+    if (d_points.empty()) {
+      return shared_ptr<DownstreamState>();
+    }
+
+    auto it = std::lower_bound(d_points.begin(), d_points.end(), std::make_pair(hash, static_cast<size_t>(0)));
+    for (size_t count = 0; count < d_points.size(); count++, ++it) {
+      if (it == d_points.end()) {
+        it = d_points.begin();
+      }
+      const auto& server = d_servers[it->second].second;
+      if (usable(*server)) {
+        return server;
+      }
+    }
+    return shared_ptr<DownstreamState>();
+  }
+
+  const NumberedServerVector& getServers() const
+  {
+    return d_servers;
+  }
+
+  size_t size() const
+  {
+    return d_points.size();
+  }
+
+private:
+  /* the hash of the point, and the position of the server owning it in d_servers */
+  std::vector<std::pair<uint32_t, size_t> > d_points;
+  NumberedServerVector d_servers;
 };
 
 struct ServerPool
 {
   const std::shared_ptr<DNSDistPacketCache> getCache() const { return packetCache; };
 
+  std::shared_ptr<const ConsistentHashRing> getHashRing() const
+  {
+    return std::atomic_load(&hashRing);
+  }
+
+  /* has to be called whenever the servers or their weights change, so that the
+     ring is never built while selecting a server */
+  void updateHashRing()
+  {
+    std::atomic_store(&hashRing, std::make_shared<const ConsistentHashRing>(servers));
+  }
+
   NumberedVector<shared_ptr<DownstreamState>> servers;
   std::shared_ptr<DNSDistPacketCache> packetCache{nullptr};
+  std::shared_ptr<const ConsistentHashRing> hashRing{nullptr};
 };
 using pools_t=map<std::string,std::shared_ptr<ServerPool>>;
 void addServerToPool(pools_t& pools, const string& poolName, std::shared_ptr<DownstreamState> server);
@@ -562,6 +818,8 @@ struct CarbonConfig
   ComboAddress server;
   std::string ourname;
   unsigned int interval;
+  /* number of top clients, qnames and suffixes to report */
+  unsigned int topEntries;
 };
 
 enum ednsHeaderFlags {
@@ -676,7 +934,7 @@ extern GlobalStateHolder<NetmaskGroup> g_ACL;
 
 extern ComboAddress g_serverControl; // not changed during runtime
 
-extern std::vector<std::tuple<ComboAddress, bool, bool, int>> g_locals; // not changed at runtime (we hope XXX)
+extern std::vector<std::tuple<ComboAddress, bool, bool, int, int>> g_locals; // not changed at runtime (we hope XXX)
 extern vector<ClientState*> g_frontends;
 extern std::string g_key; // in theory needs locking
 extern bool g_truncateTC;
@@ -687,8 +945,13 @@ extern uint16_t g_maxOutstanding;
 extern std::atomic<bool> g_configurationDone;
 extern uint64_t g_maxTCPClientThreads;
 extern uint64_t g_maxTCPQueuedConnections;
+extern uint16_t g_maxTCPPipelinedQueries;
+extern uint16_t g_maxIdleTCPConnectionsPerDownstream;
+extern int g_tcpDownstreamMaxIdleTime;
 extern std::atomic<uint16_t> g_cacheCleaningDelay;
 extern bool g_verboseHealthChecks;
+extern double g_consistentHashBalancingFactor;
+extern uint32_t g_hashperturb;
 extern uint32_t g_staleCacheEntriesTTL;
 extern bool g_apiReadWrite;
 extern std::string g_apiConfigDirectory;
@@ -727,8 +990,11 @@ const NumberedServerVector& getDownstreamCandidates(const pools_t& pools, const
 std::shared_ptr<DownstreamState> firstAvailable(const NumberedServerVector& servers, const DNSQuestion* dq);
 
 std::shared_ptr<DownstreamState> leastOutstanding(const NumberedServerVector& servers, const DNSQuestion* dq);
+std::shared_ptr<DownstreamState> powerOfTwoChoices(const NumberedServerVector& servers, const DNSQuestion* dq);
 std::shared_ptr<DownstreamState> wrandom(const NumberedServerVector& servers, const DNSQuestion* dq);
 std::shared_ptr<DownstreamState> whashed(const NumberedServerVector& servers, const DNSQuestion* dq);
+std::shared_ptr<DownstreamState> chashed(const NumberedServerVector& servers, const DNSQuestion* dq);
+std::shared_ptr<DownstreamState> chashedFromPool(const ServerPool& pool, const DNSQuestion* dq);
 std::shared_ptr<DownstreamState> roundrobin(const NumberedServerVector& servers, const DNSQuestion* dq);
 int getEDNSZ(const char* packet, unsigned int len);
 void spoofResponseFromString(DNSQuestion& dq, const string& spoofContent);
@@ -0,0 +1 @@
+../dnsdist-backend.cc
\ No newline at end of file
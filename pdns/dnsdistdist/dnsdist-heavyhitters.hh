@@ -0,0 +1 @@
+../dnsdist-heavyhitters.hh
\ No newline at end of file
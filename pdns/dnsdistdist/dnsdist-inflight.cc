@@ -0,0 +1 @@
+../dnsdist-inflight.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-inflight.hh
\ No newline at end of file
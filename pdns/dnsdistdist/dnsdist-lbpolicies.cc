@@ -0,0 +1 @@
+../dnsdist-lbpolicies.cc
\ No newline at end of file
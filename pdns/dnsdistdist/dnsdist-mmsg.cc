@@ -0,0 +1 @@
+../dnsdist-mmsg.cc
\ No newline at end of file
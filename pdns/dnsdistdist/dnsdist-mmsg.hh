@@ -0,0 +1 @@
+../dnsdist-mmsg.hh
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-rulechain.cc
\ No newline at end of file
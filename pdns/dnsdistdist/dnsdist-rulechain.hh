@@ -0,0 +1 @@
+../dnsdist-rulechain.hh
\ No newline at end of file
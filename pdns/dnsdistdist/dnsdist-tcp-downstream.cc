@@ -0,0 +1 @@
+../dnsdist-tcp-downstream.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-tcp-downstream.hh
\ No newline at end of file
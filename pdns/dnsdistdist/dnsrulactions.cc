@@ -24,6 +24,82 @@
 
 using namespace std;
 
+#ifdef HAVE_RE2
+static RE2::Options getRegexSetOptions()
+{
+  RE2::Options options(RE2::Latin1);
+  /* query names are compared case-insensitively */
+  options.set_case_sensitive(false);
+  options.set_log_errors(false);
+  return options;
+}
+
+RegexSet::RegexSet(const std::vector<std::string>& patterns): d_set(getRegexSetOptions(), RE2::UNANCHORED), d_patterns(patterns)
+{
+  if (d_patterns.empty()) {
+    throw std::runtime_error("A set of regular expressions needs at least one pattern");
+  }
+
+  for (const auto& pattern : d_patterns) {
+    string error;
+    if (d_set.Add(pattern, &error) < 0) {
+      throw std::runtime_error("Invalid regular expression '" + pattern + "': " + error);
+    }
+  }
+
+  if (!d_set.Compile()) {
+    throw std::runtime_error("Unable to compile a set of " + std::to_string(d_patterns.size()) + " regular expressions, most likely because it exceeds RE2's memory budget");
+  }
+}
+
+/* the escaped representation of DNSName::toStringNoDot(), built from the wire labels
+   into a buffer reused by the caller instead of a new string */
+static void qnameToString(const DNSName& qname, std::string& out)
+{
+  out.clear();
+  const auto& storage = qname.getStorage();
+  for (size_t pos = 0; pos < storage.size() && storage[pos] != 0; ) {
+    const size_t labelEnd = std::min(storage.size(), pos + 1 + static_cast<uint8_t>(storage[pos]));
+    if (pos > 0) {
+      out.append(1, '.');
+    }
+    for (pos++; pos < labelEnd; pos++) {
+      const uint8_t p = storage[pos];
+      if (p == '.' || p == '\\') {
+        out.append(1, '\\');
+        out.append(1, static_cast<char>(p));
+      }
+      else if (p > 0x21 && p < 0x7e) {
+        out.append(1, static_cast<char>(p));
+      }
+      else {
+        char escaped[5];
+        snprintf(escaped, sizeof(escaped), "\\%03u", static_cast<unsigned int>(p));
+        out.append(escaped, 4);
+      }
+    }
+  }
+}
+
+void RegexSet::match(const DNSName& qname, std::vector<int>& hits) const
+{
+  static thread_local std::string name;
+  qnameToString(qname, name);
+  hits.clear();
+  if (!d_set.Match(name, &hits)) {
+    return;
+  }
+  std::sort(hits.begin(), hits.end());
+}
+
+bool RegexSet::matchesAny(const DNSName& qname) const
+{
+  static thread_local std::string name;
+  qnameToString(qname, name);
+  return d_set.Match(name, nullptr);
+}
+#endif
+
 TeeAction::TeeAction(const ComboAddress& ca, bool addECS) : d_remote(ca), d_addECS(addECS)
 {
   d_fd=SSocket(d_remote.sin4.sin_family, SOCK_DGRAM, 0);
@@ -48,22 +124,27 @@ DNSAction::Action TeeAction::operator()(DNSQuestion* dq, string* ruleresult) con
     d_queries++;
 
     if(d_addECS) {
-      std::string query;
-      std::string larger;
+      /* with room for the ECS option, a query larger than our UDP buffer needing its own */
+      char buffer[4096 + s_EDNSClientSubnetRoom];
+      std::vector<char> largeBuffer;
+      char* query = buffer;
+      size_t querySize = sizeof(buffer);
+      if (dq->len > 4096) {
+        largeBuffer.resize(dq->len + s_EDNSClientSubnetRoom);
+        query = largeBuffer.data();
+        querySize = largeBuffer.size();
+      }
       uint16_t len = dq->len;
       bool ednsAdded = false;
       bool ecsAdded = false;
-      query.reserve(dq->size);
-      query.assign((char*) dq->dh, len);
+      memcpy(query, dq->dh, len);
 
-      handleEDNSClientSubnet((char*) query.c_str(), query.size(), dq->qname->wirelength(), &len, larger, &ednsAdded, &ecsAdded, *dq->remote, dq->ecsOverride, dq->ecsPrefixLength);
-
-      if (larger.empty()) {
-        res = send(d_fd, query.c_str(), len, 0);
-      }
-      else {
-        res = send(d_fd, larger.c_str(), larger.length(), 0);
+      if (!handleEDNSClientSubnet(query, querySize, dq->qname->wirelength(), &len, &ednsAdded, &ecsAdded, *dq->remote, dq->ecsOverride, dq->ecsPrefixLength)) {
+        d_ecsErrors++;
+        vinfolog("Unable to add an ECS option to the query for %s teed to %s, sending it as is", dq->qname->toString(), d_remote.toStringWithPort());
       }
+
+      res = send(d_fd, query, len, 0);
     }
     else {
       res = send(d_fd, (char*)dq->dh, dq->len, 0);
@@ -86,6 +167,7 @@ std::unordered_map<string,double> TeeAction::getStats() const
           {"responses", d_responses},
           {"recv-errors", d_recverrors},
           {"send-errors", d_senderrors},
+          {"ecs-errors", d_ecsErrors},
           {"noerrors", d_noerrors},
           {"nxdomains", d_nxdomains},
           {"refuseds", d_refuseds},
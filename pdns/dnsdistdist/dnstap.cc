@@ -0,0 +1 @@
+../dnstap.cc
\ No newline at end of file
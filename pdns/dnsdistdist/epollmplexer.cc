@@ -0,0 +1 @@
+../epollmplexer.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../fstrm_logger.cc
\ No newline at end of file
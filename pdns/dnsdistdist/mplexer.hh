@@ -0,0 +1 @@
+../mplexer.hh
\ No newline at end of file
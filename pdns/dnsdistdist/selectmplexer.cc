@@ -0,0 +1 @@
+../selectmplexer.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../test-dnsdistlbpolicies_cc.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../test-dnsdistmmsg_cc.cc
\ No newline at end of file
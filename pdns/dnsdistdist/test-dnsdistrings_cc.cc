@@ -0,0 +1 @@
+../test-dnsdistrings_cc.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../test-dnsdistrulechain_cc.cc
\ No newline at end of file
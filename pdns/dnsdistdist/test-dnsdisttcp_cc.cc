@@ -0,0 +1 @@
+../test-dnsdisttcp_cc.cc
\ No newline at end of file
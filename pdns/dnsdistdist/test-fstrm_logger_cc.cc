@@ -0,0 +1 @@
+../test-fstrm_logger_cc.cc
\ No newline at end of file
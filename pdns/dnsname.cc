@@ -357,6 +357,21 @@ void DNSName::trimToLabels(unsigned int to)
     ;
 }
 
+DNSName DNSName::getLastLabels(unsigned int to) const
+{
+  unsigned int labels = countLabels();
+  if(labels <= to)
+    return *this;
+
+  size_t pos = 0;
+  for(; labels > to; --labels)
+    pos += static_cast<unsigned char>(d_storage[pos]) + 1;
+
+  DNSName ret;
+  ret.d_storage.assign(d_storage.c_str() + pos, d_storage.size() - pos);
+  return ret;
+}
+
 
 size_t hash_value(DNSName const& d)
 {
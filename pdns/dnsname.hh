@@ -102,6 +102,7 @@ public:
   bool isRoot() const { return d_storage.size()==1 && d_storage[0]==0; }
   void clear() { d_storage.clear(); }
   void trimToLabels(unsigned int);
+  DNSName getLastLabels(unsigned int) const;    //!< Like a trimToLabels() on a copy, but only copies the last labels
   size_t hash(size_t init=0) const
   {
     return burtleCI((const unsigned char*)d_storage.c_str(), d_storage.size(), init);
@@ -256,7 +257,8 @@ struct SuffixMatchNode
       endNode=true;
     }
     else if(labels.size()==1) {
-      children.insert(SuffixMatchNode(*labels.begin(), true));
+      auto res=children.insert(SuffixMatchNode(*labels.begin(), true));
+      res.first->endNode=true; // might already have been there as a parent of a longer name
     }
     else {
       auto res=children.insert(SuffixMatchNode(*labels.rbegin(), false));
@@ -282,7 +284,7 @@ struct SuffixMatchNode
     if(child == children.end())
       return endNode;
     labels.pop_back();
-    return child->check(labels);
+    return endNode || child->check(labels);
   }
   
   std::string toString() const
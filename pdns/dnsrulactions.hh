@@ -27,6 +27,8 @@
 #include "lock.hh"
 #include "remote_logger.hh"
 #include "dnsdist-protobuf.hh"
+#include "dnstap.hh"
+#include "fstrm_logger.hh"
 #include "dnsparser.hh"
 
 class MaxQPSIPRule : public DNSRule
@@ -104,6 +106,10 @@ class NMGRule : public DNSRule
 {
 public:
   NMGRule(const NetmaskGroup& nmg) : d_nmg(nmg) {}
+  const NetmaskGroup& getNetmaskGroup() const
+  {
+    return d_nmg;
+  }
 protected:
   NetmaskGroup d_nmg;
 };
@@ -130,6 +136,10 @@ public:
     }
     return "Src: "+d_nmg.toString();
   }
+  bool isSource() const
+  {
+    return d_src;
+  }
 private:
   bool d_src;
 };
@@ -262,6 +272,7 @@ private:
 
 #ifdef HAVE_RE2
 #include <re2/re2.h>
+#include <re2/set.h>
 class RE2Rule : public DNSRule
 {
 public:
@@ -282,6 +293,68 @@ private:
   RE2 d_re2;
   string d_visual;
 };
+
+/* several RE2 patterns compiled into a single automaton, so that the qname
+   is converted and scanned only once whatever the number of patterns.
+   Like RegexRule and unlike RE2Rule, the patterns are not anchored (use ^ and $)
+   and are matched case-insensitively */
+class RegexSet
+{
+public:
+  RegexSet(const std::vector<std::string>& patterns);
+  /* fills hits with the sorted indexes of the patterns matching this qname */
+  void match(const DNSName& qname, std::vector<int>& hits) const;
+  /* whether any pattern matches, without collecting which ones */
+  bool matchesAny(const DNSName& qname) const;
+  size_t size() const
+  {
+    return d_patterns.size();
+  }
+  const std::string& getPattern(size_t idx) const
+  {
+    return d_patterns.at(idx);
+  }
+private:
+  RE2::Set d_set;
+  std::vector<std::string> d_patterns;
+};
+
+class RegexSetRule : public DNSRule
+{
+public:
+  /* matches if the pattern at this index matches, or any of them if index is negative */
+  RegexSetRule(std::shared_ptr<const RegexSet> set, int index=-1): d_set(set), d_index(index)
+  {
+  }
+  bool matches(const DNSQuestion* dq) const override
+  {
+    if (d_index < 0) {
+      return d_set->matchesAny(*dq->qname);
+    }
+    /* only allocated when at least one pattern matches */
+    std::vector<int> hits;
+    d_set->match(*dq->qname, hits);
+    return std::binary_search(hits.begin(), hits.end(), d_index);
+  }
+  string toString() const override
+  {
+    if (d_index < 0) {
+      return "RE2 set match: " + std::to_string(d_set->size()) + " patterns";
+    }
+    return "RE2 set match: " + d_set->getPattern(d_index);
+  }
+  const std::shared_ptr<const RegexSet>& getRegexSet() const
+  {
+    return d_set;
+  }
+  int getIndex() const
+  {
+    return d_index;
+  }
+private:
+  std::shared_ptr<const RegexSet> d_set;
+  int d_index;
+};
 #endif
 
 
@@ -302,6 +375,10 @@ public:
     else
       return "qname=="+d_smn.toString();
   }
+  const SuffixMatchNode& getSuffixMatchNode() const
+  {
+    return d_smn;
+  }
 private:
   SuffixMatchNode d_smn;
   bool d_quiet;
@@ -322,6 +399,10 @@ public:
     QType qt(d_qtype);
     return "qtype=="+qt.getName();
   }
+  uint16_t getQType() const
+  {
+    return d_qtype;
+  }
 private:
   uint16_t d_qtype;
 };
@@ -340,6 +421,10 @@ public:
   {
     return "qclass=="+std::to_string(d_qclass);
   }
+  uint16_t getQClass() const
+  {
+    return d_qclass;
+  }
 private:
   uint16_t d_qclass;
 };
@@ -358,6 +443,10 @@ public:
   {
     return "opcode=="+std::to_string(d_opcode);
   }
+  uint8_t getOpcode() const
+  {
+    return d_opcode;
+  }
 private:
   uint8_t d_opcode;
 };
@@ -376,6 +465,10 @@ public:
   {
     return (d_tcp ? "TCP" : "UDP");
   }
+  bool getTCP() const
+  {
+    return d_tcp;
+  }
 private:
   bool d_tcp;
 };
@@ -443,6 +536,18 @@ public:
     }
     return std::to_string(d_minCount) + " <= records in " + section + " <= "+ std::to_string(d_maxCount);
   }
+  uint8_t getSection() const
+  {
+    return d_section;
+  }
+  uint16_t getMinCount() const
+  {
+    return d_minCount;
+  }
+  uint16_t getMaxCount() const
+  {
+    return d_maxCount;
+  }
 private:
   uint16_t d_minCount;
   uint16_t d_maxCount;
@@ -536,6 +641,14 @@ public:
   {
     return "labels count < " + std::to_string(d_min) + " || labels count > " + std::to_string(d_max);
   }
+  unsigned int getMin() const
+  {
+    return d_min;
+  }
+  unsigned int getMax() const
+  {
+    return d_max;
+  }
 private:
   unsigned int d_min;
   unsigned int d_max;
@@ -556,6 +669,14 @@ public:
   {
     return "wire length < " + std::to_string(d_min) + " || wire length > " + std::to_string(d_max);
   }
+  size_t getMin() const
+  {
+    return d_min;
+  }
+  size_t getMax() const
+  {
+    return d_max;
+  }
 private:
   size_t d_min;
   size_t d_max;
@@ -661,6 +782,8 @@ private:
 
   int d_fd;
   mutable std::atomic<unsigned long> d_senderrors{0};
+  /* queries sent without the ECS option we could not add */
+  mutable std::atomic<unsigned long> d_ecsErrors{0};
   unsigned long d_recverrors{0};
   mutable std::atomic<unsigned long> d_queries{0};
   unsigned long d_responses{0};
@@ -1071,9 +1194,7 @@ public:
         (*d_alterFunc)(*dq, &message);
       }
     }
-    std::string data;
-    message.serialize(data);
-    d_logger->queueData(data);
+    d_logger->queueMessage(message);
 #endif /* HAVE_PROTOBUF */
     return Action::None;
   }
@@ -1102,9 +1223,7 @@ public:
         (*d_alterFunc)(*dr, &message);
       }
     }
-    std::string data;
-    message.serialize(data);
-    d_logger->queueData(data);
+    d_logger->queueMessage(message);
 #endif /* HAVE_PROTOBUF */
     return Action::None;
   }
@@ -1117,6 +1236,52 @@ private:
   boost::optional<std::function<void(const DNSResponse&, DNSDistProtoBufMessage*)> > d_alterFunc;
 };
 
+class DnstapLogAction : public DNSAction, public boost::noncopyable
+{
+public:
+  DnstapLogAction(const std::string& identity, std::shared_ptr<FrameStreamLogger> logger): d_identity(identity), d_logger(logger)
+  {
+  }
+  DNSAction::Action operator()(DNSQuestion* dq, string* ruleresult) const override
+  {
+#ifdef HAVE_PROTOBUF
+    DnstapMessage message(DnstapMessage::ClientQuery, d_identity, dq->remote, dq->local, dq->tcp, reinterpret_cast<const char*>(dq->dh), dq->len, nullptr);
+    d_logger->queueMessage(message);
+#endif /* HAVE_PROTOBUF */
+    return Action::None;
+  }
+  string toString() const override
+  {
+    return "dnstap log to " + d_logger->toString();
+  }
+private:
+  std::string d_identity;
+  std::shared_ptr<FrameStreamLogger> d_logger;
+};
+
+class DnstapLogResponseAction : public DNSResponseAction, public boost::noncopyable
+{
+public:
+  DnstapLogResponseAction(const std::string& identity, std::shared_ptr<FrameStreamLogger> logger): d_identity(identity), d_logger(logger)
+  {
+  }
+  DNSResponseAction::Action operator()(DNSResponse* dr, string* ruleresult) const override
+  {
+#ifdef HAVE_PROTOBUF
+    DnstapMessage message(DnstapMessage::ClientResponse, d_identity, dr->remote, dr->local, dr->tcp, reinterpret_cast<const char*>(dr->dh), dr->len, dr->queryTime);
+    d_logger->queueMessage(message);
+#endif /* HAVE_PROTOBUF */
+    return Action::None;
+  }
+  string toString() const override
+  {
+    return "dnstap log response to " + d_logger->toString();
+  }
+private:
+  std::string d_identity;
+  std::shared_ptr<FrameStreamLogger> d_logger;
+};
+
 class DropResponseAction : public DNSResponseAction
 {
 public:
@@ -0,0 +1,75 @@
+#include "dnstap.hh"
+#include "gettime.hh"
+
+#ifdef HAVE_PROTOBUF
+static void setAddress(const ComboAddress* address, std::string* field)
+{
+  if (address->sin4.sin_family == AF_INET) {
+    field->assign(reinterpret_cast<const char*>(&address->sin4.sin_addr.s_addr), sizeof(address->sin4.sin_addr.s_addr));
+  }
+  else if (address->sin4.sin_family == AF_INET6) {
+    field->assign(reinterpret_cast<const char*>(&address->sin6.sin6_addr.s6_addr), sizeof(address->sin6.sin6_addr.s6_addr));
+  }
+}
+#endif /* HAVE_PROTOBUF */
+
+DnstapMessage::DnstapMessage(DnstapMessageType type, const std::string& identity, const ComboAddress* requestor, const ComboAddress* responder, bool isTCP, const char* packet, size_t len, const struct timespec* queryTime)
+{
+#ifdef HAVE_PROTOBUF
+  d_message.set_identity(identity);
+  d_message.set_type(dnstap::Dnstap::MESSAGE);
+
+  dnstap::Message* message = d_message.mutable_message();
+  message->set_type(type == DnstapMessageType::ClientQuery ? dnstap::Message::CLIENT_QUERY : dnstap::Message::CLIENT_RESPONSE);
+  message->set_socket_protocol(isTCP ? dnstap::TCP : dnstap::UDP);
+
+  if (requestor) {
+    message->set_socket_family(requestor->sin4.sin_family == AF_INET ? dnstap::INET : dnstap::INET6);
+    setAddress(requestor, message->mutable_query_address());
+    message->set_query_port(ntohs(requestor->sin4.sin_port));
+  }
+  if (responder) {
+    setAddress(responder, message->mutable_response_address());
+    message->set_response_port(ntohs(responder->sin4.sin_port));
+  }
+
+  struct timespec now;
+  gettime(&now, true);
+  if (type == DnstapMessageType::ClientQuery) {
+    const struct timespec* when = queryTime ? queryTime : &now;
+    message->set_query_time_sec(when->tv_sec);
+    message->set_query_time_nsec(when->tv_nsec);
+    if (packet != nullptr && len > 0) {
+      message->set_query_message(packet, len);
+    }
+  }
+  else {
+    if (queryTime) {
+      message->set_query_time_sec(queryTime->tv_sec);
+      message->set_query_time_nsec(queryTime->tv_nsec);
+    }
+    message->set_response_time_sec(now.tv_sec);
+    message->set_response_time_nsec(now.tv_nsec);
+    if (packet != nullptr && len > 0) {
+      message->set_response_message(packet, len);
+    }
+  }
+#endif /* HAVE_PROTOBUF */
+}
+
+void DnstapMessage::serialize(std::string& data) const
+{
+#ifdef HAVE_PROTOBUF
+  d_message.SerializeToString(&data);
+#endif /* HAVE_PROTOBUF */
+}
+
+std::string DnstapMessage::toDebugString() const
+{
+  return
+#ifdef HAVE_PROTOBUF
+    d_message.DebugString();
+#else
+    std::string();
+#endif /* HAVE_PROTOBUF */
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "config.h"
+
+#include "iputils.hh"
+
+#ifdef HAVE_PROTOBUF
+#include "dnstap.pb.h"
+#endif /* HAVE_PROTOBUF */
+
+/* a dnstap message holding a query or a response as received or sent to a client,
+   to be sent with a FrameStreamLogger */
+class DnstapMessage
+{
+public:
+  enum DnstapMessageType {
+    ClientQuery,
+    ClientResponse
+  };
+
+  /* if queryTime is not set, the current time is used for a query. The response time is always the current time */
+  DnstapMessage(DnstapMessageType type, const std::string& identity, const ComboAddress* requestor, const ComboAddress* responder, bool isTCP, const char* packet, size_t len, const struct timespec* queryTime);
+  void serialize(std::string& data) const;
+  std::string toDebugString() const;
+
+#ifdef HAVE_PROTOBUF
+protected:
+  dnstap::Dnstap d_message;
+#endif /* HAVE_PROTOBUF */
+};
@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <mutex>
+#include <set>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "fstrm_logger.hh"
+#include "config.h"
+#ifdef PDNS_CONFIG_ARGS
+#include "logger.hh"
+#define WE_ARE_RECURSOR
+#else
+#include "dolog.hh"
+#endif
+
+/* Frame Streams control frames, sent after an escape sequence of four zero bytes */
+static const uint32_t s_fstrmControlAccept = 0x01;
+static const uint32_t s_fstrmControlStart = 0x02;
+static const uint32_t s_fstrmControlStop = 0x03;
+static const uint32_t s_fstrmControlReady = 0x04;
+static const uint32_t s_fstrmControlFinish = 0x05;
+static const uint32_t s_fstrmFieldContentType = 0x01;
+/* we only expect a few content types in an ACCEPT frame */
+static const uint32_t s_fstrmMaxControlFrameSize = 512;
+
+/* the paths used by a logger, two of them would corrupt each other's stream */
+static std::mutex s_pathsLock;
+static std::set<std::string> s_paths;
+
+static void appendUInt32(std::string& out, uint32_t value)
+{
+  value = htonl(value);
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static uint32_t getUInt32(const char* data)
+{
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return ntohl(value);
+}
+
+size_t FrameStreamLogger::writeControlFrame(uint32_t type, bool withContentType)
+{
+  std::string frame;
+  appendUInt32(frame, 0);
+  appendUInt32(frame, sizeof(uint32_t) + (withContentType ? 2 * sizeof(uint32_t) + d_contentType.size() : 0));
+  appendUInt32(frame, type);
+  if (withContentType) {
+    appendUInt32(frame, s_fstrmFieldContentType);
+    appendUInt32(frame, d_contentType.size());
+    frame.append(d_contentType);
+  }
+  writen2WithTimeout(d_socket, frame.data(), frame.size(), d_timeout);
+  return frame.size();
+}
+
+void FrameStreamLogger::readControlFrame(uint32_t expectedType)
+{
+  char header[3 * sizeof(uint32_t)];
+  readn2WithTimeout(d_socket, header, sizeof(header), d_timeout);
+  const uint32_t length = getUInt32(header + sizeof(uint32_t));
+  if (getUInt32(header) != 0 || length < sizeof(uint32_t) || length > s_fstrmMaxControlFrameSize) {
+    throw std::runtime_error("Invalid Frame Streams control frame");
+  }
+  if (getUInt32(header + 2 * sizeof(uint32_t)) != expectedType) {
+    throw std::runtime_error("Unexpected Frame Streams control frame type " + std::to_string(getUInt32(header + 2 * sizeof(uint32_t))));
+  }
+
+  std::string fields(length - sizeof(uint32_t), '\0');
+  if (!fields.empty()) {
+    readn2WithTimeout(d_socket, &fields.at(0), fields.size(), d_timeout);
+  }
+  if (expectedType != s_fstrmControlAccept) {
+    return;
+  }
+
+  /* the reader has to accept our content type */
+  for (size_t pos = 0; pos + 2 * sizeof(uint32_t) <= fields.size(); ) {
+    const uint32_t fieldType = getUInt32(fields.data() + pos);
+    const uint32_t fieldLength = getUInt32(fields.data() + pos + sizeof(uint32_t));
+    pos += 2 * sizeof(uint32_t);
+    if (fieldLength > fields.size() - pos) {
+      break;
+    }
+    if (fieldType == s_fstrmFieldContentType && fields.compare(pos, fieldLength, d_contentType) == 0) {
+      return;
+    }
+    pos += fieldLength;
+  }
+  throw std::runtime_error("Content type '" + d_contentType + "' not accepted by the Frame Streams reader");
+}
+
+bool FrameStreamLogger::reconnect()
+{
+  if (d_socket >= 0) {
+    close(d_socket);
+    d_socket = -1;
+  }
+
+  try {
+    if (d_isFile) {
+      /* a Frame Streams file holds a single stream, so we start a new one when the file is
+         first opened. After an error we continue that stream, dropping what was written of the
+         batch that failed since the last frame might be incomplete */
+      d_socket = open(d_path.c_str(), O_CREAT | O_WRONLY | O_APPEND | (d_fileOpened ? 0 : O_TRUNC), 0644);
+      if (d_socket < 0) {
+        unixDie("opening " + d_path);
+      }
+      if (d_fileOpened) {
+        struct stat st;
+        if (fstat(d_socket, &st) < 0) {
+          unixDie("getting the size of " + d_path);
+        }
+        /* unless the file has been truncated or replaced in the meantime, then we start a new stream */
+        if (st.st_size < d_fileOffset) {
+          d_fileOpened = false;
+          d_fileOffset = 0;
+        }
+        if (ftruncate(d_socket, d_fileOffset) < 0) {
+          unixDie("truncating " + d_path);
+        }
+      }
+      if (!d_fileOpened) {
+        d_fileOffset = writeControlFrame(s_fstrmControlStart, true);
+        d_fileOpened = true;
+      }
+    }
+    else {
+      struct sockaddr_un addr;
+      if (makeUNsockaddr(d_path, &addr) != 0) {
+        throw std::runtime_error("invalid unix socket path");
+      }
+      d_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (d_socket < 0) {
+        unixDie("creating a unix socket");
+      }
+      if (connect(d_socket, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        unixDie("connecting to " + d_path);
+      }
+      setNonBlocking(d_socket);
+      writeControlFrame(s_fstrmControlReady, true);
+      readControlFrame(s_fstrmControlAccept);
+      writeControlFrame(s_fstrmControlStart, true);
+    }
+  }
+  catch(const std::exception& e) {
+#ifdef WE_ARE_RECURSOR
+    L<<Logger::Warning<<"Error opening Frame Streams logger to "<<toString()<<": "<<e.what()<<std::endl;
+#else
+    warnlog("Error opening Frame Streams logger to %s: %s", toString(), e.what());
+#endif
+    if (d_socket >= 0) {
+      close(d_socket);
+      d_socket = -1;
+    }
+    return false;
+  }
+  return true;
+}
+
+void FrameStreamLogger::finish()
+{
+  try {
+    writeControlFrame(s_fstrmControlStop, false);
+    if (!d_isFile) {
+      readControlFrame(s_fstrmControlFinish);
+    }
+  }
+  catch(const std::exception& e) {
+#ifdef WE_ARE_RECURSOR
+    L<<Logger::Info<<"Error closing Frame Streams logger to "<<toString()<<": "<<e.what()<<std::endl;
+#else
+    vinfolog("Error closing Frame Streams logger to %s: %s", toString(), e.what());
+#endif
+  }
+}
+
+FrameStreamLogger::FrameStreamLogger(const std::string& path, bool isFile, const std::string& contentType, uint16_t timeout, uint64_t maxQueuedEntries, uint8_t reconnectWaitTime): BatchedLogger(timeout, maxQueuedEntries, reconnectWaitTime, sizeof(uint32_t)), d_path(path), d_contentType(contentType), d_isFile(isFile)
+{
+  {
+    std::lock_guard<std::mutex> lock(s_pathsLock);
+    if (!s_paths.insert(d_path).second) {
+      throw std::runtime_error("The Frame Streams " + toString() + " is already used by another logger");
+    }
+  }
+  reconnect();
+  start(false);
+}
+
+FrameStreamLogger::~FrameStreamLogger()
+{
+  stop();
+  std::lock_guard<std::mutex> lock(s_pathsLock);
+  s_paths.erase(d_path);
+}
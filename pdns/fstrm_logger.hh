@@ -0,0 +1,65 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+#include "config.h"
+
+#include "remote_logger.hh"
+
+/* Writes the messages as Frame Streams data frames, either to a unix socket after the
+   bidirectional handshake, or to a file. The content type is negotiated with the reader,
+   "protobuf:dnstap.Dnstap" for dnstap. Only one logger can use a given path at a time,
+   the constructor throws if another one already does. */
+class FrameStreamLogger : public BatchedLogger
+{
+public:
+  FrameStreamLogger(const std::string& path, bool isFile, const std::string& contentType="protobuf:dnstap.Dnstap", uint16_t timeout=2, uint64_t maxQueuedEntries=100, uint8_t reconnectWaitTime=1);
+  ~FrameStreamLogger();
+  std::string toString() override
+  {
+    return (d_isFile ? "file " : "unix socket ") + d_path;
+  }
+  const std::string& getPath() const
+  {
+    return d_path;
+  }
+  bool isFile() const
+  {
+    return d_isFile;
+  }
+private:
+  bool reconnect() override;
+  void finish() override;
+  void batchSent(size_t bytes) override
+  {
+    d_fileOffset += bytes;
+  }
+  size_t writeControlFrame(uint32_t type, bool withContentType);
+  void readControlFrame(uint32_t expectedType);
+
+  const std::string d_path;
+  const std::string d_contentType;
+  const bool d_isFile;
+  /* a file is only truncated, and the stream started, when it is first opened */
+  bool d_fileOpened{false};
+  /* the size of the complete frames written to the file, a batch that failed might have been cut anywhere */
+  off_t d_fileOffset{0};
+};
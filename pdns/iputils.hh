@@ -712,7 +712,10 @@ public:
       }
       if (node) {
         for(auto it = _nodes.begin(); it != _nodes.end(); it++)
-           if (node->node4.get() == *it) _nodes.erase(it);
+           if (node->node4.get() == *it) {
+             _nodes.erase(it);
+             break;
+           }
         node->node4.reset();
       }
     } else {
@@ -733,7 +736,10 @@ public:
       }
       if (node) {
         for(auto it = _nodes.begin(); it != _nodes.end(); it++)
-           if (node->node6.get() == *it) _nodes.erase(it);
+           if (node->node6.get() == *it) {
+             _nodes.erase(it);
+             break;
+           }
         node->node6.reset();
       }
     }
@@ -85,6 +85,8 @@ extern SortList g_sortlist;
 #include "gettime.hh"
 
 #include "rec-protobuf.hh"
+#include "dnstap.hh"
+#include "rec-snapshot.hh"
 
 #ifdef HAVE_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -131,6 +133,7 @@ SyncRes::domainmap_t* g_initialDomainMap; // new threads needs this to be setup
 #include "namespaces.hh"
 
 __thread MemRecursorCache* t_RC;
+MemRecursorCache* g_recCache; // shared by all threads if record-cache-shared is set, t_RC then points to it
 __thread RecursorPacketCache* t_packetCache;
 RecursorStats g_stats;
 bool g_quiet;
@@ -623,17 +626,22 @@ static void protobufLogQuery(const std::shared_ptr<RemoteLogger>& logger, uint8_
   }
 
 //  cerr <<message.toDebugString()<<endl;
-  std::string str;
-  message.serialize(str);
-  logger->queueData(str);
+  logger->queueMessage(message);
 }
 
 static void protobufLogResponse(const std::shared_ptr<RemoteLogger>& logger, const RecProtoBufMessage& message)
 {
 //  cerr <<message.toDebugString()<<endl;
-  std::string str;
-  message.serialize(str);
-  logger->queueData(str);
+  logger->queueMessage(message);
+}
+
+static void dnstapLog(const std::shared_ptr<FrameStreamLogger>& logger, const std::string& identity, DnstapMessage::DnstapMessageType type, const ComboAddress& remote, const ComboAddress& local, bool tcp, const char* packet, size_t len, const struct timeval& queryTime)
+{
+  struct timespec queryTS;
+  queryTS.tv_sec = queryTime.tv_sec;
+  queryTS.tv_nsec = queryTime.tv_usec * 1000;
+  DnstapMessage message(type, identity, &remote, &local, tcp, packet, len, &queryTS);
+  logger->queueMessage(message);
 }
 #endif
 
@@ -663,6 +671,50 @@ void handleRPZCustom(const DNSRecord& spoofed, const QType& qtype, SyncRes& sr,
   }
 }
 
+struct PrefetchRequest
+{
+  DNSName qname;
+  QType qtype;
+  ComboAddress requestor;
+};
+
+static void doPrefetch(void* p)
+{
+  std::unique_ptr<PrefetchRequest> req(reinterpret_cast<PrefetchRequest*>(p));
+  struct timeval now;
+  Utility::gettimeofday(&now, 0);
+
+  SyncRes sr(now);
+  sr.setPrefetch();
+  sr.setLogMode(SyncRes::LogNone);
+  sr.d_requestor=req->requestor;
+  sr.d_doDNSSEC=(g_dnssecmode != DNSSECMode::Off);
+  vector<DNSRecord> ret;
+  try {
+    sr.beginResolve(req->qname, req->qtype, QClass::IN, ret);
+  }
+  catch(const ImmediateServFailException& e) {
+    // the current entry will simply expire
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Warning<<"Error while prefetching '"<<req->qname<<"|"<<req->qtype.getName()<<"': "<<e.reason<<endl;
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Warning<<"Error while prefetching '"<<req->qname<<"|"<<req->qtype.getName()<<"': "<<e.what()<<endl;
+  }
+}
+
+// refresh, in the background, the popular entries that were about to expire when we served them
+static void schedulePrefetches(const SyncRes& sr, const ComboAddress& requestor)
+{
+  for(const auto& candidate : sr.getPrefetchCandidates()) {
+    if(MT->numProcesses() >= g_maxMThreads)
+      break;
+    g_stats.prefetches++;
+    MT->makeThread(doPrefetch, new PrefetchRequest{candidate.first, candidate.second, requestor});
+  }
+}
+
 void startDoResolve(void *p)
 {
   DNSComboWriter* dc=(DNSComboWriter *)p;
@@ -825,6 +877,7 @@ void startDoResolve(void *p)
       try {
         res = sr.beginResolve(dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), dc->d_mdp.d_qclass, ret);
         shouldNotValidate = sr.wasOutOfBand();
+        schedulePrefetches(sr, dc->d_remote);
       }
       catch(ImmediateServFailException &e) {
         if(g_logCommonErrors)
@@ -987,6 +1040,9 @@ void startDoResolve(void *p)
             // Is the query source interested in the value of the ad-bit?
             if (dc->d_mdp.d_header.ad || DNSSECOK)
               pw.getHeader()->ad=1;
+
+            if(AggressiveNSECCache::s_maxEntries && (res == RCode::NXDomain || res == RCode::NoError))
+              t_sstorage->aggressiveNSECs.insertDenials(time(0), ret);
           }
           else if(state == Insecure) {
             if(sr.doLog()) {
@@ -1088,6 +1144,9 @@ void startDoResolve(void *p)
       pbMessage.setQueryTime(dc->d_now.tv_sec, dc->d_now.tv_usec);
       protobufLogResponse(luaconfsLocal->protobufServer, pbMessage);
     }
+    if (luaconfsLocal->dnstapServer && luaconfsLocal->dnstapLogResponses) {
+      dnstapLog(luaconfsLocal->dnstapServer, luaconfsLocal->dnstapIdentity, DnstapMessage::ClientResponse, dc->d_remote, dc->d_local, dc->d_tcp, reinterpret_cast<const char*>(packet.data()), packet.size(), dc->d_now);
+    }
 #endif
     if(!dc->d_tcp) {
       struct msghdr msgh;
@@ -1373,6 +1432,9 @@ void handleRunningTCPQuestion(int fd, FDMultiplexer::funcparam_t& var)
             L<<Logger::Warning<<"Error parsing a TCP query packet for edns subnet: "<<e.what()<<endl;
         }
       }
+      if (luaconfsLocal->dnstapServer && luaconfsLocal->dnstapLogQueries) {
+        dnstapLog(luaconfsLocal->dnstapServer, luaconfsLocal->dnstapIdentity, DnstapMessage::ClientQuery, conn->d_remote, dest, true, conn->data, conn->qlen, g_now);
+      }
 #endif
       if(dc->d_mdp.d_header.qr) {
         delete dc;
@@ -1512,6 +1574,9 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
         protobufLogQuery(luaconfsLocal->protobufServer, luaconfsLocal->protobufMaskV4, luaconfsLocal->protobufMaskV6, uniqueId, fromaddr, destaddr, ednssubnet, false, dh->id, question.size(), qname, qtype, qclass, policyTags);
       }
     }
+    if (luaconfsLocal->dnstapServer && luaconfsLocal->dnstapLogQueries) {
+      dnstapLog(luaconfsLocal->dnstapServer, luaconfsLocal->dnstapIdentity, DnstapMessage::ClientQuery, fromaddr, destaddr, false, question.c_str(), question.size(), g_now);
+    }
 #endif /* HAVE_PROTOBUF */
 
     cacheHit = (!SyncRes::s_nopacketcache && t_packetCache->getResponsePacket(ctag, question, g_now.tv_sec, &response, &age, &pbMessage));
@@ -1532,6 +1597,11 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
       g_stats.packetCacheHits++;
       SyncRes::s_queries++;
       ageDNSPacket(response, age);
+#ifdef HAVE_PROTOBUF
+      if (luaconfsLocal->dnstapServer && luaconfsLocal->dnstapLogResponses) {
+        dnstapLog(luaconfsLocal->dnstapServer, luaconfsLocal->dnstapIdentity, DnstapMessage::ClientResponse, fromaddr, destaddr, false, response.c_str(), response.size(), g_now);
+      }
+#endif /* HAVE_PROTOBUF */
       struct msghdr msgh;
       struct iovec iov;
       char cbuf[256];
@@ -1920,7 +1990,7 @@ void doStats(void)
 
 static void houseKeeping(void *)
 {
-  static __thread time_t last_stat, last_rootupdate, last_prune, last_secpoll;
+  static __thread time_t last_stat, last_rootupdate, last_prune, last_secpoll, last_snapshot;
   static __thread int cleanCounter=0;
   static __thread bool s_running;  // houseKeeping can get suspended in secpoll, and be restarted, which makes us do duplicate work
   try {
@@ -1934,10 +2004,15 @@ static void houseKeeping(void *)
     if(now.tv_sec - last_prune > (time_t)(5 + t_id)) {
       DTime dt;
       dt.setTimeval(now);
-      t_RC->doPrune(); // this function is local to a thread, so fine anyhow
+      // a shared record cache is pruned by the first thread only, against the global limit
+      if(!g_recCache)
+        t_RC->doPrune(::arg().asNum("max-cache-entries") / g_numThreads);
+      else if(!t_id)
+        t_RC->doPrune(::arg().asNum("max-cache-entries"));
       t_packetCache->doPruneTo(::arg().asNum("max-packetcache-entries") / g_numWorkerThreads);
 
       pruneCollection(t_sstorage->negcache, ::arg().asNum("max-cache-entries") / (g_numWorkerThreads * 10), 200);
+      t_sstorage->aggressiveNSECs.prune(now.tv_sec, AggressiveNSECCache::s_maxEntries / g_numWorkerThreads);
 
       if(!((cleanCounter++)%40)) {  // this is a full scan!
 	time_t limit=now.tv_sec-300;
@@ -1968,6 +2043,14 @@ static void houseKeeping(void *)
 	}
 	catch(...) {}
       }
+
+      if(!last_snapshot)
+        last_snapshot=now.tv_sec; // the caches were just loaded from the snapshot, if any
+      if(::arg().asNum("cache-snapshot-interval") > 0 && !::arg()["cache-snapshot-file"].empty() &&
+         now.tv_sec - last_snapshot >= ::arg().asNum("cache-snapshot-interval")) {
+        writeCacheSnapshot(::arg()["cache-snapshot-file"]);
+        last_snapshot=time(0);
+      }
     }
     s_running=false;
   }
@@ -2696,6 +2779,10 @@ int serviceMain(int argc, char*argv[])
   SyncRes::s_maxqperq=::arg().asNum("max-qperq");
   SyncRes::s_maxtotusec=1000*::arg().asNum("max-total-msec");
   SyncRes::s_rootNXTrust = ::arg().mustDo( "root-nx-trust");
+  MemRecursorCache::s_maxServeStaleExtension = ::arg().asNum("serve-stale-extension");
+  MemRecursorCache::s_prefetchTTLPerc = ::arg().asNum("prefetch-ttl-perc");
+  MemRecursorCache::s_prefetchMinHits = ::arg().asNum("prefetch-min-hits");
+  AggressiveNSECCache::s_maxEntries = ::arg().asNum("aggressive-nsec-cache-size");
   if(SyncRes::s_serverID.empty()) {
     char tmp[128];
     gethostname(tmp, sizeof(tmp)-1);
@@ -2740,6 +2827,12 @@ int serviceMain(int argc, char*argv[])
   g_maxMThreads = ::arg().asNum("max-mthreads");
   checkOrFixFDS();
 
+  if(::arg().mustDo("record-cache-shared")) {
+    size_t shards = std::max(::arg().asNum("record-cache-shards"), 1);
+    g_recCache = new MemRecursorCache(shards);
+    L<<Logger::Warning<<"Sharing the record cache between all threads, using "<<shards<<" shards"<<endl;
+  }
+
   openssl_thread_setup();
   openssl_seed();
 
@@ -2806,7 +2899,11 @@ try
   t_allowFrom = g_initialAllowFrom;
   t_udpclientsocks = new UDPClientSocks();
   t_tcpClientCounts = new tcpClientCounts_t();
+  if(g_recCache)
+    t_RC = g_recCache;
   primeHints();
+  if(!::arg()["cache-snapshot-file"].empty())
+    loadCacheSnapshot(::arg()["cache-snapshot-file"]);
 
   t_packetCache = new RecursorPacketCache();
 
@@ -3013,6 +3110,14 @@ int main(int argc, char **argv)
     ::arg().set("server-down-throttle-time","Number of seconds to throttle all queries to a server after being marked as down")="60";
     ::arg().set("hint-file", "If set, load root hints from this file")="";
     ::arg().set("max-cache-entries", "If set, maximum number of entries in the main cache")="1000000";
+    ::arg().set("cache-snapshot-file", "If set, load the caches from this file at startup, and write them to it on quit-nicely and every cache-snapshot-interval seconds")="";
+    ::arg().set("cache-snapshot-interval", "Number of seconds between two writes of the cache snapshot, 0 to only write it on quit-nicely")="0";
+    ::arg().set("prefetch-ttl-perc", "Refresh popular records in the background when they are served within this percentage of the end of their TTL, 0 to disable")="0";
+    ::arg().set("prefetch-min-hits", "Minimum number of cache hits since a record was stored for it to be prefetched")="3";
+    ::arg().set("serve-stale-extension", "Number of seconds after their expiration during which records are served when the authoritative servers can't be reached, 0 to disable")="0";
+    ::arg().set("aggressive-nsec-cache-size", "Maximum number of validated NSEC and NSEC3 records kept to synthesize negative answers, 0 to disable")="100000";
+    ::arg().set("record-cache-shared", "If set, share a single record cache between all threads instead of one per thread")="no";
+    ::arg().set("record-cache-shards", "Number of independently locked shards of the shared record cache")="1024";
     ::arg().set("max-negative-ttl", "maximum number of seconds to keep a negative cached entry in memory")="3600";
     ::arg().set("max-cache-ttl", "maximum number of seconds to keep a cached entry in memory")="86400";
     ::arg().set("packetcache-ttl", "maximum number of seconds to keep a cached entry in packetcache")="3600";
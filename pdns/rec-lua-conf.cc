@@ -295,6 +295,59 @@ void loadRecursorLuaConfig(const std::string& fname, bool checkOnly)
         theL()<<Logger::Error<<"Error while starting protobuf logger to '"<<server_<<": "<<e.reason<<endl;
       }
     });
+
+  Lua.writeFunction("dnstapFrameStreamServer", [&lci, checkOnly](const string& path, const boost::optional<std::unordered_map<string,boost::variant<bool, int, string>>>& options) {
+      try {
+        if (lci.dnstapServer) {
+          theL()<<Logger::Error<<"Only one dnstap server can be configured, we already have "<<lci.dnstapServer->toString()<<endl;
+          return;
+        }
+
+        bool isFile = false;
+        uint64_t maxQueuedEntries = 100;
+        uint8_t reconnectWaitTime = 1;
+        if (options) {
+          auto& have = *options;
+          if (have.count("isFile")) {
+            isFile = boost::get<bool>(constGet(have, "isFile"));
+          }
+          if (have.count("identity")) {
+            lci.dnstapIdentity = boost::get<string>(constGet(have, "identity"));
+          }
+          if (have.count("logQueries")) {
+            lci.dnstapLogQueries = boost::get<bool>(constGet(have, "logQueries"));
+          }
+          if (have.count("logResponses")) {
+            lci.dnstapLogResponses = boost::get<bool>(constGet(have, "logResponses"));
+          }
+          if (have.count("maxQueuedEntries")) {
+            maxQueuedEntries = boost::get<int>(constGet(have, "maxQueuedEntries"));
+          }
+          if (have.count("reconnectWaitTime")) {
+            reconnectWaitTime = boost::get<int>(constGet(have, "reconnectWaitTime"));
+          }
+        }
+
+        if (!checkOnly) {
+          /* the current logger keeps writing until every thread has picked up the new configuration,
+             and a second one for the same path would corrupt its stream, so we keep it */
+          const auto current = g_luaconfs.getLocal()->dnstapServer;
+          if (current && current->getPath() == path && current->isFile() == isFile) {
+            theL()<<Logger::Info<<"Keeping the existing dnstap logger to "<<current->toString()<<", a restart is needed to change its queue settings"<<endl;
+            lci.dnstapServer = current;
+          }
+          else {
+            lci.dnstapServer = std::make_shared<FrameStreamLogger>(path, isFile, "protobuf:dnstap.Dnstap", 2, maxQueuedEntries, reconnectWaitTime);
+          }
+        }
+      }
+      catch(std::exception& e) {
+        theL()<<Logger::Error<<"Error while starting dnstap logger to '"<<path<<"': "<<e.what()<<endl;
+      }
+      catch(PDNSException& e) {
+        theL()<<Logger::Error<<"Error while starting dnstap logger to '"<<path<<"': "<<e.reason<<endl;
+      }
+    });
 #endif
 
   try {
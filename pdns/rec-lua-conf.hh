@@ -23,6 +23,7 @@
 #include "sholder.hh"
 #include "sortlist.hh"
 #include "filterpo.hh"
+#include "fstrm_logger.hh"
 #include "remote_logger.hh"
 #include "validate.hh"
 
@@ -38,6 +39,10 @@ public:
   uint8_t protobufMaskV4{32};
   uint8_t protobufMaskV6{128};
   bool protobufTaggedOnly{false};
+  std::shared_ptr<FrameStreamLogger> dnstapServer{nullptr};
+  std::string dnstapIdentity;
+  bool dnstapLogQueries{true};
+  bool dnstapLogResponses{true};
 };
 
 extern GlobalStateHolder<LuaConfigItems> g_luaconfs;
@@ -0,0 +1,326 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <boost/bind.hpp>
+#include "rec-snapshot.hh"
+#include "syncres.hh"
+#include "logger.hh"
+#include "misc.hh"
+
+static const std::string s_snapshotMagic("PDNSSNAP");
+static const uint32_t s_snapshotVersion = 2;
+static std::atomic<bool> s_snapshotFailed{false};
+
+void SnapshotWriter::flush(size_t atLeast)
+{
+  if(d_buffer.empty() || d_buffer.size() < atLeast)
+    return;
+
+  writen2(d_fd, d_buffer);
+  d_buffer.clear();
+}
+
+static void putRecord(SnapshotWriter& sw, const DNSRecord& dr)
+{
+  sw.putName(dr.d_name);
+  sw.putUInt16(dr.d_type);
+  sw.putUInt32(dr.d_ttl);
+  sw.putUInt8(dr.d_place);
+  sw.putBlob(dr.d_content->serialize(dr.d_name));
+}
+
+static DNSRecord getRecord(SnapshotReader& sr)
+{
+  DNSRecord dr;
+  dr.d_name = sr.getName();
+  dr.d_type = sr.getUInt16();
+  dr.d_ttl = sr.getUInt32();
+  dr.d_place = static_cast<DNSResourceRecord::Place>(sr.getUInt8());
+  dr.d_content = DNSRecordContent::unserialize(dr.d_name, dr.d_type, sr.getBlob());
+  return dr;
+}
+
+static uint64_t* pleaseWriteCacheSnapshot(int fd)
+{
+  SnapshotWriter sw(fd);
+  uint64_t count=0;
+  try {
+    sw.putUInt8(static_cast<uint8_t>(SnapshotEntryType::Thread));
+    sw.putUInt16(t_id);
+
+    // a shared record cache is written by the first thread only
+    if(!g_recCache || !t_id)
+      count+=t_RC->doSnapshot(sw);
+
+    uint32_t now=time(0);
+    for(const auto& ne : t_sstorage->negcache) {
+      if(ne.d_ttd <= now)
+        continue;
+      sw.putUInt8(static_cast<uint8_t>(SnapshotEntryType::Negative));
+      sw.putName(ne.d_name);
+      sw.putUInt16(ne.d_qtype.getCode());
+      sw.putName(ne.d_qname);
+      sw.putUInt32(ne.d_ttd);
+      sw.putUInt16(ne.d_dnssecProof.size());
+      for(const auto& proof : ne.d_dnssecProof) {
+        sw.putName(proof.first.first);
+        sw.putUInt16(proof.first.second);
+        sw.putUInt16(proof.second.records.size());
+        for(const auto& record : proof.second.records)
+          putRecord(sw, record);
+        sw.putUInt16(proof.second.signatures.size());
+        for(const auto& signature : proof.second.signatures)
+          putRecord(sw, signature);
+      }
+      count++;
+      sw.flush(65536);
+    }
+
+    // same staleness limit as the periodic cleanup in houseKeeping()
+    time_t limit=now-300;
+    for(auto& speeds : t_sstorage->nsSpeeds) {
+      if(speeds.second.stale(limit))
+        continue;
+      sw.putUInt8(static_cast<uint8_t>(SnapshotEntryType::NSSpeed));
+      sw.putName(speeds.first);
+      sw.putUInt16(speeds.second.d_collection.size());
+      for(auto& speed : speeds.second.d_collection) {
+        sw.putBlob(speed.first.toStringWithPort());
+        sw.putUInt32(speed.second.peek());
+      }
+      count++;
+      sw.flush(65536);
+    }
+    sw.flush();
+  }
+  catch(const std::exception& e) {
+    s_snapshotFailed=true;
+    L<<Logger::Error<<"Error writing the cache snapshot: "<<e.what()<<endl;
+  }
+  catch(const PDNSException& e) {
+    s_snapshotFailed=true;
+    L<<Logger::Error<<"Error writing the cache snapshot: "<<e.reason<<endl;
+  }
+  return new uint64_t(count);
+}
+
+uint64_t writeCacheSnapshot(const std::string& fname)
+{
+  // write to a temporary file first, so that a failure leaves the previous snapshot intact
+  const std::string tmpname=fname+".tmp";
+  int fd=open(tmpname.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0660);
+  if(fd < 0) {
+    L<<Logger::Error<<"Error opening cache snapshot file '"<<tmpname<<"' for writing: "<<stringerror()<<endl;
+    return 0;
+  }
+
+  s_snapshotFailed=false;
+  uint64_t count=0;
+  try {
+    SnapshotWriter sw(fd);
+    for(const auto c : s_snapshotMagic)
+      sw.putUInt8(c);
+    sw.putUInt32(s_snapshotVersion);
+    sw.putUInt32(time(0));
+    sw.flush();
+    count=broadcastAccFunction<uint64_t>(boost::bind(pleaseWriteCacheSnapshot, fd));
+  }
+  catch(const std::exception& e) {
+    s_snapshotFailed=true;
+    L<<Logger::Error<<"Error writing the cache snapshot header: "<<e.what()<<endl;
+  }
+
+  if(fsync(fd) < 0)
+    s_snapshotFailed=true;
+  close(fd);
+
+  if(s_snapshotFailed || rename(tmpname.c_str(), fname.c_str()) < 0) {
+    L<<Logger::Error<<"Unable to write cache snapshot to '"<<fname<<"'"<<endl;
+    unlink(tmpname.c_str());
+    return 0;
+  }
+
+  L<<Logger::Warning<<"Wrote "<<count<<" entries to cache snapshot '"<<fname<<"'"<<endl;
+  return count;
+}
+
+static bool loadRecordEntry(SnapshotReader& sr, time_t now, bool wanted)
+{
+  DNSName qname=sr.getName();
+  uint16_t qtype=sr.getUInt16();
+  std::string netmask=sr.getBlob();
+  bool auth=sr.getUInt8();
+  uint32_t ttd=sr.getUInt32();
+  uint32_t origTTL=sr.getUInt32();
+
+  vector<std::string> records(sr.getUInt16());
+  for(auto& record : records)
+    record=sr.getBlob();
+  vector<std::string> signatures(sr.getUInt16());
+  for(auto& signature : signatures)
+    signature=sr.getBlob();
+
+  if(!wanted || ttd <= now || records.empty())
+    return false;
+
+  vector<DNSRecord> content;
+  content.reserve(records.size());
+  for(const auto& record : records) {
+    DNSRecord dr;
+    dr.d_name=qname;
+    dr.d_type=qtype;
+    dr.d_ttl=ttd;
+    dr.d_content=DNSRecordContent::unserialize(qname, qtype, record);
+    content.push_back(dr);
+  }
+
+  vector<shared_ptr<RRSIGRecordContent>> sigs;
+  sigs.reserve(signatures.size());
+  for(const auto& signature : signatures) {
+    auto rrsig=std::dynamic_pointer_cast<RRSIGRecordContent>(DNSRecordContent::unserialize(qname, QType::RRSIG, signature));
+    if(rrsig)
+      sigs.push_back(rrsig);
+  }
+
+  t_RC->replace(now, qname, QType(qtype), content, sigs, auth, netmask.empty() ? boost::optional<Netmask>() : boost::optional<Netmask>(Netmask(netmask)), origTTL);
+  return true;
+}
+
+static bool loadNegativeEntry(SnapshotReader& sr, time_t now, bool wanted)
+{
+  NegCacheEntry ne;
+  ne.d_name=sr.getName();
+  ne.d_qtype=QType(sr.getUInt16());
+  ne.d_qname=sr.getName();
+  ne.d_ttd=sr.getUInt32();
+  uint16_t proofs=sr.getUInt16();
+  for(uint16_t idx=0; idx < proofs; idx++) {
+    DNSName name=sr.getName();
+    uint16_t qtype=sr.getUInt16();
+    auto& proof=ne.d_dnssecProof[make_pair(name, qtype)];
+    uint16_t records=sr.getUInt16();
+    for(uint16_t rec=0; rec < records; rec++)
+      proof.records.push_back(getRecord(sr));
+    uint16_t signatures=sr.getUInt16();
+    for(uint16_t sig=0; sig < signatures; sig++)
+      proof.signatures.push_back(getRecord(sr));
+  }
+
+  if(!wanted || ne.d_ttd <= now)
+    return false;
+
+  return t_sstorage->negcache.insert(ne).second;
+}
+
+static bool loadNSSpeedEntry(SnapshotReader& sr, struct timeval& now, bool wanted)
+{
+  DNSName name=sr.getName();
+  uint16_t count=sr.getUInt16();
+  for(uint16_t idx=0; idx < count; idx++) {
+    ComboAddress remote(sr.getBlob(), 53);
+    uint32_t usecs=sr.getUInt32();
+    if(wanted)
+      t_sstorage->nsSpeeds[name].submit(remote, usecs, &now);
+  }
+  return wanted && count > 0;
+}
+
+uint64_t loadCacheSnapshot(const std::string& fname)
+{
+  int fd=open(fname.c_str(), O_RDONLY);
+  if(fd < 0) {
+    if(errno != ENOENT)
+      L<<Logger::Error<<"Error opening cache snapshot file '"<<fname<<"': "<<stringerror()<<endl;
+    return 0;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  void* data=mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) {
+    L<<Logger::Error<<"Error mapping cache snapshot file '"<<fname<<"': "<<stringerror()<<endl;
+    return 0;
+  }
+
+  uint64_t loaded=0, skipped=0;
+  try {
+    SnapshotReader sr(static_cast<const char*>(data), st.st_size);
+    for(const auto c : s_snapshotMagic) {
+      if(sr.getUInt8() != static_cast<uint8_t>(c))
+        throw std::runtime_error("not a cache snapshot");
+    }
+    if(sr.getUInt32() != s_snapshotVersion)
+      throw std::runtime_error("unsupported snapshot version");
+    sr.getUInt32(); // time of writing
+
+    struct timeval now;
+    Utility::gettimeofday(&now, 0);
+    // only the entries written by the same thread are loaded, so that each one is loaded once.
+    // A shared record cache is written by the first thread only, and so loaded by it
+    bool wanted=false;
+
+    while(!sr.atEnd()) {
+      bool added=false;
+      switch(static_cast<SnapshotEntryType>(sr.getUInt8())) {
+      case SnapshotEntryType::Thread:
+        wanted = sr.getUInt16() % g_numThreads == t_id;
+        continue;
+      case SnapshotEntryType::Record:
+        added=loadRecordEntry(sr, now.tv_sec, wanted);
+        break;
+      case SnapshotEntryType::Negative:
+        added=loadNegativeEntry(sr, now.tv_sec, wanted);
+        break;
+      case SnapshotEntryType::NSSpeed:
+        added=loadNSSpeedEntry(sr, now, wanted);
+        break;
+      default:
+        throw std::runtime_error("unknown entry type");
+      }
+      if(added)
+        loaded++;
+      else if(wanted)
+        skipped++;
+    }
+  }
+  catch(const std::exception& e) {
+    L<<Logger::Error<<"Error loading cache snapshot '"<<fname<<"', stopped after "<<loaded<<" entries: "<<e.what()<<endl;
+  }
+  catch(const PDNSException& e) {
+    L<<Logger::Error<<"Error loading cache snapshot '"<<fname<<"', stopped after "<<loaded<<" entries: "<<e.reason<<endl;
+  }
+  munmap(data, st.st_size);
+
+  L<<Logger::Warning<<t_id<<" loaded "<<loaded<<" entries from cache snapshot '"<<fname<<"', ignored "<<skipped<<" expired or already known ones"<<endl;
+  return loaded;
+}
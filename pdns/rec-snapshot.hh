@@ -0,0 +1,127 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+#include <string>
+#include <stdexcept>
+#include "dnsname.hh"
+
+/* Compact binary snapshot of the record cache, negative cache and nameserver speeds,
+   written periodically and on quit-nicely, and loaded at startup so that a restarted
+   recursor does not start with cold caches. TTDs are stored as the absolute wall-clock
+   times the caches already use, so entries that expired in the meantime are skipped
+   while loading. The entries of each thread follow a Thread entry holding its id, and are
+   only loaded by the thread with that id, modulo the number of threads. */
+
+enum class SnapshotEntryType : uint8_t { Record=1, Negative=2, NSSpeed=3, Thread=4 };
+
+class SnapshotWriter
+{
+public:
+  SnapshotWriter(int fd): d_fd(fd)
+  {
+  }
+  void putUInt8(uint8_t value)
+  {
+    d_buffer.append(1, static_cast<char>(value));
+  }
+  void putUInt16(uint16_t value)
+  {
+    putUInt8(value >> 8);
+    putUInt8(value & 0xff);
+  }
+  void putUInt32(uint32_t value)
+  {
+    putUInt16(value >> 16);
+    putUInt16(value & 0xffff);
+  }
+  void putBlob(const std::string& blob)
+  {
+    if(blob.size() > 65535)
+      throw std::runtime_error("Snapshot entry too large");
+    putUInt16(blob.size());
+    d_buffer.append(blob);
+  }
+  void putName(const DNSName& name)
+  {
+    putBlob(name.toDNSString());
+  }
+  /* writes the buffered entries to the file once they reach 'atLeast' bytes */
+  void flush(size_t atLeast=0);
+private:
+  std::string d_buffer;
+  int d_fd;
+};
+
+class SnapshotReader
+{
+public:
+  SnapshotReader(const char* data, size_t size): d_data(data), d_size(size)
+  {
+  }
+  bool atEnd() const
+  {
+    return d_pos >= d_size;
+  }
+  uint8_t getUInt8()
+  {
+    need(1);
+    return static_cast<uint8_t>(d_data[d_pos++]);
+  }
+  uint16_t getUInt16()
+  {
+    uint16_t value = getUInt8() << 8;
+    return value | getUInt8();
+  }
+  uint32_t getUInt32()
+  {
+    uint32_t value = getUInt16() << 16;
+    return value | getUInt16();
+  }
+  std::string getBlob()
+  {
+    uint16_t len = getUInt16();
+    need(len);
+    std::string blob(d_data + d_pos, len);
+    d_pos += len;
+    return blob;
+  }
+  DNSName getName()
+  {
+    std::string wire = getBlob();
+    return DNSName(wire.c_str(), wire.size(), 0, false);
+  }
+private:
+  void need(size_t len) const
+  {
+    if(d_size - d_pos < len)
+      throw std::runtime_error("Truncated snapshot");
+  }
+
+  const char* d_data;
+  size_t d_size;
+  size_t d_pos{0};
+};
+
+// writes the caches of all threads to fname, to be called from the first thread. Returns the number of entries written
+uint64_t writeCacheSnapshot(const std::string& fname);
+// loads the entries of the snapshot written by the calling thread that are still valid into its caches
+uint64_t loadCacheSnapshot(const std::string& fname);
@@ -35,6 +35,7 @@
 
 #include "secpoll-recursor.hh"
 #include "pubsuffix.hh"
+#include "rec-snapshot.hh"
 #include "namespaces.hh"
 pthread_mutex_t g_carbon_config_lock=PTHREAD_MUTEX_INITIALIZER;
 
@@ -192,9 +193,15 @@ static uint64_t dumpNegCache(SyncRes::negcache_t& negcache, int fd)
   return count;
 }
 
+// a shared record cache is reported by the first thread only, instead of once per thread
+static bool reportRecordCache()
+{
+  return !g_recCache || !t_id;
+}
+
 static uint64_t* pleaseDump(int fd)
 {
-  return new uint64_t(t_RC->doDump(fd) + dumpNegCache(t_sstorage->negcache, fd) + t_packetCache->doDump(fd));
+  return new uint64_t((reportRecordCache() ? t_RC->doDump(fd) : 0) + dumpNegCache(t_sstorage->negcache, fd) + t_packetCache->doDump(fd));
 }
 
 static uint64_t* pleaseDumpNSSpeeds(int fd)
@@ -277,14 +284,15 @@ uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree)
 
 uint64_t* pleaseWipeAndCountNegCache(const DNSName& canon, bool subtree)
 {
+  uint64_t nsecs = t_sstorage->aggressiveNSECs.wipe(canon, subtree);
   if(!subtree) {
-    uint64_t res = t_sstorage->negcache.count(tie(canon));
+    uint64_t res = nsecs + t_sstorage->negcache.count(tie(canon));
     auto range=t_sstorage->negcache.equal_range(tie(canon));
     t_sstorage->negcache.erase(range.first, range.second);
     return new uint64_t(res);
   }
   else {
-    unsigned int erased=0;
+    unsigned int erased=nsecs;
     for(auto iter = t_sstorage->negcache.lower_bound(tie(canon)); iter != t_sstorage->negcache.end(); ) {
       if(!iter->d_qname.isPartOf(canon))
 	break;
@@ -656,6 +664,16 @@ uint64_t getNegCacheSize()
   return broadcastAccFunction<uint64_t>(pleaseGetNegCacheSize);
 }
 
+uint64_t* pleaseGetAggressiveNSECCacheSize()
+{
+  return new uint64_t(t_sstorage->aggressiveNSECs.size());
+}
+
+uint64_t getAggressiveNSECCacheSize()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetAggressiveNSECCacheSize);
+}
+
 uint64_t* pleaseGetFailedHostsSize()
 {
   uint64_t tmp=t_sstorage->fails.size();
@@ -688,12 +706,12 @@ static uint64_t getConcurrentQueries()
 
 uint64_t* pleaseGetCacheSize()
 {
-  return new uint64_t(t_RC->size());
+  return new uint64_t(reportRecordCache() ? t_RC->size() : 0);
 }
 
 uint64_t* pleaseGetCacheBytes()
 {
-  return new uint64_t(t_RC->bytes());
+  return new uint64_t(reportRecordCache() ? t_RC->bytes() : 0);
 }
 
 
@@ -715,7 +733,7 @@ uint64_t doGetCacheBytes()
 
 uint64_t* pleaseGetCacheHits()
 {
-  return new uint64_t(t_RC->cacheHits);
+  return new uint64_t(reportRecordCache() ? t_RC->cacheHits.load() : 0);
 }
 
 uint64_t doGetCacheHits()
@@ -725,7 +743,7 @@ uint64_t doGetCacheHits()
 
 uint64_t* pleaseGetCacheMisses()
 {
-  return new uint64_t(t_RC->cacheMisses);
+  return new uint64_t(reportRecordCache() ? t_RC->cacheMisses.load() : 0);
 }
 
 uint64_t doGetCacheMisses()
@@ -856,6 +874,7 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("max-mthread-stack", &g_stats.maxMThreadStackUsage);
   
   addGetStat("negcache-entries", boost::bind(getNegCacheSize));
+  addGetStat("aggressive-nsec-cache-entries", boost::bind(getAggressiveNSECCacheSize));
   addGetStat("throttle-entries", boost::bind(getThrottleSize)); 
 
   addGetStat("nsspeeds-entries", boost::bind(getNsSpeedsSize));
@@ -873,6 +892,9 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("dont-outqueries", &SyncRes::s_dontqueries);
   addGetStat("throttled-out", &SyncRes::s_throttledqueries);
   addGetStat("unreachables", &SyncRes::s_unreachables);
+  addGetStat("served-stale", &SyncRes::s_servedStale);
+  addGetStat("nsec-synthesized", &SyncRes::s_nsecSynthesized);
+  addGetStat("prefetches", &g_stats.prefetches);
   addGetStat("chain-resends", &g_stats.chainResends);
   addGetStat("tcp-clients", boost::bind(TCPConnection::getCurrentConnections));
 
@@ -928,8 +950,11 @@ static void doExitGeneric(bool nicely)
   extern string s_pidfname;
   if(!s_pidfname.empty()) 
     unlink(s_pidfname.c_str()); // we can at least try..
-  if(nicely)
+  if(nicely) {
+    if(!::arg()["cache-snapshot-file"].empty())
+      writeCacheSnapshot(::arg()["cache-snapshot-file"]);
     exit(1);
+  }
   else
     _exit(1);
 }
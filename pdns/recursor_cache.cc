@@ -9,11 +9,17 @@
 #include "syncres.hh"
 #include "recursor_cache.hh"
 #include "cachecleaner.hh"
+#include "rec-snapshot.hh"
 #include "namespaces.hh"
 
 unsigned int MemRecursorCache::size()
 {
-  return (unsigned int)d_cache.size();
+  size_t count=0;
+  for(auto& map : d_maps) {
+    Lock l(&map.d_mut);
+    count+=map.d_map.size();
+  }
+  return (unsigned int)count;
 }
 
 // this function is too slow to poll!
@@ -21,26 +27,35 @@ unsigned int MemRecursorCache::bytes()
 {
   unsigned int ret=0;
 
-  for(cache_t::const_iterator i=d_cache.begin(); i!=d_cache.end(); ++i) {
-    ret+=sizeof(struct CacheEntry);
-    ret+=(unsigned int)i->d_qname.toString().length();
-    for(auto j=i->d_records.begin(); j!= i->d_records.end(); ++j)
-      ret+= sizeof(*j); // XXX WRONG we don't know the stored size! j->size();
+  for(auto& map : d_maps) {
+    Lock l(&map.d_mut);
+    for(cache_t::const_iterator i=map.d_map.begin(); i!=map.d_map.end(); ++i) {
+      ret+=sizeof(struct CacheEntry);
+      ret+=(unsigned int)i->d_qname.toString().length();
+      for(auto j=i->d_records.begin(); j!= i->d_records.end(); ++j)
+        ret+= sizeof(*j); // XXX WRONG we don't know the stored size! j->size();
+    }
   }
   return ret;
 }
 
 // returns -1 for no hits
-int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures)
+uint32_t MemRecursorCache::s_maxServeStaleExtension;
+unsigned int MemRecursorCache::s_prefetchTTLPerc;
+unsigned int MemRecursorCache::s_prefetchMinHits;
+
+int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, bool serveStale, bool* refresh)
 {
   unsigned int ttd=0;
   //  cerr<<"looking up "<< qname<<"|"+qt.getName()<<"\n";
+  auto& map = getMap(qname);
+  Lock l(&map.d_mut);
 
-  if(!d_cachecachevalid || d_cachedqname!= qname) {
+  if(!map.d_cachecachevalid || map.d_cachedqname!= qname) {
     //    cerr<<"had cache cache miss"<<endl;
-    d_cachedqname=qname;
-    d_cachecache=d_cache.equal_range(tie(qname));
-    d_cachecachevalid=true;
+    map.d_cachedqname=qname;
+    map.d_cachecache=map.d_map.get<2>().equal_range(qname);
+    map.d_cachecachevalid=true;
   }
   //  else cerr<<"had cache cache hit!"<<endl;
 
@@ -48,20 +63,20 @@ int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vec
     res->clear();
 
   bool haveSubnetSpecific=false;
-  if(d_cachecache.first!=d_cachecache.second) {
-    for(cache_t::const_iterator i=d_cachecache.first; i != d_cachecache.second; ++i) {
+  if(map.d_cachecache.first!=map.d_cachecache.second) {
+    for(auto i=map.d_cachecache.first; i != map.d_cachecache.second; ++i) {
       if(!i->d_netmask.empty()) {
 	//	cout<<"Had a subnet specific hit: "<<i->d_netmask.toString()<<", query was for "<<who.toString()<<": match "<<i->d_netmask.match(who)<<endl;
 	haveSubnetSpecific=true;
       }
     }
-    for(cache_t::const_iterator i=d_cachecache.first; i != d_cachecache.second; ++i)
-      if(i->d_ttd > now && ((i->d_qtype == qt.getCode() || qt.getCode()==QType::ANY ||
+    for(auto i=map.d_cachecache.first; i != map.d_cachecache.second; ++i)
+      if((i->d_ttd > now || (serveStale && (time_t)i->d_ttd + s_maxServeStaleExtension > now)) && ((i->d_qtype == qt.getCode() || qt.getCode()==QType::ANY ||
 			    (qt.getCode()==QType::ADDR && (i->d_qtype == QType::A || i->d_qtype == QType::AAAA) )) 
 			    && (!haveSubnetSpecific || i->d_netmask.match(who)))
          ) {
 
-	ttd = i->d_ttd;	
+	ttd = i->d_ttd > now ? i->d_ttd : now + s_staleAnswerTTL;
         //        cerr<<"Looking at "<<i->d_records.size()<<" records for this name"<<endl;
 	for(auto k=i->d_records.begin(); k != i->d_records.end(); ++k) {
 	  if(res) {
@@ -70,7 +85,7 @@ int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vec
 	    dr.d_type = i->d_qtype;
 	    dr.d_class = 1;
 	    dr.d_content = *k; 
-	    dr.d_ttl = i->d_ttd;
+	    dr.d_ttl = ttd;
 	    dr.d_place = DNSResourceRecord::ANSWER;
 	    res->push_back(dr);
 	  }
@@ -78,11 +93,20 @@ int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vec
       
 	if(signatures)  // if you do an ANY lookup you are hosed XXXX
 	  *signatures=i->d_signatures;
+        if(refresh && s_prefetchTTLPerc && i->d_ttd > now) {
+          i->d_hits++;
+          if(!i->d_prefetchRequested && i->d_hits >= s_prefetchMinHits &&
+             (uint64_t)(i->d_ttd - now) * 100 <= (uint64_t)i->d_origTTL * s_prefetchTTLPerc) {
+            i->d_prefetchRequested = true;
+            *refresh = true;
+          }
+        }
         if(res) {
+          auto entry = map.d_map.project<0>(i);
           if(res->empty())
-            moveCacheItemToFront(d_cache, i);
+            moveCacheItemToFront(map.d_map, entry);
           else
-            moveCacheItemToBack(d_cache, i);
+            moveCacheItemToBack(map.d_map, entry);
         }
         if(qt.getCode()!=QType::ANY && qt.getCode()!=QType::ADDR) // normally if we have a hit, we are done
           break;
@@ -124,15 +148,18 @@ bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const vector<DNSRe
   return true;
 }
 
-void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth, boost::optional<Netmask> ednsmask)
+void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth, boost::optional<Netmask> ednsmask, uint32_t origTTL)
 {
-  d_cachecachevalid=false;
+  auto& map = getMap(qname);
+  Lock l(&map.d_mut);
+
+  map.d_cachecachevalid=false;
   cache_t::iterator stored;
   bool isNew = false;
   auto key=boost::make_tuple(qname, qt.getCode(), ednsmask ? *ednsmask : Netmask());
-  stored=d_cache.find(key);
-  if(stored == d_cache.end()) {
-    stored=d_cache.insert(CacheEntry(key,CacheEntry::records_t(), auth)).first;
+  stored=map.d_map.find(key);
+  if(stored == map.d_map.end()) {
+    stored=map.d_map.insert(CacheEntry(key,CacheEntry::records_t(), auth)).first;
     isNew = true;
   }
 
@@ -140,6 +167,8 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
   CacheEntry ce=*stored; // this is a COPY
   ce.d_qtype=qt.getCode();
   ce.d_signatures=signatures;
+  ce.d_hits=0;
+  ce.d_prefetchRequested=false;
   
   //  cerr<<"asked to store "<< (qname.empty() ? "EMPTY" : qname.toString()) <<"|"+qt.getName()<<" -> '";
   //  cerr<<(content.empty() ? string("EMPTY CONTENT")  : content.begin()->d_content->getZoneRepresentation())<<"', auth="<<auth<<", ce.auth="<<ce.d_auth;
@@ -178,39 +207,49 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
     ce.d_records.push_back(i->d_content);
     // there was code here that did things with TTL and auth. Unsure if it was good. XXX
   }
+  if(origTTL)
+    ce.d_origTTL = origTTL;
+  else
+    ce.d_origTTL = ce.d_ttd > now ? ce.d_ttd - now : 0;
 
   if (!isNew) {
-    moveCacheItemToBack(d_cache, stored);
+    moveCacheItemToBack(map.d_map, stored);
   }
-  d_cache.replace(stored, ce);
+  map.d_map.replace(stored, ce);
 }
 
 int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
 {
   int count=0;
-  d_cachecachevalid=false;
-  pair<cache_t::iterator, cache_t::iterator> range;
 
   if(!sub) {
-    if(qtype==0xffff)
-      range=d_cache.equal_range(tie(name));
-    else
-      range=d_cache.equal_range(tie(name, qtype));
-    for(cache_t::const_iterator i=range.first; i != range.second; ) {
-      count++;
-      d_cache.erase(i++);
+    auto& map = getMap(name);
+    Lock l(&map.d_mut);
+    map.d_cachecachevalid=false;
+    auto& idx = map.d_map.get<2>();
+    auto range = idx.equal_range(name);
+    for(auto i=range.first; i != range.second; ) {
+      if(i->d_qtype == qtype || qtype == 0xffff) {
+        count++;
+        idx.erase(i++);
+      }
+      else
+        ++i;
     }
   }
   else {
-    for(auto iter = d_cache.lower_bound(tie(name)); iter != d_cache.end(); ) {
-      if(!iter->d_qname.isPartOf(name))
-	break;
-      if(iter->d_qtype == qtype || qtype == 0xffff) {
-	count++;
-	d_cache.erase(iter++);
+    // the names below 'name' are spread over all the maps, and not ordered
+    for(auto& map : d_maps) {
+      Lock l(&map.d_mut);
+      map.d_cachecachevalid=false;
+      for(auto iter = map.d_map.begin(); iter != map.d_map.end(); ) {
+        if(iter->d_qname.isPartOf(name) && (iter->d_qtype == qtype || qtype == 0xffff)) {
+          count++;
+          map.d_map.erase(iter++);
+        }
+        else
+          ++iter;
       }
-      else 
-	iter++;
     }
   }
   return count;
@@ -218,9 +257,12 @@ int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
 
 bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtype, int32_t newTTL)
 {
-  cache_t::iterator iter = d_cache.find(tie(name, qtype));
+  auto& map = getMap(name);
+  Lock l(&map.d_mut);
+  // only the entry that is not specific to a client subnet
+  cache_t::iterator iter = map.d_map.find(boost::make_tuple(name, qtype, Netmask()));
   uint32_t maxTTD=std::numeric_limits<uint32_t>::min();
-  if(iter == d_cache.end()) {
+  if(iter == map.d_map.end()) {
     return false;
   }
 
@@ -234,7 +276,7 @@ bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtyp
     return false;  // would be dead anyhow
 
   if(maxTTL > newTTL) {
-    d_cachecachevalid=false;
+    map.d_cachecachevalid=false;
 
     uint32_t newTTD = now + newTTL;
 
@@ -243,7 +285,7 @@ bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtyp
       ce.d_ttd = newTTD;
   
 
-    d_cache.replace(iter, ce);
+    map.d_map.replace(iter, ce);
     return true;
   }
   return false;
@@ -279,18 +321,21 @@ uint64_t MemRecursorCache::doDump(int fd)
     return 0;
   }
   fprintf(fp, "; main record cache dump from thread follows\n;\n");
-  const auto& sidx=d_cache.get<1>();
 
   uint64_t count=0;
   time_t now=time(0);
-  for(auto i=sidx.cbegin(); i != sidx.cend(); ++i) {
-    for(auto j=i->d_records.cbegin(); j != i->d_records.cend(); ++j) {
-      count++;
-      try {
-        fprintf(fp, "%s %d IN %s %s ; %s\n", i->d_qname.toString().c_str(), (int32_t)(i->d_ttd - now), DNSRecordContent::NumberToType(i->d_qtype).c_str(), (*j)->getZoneRepresentation().c_str(), i->d_netmask.empty() ? "" : i->d_netmask.toString().c_str());
-      }
-      catch(...) {
-        fprintf(fp, "; error printing '%s'\n", i->d_qname.empty() ? "EMPTY" : i->d_qname.toString().c_str());
+  for(auto& map : d_maps) {
+    Lock l(&map.d_mut);
+    const auto& sidx=map.d_map.get<1>();
+    for(auto i=sidx.cbegin(); i != sidx.cend(); ++i) {
+      for(auto j=i->d_records.cbegin(); j != i->d_records.cend(); ++j) {
+        count++;
+        try {
+          fprintf(fp, "%s %d IN %s %s ; %s\n", i->d_qname.toString().c_str(), (int32_t)(i->d_ttd - now), DNSRecordContent::NumberToType(i->d_qtype).c_str(), (*j)->getZoneRepresentation().c_str(), i->d_netmask.empty() ? "" : i->d_netmask.toString().c_str());
+        }
+        catch(...) {
+          fprintf(fp, "; error printing '%s'\n", i->d_qname.empty() ? "EMPTY" : i->d_qname.toString().c_str());
+        }
       }
     }
   }
@@ -298,10 +343,47 @@ uint64_t MemRecursorCache::doDump(int fd)
   return count;
 }
 
-void MemRecursorCache::doPrune(void)
+uint64_t MemRecursorCache::doSnapshot(SnapshotWriter& sw)
 {
-  d_cachecachevalid=false;
+  uint64_t count=0;
+  uint32_t now=time(0);
+  for(auto& map : d_maps) {
+    {
+      // the entries of a map are only serialized into the buffer while it is locked,
+      // so that the threads using a shared cache are not blocked by the disk
+      Lock l(&map.d_mut);
+      for(auto i=map.d_map.cbegin(); i != map.d_map.cend(); ++i) {
+        if(i->d_ttd <= now || i->d_records.empty())
+          continue;
+
+        sw.putUInt8(static_cast<uint8_t>(SnapshotEntryType::Record));
+        sw.putName(i->d_qname);
+        sw.putUInt16(i->d_qtype);
+        sw.putBlob(i->d_netmask.empty() ? "" : i->d_netmask.toString());
+        sw.putUInt8(i->d_auth);
+        sw.putUInt32(i->d_ttd);
+        sw.putUInt32(i->d_origTTL);
+        sw.putUInt16(i->d_records.size());
+        for(const auto& record : i->d_records)
+          sw.putBlob(record->serialize(i->d_qname));
+        sw.putUInt16(i->d_signatures.size());
+        for(const auto& signature : i->d_signatures)
+          sw.putBlob(signature->serialize(i->d_qname));
+        count++;
+      }
+    }
+    sw.flush();
+  }
+  return count;
+}
 
-  unsigned int maxCached=::arg().asNum("max-cache-entries") / g_numThreads;
-  pruneCollection(d_cache, maxCached);
+void MemRecursorCache::doPrune(unsigned int maxCached)
+{
+  const unsigned int maxPerMap = maxCached / d_maps.size();
+
+  for(auto& map : d_maps) {
+    Lock l(&map.d_mut);
+    map.d_cachecachevalid=false;
+    pruneCollection(map.d_map, maxPerMap);
+  }
 }
@@ -23,6 +23,7 @@
 #define RECURSOR_CACHE_HH
 #include <string>
 #include <set>
+#include <atomic>
 #include "dns.hh"
 #include "qtype.hh"
 #include "misc.hh"
@@ -32,38 +33,53 @@
 #include <boost/utility.hpp>
 #undef L
 #include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/multi_index/key_extractors.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
 #include <boost/version.hpp>
 #include "iputils.hh"
+#include "lock.hh"
 #undef max
 
 #define L theL()
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
+class SnapshotWriter;
+
 class MemRecursorCache : public boost::noncopyable //  : public RecursorCache
 {
 public:
-  MemRecursorCache() : d_cachecachevalid(false)
+  /* the cache is split into 'shards' maps, selected by qname hash, each with its own lock,
+     so that a single instance can be shared by all threads (see record-cache-shared) */
+  MemRecursorCache(size_t shards=1) : d_maps(shards)
   {
     cacheHits = cacheMisses = 0;
   }
   unsigned int size();
   unsigned int bytes();
-  int get(time_t, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=0);
+  /* if serveStale is set, entries that expired less than s_maxServeStaleExtension seconds ago are returned
+     with a TTL of s_staleAnswerTTL. If refresh is not null, it is set to true when the entry is popular
+     and close enough to its expiration to be refreshed now, which is reported only once per entry */
+  int get(time_t, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=0, bool serveStale=false, bool* refresh=nullptr);
 
-  void replace(time_t, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth, boost::optional<Netmask> ednsmask=boost::optional<Netmask>());
-  void doPrune(void);
+  /* origTTL is the TTL the records were received with, if not 0, when restoring an entry whose TTL has already decreased */
+  void replace(time_t, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth, boost::optional<Netmask> ednsmask=boost::optional<Netmask>(), uint32_t origTTL=0);
+  void doPrune(unsigned int maxCached);
   void doSlash(int perc);
   uint64_t doDump(int fd);
+  uint64_t doSnapshot(SnapshotWriter& sw);
   uint64_t doDumpNSSpeeds(int fd);
 
   int doWipeCache(const DNSName& name, bool sub, uint16_t qtype=0xffff);
   bool doAgeCache(time_t now, const DNSName& name, uint16_t qtype, int32_t newTTL);
-  uint64_t cacheHits, cacheMisses;
+  std::atomic<uint64_t> cacheHits, cacheMisses;
+
+  static uint32_t s_maxServeStaleExtension;
+  static const uint32_t s_staleAnswerTTL = 30;
+  static unsigned int s_prefetchTTLPerc;
+  static unsigned int s_prefetchMinHits;
 
 private:
 
@@ -75,39 +91,94 @@ private:
 
     typedef vector<std::shared_ptr<DNSRecordContent>> records_t;
     vector<std::shared_ptr<RRSIGRecordContent>> d_signatures;
+    // expired entries are kept around as long as they might be served stale
     uint32_t getTTD() const
     {
-      return d_ttd;
+      return d_ttd + s_maxServeStaleExtension;
     }
 
     DNSName d_qname; 
     uint16_t d_qtype;
     bool d_auth;
     uint32_t d_ttd;
+    uint32_t d_origTTL{0};
     records_t d_records;
     Netmask d_netmask;
+    // hits since the entry was last replaced, and whether a refresh has been requested since then
+    mutable uint32_t d_hits{0};
+    mutable bool d_prefetchRequested{false};
+  };
+
+  struct NetmaskHash
+  {
+    size_t operator()(const Netmask& nm) const
+    {
+      if(nm.empty())
+        return 0;
+      return ComboAddress::addressOnlyHash()(nm.getNetwork()) ^ nm.getBits();
+    }
   };
 
+  /* the address of an empty Netmask is not fully initialized, so Netmask::operator== can't be used */
+  struct NetmaskEqual
+  {
+    bool operator()(const Netmask& a, const Netmask& b) const
+    {
+      if(a.empty() || b.empty())
+        return a.empty() && b.empty();
+      return a == b;
+    }
+  };
+
+  /* lookups are done on the exact (qname, qtype, netmask) or on the qname only, so both are hashed
+     to avoid canonical name comparisons on the hot path. Nothing needs the canonical order, wiping
+     a whole subtree is rare enough to scan the entries instead */
   typedef multi_index_container<
     CacheEntry,
     indexed_by <
-                ordered_unique<
+                hashed_unique<
                       composite_key< 
                         CacheEntry,
                         member<CacheEntry,DNSName,&CacheEntry::d_qname>,
                         member<CacheEntry,uint16_t,&CacheEntry::d_qtype>,
                         member<CacheEntry,Netmask,&CacheEntry::d_netmask>
                       >,
-		  composite_key_compare<CanonDNSNameCompare, std::less<uint16_t>, std::less<Netmask> >
+                      composite_key_hash<std::hash<DNSName>, std::hash<uint16_t>, NetmaskHash>,
+                      composite_key_equal_to<std::equal_to<DNSName>, std::equal_to<uint16_t>, NetmaskEqual>
                 >,
-               sequenced<>
+               sequenced<>,
+               hashed_non_unique<member<CacheEntry,DNSName,&CacheEntry::d_qname>, std::hash<DNSName> >
                >
   > cache_t;
+  typedef cache_t::nth_index<2>::type::iterator name_iterator_t;
+
+  struct MapCombo
+  {
+    MapCombo()
+    {
+      pthread_mutex_init(&d_mut, 0);
+    }
+    MapCombo(const MapCombo& old) : MapCombo()
+    {
+    }
+    ~MapCombo()
+    {
+      pthread_mutex_destroy(&d_mut);
+    }
+
+    cache_t d_map;
+    pair<name_iterator_t, name_iterator_t> d_cachecache;
+    DNSName d_cachedqname;
+    bool d_cachecachevalid{false};
+    pthread_mutex_t d_mut;
+  };
+
+  vector<MapCombo> d_maps;
+  MapCombo& getMap(const DNSName& qname)
+  {
+    return d_maps[qname.hash() % d_maps.size()];
+  }
 
-  cache_t d_cache;
-  pair<cache_t::iterator, cache_t::iterator> d_cachecache;
-  DNSName d_cachedqname;
-  bool d_cachecachevalid;
   bool attemptToRefreshNSTTL(const QType& qt, const vector<DNSRecord>& content, const CacheEntry& stored);
 };
 #endif
@@ -0,0 +1 @@
+../aggressive_nsec.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../aggressive_nsec.hh
\ No newline at end of file
@@ -0,0 +1 @@
+../dnstap.hh
\ No newline at end of file
@@ -0,0 +1 @@
+../fstrm_logger.hh
\ No newline at end of file
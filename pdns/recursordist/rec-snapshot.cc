@@ -0,0 +1 @@
+../rec-snapshot.cc
\ No newline at end of file
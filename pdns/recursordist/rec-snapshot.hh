@@ -0,0 +1 @@
+../rec-snapshot.hh
\ No newline at end of file
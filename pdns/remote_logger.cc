@@ -1,4 +1,6 @@
+#include <limits>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "remote_logger.hh"
 #include "config.h"
 #ifdef PDNS_CONFIG_ARGS
@@ -8,10 +10,18 @@
 #include "dolog.hh"
 #endif
 
+/* the maximum number of messages sent in a single writev() call, two iovecs each */
+static const size_t s_maxBatchSize = 64;
+/* the capacity preallocated for every queued message, larger ones grow their buffer once */
+static const size_t s_slotPreallocatedSize = 512;
+/* the reconnection delay doubles after each failure, up to this many seconds */
+static const unsigned int s_maxReconnectWaitTime = 60;
+
 bool RemoteLogger::reconnect()
 {
   if (d_socket >= 0) {
     close(d_socket);
+    d_socket = -1;
   }
   try {
     d_socket = SSocket(d_remote.sin4.sin_family, SOCK_STREAM, 0);
@@ -20,103 +30,259 @@ bool RemoteLogger::reconnect()
   }
   catch(const std::exception& e) {
 #ifdef WE_ARE_RECURSOR
-    L<<Logger::Warning<<"Error connecting to remote logger "<<d_remote.toStringWithPort()<<": "<<e.what()<<std::endl;
+    L<<Logger::Warning<<"Error connecting to remote logger "<<toString()<<": "<<e.what()<<std::endl;
 #else
-    warnlog("Error connecting to remote logger %s: %s", d_remote.toStringWithPort(), e.what());
+    warnlog("Error connecting to remote logger %s: %s", toString(), e.what());
 #endif
+    if (d_socket >= 0) {
+      close(d_socket);
+      d_socket = -1;
+    }
     return false;
   }
   return true;
 }
 
-bool RemoteLogger::sendData(const char* buffer, size_t bufferSize)
+/* reconnect, waiting longer after each failure, until it works or we are exiting */
+void BatchedLogger::waitForReconnect()
+{
+  unsigned int waitTime = d_reconnectWaitTime;
+  while (!d_exiting) {
+    d_reconnects++;
+    if (reconnect()) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(d_wakeupMutex);
+    d_wakeupCond.wait_for(lock, std::chrono::seconds(waitTime), [this]{ return d_exiting.load(); });
+    waitTime = std::min(std::max(waitTime * 2, 1U), std::max(s_maxReconnectWaitTime, static_cast<unsigned int>(d_reconnectWaitTime)));
+  }
+}
+
+bool BatchedLogger::sendBatch(struct iovec* iov, size_t iovCount)
 {
-  size_t pos = 0;
-  while(pos < bufferSize) {
-    ssize_t written = write(d_socket, buffer + pos, bufferSize - pos);
+  while (iovCount > 0) {
+    ssize_t written = writev(d_socket, iov, iovCount);
     if (written == -1) {
       int res = errno;
-      if (res == EWOULDBLOCK || res == EAGAIN) {
-        return false;
+      if (res == EINTR) {
+        continue;
       }
-      else if (res != EINTR) {
-        reconnect();
-        return false;
+      if (res == EWOULDBLOCK || res == EAGAIN) {
+        if (waitForRWData(d_socket, false, d_timeout, 0) <= 0) {
+          return false;
+        }
+        continue;
       }
+      return false;
     }
     else if (written == 0) {
-      reconnect();
       return false;
     }
-    else {
-      pos += (size_t) written;
+
+    /* skip what has been fully written, then adjust the partially written iovec */
+    size_t remaining = static_cast<size_t>(written);
+    while (iovCount > 0 && remaining >= iov->iov_len) {
+      remaining -= iov->iov_len;
+      iov++;
+      iovCount--;
+    }
+    if (iovCount > 0) {
+      iov->iov_base = reinterpret_cast<char*>(iov->iov_base) + remaining;
+      iov->iov_len -= remaining;
     }
   }
 
   return true;
 }
 
-void RemoteLogger::worker()
+bool BatchedLogger::reserveSlot(uint64_t& pos)
 {
-  if (d_asyncConnect) {
-    reconnect();
+  pos = d_enqueuePos.load(std::memory_order_relaxed);
+  for (;;) {
+    const Slot& slot = getSlot(pos);
+    const uint64_t sequence = slot.d_sequence.load(std::memory_order_acquire);
+    if (sequence == pos) {
+      if (d_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        return true;
+      }
+      /* pos has been updated, try again */
+    }
+    else if (sequence < pos) {
+      /* this slot has not been sent yet, the ring is full */
+      d_dropped++;
+      return false;
+    }
+    else {
+      /* another thread got this slot */
+      pos = d_enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void BatchedLogger::commitSlot(uint64_t pos)
+{
+  getSlot(pos).d_sequence.store(pos + 1, std::memory_order_release);
+  d_queued++;
+
+  /* the worker checks the ring again after announcing that it is going to sleep,
+     while holding the lock, so it either sees this message or gets notified */
+  if (d_workerSleeping.load()) {
+    std::lock_guard<std::mutex> lock(d_wakeupMutex);
+    d_wakeupCond.notify_one();
+  }
+}
+
+void BatchedLogger::worker(bool connect)
+{
+  if (connect) {
+    if (!reconnect()) {
+      waitForReconnect();
+    }
   }
 
+  struct iovec iov[s_maxBatchSize * 2];
+  unsigned char prefixes[s_maxBatchSize][sizeof(uint32_t)];
+  const size_t maxSize = d_lengthPrefixSize == sizeof(uint16_t) ? std::numeric_limits<uint16_t>::max() : std::numeric_limits<uint32_t>::max();
+
   while(true) {
-    std::string data;
-    {
-      std::unique_lock<std::mutex> lock(d_writeMutex);
-      d_queueCond.wait(lock, [this]{return (!d_writeQueue.empty()) || d_exiting;});
-      if (d_exiting) {
-        return;
+    if (d_exiting) {
+      return;
+    }
+
+    size_t count = 0;
+    size_t iovCount = 0;
+    size_t batchSize = 0;
+    for (; count < s_maxBatchSize; count++) {
+      const uint64_t pos = d_dequeuePos + count;
+      Slot& slot = getSlot(pos);
+      if (slot.d_sequence.load(std::memory_order_acquire) != pos + 1) {
+        break;
+      }
+      /* empty messages come from a failed serialization, and larger ones can't be framed */
+      if (slot.d_data.empty() || slot.d_data.size() > maxSize) {
+        d_dropped++;
+        continue;
       }
-      data = d_writeQueue.front();
-      d_writeQueue.pop();
+      size_t size = slot.d_data.size();
+      for (size_t idx = d_lengthPrefixSize; idx > 0; idx--) {
+        prefixes[count][idx - 1] = size & 0xff;
+        size >>= 8;
+      }
+      iov[iovCount].iov_base = prefixes[count];
+      iov[iovCount].iov_len = d_lengthPrefixSize;
+      iovCount++;
+      iov[iovCount].iov_base = const_cast<char*>(slot.d_data.data());
+      iov[iovCount].iov_len = slot.d_data.size();
+      iovCount++;
+      batchSize += d_lengthPrefixSize + slot.d_data.size();
     }
 
-    try {
-      uint16_t len = data.length();
-      len = htons(len);
-      writen2WithTimeout(d_socket, &len, sizeof(len), (int) d_timeout);
-      writen2WithTimeout(d_socket, data.c_str(), data.length(), (int) d_timeout);
+    if (count == 0) {
+      std::unique_lock<std::mutex> lock(d_wakeupMutex);
+      d_workerSleeping = true;
+      if (getSlot(d_dequeuePos).d_sequence.load(std::memory_order_acquire) != d_dequeuePos + 1 && !d_exiting) {
+        d_wakeupCond.wait_for(lock, std::chrono::seconds(1));
+      }
+      d_workerSleeping = false;
+      continue;
     }
-    catch(const std::runtime_error& e) {
+
+    size_t sent = 0;
+    size_t dropped = 0;
+    if (iovCount > 0) {
+      if (d_socket < 0) {
+        waitForReconnect();
+      }
+      bool done = d_socket >= 0 && sendBatch(iov, iovCount);
+      if (!done) {
 #ifdef WE_ARE_RECURSOR
-      L<<Logger::Info<<"Error sending data to remote logger "<<d_remote.toStringWithPort()<<": "<< e.what()<<endl;
+        L<<Logger::Info<<"Error sending data to remote logger "<<toString()<<endl;
 #else
-      vinfolog("Error sending data to remote logger (%s): %s", d_remote.toStringWithPort(), e.what());
+        vinfolog("Error sending data to remote logger (%s)", toString());
 #endif
-      while (!reconnect()) {
-        sleep(d_reconnectWaitTime);
+        /* the stream might have been cut in the middle of a message, so the whole batch is lost */
+        dropped = iovCount / 2;
+        if (d_socket >= 0) {
+          waitForReconnect();
+        }
       }
+      else {
+        sent = iovCount / 2;
+        batchSent(batchSize);
+      }
+    }
+
+    /* release the slots to the producers */
+    for (size_t idx = 0; idx < count; idx++) {
+      const uint64_t pos = d_dequeuePos + idx;
+      getSlot(pos).d_sequence.store(pos + d_maxQueuedEntries, std::memory_order_release);
     }
+    d_dequeuePos += count;
+
+    /* only once the slots are available again, so that a producer seeing these counters
+       knows that the ring has room for that many messages */
+    d_dropped += dropped;
+    d_sent += sent;
+  }
+}
+
+void BatchedLogger::queueData(const std::string& data)
+{
+  uint64_t pos;
+  if (!reserveSlot(pos)) {
+    return;
   }
+  /* assign() reuses the capacity of the slot buffer */
+  getSlot(pos).d_data.assign(data);
+  commitSlot(pos);
 }
 
-void RemoteLogger::queueData(const std::string& data)
+BatchedLogger::BatchedLogger(uint16_t timeout, uint64_t maxQueuedEntries, uint8_t reconnectWaitTime, uint8_t lengthPrefixSize): d_timeout(timeout), d_slots(new Slot[std::max(maxQueuedEntries, static_cast<uint64_t>(1))]), d_maxQueuedEntries(std::max(maxQueuedEntries, static_cast<uint64_t>(1))), d_reconnectWaitTime(reconnectWaitTime), d_lengthPrefixSize(lengthPrefixSize == sizeof(uint16_t) ? sizeof(uint16_t) : sizeof(uint32_t))
 {
-  {
-    std::unique_lock<std::mutex> lock(d_writeMutex);
-    if (d_writeQueue.size() >= d_maxQueuedEntries) {
-      d_writeQueue.pop();
+  for (uint64_t idx = 0; idx < d_maxQueuedEntries; idx++) {
+    d_slots[idx].d_sequence.store(idx);
+    d_slots[idx].d_data.reserve(s_slotPreallocatedSize);
+  }
+}
+
+BatchedLogger::~BatchedLogger()
+{
+  stop();
+}
+
+void BatchedLogger::start(bool connectFromWorker)
+{
+  d_thread = std::thread(&BatchedLogger::worker, this, connectFromWorker);
+}
+
+void BatchedLogger::stop()
+{
+  if (d_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(d_wakeupMutex);
+      d_exiting = true;
     }
-    d_writeQueue.push(data);
+    d_wakeupCond.notify_one();
+    d_thread.join();
+  }
+
+  if (d_socket >= 0) {
+    finish();
+    close(d_socket);
+    d_socket = -1;
   }
-  d_queueCond.notify_one();
 }
 
-RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedEntries, uint8_t reconnectWaitTime, bool asyncConnect): d_remote(remote), d_maxQueuedEntries(maxQueuedEntries), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect), d_thread(&RemoteLogger::worker, this)
+RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedEntries, uint8_t reconnectWaitTime, bool asyncConnect): BatchedLogger(timeout, maxQueuedEntries, reconnectWaitTime, sizeof(uint16_t)), d_remote(remote)
 {
-  if (!d_asyncConnect) {
+  if (!asyncConnect) {
     reconnect();
   }
+  start(asyncConnect);
 }
 
 RemoteLogger::~RemoteLogger()
 {
-  d_exiting = true;
-  if (d_socket >= 0)
-    close(d_socket);
-  d_queueCond.notify_one();
-  d_thread.join();
+  stop();
 }
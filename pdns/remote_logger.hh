@@ -24,35 +24,113 @@
 
 #include <atomic>
 #include <condition_variable>
-#include <queue>
+#include <memory>
 #include <thread>
 
 #include "iputils.hh"
 
-class RemoteLogger
+/* Messages are queued into a bounded ring of reusable buffers, without taking a lock,
+   and sent by a single worker thread in batches over the connection opened by the
+   derived class, each message being prefixed by its length in network byte order.
+   When the ring is full, new messages are dropped. */
+class BatchedLogger
 {
 public:
-  RemoteLogger(const ComboAddress& remote, uint16_t timeout=2, uint64_t maxQueuedEntries=100, uint8_t reconnectWaitTime=1, bool asyncConnect=false);
-  ~RemoteLogger();
+  virtual ~BatchedLogger();
   void queueData(const std::string& data);
-  std::string toString()
+  /* serializes the message directly into a queued buffer, T needs a serialize(std::string&) method */
+  template<typename T> void queueMessage(const T& message)
+  {
+    uint64_t pos;
+    if (!reserveSlot(pos)) {
+      return;
+    }
+    auto& slot = getSlot(pos);
+    try {
+      message.serialize(slot.d_data);
+    }
+    catch(...) {
+      /* the slot still has to be released, an empty message is skipped by the worker */
+      slot.d_data.clear();
+      commitSlot(pos);
+      throw;
+    }
+    commitSlot(pos);
+  }
+  virtual std::string toString() = 0;
+  uint64_t getQueued() const { return d_queued; }
+  uint64_t getSent() const { return d_sent; }
+  uint64_t getDropped() const { return d_dropped; }
+  uint64_t getReconnects() const { return d_reconnects; }
+
+protected:
+  BatchedLogger(uint16_t timeout, uint64_t maxQueuedEntries, uint8_t reconnectWaitTime, uint8_t lengthPrefixSize);
+  /* start the worker, once the derived object is fully constructed */
+  void start(bool connectFromWorker);
+  /* stop the worker and close the connection, before the derived object is destroyed */
+  void stop();
+  /* open a new connection into d_socket, closing the existing one if any */
+  virtual bool reconnect() = 0;
+  /* called before the connection is closed when exiting */
+  virtual void finish()
+  {
+  }
+  /* called once a batch of that many bytes, holding only complete messages, has been sent */
+  virtual void batchSent(size_t bytes)
   {
-    return d_remote.toStringWithPort();
   }
-private:
-  bool reconnect();
-  bool sendData(const char* buffer, size_t bufferSize);
-  void worker();
 
-  std::queue<std::string> d_writeQueue;
-  std::mutex d_writeMutex;
-  std::condition_variable d_queueCond;
-  ComboAddress d_remote;
-  uint64_t d_maxQueuedEntries;
   int d_socket{-1};
   uint16_t d_timeout;
+
+private:
+  struct Slot
+  {
+    /* the position this slot is expected to be written at when it is free,
+       that position + 1 once it holds a message not yet sent */
+    std::atomic<uint64_t> d_sequence{0};
+    std::string d_data;
+  };
+
+  bool reserveSlot(uint64_t& pos);
+  void commitSlot(uint64_t pos);
+  Slot& getSlot(uint64_t pos)
+  {
+    return d_slots[pos % d_maxQueuedEntries];
+  }
+  bool sendBatch(struct iovec* iov, size_t iovCount);
+  void waitForReconnect();
+  void worker(bool connect);
+
+  std::unique_ptr<Slot[]> d_slots;
+  std::mutex d_wakeupMutex;
+  std::condition_variable d_wakeupCond;
+  std::atomic<uint64_t> d_enqueuePos{0};
+  std::atomic<uint64_t> d_queued{0};
+  std::atomic<uint64_t> d_sent{0};
+  std::atomic<uint64_t> d_dropped{0};
+  std::atomic<uint64_t> d_reconnects{0};
+  uint64_t d_dequeuePos{0};
+  uint64_t d_maxQueuedEntries;
   uint8_t d_reconnectWaitTime;
+  uint8_t d_lengthPrefixSize;
   std::atomic<bool> d_exiting{false};
-  bool d_asyncConnect{false};
+  std::atomic<bool> d_workerSleeping{false};
   std::thread d_thread;
 };
+
+/* sends the messages to a TCP server, each prefixed by its length on two bytes */
+class RemoteLogger : public BatchedLogger
+{
+public:
+  RemoteLogger(const ComboAddress& remote, uint16_t timeout=2, uint64_t maxQueuedEntries=100, uint8_t reconnectWaitTime=1, bool asyncConnect=false);
+  ~RemoteLogger();
+  std::string toString() override
+  {
+    return d_remote.toStringWithPort();
+  }
+private:
+  bool reconnect() override;
+
+  ComboAddress d_remote;
+};
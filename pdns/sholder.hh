@@ -69,6 +69,12 @@ public:
     return *operator->();
   }
 
+  //! generation of the local copy, as of the last access. Does not refresh it.
+  unsigned int getGeneration() const
+  {
+    return d_generation;
+  }
+
   void reset()
   {
     d_generation=0;
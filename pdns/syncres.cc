@@ -68,6 +68,8 @@ std::atomic<uint64_t> SyncRes::s_throttledqueries;
 std::atomic<uint64_t> SyncRes::s_dontqueries;
 std::atomic<uint64_t> SyncRes::s_nodelegated;
 std::atomic<uint64_t> SyncRes::s_unreachables;
+std::atomic<uint64_t> SyncRes::s_servedStale;
+std::atomic<uint64_t> SyncRes::s_nsecSynthesized;
 unsigned int SyncRes::s_minimumTTL;
 bool SyncRes::s_doIPv6;
 bool SyncRes::s_nopacketcache;
@@ -443,11 +445,19 @@ int SyncRes::doResolve(const DNSName &qname, const QType &qtype, vector<DNSRecor
       }
     }
 
-    if(!d_skipCNAMECheck && doCNAMECacheCheck(qname,qtype,ret,depth,res)) // will reroute us if needed
-      return res;
+    if(d_prefetch && depth == 0) {
+      LOG(prefix<<qname<<": Prefetching, not looking at the cache for '"<<qname<<"|"<<qtype.getName()<<"'"<<endl);
+    }
+    else {
+      if(!d_skipCNAMECheck && doCNAMECacheCheck(qname,qtype,ret,depth,res)) // will reroute us if needed
+        return res;
+
+      if(doCacheCheck(qname,qtype,ret,depth,res)) // we done
+        return res;
 
-    if(doCacheCheck(qname,qtype,ret,depth,res)) // we done
-      return res;
+      if(doAggressiveNSECCacheCheck(qname,qtype,ret,depth,res))
+        return res;
+    }
   }
 
   if(d_cacheonly)
@@ -476,6 +486,19 @@ int SyncRes::doResolve(const DNSName &qname, const QType &qtype, vector<DNSRecor
   if (res == -2)
     return res;
 
+  // RFC 8767: the authoritative servers could not be reached, answer from expired data if we still have some
+  if((res < 0 || res == RCode::ServFail) && MemRecursorCache::s_maxServeStaleExtension && !d_serveStale && !d_prefetch) {
+    int staleRes=0;
+    d_serveStale=true;
+    bool found = (!d_skipCNAMECheck && doCNAMECacheCheck(qname, qtype, ret, depth, staleRes)) || doCacheCheck(qname, qtype, ret, depth, staleRes);
+    d_serveStale=false;
+    if(found) {
+      LOG(prefix<<qname<<": serving stale data for '"<<qname<<"|"<<qtype.getName()<<"'"<<endl);
+      s_servedStale++;
+      return staleRes;
+    }
+  }
+
   return res<0 ? RCode::ServFail : res;
 }
 
@@ -700,7 +723,10 @@ bool SyncRes::doCNAMECacheCheck(const DNSName &qname, const QType &qtype, vector
   LOG(prefix<<qname<<": Looking for CNAME cache hit of '"<<qname<<"|CNAME"<<"'"<<endl);
   vector<DNSRecord> cset;
   vector<std::shared_ptr<RRSIGRecordContent>> signatures;
-  if(t_RC->get(d_now.tv_sec, qname,QType(QType::CNAME), &cset, d_requestor, &signatures) > 0) {
+  bool prefetch=false;
+  if(t_RC->get(d_now.tv_sec, qname,QType(QType::CNAME), &cset, d_requestor, &signatures, d_serveStale, &prefetch) > 0) {
+    if(prefetch)
+      d_prefetchCandidates.push_back(make_pair(qname, QType(QType::CNAME)));
 
     for(auto j=cset.cbegin() ; j != cset.cend() ; ++j) {
       if(j->d_ttl>(unsigned int) d_now.tv_sec) {
@@ -742,6 +768,30 @@ static const DNSName getLastLabel(const DNSName& qname)
 }
 
 
+// RFC 8198: deny qname|qtype from the validated NSEC and NSEC3 ranges we hold, instead of asking
+bool SyncRes::doAggressiveNSECCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, int depth, int &res)
+{
+  if(!AggressiveNSECCache::s_maxEntries || !d_doDNSSEC || qtype == QType::ANY)
+    return false;
+
+  // leave whatever we forward or serve ourselves alone
+  DNSName authname(qname);
+  if(getBestAuthZone(&authname) != t_sstorage->domainmap->end())
+    return false;
+
+  if(!t_sstorage->aggressiveNSECs.getDenial(d_now.tv_sec, qname, qtype, ret, res, d_doDNSSEC))
+    return false;
+
+  string prefix;
+  if(doLog()) {
+    prefix=d_prefix;
+    prefix.append(depth, ' ');
+  }
+  LOG(prefix<<qname<<": "<<(res == RCode::NXDomain ? "Entire name" : qtype.getName())<<" denied by cached NSEC(3) records, synthesizing "<<RCode::to_s(res)<<endl);
+  s_nsecSynthesized++;
+  return true;
+}
+
 bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, int depth, int &res)
 {
   bool giveNegative=false;
@@ -820,7 +870,10 @@ bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSR
   bool found=false, expired=false;
   vector<std::shared_ptr<RRSIGRecordContent>> signatures;
   uint32_t ttl=0;
-  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset, d_requestor, d_doDNSSEC ? &signatures : 0) > 0) {
+  bool prefetch=false;
+  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset, d_requestor, d_doDNSSEC ? &signatures : 0, d_serveStale, giveNegative ? nullptr : &prefetch) > 0) {
+    if(prefetch)
+      d_prefetchCandidates.push_back(make_pair(sqname, sqt));
     LOG(prefix<<sqname<<": Found cache hit for "<<sqt.getName()<<": ");
     for(auto j=cset.cbegin() ; j != cset.cend() ; ++j) {
       LOG(j->d_content->getZoneRepresentation());
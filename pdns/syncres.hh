@@ -40,6 +40,7 @@
 #include "sstuff.hh"
 #include "recursor_cache.hh"
 #include "recpacketcache.hh"
+#include "aggressive_nsec.hh"
 #include <boost/tuple/tuple.hpp>
 #include <boost/optional.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
@@ -345,6 +346,18 @@ public:
     d_skipCNAMECheck = skip;
   }
 
+  //! when set, the cache is not consulted for the queried name itself, so that its entry gets refreshed
+  void setPrefetch(bool prefetch = true)
+  {
+    d_prefetch = prefetch;
+  }
+
+  //! names and types served from the cache during this resolution that should be prefetched
+  const vector<pair<DNSName, QType> >& getPrefetchCandidates() const
+  {
+    return d_prefetchCandidates;
+  }
+
   int asyncresolveWrapper(const ComboAddress& ip, bool ednsMANDATORY, const DNSName& domain, int type, bool doTCP, bool sendRDQuery, struct timeval* now, boost::optional<Netmask>& srcmask, LWResult* res);
 
   static void doEDNSDumpAndClose(int fd);
@@ -359,6 +372,8 @@ public:
   static std::atomic<uint64_t> s_tcpoutqueries;
   static std::atomic<uint64_t> s_nodelegated;
   static std::atomic<uint64_t> s_unreachables;
+  static std::atomic<uint64_t> s_servedStale;
+  static std::atomic<uint64_t> s_nsecSynthesized;
   static unsigned int s_minimumTTL;
   static bool s_doIPv6;
   static unsigned int s_maxqperq;
@@ -378,6 +393,9 @@ public:
   bool d_wasOutOfBand{false};
   bool d_wantsRPZ{true};
   bool d_skipCNAMECheck{false};
+  bool d_prefetch{false};
+  bool d_serveStale{false};
+  vector<pair<DNSName, QType> > d_prefetchCandidates;
   
   typedef multi_index_container <
     NegCacheEntry,
@@ -497,6 +515,7 @@ public:
 
   struct StaticStorage {
     negcache_t negcache;
+    AggressiveNSECCache aggressiveNSECs;
     nsspeeds_t nsSpeeds;
     ednsstatus_t ednsstatus;
     throttle_t throttle;
@@ -514,6 +533,7 @@ private:
   domainmap_t::const_iterator getBestAuthZone(DNSName* qname);
   bool doCNAMECacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, int depth, int &res);
   bool doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, int depth, int &res);
+  bool doAggressiveNSECCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSRecord>&ret, int depth, int &res);
   void getBestNSFromCache(const DNSName &qname, const QType &qtype, vector<DNSRecord>&bestns, bool* flawedNSSet, int depth, set<GetBestNSAnswer>& beenthere);
   DNSName getBestNSNamesFromCache(const DNSName &qname, const QType &qtype, NsSet& nsset, bool* flawedNSSet, int depth, set<GetBestNSAnswer>&beenthere);
 
@@ -605,6 +625,8 @@ struct PacketIDBirthdayCompare: public std::binary_function<PacketID, PacketID,
   }
 };
 extern __thread MemRecursorCache* t_RC;
+extern MemRecursorCache* g_recCache;
+extern __thread unsigned int t_id;
 extern __thread RecursorPacketCache* t_packetCache;
 typedef MTasker<PacketID,string> MT_t;
 extern __thread MT_t* MT;
@@ -640,6 +662,7 @@ struct RecursorStats
   std::atomic<uint64_t> ednsPingMismatches;
   std::atomic<uint64_t> noPingOutQueries, noEdnsOutQueries;
   std::atomic<uint64_t> packetCacheHits;
+  std::atomic<uint64_t> prefetches;
   std::atomic<uint64_t> noPacketError;
   std::atomic<uint64_t> ignoredCount;
   time_t startupTime;
@@ -335,6 +335,101 @@ BOOST_AUTO_TEST_CASE(DNSCryptEncryptedQueryInvalidWithWrongKey) {
   BOOST_CHECK_EQUAL(query->valid, false);
 }
 
+// the shared key is computed once per client, then cached until the certificate changes
+BOOST_AUTO_TEST_CASE(DNSCryptSharedKeysCache) {
+  DnsCryptPrivateKey resolverPrivateKey;
+  DnsCryptCert resolverCert;
+  unsigned char providerPublicKey[DNSCRYPT_PROVIDER_PUBLIC_KEY_SIZE];
+  unsigned char providerPrivateKey[DNSCRYPT_PROVIDER_PRIVATE_KEY_SIZE];
+  time_t now = time(NULL);
+  DnsCryptContext::generateProviderKeys(providerPublicKey, providerPrivateKey);
+  DnsCryptContext::generateCertificate(1, now, now + (24 * 60 * 3600), providerPrivateKey, resolverPrivateKey, resolverCert);
+  DnsCryptContext ctx("2.name", resolverCert, resolverPrivateKey);
+
+  DnsCryptPrivateKey clientPrivateKey;
+  unsigned char clientPublicKey[DNSCRYPT_PUBLIC_KEY_SIZE];
+
+  DnsCryptContext::generateResolverKeyPair(clientPrivateKey, clientPublicKey);
+
+  unsigned char clientNonce[DNSCRYPT_NONCE_SIZE / 2] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x08, 0x09, 0x0A, 0x0B };
+
+  DNSName name("www.powerdns.com.");
+  auto cache = ctx.getSharedKeysCache();
+  BOOST_CHECK_EQUAL(cache->getEntriesCount(), 0);
+
+  for (size_t idx = 0; idx < 2; idx++) {
+    vector<uint8_t> plainQuery;
+    DNSPacketWriter pw(plainQuery, name, QType::AAAA, QClass::IN, 0);
+    pw.getHeader()->rd = 1;
+
+    size_t requiredSize = plainQuery.size() + sizeof(DnsCryptQueryHeader) + DNSCRYPT_MAC_SIZE;
+    if (requiredSize < DnsCryptQuery::minUDPLength) {
+      requiredSize = DnsCryptQuery::minUDPLength;
+    }
+
+    plainQuery.reserve(requiredSize);
+    uint16_t len = plainQuery.size();
+    uint16_t encryptedResponseLen = 0;
+
+    int res = ctx.encryptQuery((char*) plainQuery.data(), len, plainQuery.capacity(), clientPublicKey, clientPrivateKey, clientNonce, false, &encryptedResponseLen);
+    BOOST_CHECK_EQUAL(res, 0);
+
+    std::shared_ptr<DnsCryptQuery> query = std::make_shared<DnsCryptQuery>();
+    uint16_t decryptedLen = 0;
+
+    ctx.parsePacket((char*) plainQuery.data(), encryptedResponseLen, query, false, &decryptedLen);
+
+    BOOST_CHECK_EQUAL(query->valid, true);
+    BOOST_CHECK_EQUAL(query->encrypted, true);
+    BOOST_CHECK_EQUAL(query->sharedKeyComputed, true);
+    BOOST_CHECK_EQUAL(cache->getEntriesCount(), 1);
+    BOOST_CHECK_EQUAL(cache->getMisses(), 1);
+    BOOST_CHECK_EQUAL(cache->getHits(), idx);
+
+    MOADNSParser mdp((char*) plainQuery.data(), decryptedLen);
+    BOOST_CHECK_EQUAL(mdp.d_qname, name);
+  }
+
+  DnsCryptContext::generateCertificate(2, now, now + (24 * 60 * 3600), providerPrivateKey, resolverPrivateKey, resolverCert);
+  ctx.setNewCertificate(resolverCert, resolverPrivateKey);
+  BOOST_CHECK_EQUAL(cache->getEntriesCount(), 0);
+
+  /* the cache is bounded */
+  DnsCryptSharedKeysCache bounded(10, 1);
+  unsigned char sharedKey[DNSCRYPT_BEFORENM_SIZE];
+  memset(sharedKey, 0x42, sizeof(sharedKey));
+  uint64_t generation = bounded.getGeneration();
+  for (uint32_t serial = 0; serial < 20; serial++) {
+    bounded.insert(clientPublicKey, serial, false, generation, sharedKey);
+  }
+  BOOST_CHECK_EQUAL(bounded.getEntriesCount(), 10);
+
+  unsigned char found[DNSCRYPT_BEFORENM_SIZE];
+  BOOST_CHECK_EQUAL(bounded.get(clientPublicKey, 19, false, generation, found), true);
+  BOOST_CHECK(memcmp(found, sharedKey, sizeof(found)) == 0);
+  BOOST_CHECK_EQUAL(bounded.get(clientPublicKey, 19, true, generation, found), false);
+
+  /* a key computed before the cache was cleared, for example because the certificate
+     changed while the query was being decrypted, is not inserted */
+  bounded.clear();
+  BOOST_CHECK_EQUAL(bounded.getEntriesCount(), 0);
+  bounded.insert(clientPublicKey, 19, false, generation, sharedKey);
+  BOOST_CHECK_EQUAL(bounded.getEntriesCount(), 0);
+  BOOST_CHECK_EQUAL(bounded.get(clientPublicKey, 19, false, bounded.getGeneration(), found), false);
+
+  /* and an entry is only returned to a caller of the same generation */
+  generation = bounded.getGeneration();
+  bounded.insert(clientPublicKey, 19, false, generation, sharedKey);
+  BOOST_CHECK_EQUAL(bounded.get(clientPublicKey, 19, false, generation, found), true);
+  BOOST_CHECK_EQUAL(bounded.get(clientPublicKey, 19, false, generation - 1, found), false);
+
+  /* disabled */
+  DnsCryptSharedKeysCache disabled(0);
+  disabled.insert(clientPublicKey, 1, false, disabled.getGeneration(), sharedKey);
+  BOOST_CHECK_EQUAL(disabled.getEntriesCount(), 0);
+  BOOST_CHECK_EQUAL(disabled.get(clientPublicKey, 1, false, disabled.getGeneration(), found), false);
+}
+
 #endif
 
 BOOST_AUTO_TEST_SUITE_END();
@@ -73,7 +73,6 @@ static void validateResponse(const char * packet, size_t packetSize, bool hasEdn
 
 BOOST_AUTO_TEST_CASE(addECSWithoutEDNS)
 {
-  string largerPacket;
   bool ednsAdded = false;
   bool ecsAdded = false;
   ComboAddress remote;
@@ -94,30 +93,30 @@ BOOST_AUTO_TEST_CASE(addECSWithoutEDNS)
   BOOST_CHECK_EQUAL(qname, name);
   BOOST_CHECK(qtype == QType::A);
 
-  handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, largerPacket, &ednsAdded, &ecsAdded, remote, false, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6);
+  BOOST_CHECK(handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, &ednsAdded, &ecsAdded, remote, false, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6));
   BOOST_CHECK((size_t) len > query.size());
-  BOOST_CHECK_EQUAL(largerPacket.size(), 0);
   BOOST_CHECK_EQUAL(ednsAdded, true);
   BOOST_CHECK_EQUAL(ecsAdded, false);
   validateQuery(packet, len);
 
-  /* not large enought packet */
+  /* not large enough packet, left untouched */
+  ednsAdded = false;
+  ecsAdded = false;
   consumed = 0;
   len = query.size();
   qname = DNSName((char*) query.data(), len, sizeof(dnsheader), false, &qtype, NULL, &consumed);
   BOOST_CHECK_EQUAL(qname, name);
   BOOST_CHECK(qtype == QType::A);
 
-  handleEDNSClientSubnet((char*) query.data(), query.size(), consumed, &len, largerPacket, &ednsAdded, &ecsAdded, remote, false, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6);
+  const vector<uint8_t> original = query;
+  BOOST_CHECK(!handleEDNSClientSubnet((char*) query.data(), query.size(), consumed, &len, &ednsAdded, &ecsAdded, remote, false, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6));
   BOOST_CHECK_EQUAL((size_t) len, query.size());
-  BOOST_CHECK(largerPacket.size() > query.size());
-  BOOST_CHECK_EQUAL(ednsAdded, true);
+  BOOST_CHECK(query == original);
+  BOOST_CHECK_EQUAL(ednsAdded, false);
   BOOST_CHECK_EQUAL(ecsAdded, false);
-  validateQuery(largerPacket.c_str(), largerPacket.size());
 }
 
 BOOST_AUTO_TEST_CASE(addECSWithEDNSNoECS) {
-  string largerPacket;
   bool ednsAdded = false;
   bool ecsAdded = false;
   ComboAddress remote;
@@ -140,30 +139,30 @@ BOOST_AUTO_TEST_CASE(addECSWithEDNSNoECS) {
   BOOST_CHECK_EQUAL(qname, name);
   BOOST_CHECK(qtype == QType::A);
 
-  handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, largerPacket, &ednsAdded, &ecsAdded, remote, false, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6);
+  BOOST_CHECK(handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, &ednsAdded, &ecsAdded, remote, false, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6));
   BOOST_CHECK((size_t) len > query.size());
-  BOOST_CHECK_EQUAL(largerPacket.size(), 0);
   BOOST_CHECK_EQUAL(ednsAdded, false);
   BOOST_CHECK_EQUAL(ecsAdded, true);
   validateQuery(packet, len);
 
-  /* not large enought packet */
+  /* not large enough packet, left untouched */
+  ednsAdded = false;
+  ecsAdded = false;
   consumed = 0;
   len = query.size();
   qname = DNSName((char*) query.data(), len, sizeof(dnsheader), false, &qtype, NULL, &consumed);
   BOOST_CHECK_EQUAL(qname, name);
   BOOST_CHECK(qtype == QType::A);
 
-  handleEDNSClientSubnet((char*) query.data(), query.size(), consumed, &len, largerPacket, &ednsAdded, &ecsAdded, remote, false, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6);
+  const vector<uint8_t> original = query;
+  BOOST_CHECK(!handleEDNSClientSubnet((char*) query.data(), query.size(), consumed, &len, &ednsAdded, &ecsAdded, remote, false, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6));
   BOOST_CHECK_EQUAL((size_t) len, query.size());
-  BOOST_CHECK(largerPacket.size() > query.size());
+  BOOST_CHECK(query == original);
   BOOST_CHECK_EQUAL(ednsAdded, false);
-  BOOST_CHECK_EQUAL(ecsAdded, true);
-  validateQuery(largerPacket.c_str(), largerPacket.size());
+  BOOST_CHECK_EQUAL(ecsAdded, false);
 }
 
 BOOST_AUTO_TEST_CASE(replaceECSWithSameSize) {
-  string largerPacket;
   bool ednsAdded = false;
   bool ecsAdded = false;
   ComboAddress remote("192.168.1.25");
@@ -192,16 +191,14 @@ BOOST_AUTO_TEST_CASE(replaceECSWithSameSize) {
   BOOST_CHECK_EQUAL(qname, name);
   BOOST_CHECK(qtype == QType::A);
 
-  handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, largerPacket, &ednsAdded, &ecsAdded, remote, true, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6);
+  BOOST_CHECK(handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, &ednsAdded, &ecsAdded, remote, true, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6));
   BOOST_CHECK_EQUAL((size_t) len, query.size());
-  BOOST_CHECK_EQUAL(largerPacket.size(), 0);
   BOOST_CHECK_EQUAL(ednsAdded, false);
   BOOST_CHECK_EQUAL(ecsAdded, false);
   validateQuery(packet, len);
 }
 
 BOOST_AUTO_TEST_CASE(replaceECSWithSmaller) {
-  string largerPacket;
   bool ednsAdded = false;
   bool ecsAdded = false;
   ComboAddress remote("192.168.1.25");
@@ -230,16 +227,14 @@ BOOST_AUTO_TEST_CASE(replaceECSWithSmaller) {
   BOOST_CHECK_EQUAL(qname, name);
   BOOST_CHECK(qtype == QType::A);
 
-  handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, largerPacket, &ednsAdded, &ecsAdded, remote, true, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6);
+  BOOST_CHECK(handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, &ednsAdded, &ecsAdded, remote, true, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6));
   BOOST_CHECK((size_t) len < query.size());
-  BOOST_CHECK_EQUAL(largerPacket.size(), 0);
   BOOST_CHECK_EQUAL(ednsAdded, false);
   BOOST_CHECK_EQUAL(ecsAdded, false);
   validateQuery(packet, len);
 }
 
 BOOST_AUTO_TEST_CASE(replaceECSWithLarger) {
-  string largerPacket;
   bool ednsAdded = false;
   bool ecsAdded = false;
   ComboAddress remote("192.168.1.25");
@@ -268,26 +263,83 @@ BOOST_AUTO_TEST_CASE(replaceECSWithLarger) {
   BOOST_CHECK_EQUAL(qname, name);
   BOOST_CHECK(qtype == QType::A);
 
-  handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, largerPacket, &ednsAdded, &ecsAdded, remote, true, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6);
+  BOOST_CHECK(handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, &ednsAdded, &ecsAdded, remote, true, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6));
   BOOST_CHECK((size_t) len > query.size());
-  BOOST_CHECK_EQUAL(largerPacket.size(), 0);
   BOOST_CHECK_EQUAL(ednsAdded, false);
   BOOST_CHECK_EQUAL(ecsAdded, false);
   validateQuery(packet, len);
 
-  /* not large enought packet */
+  /* not large enough packet, left untouched */
+  ednsAdded = false;
+  ecsAdded = false;
   consumed = 0;
   len = query.size();
   qname = DNSName((char*) query.data(), len, sizeof(dnsheader), false, &qtype, NULL, &consumed);
   BOOST_CHECK_EQUAL(qname, name);
   BOOST_CHECK(qtype == QType::A);
 
-  handleEDNSClientSubnet((char*) query.data(), query.size(), consumed, &len, largerPacket, &ednsAdded, &ecsAdded, remote, true, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6);
+  const vector<uint8_t> original = query;
+  BOOST_CHECK(!handleEDNSClientSubnet((char*) query.data(), query.size(), consumed, &len, &ednsAdded, &ecsAdded, remote, true, remote.sin4.sin_family == AF_INET ? ECSSourcePrefixV4 : ECSSourcePrefixV6));
   BOOST_CHECK_EQUAL((size_t) len, query.size());
-  BOOST_CHECK(largerPacket.size() > query.size());
+  BOOST_CHECK(query == original);
   BOOST_CHECK_EQUAL(ednsAdded, false);
   BOOST_CHECK_EQUAL(ecsAdded, false);
-  validateQuery(largerPacket.c_str(), largerPacket.size());
+}
+
+BOOST_AUTO_TEST_CASE(addECSWithinReservedRoom) {
+  bool ednsAdded = false;
+  bool ecsAdded = false;
+  ComboAddress remote("2001:db8::1");
+  DNSName name("www.powerdns.com.");
+
+  vector<uint8_t> query;
+  DNSPacketWriter pw(query, name, QType::A, QClass::IN, 0);
+  pw.getHeader()->rd = 1;
+  uint16_t len = query.size();
+
+  /* exactly the room reserved after the largest query, adding an OPT RR with a full IPv6 address */
+  vector<uint8_t> packet(query.size() + s_EDNSClientSubnetRoom);
+  memcpy(packet.data(), query.data(), query.size());
+
+  unsigned int consumed = 0;
+  uint16_t qtype;
+  DNSName qname((const char*) packet.data(), len, sizeof(dnsheader), false, &qtype, NULL, &consumed);
+
+  BOOST_CHECK(handleEDNSClientSubnet((char*) packet.data(), packet.size(), consumed, &len, &ednsAdded, &ecsAdded, remote, false, 128));
+  BOOST_CHECK_EQUAL((size_t) len, packet.size());
+  BOOST_CHECK_EQUAL(ednsAdded, true);
+  BOOST_CHECK_EQUAL(ecsAdded, false);
+  validateQuery((const char*) packet.data(), len);
+}
+
+BOOST_AUTO_TEST_CASE(addECSMasksSourceAddress) {
+  bool ednsAdded = false;
+  bool ecsAdded = false;
+  ComboAddress remote("192.0.2.255");
+  DNSName name("www.powerdns.com.");
+
+  vector<uint8_t> query;
+  DNSPacketWriter pw(query, name, QType::A, QClass::IN, 0);
+  pw.getHeader()->rd = 1;
+  uint16_t len = query.size();
+
+  char packet[1500];
+  memcpy(packet, query.data(), query.size());
+
+  unsigned int consumed = 0;
+  uint16_t qtype;
+  DNSName qname(packet, len, sizeof(dnsheader), false, &qtype, NULL, &consumed);
+
+  BOOST_CHECK(handleEDNSClientSubnet(packet, sizeof packet, consumed, &len, &ednsAdded, &ecsAdded, remote, false, 20));
+  validateQuery(packet, len);
+
+  /* the bits beyond the prefix length are zeroed, so that all the clients of the same prefix share the same query */
+  const unsigned char* ecs = reinterpret_cast<const unsigned char*>(packet) + len - 5;
+  BOOST_CHECK_EQUAL(ecs[0], 20);
+  BOOST_CHECK_EQUAL(ecs[1], 0);
+  BOOST_CHECK_EQUAL(ecs[2], 192);
+  BOOST_CHECK_EQUAL(ecs[3], 0);
+  BOOST_CHECK_EQUAL(ecs[4], 0);
 }
 
 BOOST_AUTO_TEST_CASE(removeEDNSWhenFirst) {
@@ -754,4 +806,131 @@ BOOST_AUTO_TEST_CASE(rewritingWithoutECSWhenLastOption) {
   validateResponse((const char *) newResponse.data(), newResponse.size(), true, 1);
 }
 
+BOOST_AUTO_TEST_CASE(removeEDNSInPlaceWhenIntermediary) {
+  DNSName name("www.powerdns.com.");
+
+  vector<uint8_t> response;
+  DNSPacketWriter pw(response, name, QType::A, QClass::IN, 0);
+  pw.getHeader()->qr = 1;
+  pw.startRecord(name, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER, true);
+  pw.xfr32BitInt(0x01020304);
+  pw.startRecord(DNSName("other.powerdns.com."), QType::A, 3600, QClass::IN, DNSResourceRecord::ADDITIONAL, true);
+  pw.xfr32BitInt(0x01020304);
+  pw.commit();
+  pw.addOpt(512, 0, 0);
+  pw.commit();
+  /* compressed, pointing before the OPT RR */
+  pw.startRecord(DNSName("yetanother.powerdns.com."), QType::A, 3600, QClass::IN, DNSResourceRecord::ADDITIONAL, true);
+  pw.xfr32BitInt(0x01020304);
+  pw.commit();
+
+  char * optStart = NULL;
+  size_t optLen = 0;
+  bool last = false;
+
+  int res = locateEDNSOptRR((char *) response.data(), response.size(), &optStart, &optLen, &last);
+  BOOST_CHECK_EQUAL(res, 0);
+  BOOST_CHECK_EQUAL(last, false);
+
+  uint16_t responseLen = response.size();
+  res = removeEDNSOptRRInPlace((char *) response.data(), &responseLen, optStart, optLen);
+  BOOST_CHECK_EQUAL(res, 0);
+  size_t const ednsOptRRSize = sizeof(struct dnsrecordheader) + 1 /* root in OPT RR */;
+  BOOST_CHECK_EQUAL(responseLen, response.size() - ednsOptRRSize);
+
+  validateResponse((const char *) response.data(), responseLen, false, 2);
+
+  MOADNSParser mdp((const char *) response.data(), responseLen);
+  BOOST_REQUIRE_EQUAL(mdp.d_answers.size(), 3);
+  BOOST_CHECK_EQUAL(mdp.d_answers.at(2).first.d_name.toString(), "yetanother.powerdns.com.");
+}
+
+BOOST_AUTO_TEST_CASE(removeEDNSInPlaceWhenPointedTo) {
+  DNSName name("www.powerdns.com.");
+
+  vector<uint8_t> response;
+  DNSPacketWriter pw(response, name, QType::A, QClass::IN, 0);
+  pw.getHeader()->qr = 1;
+  pw.startRecord(name, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER, true);
+  pw.xfr32BitInt(0x01020304);
+  pw.addOpt(512, 0, 0);
+  pw.commit();
+  pw.startRecord(DNSName("other.powerdns.com."), QType::A, 3600, QClass::IN, DNSResourceRecord::ADDITIONAL, true);
+  pw.xfr32BitInt(0x01020304);
+  pw.commit();
+  /* compressed, pointing to the previous record, after the OPT RR */
+  pw.startRecord(DNSName("other.powerdns.com."), QType::A, 3600, QClass::IN, DNSResourceRecord::ADDITIONAL, true);
+  pw.xfr32BitInt(0x05060708);
+  pw.commit();
+
+  char * optStart = NULL;
+  size_t optLen = 0;
+  bool last = false;
+
+  int res = locateEDNSOptRR((char *) response.data(), response.size(), &optStart, &optLen, &last);
+  BOOST_CHECK_EQUAL(res, 0);
+  BOOST_CHECK_EQUAL(last, false);
+
+  const vector<uint8_t> original = response;
+  uint16_t responseLen = response.size();
+  res = removeEDNSOptRRInPlace((char *) response.data(), &responseLen, optStart, optLen);
+  BOOST_CHECK_EQUAL(res, ENOTSUP);
+  /* left untouched */
+  BOOST_CHECK_EQUAL(responseLen, original.size());
+  BOOST_CHECK(response == original);
+
+  vector<uint8_t> newResponse;
+  res = rewriteResponseWithoutEDNS((const char *) response.data(), response.size(), newResponse);
+  BOOST_CHECK_EQUAL(res, 0);
+  validateResponse((const char *) newResponse.data(), newResponse.size(), false, 2);
+}
+
+BOOST_AUTO_TEST_CASE(removeECSInPlaceWhenIntermediary) {
+  DNSName name("www.powerdns.com.");
+  ComboAddress origRemote("127.0.0.1");
+
+  vector<uint8_t> response;
+  DNSPacketWriter pw(response, name, QType::A, QClass::IN, 0);
+  pw.getHeader()->qr = 1;
+  pw.startRecord(name, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER, true);
+  pw.xfr32BitInt(0x01020304);
+
+  EDNSSubnetOpts ecsOpts;
+  ecsOpts.source = Netmask(origRemote, ECSSourcePrefixV4);
+  string origECSOptionStr = makeEDNSSubnetOptsString(ecsOpts);
+  EDNSCookiesOpt cookiesOpt;
+  cookiesOpt.client = string("deadbeef");
+  cookiesOpt.server = string("deadbeef");
+  string cookiesOptionStr = makeEDNSCookiesOptString(cookiesOpt);
+  DNSPacketWriter::optvect_t opts;
+  opts.push_back(make_pair(EDNSOptionCode::ECS, origECSOptionStr));
+  opts.push_back(make_pair(EDNSOptionCode::COOKIE, cookiesOptionStr));
+  pw.addOpt(512, 0, 0, opts);
+  pw.commit();
+
+  pw.startRecord(name, QType::AAAA, 3600, QClass::IN, DNSResourceRecord::ADDITIONAL, true);
+  pw.xfrIP6(std::string(16, '\x01'));
+  pw.commit();
+
+  char * optStart = NULL;
+  size_t optLen = 0;
+  bool last = false;
+
+  int res = locateEDNSOptRR((char *) response.data(), response.size(), &optStart, &optLen, &last);
+  BOOST_CHECK_EQUAL(res, 0);
+  BOOST_CHECK_EQUAL(last, false);
+
+  uint16_t responseLen = response.size();
+  res = removeEDNSOptionInPlace((char *) response.data(), &responseLen, optStart, optLen, EDNSOptionCode::ECS);
+  BOOST_CHECK_EQUAL(res, 0);
+  BOOST_CHECK_EQUAL(responseLen, response.size() - (origECSOptionStr.size() + 4));
+
+  validateResponse((const char *) response.data(), responseLen, true, 1);
+
+  MOADNSParser mdp((const char *) response.data(), responseLen);
+  BOOST_REQUIRE_EQUAL(mdp.d_answers.size(), 3);
+  BOOST_CHECK(mdp.d_answers.at(2).first.d_type == QType::AAAA);
+  BOOST_CHECK_EQUAL(mdp.d_answers.at(2).first.d_name, name);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
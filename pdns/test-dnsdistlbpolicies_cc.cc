@@ -0,0 +1,216 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+#include "dnswriter.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistlbpolicies_cc)
+
+static std::shared_ptr<DownstreamState> makeServer(const std::string& address, int weight=1)
+{
+  auto server = std::make_shared<DownstreamState>(ComboAddress(address, 53));
+  server->weight = weight;
+  server->setUp();
+  return server;
+}
+
+/* holds everything a DNSQuestion points to */
+struct TestQuery
+{
+  TestQuery(const std::string& name): qname(name), remote("192.0.2.1"), local("192.0.2.254:53")
+  {
+    DNSPacketWriter pw(packet, qname, QType::A);
+    dq = std::unique_ptr<DNSQuestion>(new DNSQuestion(&qname, QType::A, QClass::IN, &local, &remote, reinterpret_cast<struct dnsheader*>(packet.data()), packet.size(), packet.size(), false));
+  }
+
+  std::vector<uint8_t> packet;
+  DNSName qname;
+  ComboAddress remote;
+  ComboAddress local;
+  std::unique_ptr<DNSQuestion> dq;
+};
+
+static const size_t s_namesCount{1000};
+
+/* the server selected for each name by the chashed policy of the pool */
+static std::vector<const DownstreamState*> getSelection(const ServerPolicy& policy, const ServerPool& pool)
+{
+  std::vector<const DownstreamState*> result;
+  for (size_t idx = 0; idx < s_namesCount; idx++) {
+    TestQuery query("name" + std::to_string(idx) + ".powerdns.com.");
+    auto server = policy.getSelectedBackend(pool, query.dq.get());
+    result.push_back(server.get());
+  }
+  return result;
+}
+
+BOOST_AUTO_TEST_CASE(test_ConsistentHashingStability) {
+  const ServerPolicy policy{"chashed", chashed, chashedFromPool};
+  pools_t pools;
+  std::vector<std::shared_ptr<DownstreamState> > servers;
+  for (size_t idx = 1; idx <= 5; idx++) {
+    servers.push_back(makeServer("127.0.0." + std::to_string(idx)));
+    addServerToPool(pools, "", servers.back());
+  }
+  auto pool = getPool(pools, "");
+  BOOST_REQUIRE(pool->getHashRing());
+  BOOST_CHECK_EQUAL(pool->getHashRing()->size(), 5 * 100);
+
+  const auto initial = getSelection(policy, *pool);
+  std::map<const DownstreamState*, size_t> counts;
+  for (const auto server : initial) {
+    BOOST_REQUIRE(server != nullptr);
+    counts[server]++;
+  }
+  /* every server gets a fair share */
+  BOOST_CHECK_EQUAL(counts.size(), servers.size());
+  for (const auto& count : counts) {
+    BOOST_CHECK_GT(count.second, s_namesCount / servers.size() / 2);
+  }
+
+  /* the pool's ring gives the same result as one built on the fly, as for custom policies */
+  for (size_t idx = 0; idx < 10; idx++) {
+    TestQuery query("name" + std::to_string(idx) + ".powerdns.com.");
+    BOOST_CHECK(chashed(pool->servers, query.dq.get()).get() == initial.at(idx));
+  }
+
+  /* adding a server only moves names to that server */
+  auto added = makeServer("127.0.0.6");
+  addServerToPool(pools, "", added);
+  auto selection = getSelection(policy, *pool);
+  size_t moved = 0;
+  for (size_t idx = 0; idx < s_namesCount; idx++) {
+    if (selection.at(idx) != initial.at(idx)) {
+      BOOST_CHECK(selection.at(idx) == added.get());
+      moved++;
+    }
+  }
+  BOOST_CHECK_GT(moved, 0);
+  BOOST_CHECK_LT(moved, s_namesCount / 3);
+
+  /* removing it moves them back */
+  removeServerFromPool(pools, "", added);
+  BOOST_CHECK(getSelection(policy, *pool) == initial);
+
+  /* removing another server only moves the names it had */
+  const auto removed = servers.at(2);
+  removeServerFromPool(pools, "", removed);
+  selection = getSelection(policy, *pool);
+  for (size_t idx = 0; idx < s_namesCount; idx++) {
+    if (initial.at(idx) == removed.get()) {
+      BOOST_CHECK(selection.at(idx) != removed.get());
+    }
+    else {
+      BOOST_CHECK(selection.at(idx) == initial.at(idx));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_ConsistentHashingDownServer) {
+  const ServerPolicy policy{"chashed", chashed, chashedFromPool};
+  pools_t pools;
+  std::vector<std::shared_ptr<DownstreamState> > servers;
+  for (size_t idx = 1; idx <= 4; idx++) {
+    servers.push_back(makeServer("127.0.0." + std::to_string(idx)));
+    addServerToPool(pools, "", servers.back());
+  }
+  auto pool = getPool(pools, "");
+  const auto initial = getSelection(policy, *pool);
+
+  /* a server going down is skipped without rebuilding the ring, and only its names move */
+  const auto ring = pool->getHashRing();
+  servers.at(0)->setDown();
+  auto selection = getSelection(policy, *pool);
+  BOOST_CHECK(pool->getHashRing() == ring);
+  for (size_t idx = 0; idx < s_namesCount; idx++) {
+    if (initial.at(idx) == servers.at(0).get()) {
+      BOOST_CHECK(selection.at(idx) != nullptr);
+      BOOST_CHECK(selection.at(idx) != servers.at(0).get());
+    }
+    else {
+      BOOST_CHECK(selection.at(idx) == initial.at(idx));
+    }
+  }
+
+  servers.at(0)->setUp();
+  BOOST_CHECK(getSelection(policy, *pool) == initial);
+
+  /* nothing is up */
+  for (auto& server : servers) {
+    server->setDown();
+  }
+  TestQuery query("www.powerdns.com.");
+  BOOST_CHECK(policy.getSelectedBackend(*pool, query.dq.get()) == nullptr);
+
+  /* an empty pool */
+  pools_t emptyPools;
+  createPoolIfNotExists(emptyPools, "empty");
+  BOOST_CHECK(policy.getSelectedBackend(*getPool(emptyPools, "empty"), query.dq.get()) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_ConsistentHashingWeight) {
+  const ServerPolicy policy{"chashed", chashed, chashedFromPool};
+  pools_t pools;
+  auto light = makeServer("127.0.0.1", 1);
+  auto heavy = makeServer("127.0.0.2", 3);
+  auto none = makeServer("127.0.0.3", 0);
+  addServerToPool(pools, "", light);
+  addServerToPool(pools, "", heavy);
+  addServerToPool(pools, "", none);
+  auto pool = getPool(pools, "");
+  BOOST_CHECK_EQUAL(pool->getHashRing()->size(), 4 * 100);
+
+  std::map<const DownstreamState*, size_t> counts;
+  for (const auto server : getSelection(policy, *pool)) {
+    counts[server]++;
+  }
+  BOOST_CHECK_EQUAL(counts.count(none.get()), 0);
+  BOOST_CHECK_GT(counts[heavy.get()], counts[light.get()]);
+}
+
+BOOST_AUTO_TEST_CASE(test_PowerOfTwoChoices) {
+  NumberedServerVector servers;
+  /* fast but busy: (100 + 1) * (10 + 1) = 1111 */
+  auto busy = makeServer("127.0.0.1");
+  busy->latencyUsec = 100;
+  busy->outstanding = 10;
+  servers.push_back({1, busy});
+  /* slow but idle: (1000 + 1) * (0 + 1) = 1001 */
+  auto idle = makeServer("127.0.0.2");
+  idle->latencyUsec = 1000;
+  servers.push_back({2, idle});
+  /* the best score, but a higher order */
+  auto backup = makeServer("127.0.0.3");
+  backup->order = 2;
+  servers.push_back({3, backup});
+
+  TestQuery query("www.powerdns.com.");
+  /* with only two servers of the lowest order, both are always picked and the best score wins */
+  for (size_t idx = 0; idx < 100; idx++) {
+    BOOST_CHECK(powerOfTwoChoices(servers, query.dq.get()) == idle);
+  }
+
+  idle->outstanding = 1;
+  /* (1000 + 1) * (1 + 1) = 2002 */
+  for (size_t idx = 0; idx < 100; idx++) {
+    BOOST_CHECK(powerOfTwoChoices(servers, query.dq.get()) == busy);
+  }
+
+  /* a single server of the lowest order is up */
+  busy->setDown();
+  for (size_t idx = 0; idx < 100; idx++) {
+    BOOST_CHECK(powerOfTwoChoices(servers, query.dq.get()) == idle);
+  }
+
+  /* the higher order is only used once the lower one is down */
+  idle->setDown();
+  BOOST_CHECK(powerOfTwoChoices(servers, query.dq.get()) == backup);
+
+  backup->setDown();
+  BOOST_CHECK(powerOfTwoChoices(servers, query.dq.get()) == nullptr);
+  BOOST_CHECK(powerOfTwoChoices(NumberedServerVector(), query.dq.get()) == nullptr);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
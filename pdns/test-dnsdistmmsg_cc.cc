@@ -0,0 +1,173 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-mmsg.hh"
+#include "iputils.hh"
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+
+BOOST_AUTO_TEST_SUITE(dnsdistmmsg_cc)
+
+static int getBoundSocket(ComboAddress& local)
+{
+  int fd = SSocket(AF_INET, SOCK_DGRAM, 0);
+  local = ComboAddress("127.0.0.1", 0);
+  SBind(fd, local);
+  socklen_t len = local.getSocklen();
+  BOOST_REQUIRE_EQUAL(getsockname(fd, reinterpret_cast<struct sockaddr*>(&local), &len), 0);
+  return fd;
+}
+
+static void sendTo(int fd, const std::string& payload, const ComboAddress& dest)
+{
+  BOOST_REQUIRE_EQUAL(sendto(fd, payload.data(), payload.size(), 0, reinterpret_cast<const struct sockaddr*>(&dest), dest.getSocklen()), static_cast<ssize_t>(payload.size()));
+}
+
+static std::string receiveFrom(int fd, ComboAddress& from)
+{
+  char buffer[1500];
+  from = ComboAddress("0.0.0.0", 0);
+  socklen_t len = from.getSocklen();
+  ssize_t got = recvfrom(fd, buffer, sizeof(buffer), 0, reinterpret_cast<struct sockaddr*>(&from), &len);
+  BOOST_REQUIRE_GE(got, 0);
+  return std::string(buffer, got);
+}
+
+BOOST_AUTO_TEST_CASE(test_ReceiveAndSendBatch) {
+  ComboAddress serverAddr, client1Addr, client2Addr;
+  int server = getBoundSocket(serverAddr);
+  int client1 = getBoundSocket(client1Addr);
+  int client2 = getBoundSocket(client2Addr);
+
+  UDPMessagesBatch batch(8, AF_INET, 512, 600, 512);
+  BOOST_CHECK_EQUAL(batch.size(), 8);
+  BOOST_CHECK_EQUAL(batch.getQueryBufferSize(), 600);
+
+  sendTo(client1, "query-1", serverAddr);
+  sendTo(client2, "query-2", serverAddr);
+  sendTo(client1, "query-3", serverAddr);
+
+  int got = batch.receive(server);
+  BOOST_REQUIRE_EQUAL(got, 3);
+  BOOST_CHECK_EQUAL(std::string(batch.getQuery(0), batch.getQueryLength(0)), "query-1");
+  BOOST_CHECK_EQUAL(std::string(batch.getQuery(1), batch.getQueryLength(1)), "query-2");
+  BOOST_CHECK_EQUAL(std::string(batch.getQuery(2), batch.getQueryLength(2)), "query-3");
+  BOOST_CHECK(batch.getRemote(0) == client1Addr);
+  BOOST_CHECK(batch.getRemote(1) == client2Addr);
+  BOOST_CHECK(batch.getRemote(2) == client1Addr);
+
+  /* only the first and the last ones get an immediate response, in their own buffers */
+  for (size_t idx = 0; idx < 3; idx++) {
+    batch.getDest(idx).sin4.sin_family = 0;
+  }
+  const std::string resp1("response-1"), resp3("response-3");
+  memcpy(batch.getResponse(0), resp1.data(), resp1.size());
+  memcpy(batch.getResponse(2), resp3.data(), resp3.size());
+  batch.queueResponse(0, batch.getResponse(0), resp1.size());
+  batch.queueResponse(2, batch.getResponse(2), resp3.size());
+  BOOST_CHECK_EQUAL(batch.getQueuedCount(), 2);
+  BOOST_CHECK_EQUAL(batch.sendQueued(server), 2);
+  BOOST_CHECK_EQUAL(batch.getQueuedCount(), 0);
+  BOOST_CHECK_EQUAL(batch.sendQueued(server), 0);
+
+  ComboAddress from;
+  BOOST_CHECK_EQUAL(receiveFrom(client1, from), resp1);
+  BOOST_CHECK(from == serverAddr);
+  BOOST_CHECK_EQUAL(receiveFrom(client1, from), resp3);
+
+  /* nothing was sent to the second client */
+  char buffer[16];
+  BOOST_CHECK_EQUAL(recv(client2, buffer, sizeof(buffer), MSG_DONTWAIT), -1);
+
+  close(client2);
+  close(client1);
+  close(server);
+}
+
+BOOST_AUTO_TEST_CASE(test_ReceiveResetsHeaders) {
+  ComboAddress serverAddr, client1Addr, client2Addr;
+  int server = getBoundSocket(serverAddr);
+  int client1 = getBoundSocket(client1Addr);
+  int client2 = getBoundSocket(client2Addr);
+
+  UDPMessagesBatch batch(2, AF_INET, 512, 512, 512);
+
+  /* more datagrams than the batch can hold */
+  sendTo(client1, "a", serverAddr);
+  sendTo(client1, "bb", serverAddr);
+  sendTo(client2, "ccc", serverAddr);
+
+  BOOST_REQUIRE_EQUAL(batch.receive(server), 2);
+  BOOST_CHECK_EQUAL(batch.getQueryLength(0), 1);
+  BOOST_CHECK_EQUAL(batch.getQueryLength(1), 2);
+
+  /* the remaining one is received by the next call, with its own sender */
+  BOOST_REQUIRE_EQUAL(batch.receive(server), 1);
+  BOOST_CHECK_EQUAL(std::string(batch.getQuery(0), batch.getQueryLength(0)), "ccc");
+  BOOST_CHECK(batch.getRemote(0) == client2Addr);
+  BOOST_CHECK_EQUAL(batch.getMessageHeader(0)->msg_flags & MSG_TRUNC, 0);
+
+  close(client2);
+  close(client1);
+  close(server);
+}
+
+BOOST_AUTO_TEST_CASE(test_TruncatedDatagram) {
+  ComboAddress serverAddr, clientAddr;
+  int server = getBoundSocket(serverAddr);
+  int client = getBoundSocket(clientAddr);
+
+  /* only the first 16 bytes of the 32-byte buffer are used for receiving */
+  UDPMessagesBatch batch(4, AF_INET, 16, 32, 512);
+
+  sendTo(client, std::string(20, 'x'), serverAddr);
+  sendTo(client, std::string(10, 'y'), serverAddr);
+
+  BOOST_REQUIRE_EQUAL(batch.receive(server), 2);
+  BOOST_CHECK(batch.getMessageHeader(0)->msg_flags & MSG_TRUNC);
+  BOOST_CHECK_EQUAL(batch.getQueryLength(0), 16);
+  BOOST_CHECK_EQUAL(batch.getMessageHeader(1)->msg_flags & MSG_TRUNC, 0);
+  BOOST_CHECK_EQUAL(batch.getQueryLength(1), 10);
+
+  close(client);
+  close(server);
+}
+
+BOOST_AUTO_TEST_CASE(test_ResponseFromDestination) {
+  ComboAddress serverAddr, clientAddr;
+  /* listen on the wildcard address, so that the source of the response has to be set explicitly */
+  int server = SSocket(AF_INET, SOCK_DGRAM, 0);
+  SBind(server, ComboAddress("0.0.0.0", 0));
+  socklen_t len = serverAddr.getSocklen();
+  BOOST_REQUIRE_EQUAL(getsockname(server, reinterpret_cast<struct sockaddr*>(&serverAddr), &len), 0);
+  serverAddr = ComboAddress("127.0.0.1", ntohs(serverAddr.sin4.sin_port));
+  int one = 1;
+#ifdef IP_PKTINFO
+  BOOST_REQUIRE_EQUAL(setsockopt(server, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)), 0);
+#endif
+  int client = getBoundSocket(clientAddr);
+
+  UDPMessagesBatch batch(2, AF_INET, 512, 512, 512);
+  sendTo(client, "query", serverAddr);
+  BOOST_REQUIRE_EQUAL(batch.receive(server), 1);
+
+  ComboAddress& dest = batch.getDest(0);
+  BOOST_REQUIRE(HarvestDestinationAddress(const_cast<struct msghdr*>(batch.getMessageHeader(0)), &dest));
+  BOOST_CHECK_EQUAL(dest.toString(), "127.0.0.1");
+
+  batch.queueResponse(0, "response", 8);
+  BOOST_CHECK_EQUAL(batch.sendQueued(server), 1);
+
+  ComboAddress from;
+  BOOST_CHECK_EQUAL(receiveFrom(client, from), "response");
+  BOOST_CHECK(from == serverAddr);
+
+  close(client);
+  close(server);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
@@ -7,6 +7,7 @@
 #include "iputils.hh"
 #include "dnswriter.hh"
 #include "dnsdist-cache.hh"
+#include "dnsdist-ecs.hh"
 
 BOOST_AUTO_TEST_SUITE(dnsdistpacketcache_cc)
 
@@ -105,6 +106,240 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheSimple) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_PacketCacheSharded) {
+  const size_t maxEntries = 150000;
+  DNSDistPacketCache PC(maxEntries, 86400, 1, 60, 60, 20);
+  BOOST_CHECK_EQUAL(PC.getSize(), 0);
+  BOOST_CHECK_EQUAL(PC.getShardsCount(), 20);
+
+  size_t counter=0;
+  size_t skipped=0;
+  ComboAddress remote;
+  try {
+    for(counter = 0; counter < 100000; ++counter) {
+      DNSName a=DNSName(std::to_string(counter))+DNSName("sharded.powerdns.com.");
+
+      vector<uint8_t> query;
+      DNSPacketWriter pwQ(query, a, QType::AAAA, QClass::IN, 0);
+      pwQ.getHeader()->rd = 1;
+
+      vector<uint8_t> response;
+      DNSPacketWriter pwR(response, a, QType::AAAA, QClass::IN, 0);
+      pwR.getHeader()->rd = 1;
+      pwR.getHeader()->ra = 1;
+      pwR.getHeader()->qr = 1;
+      pwR.getHeader()->id = pwQ.getHeader()->id;
+      pwR.startRecord(a, QType::AAAA, 100, QClass::IN, DNSResourceRecord::ANSWER);
+      ComboAddress v6("2001:db8::1");
+      pwR.xfrIP6(std::string(reinterpret_cast<const char*>(v6.sin6.sin6_addr.s6_addr), 16));
+      pwR.commit();
+      uint16_t responseLen = response.size();
+
+      char responseBuf[4096];
+      uint16_t responseBufSize = sizeof(responseBuf);
+      uint32_t key = 0;
+      DNSQuestion dq(&a, QType::AAAA, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false);
+      bool found = PC.get(dq, a.wirelength(), 0, responseBuf, &responseBufSize, &key);
+      BOOST_CHECK_EQUAL(found, false);
+
+      PC.insert(key, a, QType::AAAA, QClass::IN, (const char*) response.data(), responseLen, false);
+
+      found = PC.get(dq, a.wirelength(), pwR.getHeader()->id, responseBuf, &responseBufSize, &key, 0, true);
+      if (found == true) {
+        BOOST_CHECK_EQUAL(responseBufSize, responseLen);
+        int match = memcmp(responseBuf, response.data(), responseLen);
+        BOOST_CHECK_EQUAL(match, 0);
+      }
+      else {
+        skipped++;
+      }
+    }
+
+    BOOST_CHECK_EQUAL(skipped, PC.getInsertCollisions());
+    BOOST_CHECK_EQUAL(PC.getSize(), counter - skipped);
+    BOOST_CHECK_EQUAL(PC.getEntriesCount(), counter - skipped);
+
+    PC.expungeByName(DNSName("0.sharded.powerdns.com."));
+    BOOST_CHECK_EQUAL(PC.getSize(), counter - skipped - 1);
+
+    PC.expunge(0);
+    BOOST_CHECK_EQUAL(PC.getSize(), 0);
+  }
+  catch(PDNSException& e) {
+    cerr<<"Had error: "<<e.reason<<endl;
+    throw;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheSlabs) {
+  const size_t maxEntries = 1000;
+  const uint16_t slabSize = 128;
+  DNSDistPacketCache PC(maxEntries, 86400, 1, 60, 60, 1, slabSize);
+  BOOST_CHECK_EQUAL(PC.getSlabSize(), slabSize);
+
+  ComboAddress remote;
+  try {
+    for(size_t counter = 0; counter < maxEntries; ++counter) {
+      DNSName a=DNSName(std::to_string(counter))+DNSName("slabs.powerdns.com.");
+
+      vector<uint8_t> query;
+      DNSPacketWriter pwQ(query, a, QType::A, QClass::IN, 0);
+      pwQ.getHeader()->rd = 1;
+
+      vector<uint8_t> response;
+      DNSPacketWriter pwR(response, a, QType::A, QClass::IN, 0);
+      pwR.getHeader()->rd = 1;
+      pwR.getHeader()->ra = 1;
+      pwR.getHeader()->qr = 1;
+      pwR.getHeader()->id = pwQ.getHeader()->id;
+      pwR.startRecord(a, QType::A, 100, QClass::IN, DNSResourceRecord::ANSWER);
+      pwR.xfr32BitInt(0x01020304);
+      pwR.commit();
+      uint16_t responseLen = response.size();
+
+      char responseBuf[4096];
+      uint16_t responseBufSize = sizeof(responseBuf);
+      uint32_t key = 0;
+      DNSQuestion dq(&a, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false);
+      bool found = PC.get(dq, a.wirelength(), 0, responseBuf, &responseBufSize, &key);
+      BOOST_CHECK_EQUAL(found, false);
+
+      PC.insert(key, a, QType::A, QClass::IN, (const char*) response.data(), responseLen, false);
+
+      found = PC.get(dq, a.wirelength(), pwR.getHeader()->id, responseBuf, &responseBufSize, &key, 0, true);
+      BOOST_CHECK_EQUAL(found, true);
+      BOOST_CHECK_EQUAL(responseBufSize, responseLen);
+      BOOST_CHECK_EQUAL(memcmp(responseBuf, response.data(), responseLen), 0);
+    }
+    BOOST_CHECK_EQUAL(PC.getSize(), maxEntries);
+
+    /* the cache is full, removing an entry frees a slot for a new one */
+    PC.expungeByName(DNSName("0.slabs.powerdns.com."));
+    BOOST_CHECK_EQUAL(PC.getSize(), maxEntries - 1);
+
+    /* the lookup is case-insensitive, but the case of the query is preserved */
+    DNSName a("1.SLABS.powerdns.com.");
+    vector<uint8_t> query;
+    DNSPacketWriter pwQ(query, a, QType::A, QClass::IN, 0);
+    pwQ.getHeader()->rd = 1;
+    char responseBuf[4096];
+    uint16_t responseBufSize = sizeof(responseBuf);
+    uint32_t key = 0;
+    DNSQuestion dq(&a, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false);
+    bool found = PC.get(dq, a.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, true);
+    BOOST_CHECK_EQUAL(found, true);
+    BOOST_CHECK_EQUAL(DNSName(responseBuf, responseBufSize, sizeof(dnsheader), false).toString(), "1.SLABS.powerdns.com.");
+
+    /* responses larger than the slab size are not cached */
+    DNSName b("large.slabs.powerdns.com.");
+    vector<uint8_t> largeQuery;
+    DNSPacketWriter pwLQ(largeQuery, b, QType::TXT, QClass::IN, 0);
+    vector<uint8_t> largeResponse;
+    DNSPacketWriter pwLR(largeResponse, b, QType::TXT, QClass::IN, 0);
+    pwLR.getHeader()->qr = 1;
+    pwLR.startRecord(b, QType::TXT, 100, QClass::IN, DNSResourceRecord::ANSWER);
+    pwLR.xfrText("\"" + std::string(200, 'a') + "\"");
+    pwLR.commit();
+    BOOST_CHECK_GT(largeResponse.size(), slabSize);
+    DNSQuestion ldq(&b, QType::TXT, QClass::IN, &remote, &remote, (struct dnsheader*) largeQuery.data(), largeQuery.size(), largeQuery.size(), false);
+    responseBufSize = sizeof(responseBuf);
+    found = PC.get(ldq, b.wirelength(), 0, responseBuf, &responseBufSize, &key);
+    BOOST_CHECK_EQUAL(found, false);
+    PC.insert(key, b, QType::TXT, QClass::IN, (const char*) largeResponse.data(), largeResponse.size(), false);
+    BOOST_CHECK_EQUAL(PC.getSize(), maxEntries - 1);
+
+    PC.expunge(0);
+    BOOST_CHECK_EQUAL(PC.getSize(), 0);
+  }
+  catch(PDNSException& e) {
+    cerr<<"Had error: "<<e.reason<<endl;
+    throw;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheSlabSizeClasses) {
+  /* 16 pages of 512 bytes, each divided in slots of 64, 128, 256 or 512 bytes when first needed */
+  const size_t maxEntries = 16;
+  const uint16_t slabSize = 512;
+  DNSDistPacketCache PC(maxEntries, 86400, 1, 60, 60, 1, slabSize);
+  ComboAddress remote;
+  char responseBuf[4096];
+  uint16_t responseBufSize;
+  uint32_t key = 0;
+
+  /* 'records' TXT records of 'textSize' characters */
+  auto buildResponse = [](const DNSName& name, size_t records, size_t textSize, uint32_t ttl, vector<uint8_t>& response) {
+    response.clear();
+    DNSPacketWriter pwR(response, name, QType::TXT, QClass::IN, 0);
+    pwR.getHeader()->qr = 1;
+    for (size_t idx = 0; idx < records; idx++) {
+      pwR.startRecord(name, QType::TXT, ttl, QClass::IN, DNSResourceRecord::ANSWER);
+      pwR.xfrText("\"" + std::string(textSize, 'a' + idx) + "\"");
+    }
+    pwR.commit();
+  };
+  /* whether the cached response for name is that one, sets key */
+  auto lookup = [&](const DNSName& name, const vector<uint8_t>& response) {
+    vector<uint8_t> query;
+    DNSPacketWriter pwQ(query, name, QType::TXT, QClass::IN, 0);
+    DNSQuestion dq(&name, QType::TXT, QClass::IN, &remote, &remote, reinterpret_cast<struct dnsheader*>(query.data()), query.size(), query.size(), false);
+    responseBufSize = sizeof(responseBuf);
+    return PC.get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, true) && responseBufSize == response.size() && memcmp(responseBuf, response.data(), response.size()) == 0;
+  };
+  auto insertAndCheck = [&](const DNSName& name, const vector<uint8_t>& response) {
+    lookup(name, response);
+    PC.insert(key, name, QType::TXT, QClass::IN, reinterpret_cast<const char*>(response.data()), response.size(), false);
+    return lookup(name, response);
+  };
+
+  /* small responses all share the same page */
+  vector<uint8_t> response;
+  for (size_t idx = 0; idx < 8; idx++) {
+    const DNSName name("small" + std::to_string(idx) + ".powerdns.com.");
+    buildResponse(name, 1, 10, 100, response);
+    BOOST_CHECK(insertAndCheck(name, response));
+  }
+  BOOST_CHECK_LE(response.size(), 64);
+
+  /* a longer-lived and larger response for the same query moves the entry to a larger slot */
+  const DNSName replaced("small0.powerdns.com.");
+  buildResponse(replaced, 2, 200, 200, response);
+  BOOST_CHECK_GT(response.size(), 256);
+  BOOST_CHECK(insertAndCheck(replaced, response));
+  BOOST_CHECK_EQUAL(PC.getSize(), 8);
+
+  for (size_t idx = 0; idx < 8; idx++) {
+    const DNSName name("large" + std::to_string(idx) + ".powerdns.com.");
+    buildResponse(name, 2, 200, 100, response);
+    BOOST_CHECK(insertAndCheck(name, response));
+  }
+  BOOST_CHECK_EQUAL(PC.getSize(), maxEntries);
+
+  /* the pages stay assigned to their size class once released, only 6 are left for the medium
+     responses but they can use the free slots of the larger size class as well */
+  PC.expunge(0);
+  BOOST_CHECK_EQUAL(PC.getSize(), 0);
+  std::vector<vector<uint8_t> > responses(maxEntries);
+  for (size_t idx = 0; idx < maxEntries; idx++) {
+    const DNSName name("medium" + std::to_string(idx) + ".powerdns.com.");
+    buildResponse(name, 1, 200, 100, responses.at(idx));
+    BOOST_CHECK_GT(responses.at(idx).size(), 128);
+    BOOST_CHECK_LE(responses.at(idx).size(), 256);
+    BOOST_CHECK(insertAndCheck(name, responses.at(idx)));
+  }
+  BOOST_CHECK_EQUAL(PC.getSize(), maxEntries);
+
+  /* removing entries from the index does not hide the other ones */
+  for (size_t idx = 0; idx < maxEntries; idx += 2) {
+    PC.expungeByName(DNSName("medium" + std::to_string(idx) + ".powerdns.com."));
+  }
+  BOOST_CHECK_EQUAL(PC.getSize(), maxEntries / 2);
+  BOOST_CHECK_EQUAL(PC.getEntriesCount(), maxEntries / 2);
+  for (size_t idx = 0; idx < maxEntries; idx++) {
+    BOOST_CHECK_EQUAL(lookup(DNSName("medium" + std::to_string(idx) + ".powerdns.com."), responses.at(idx)), idx % 2 == 1);
+  }
+}
+
 static DNSDistPacketCache PC(500000);
 
 static void *threadMangler(void* a)
@@ -203,4 +438,274 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheThreaded) {
 
 }
 
+static void buildCachedResponse(const DNSName& qname, uint16_t id, uint32_t ttl, uint8_t rcode, vector<uint8_t>& response)
+{
+  response.clear();
+  DNSPacketWriter pwR(response, qname, QType::A, QClass::IN, 0);
+  pwR.getHeader()->rd = 1;
+  pwR.getHeader()->ra = 1;
+  pwR.getHeader()->qr = 1;
+  pwR.getHeader()->id = id;
+  pwR.getHeader()->rcode = rcode;
+  if (rcode == RCode::NoError) {
+    pwR.startRecord(qname, QType::A, ttl, QClass::IN, DNSResourceRecord::ANSWER);
+    pwR.xfr32BitInt(0x01020304);
+    pwR.commit();
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheRefresh) {
+  const size_t maxEntries = 100;
+  /* refresh as soon as we get a hit, serve for up to 10s after the expiration while refreshing */
+  DNSDistPacketCache PC(maxEntries, 86400, 0, 60, 60, 1, 0, 100, 10);
+  BOOST_CHECK_EQUAL(PC.getPrefetchThreshold(), 100);
+  BOOST_CHECK_EQUAL(PC.getStaleWhileRevalidate(), 10);
+
+  ComboAddress remote;
+  const DNSName qname("refresh.powerdns.com.");
+  vector<uint8_t> query;
+  DNSPacketWriter pwQ(query, qname, QType::A, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+  DNSQuestion dq(&qname, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false);
+
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  uint32_t key = 0;
+  bool refresh = true;
+  BOOST_CHECK_EQUAL(PC.get(dq, qname.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &refresh), false);
+  BOOST_CHECK_EQUAL(refresh, false);
+
+  vector<uint8_t> response;
+  buildCachedResponse(qname, pwQ.getHeader()->id, 100, RCode::NoError, response);
+  PC.insert(key, qname, QType::A, QClass::IN, (const char*) response.data(), response.size(), false);
+
+  /* no refresh if the caller can't send one */
+  BOOST_CHECK_EQUAL(PC.get(dq, qname.wirelength(), 0, responseBuf, &responseBufSize, &key), true);
+  BOOST_CHECK_EQUAL(PC.getRefreshes(), 0);
+
+  /* the first hit triggers a refresh, the next ones don't */
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK_EQUAL(PC.get(dq, qname.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &refresh), true);
+  BOOST_CHECK_EQUAL(refresh, true);
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK_EQUAL(PC.get(dq, qname.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &refresh), true);
+  BOOST_CHECK_EQUAL(refresh, false);
+  BOOST_CHECK_EQUAL(PC.getRefreshes(), 1);
+
+  /* a Server Failure does not replace a valid entry */
+  vector<uint8_t> servFail;
+  buildCachedResponse(qname, pwQ.getHeader()->id, 0, RCode::ServFail, servFail);
+  PC.insert(key, qname, QType::A, QClass::IN, (const char*) servFail.data(), servFail.size(), false, true);
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK_EQUAL(PC.get(dq, qname.wirelength(), pwQ.getHeader()->id, responseBuf, &responseBufSize, &key, 0, true, &refresh), true);
+  BOOST_CHECK_EQUAL(responseBufSize, response.size());
+  BOOST_CHECK_EQUAL(memcmp(responseBuf, response.data(), response.size()), 0);
+
+  /* the refreshed entry can be refreshed again */
+  buildCachedResponse(qname, pwQ.getHeader()->id, 200, RCode::NoError, response);
+  PC.insert(key, qname, QType::A, QClass::IN, (const char*) response.data(), response.size(), false);
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK_EQUAL(PC.get(dq, qname.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &refresh), true);
+  BOOST_CHECK_EQUAL(refresh, true);
+  BOOST_CHECK_EQUAL(PC.getRefreshes(), 2);
+  BOOST_CHECK_EQUAL(PC.getStaleHits(), 0);
+
+  /* stale while revalidate */
+  const DNSName expiring("expiring.powerdns.com.");
+  vector<uint8_t> expiringQuery;
+  DNSPacketWriter pwE(expiringQuery, expiring, QType::A, QClass::IN, 0);
+  pwE.getHeader()->rd = 1;
+  DNSQuestion dqE(&expiring, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) expiringQuery.data(), expiringQuery.size(), expiringQuery.size(), false);
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK_EQUAL(PC.get(dqE, expiring.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+  buildCachedResponse(expiring, pwE.getHeader()->id, 1, RCode::NoError, response);
+  PC.insert(key, expiring, QType::A, QClass::IN, (const char*) response.data(), response.size(), false);
+
+  sleep(2);
+
+  /* expired, so only usable while revalidating */
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK_EQUAL(PC.get(dqE, expiring.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK_EQUAL(PC.get(dqE, expiring.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &refresh), true);
+  BOOST_CHECK_EQUAL(refresh, true);
+  BOOST_CHECK_EQUAL(PC.getStaleHits(), 1);
+  BOOST_CHECK_EQUAL(PC.getRefreshes(), 3);
+
+  /* and not purged yet */
+  PC.purgeExpired(0);
+  BOOST_CHECK_EQUAL(PC.getSize(), 2);
+}
+
+/* build a query for qname and add an ECS option for remote, as dnsdist does */
+static void buildECSQuery(const DNSName& qname, const ComboAddress& remote, uint16_t ecsPrefixLength, vector<uint8_t>& query, uint16_t* lenBeforeECS)
+{
+  query.clear();
+  DNSPacketWriter pwQ(query, qname, QType::A, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+  *lenBeforeECS = query.size();
+  uint16_t len = query.size();
+  query.resize(query.size() + s_EDNSClientSubnetRoom);
+  bool ednsAdded = false;
+  bool ecsAdded = false;
+  BOOST_REQUIRE(handleEDNSClientSubnet(reinterpret_cast<char*>(query.data()), query.size(), qname.wirelength(), &len, &ednsAdded, &ecsAdded, remote, false, ecsPrefixLength));
+  BOOST_REQUIRE(ednsAdded);
+  query.resize(len);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheECSScoping) {
+  /* with and without a slab, which stores the scopes of the entries differently */
+  const std::vector<uint16_t> slabSizes = {0, 512};
+  for (const auto slabSize : slabSizes) {
+    DNSDistPacketCache PC(100, 86400, 0, 60, 60, 1, slabSize, 0, 0, true);
+    BOOST_CHECK(PC.isECSScoping());
+
+    const ComboAddress first("192.0.2.1");
+    const ComboAddress second("192.0.2.42");
+    const ComboAddress other("198.51.100.1");
+    const DNSName qname("scoped.powerdns.com.");
+    const DNSName global("global.powerdns.com.");
+    char responseBuf[4096];
+    uint16_t responseBufSize = sizeof(responseBuf);
+    uint32_t key = 0;
+    uint16_t lenBeforeECS = 0;
+    vector<uint8_t> query;
+    vector<uint8_t> response;
+
+    auto lookup = [&](const DNSName& name, const ComboAddress& remote) {
+      buildECSQuery(name, remote, 24, query, &lenBeforeECS);
+      DNSQuestion dq(&name, QType::A, QClass::IN, &remote, &remote, reinterpret_cast<struct dnsheader*>(query.data()), query.size(), query.size(), false);
+      const Netmask source(remote, 24);
+      responseBufSize = sizeof(responseBuf);
+      return PC.get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, nullptr, &source, lenBeforeECS);
+    };
+
+    /* a scope of 0 is shared by every client */
+    BOOST_CHECK_EQUAL(lookup(global, first), false);
+    buildCachedResponse(global, 0, 100, RCode::NoError, response);
+    const Netmask globalScope(first, 0);
+    PC.insert(key, global, QType::A, QClass::IN, reinterpret_cast<const char*>(response.data()), response.size(), false, false, &globalScope);
+    BOOST_CHECK_EQUAL(lookup(global, second), true);
+    BOOST_CHECK_EQUAL(lookup(global, other), true);
+
+    /* a /24 scope is only shared inside that subnet */
+    BOOST_CHECK_EQUAL(lookup(qname, first), false);
+    const uint32_t scopelessKey = key;
+    buildCachedResponse(qname, 0, 100, RCode::NoError, response);
+    const Netmask subnetScope(first, 24);
+    PC.insert(key, qname, QType::A, QClass::IN, reinterpret_cast<const char*>(response.data()), response.size(), false, false, &subnetScope);
+    BOOST_CHECK_EQUAL(lookup(qname, second), true);
+    BOOST_CHECK_EQUAL(key, scopelessKey);
+    BOOST_CHECK_EQUAL(lookup(qname, other), false);
+    BOOST_CHECK_EQUAL(PC.getSize(), 2);
+
+    /* a scoped entry does not answer an unscoped query for the same name */
+    vector<uint8_t> plainQuery;
+    DNSPacketWriter pwQ(plainQuery, qname, QType::A, QClass::IN, 0);
+    pwQ.getHeader()->rd = 1;
+    DNSQuestion dq(&qname, QType::A, QClass::IN, &first, &first, reinterpret_cast<struct dnsheader*>(plainQuery.data()), plainQuery.size(), plainQuery.size(), false);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(PC.get(dq, qname.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+
+    PC.expungeByName(qname);
+    BOOST_CHECK_EQUAL(PC.getSize(), 1);
+    BOOST_CHECK_EQUAL(lookup(qname, second), false);
+    BOOST_CHECK_EQUAL(lookup(global, other), true);
+
+    /* a more specific scope only hides a broader one while its entry exists */
+    BOOST_CHECK_EQUAL(lookup(qname, first), false);
+    buildCachedResponse(qname, 0, 100, RCode::NoError, response);
+    const Netmask broadScope(first, 16);
+    PC.insert(key, qname, QType::A, QClass::IN, reinterpret_cast<const char*>(response.data()), response.size(), false, false, &broadScope);
+    buildCachedResponse(qname, 0, 1, RCode::NoError, response);
+    PC.insert(key, qname, QType::A, QClass::IN, reinterpret_cast<const char*>(response.data()), response.size(), false, false, &subnetScope);
+    BOOST_CHECK_EQUAL(PC.getSize(), 3);
+    BOOST_CHECK_EQUAL(lookup(qname, second), true);
+
+    sleep(2);
+    /* the expired /24 entry hides the /16 one until it is purged */
+    BOOST_CHECK_EQUAL(lookup(qname, second), false);
+    PC.purgeExpired(0);
+    BOOST_CHECK_EQUAL(PC.getSize(), 2);
+    BOOST_CHECK_EQUAL(lookup(qname, second), true);
+
+    /* and the same goes for an expunged one */
+    buildCachedResponse(qname, 0, 100, RCode::NoError, response);
+    PC.insert(key, qname, QType::A, QClass::IN, reinterpret_cast<const char*>(response.data()), response.size(), false, false, &subnetScope);
+    BOOST_CHECK_EQUAL(PC.getSize(), 3);
+    PC.expungeByName(global);
+    PC.expunge(1);
+    BOOST_CHECK_EQUAL(PC.getSize(), 1);
+    BOOST_CHECK_EQUAL(lookup(qname, second), true);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_InFlightQueries) {
+  DNSDistPacketCache PC(100, 86400, 1);
+  DNSDistPacketCache otherPC(100, 86400, 1);
+  InFlightQueries IFQ(4, 2, 2);
+  const DNSName qname("powerdns.com.");
+  const uint32_t key = 42;
+
+  auto makeWaiter = [](const DNSName& name, uint16_t id) {
+    InFlightWaiter waiter;
+    waiter.qname = name;
+    waiter.origRemote = ComboAddress("192.0.2.1:" + std::to_string(id + 1024));
+    waiter.origID = id;
+    return waiter;
+  };
+
+  /* the first query is sent to a backend, the next ones wait for its response */
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 1)) == InFlightQueries::Status::Leader);
+  BOOST_CHECK(IFQ.add(&PC, key, DNSName("PowerDNS.com."), QType::A, QClass::IN, false, false, makeWaiter(DNSName("PowerDNS.com."), 2)) == InFlightQueries::Status::Waiting);
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 3)) == InFlightQueries::Status::Waiting);
+  /* too many waiters */
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 4)) == InFlightQueries::Status::Independent);
+  /* same key, but not the same query or cache */
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::AAAA, QClass::IN, false, false, makeWaiter(qname, 5)) == InFlightQueries::Status::Independent);
+  BOOST_CHECK(IFQ.add(&PC, key, DNSName("powerdns.org."), QType::A, QClass::IN, false, false, makeWaiter(qname, 6)) == InFlightQueries::Status::Independent);
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, true, true, makeWaiter(qname, 7)) == InFlightQueries::Status::Independent);
+  BOOST_CHECK(IFQ.add(&otherPC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 8)) == InFlightQueries::Status::Independent);
+  BOOST_CHECK_EQUAL(IFQ.size(), 1);
+
+  /* the response to a different query does not release the waiters */
+  BOOST_CHECK_EQUAL(IFQ.release(&PC, key, qname, QType::AAAA, QClass::IN).size(), 0);
+  BOOST_CHECK_EQUAL(IFQ.size(), 1);
+
+  auto waiters = IFQ.release(&PC, key, qname, QType::A, QClass::IN);
+  BOOST_REQUIRE_EQUAL(waiters.size(), 2);
+  BOOST_CHECK_EQUAL(waiters.at(0).origID, 2);
+  BOOST_CHECK_EQUAL(waiters.at(0).qname.toString(), "PowerDNS.com.");
+  BOOST_CHECK_EQUAL(waiters.at(1).origID, 3);
+  BOOST_CHECK_EQUAL(IFQ.size(), 0);
+  BOOST_CHECK_EQUAL(IFQ.release(&PC, key, qname, QType::A, QClass::IN).size(), 0);
+
+  /* a leader whose response never arrives is replaced once the timeout has elapsed */
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 9)) == InFlightQueries::Status::Leader);
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 10)) == InFlightQueries::Status::Waiting);
+  sleep(2);
+  IFQ.purgeExpired();
+  BOOST_CHECK_EQUAL(IFQ.size(), 0);
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 11)) == InFlightQueries::Status::Leader);
+  BOOST_CHECK_EQUAL(IFQ.release(&PC, key, qname, QType::A, QClass::IN).size(), 0);
+
+  /* a leader not getting a usable response only releases its own entry, not the one of a more recent leader */
+  uint64_t firstLeader = 0;
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 12), &firstLeader) == InFlightQueries::Status::Leader);
+  BOOST_CHECK(firstLeader != 0);
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 13)) == InFlightQueries::Status::Waiting);
+  sleep(2);
+  uint64_t secondLeader = 0;
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 14), &secondLeader) == InFlightQueries::Status::Leader);
+  BOOST_CHECK(secondLeader != 0);
+  BOOST_CHECK(secondLeader != firstLeader);
+  BOOST_CHECK(IFQ.add(&PC, key, qname, QType::A, QClass::IN, false, false, makeWaiter(qname, 15)) == InFlightQueries::Status::Waiting);
+  BOOST_CHECK_EQUAL(IFQ.release(&PC, key, qname, QType::A, QClass::IN, firstLeader).size(), 0);
+  BOOST_CHECK_EQUAL(IFQ.size(), 1);
+  waiters = IFQ.release(&PC, key, qname, QType::A, QClass::IN, secondLeader);
+  BOOST_REQUIRE_EQUAL(waiters.size(), 1);
+  BOOST_CHECK_EQUAL(waiters.at(0).origID, 15);
+  BOOST_CHECK_EQUAL(IFQ.size(), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,372 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <thread>
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+#include "gettime.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistrings_cc)
+
+static void ringReaderThread(Rings& rings, std::atomic<bool>& done, size_t numberOfEntries, uint16_t qtype)
+{
+  while (!done) {
+    size_t iteratedCount = 0;
+    rings.forEachQuery([&iteratedCount, qtype](const Rings::Query& q) {
+        BOOST_CHECK_EQUAL(q.qtype, qtype);
+        iteratedCount++;
+      });
+    BOOST_CHECK_LE(iteratedCount, numberOfEntries);
+  }
+}
+
+static void ringWriterThread(Rings& rings, size_t numberOfEntries, const DNSName& qname, uint16_t qtype, uint16_t size, const ComboAddress& requestor)
+{
+  struct timespec now;
+  gettime(&now);
+  struct dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+
+  for (size_t idx = 0; idx < numberOfEntries; idx++) {
+    rings.insertQuery(now, requestor, qname, qtype, size, dh);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_Rings_Simple) {
+  const size_t capacity = 100;
+  const size_t numberOfShards = 10;
+  Rings rings(capacity, numberOfShards);
+  BOOST_CHECK_EQUAL(rings.getCapacity(), capacity);
+  BOOST_CHECK_EQUAL(rings.getShardCapacity(), capacity / numberOfShards);
+  BOOST_CHECK_EQUAL(rings.getNumberOfShards(), numberOfShards);
+
+  const DNSName qname("rings.powerdns.com.");
+  const ComboAddress requestor("192.0.2.1");
+  const ComboAddress server("192.0.2.42:53");
+  struct timespec now;
+  gettime(&now);
+  struct dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+
+  /* this thread always ends up in the same shard, so we can't store more than capacity / numberOfShards entries */
+  for (size_t idx = 0; idx < capacity * 2; idx++) {
+    rings.insertQuery(now, requestor, qname, QType::A, 42, dh);
+    rings.insertResponse(now, requestor, qname, QType::A, 1000, 84, dh, server);
+  }
+
+  size_t queries = 0;
+  rings.forEachQuery([&queries, &qname, &requestor](const Rings::Query& q) {
+      BOOST_CHECK_EQUAL(q.name, qname);
+      BOOST_CHECK_EQUAL(q.qtype, QType::A);
+      BOOST_CHECK_EQUAL(q.size, 42);
+      BOOST_CHECK_EQUAL(q.requestor.toStringWithPort(), requestor.toStringWithPort());
+      queries++;
+    });
+  BOOST_CHECK_EQUAL(queries, capacity / numberOfShards);
+
+  size_t responses = 0;
+  rings.forEachResponse([&responses, &server](const Rings::Response& r) {
+      BOOST_CHECK_EQUAL(r.usec, 1000);
+      BOOST_CHECK_EQUAL(r.size, 84);
+      BOOST_CHECK_EQUAL(r.ds.toStringWithPort(), server.toStringWithPort());
+      responses++;
+    });
+  BOOST_CHECK_EQUAL(responses, capacity / numberOfShards);
+
+  BOOST_CHECK_EQUAL(rings.numDistinctRequestors(), 1);
+  /* the top entries are not limited to the content of the rings */
+  auto top = rings.getTopBandwidth(10);
+  BOOST_REQUIRE_EQUAL(top.size(), 2);
+  BOOST_CHECK_EQUAL(boost::get<string>(top.at(1).at(0)), requestor.toString());
+  BOOST_CHECK_EQUAL(boost::get<double>(top.at(1).at(1)), (42 + 84) * capacity * 2);
+  BOOST_CHECK_EQUAL(boost::get<double>(top.at(2).at(1)), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_SpaceSaving) {
+  SpaceSaving<std::string> ss(4);
+  BOOST_CHECK_EQUAL(ss.getCapacity(), 4);
+
+  /* while the summary is not full, the counts are exact */
+  ss.add("heavy", 10);
+  ss.add("medium", 5);
+  ss.add("medium");
+  SpaceSaving<std::string>::counts_t counts;
+  BOOST_CHECK_EQUAL(ss.addTo(counts), 16);
+  BOOST_REQUIRE_EQUAL(counts.size(), 2);
+  BOOST_CHECK_EQUAL(counts.at("heavy"), 10);
+  BOOST_CHECK_EQUAL(counts.at("medium"), 6);
+  ss.clear();
+
+  for (size_t idx = 0; idx < 100; idx++) {
+    ss.add("heavy");
+    if (idx % 2 == 0) {
+      ss.add("medium");
+    }
+    /* a different key every time, they keep replacing each other */
+    ss.add("light-" + std::to_string(idx));
+  }
+  BOOST_CHECK_EQUAL(ss.size(), 4);
+  BOOST_CHECK_EQUAL(ss.getTotal(), 250);
+
+  counts.clear();
+  BOOST_CHECK_EQUAL(ss.addTo(counts), 250);
+  BOOST_REQUIRE_EQUAL(counts.size(), 4);
+  /* the last key seen is always there */
+  BOOST_CHECK_EQUAL(counts.count("light-99"), 1);
+  /* counts are over-estimated, never under-estimated, and add up to the total */
+  uint64_t sum = 0;
+  for (const auto& entry : counts) {
+    sum += entry.second;
+  }
+  BOOST_CHECK_EQUAL(sum, 250);
+
+  /* 'heavy' has been seen more than total / capacity times, so it has to be there */
+  auto top = getTopEntries(counts, 1);
+  BOOST_REQUIRE_EQUAL(top.size(), 1);
+  BOOST_CHECK_EQUAL(top.at(0).first, "heavy");
+  BOOST_CHECK_GE(top.at(0).second, 100);
+
+  ss.clear();
+  BOOST_CHECK_EQUAL(ss.size(), 0);
+  BOOST_CHECK_EQUAL(ss.getTotal(), 0);
+
+  /* removing and replacing the lowest entry, for callers bounding several summaries together */
+  ss.add("heavy", 10);
+  ss.add("light", 1);
+  ss.add("medium", 5);
+  BOOST_CHECK(ss.contains("light"));
+  ss.removeMin();
+  BOOST_CHECK_EQUAL(ss.size(), 2);
+  BOOST_CHECK(!ss.contains("light"));
+  ss.replaceMin("new", 2);
+  BOOST_CHECK_EQUAL(ss.size(), 2);
+  BOOST_CHECK(!ss.contains("medium"));
+  counts.clear();
+  ss.addTo(counts);
+  BOOST_CHECK_EQUAL(counts.at("heavy"), 10);
+  BOOST_CHECK_EQUAL(counts.at("new"), 7);
+  ss.removeMin();
+  ss.removeMin();
+  BOOST_CHECK_EQUAL(ss.size(), 0);
+  ss.clear();
+
+  /* periods */
+  HeavyHitters<std::string> hh(10, 60);
+  hh.add("old", 1, 60);
+  hh.add("previous", 1, 120);
+  hh.add("current", 5, 180);
+  counts.clear();
+  BOOST_CHECK_EQUAL(hh.addTo(counts, 190), 6);
+  BOOST_CHECK_EQUAL(counts.size(), 2);
+  BOOST_CHECK_EQUAL(counts.at("current"), 5);
+  /* one period later, only the current one is reported */
+  counts.clear();
+  BOOST_CHECK_EQUAL(hh.addTo(counts, 250), 5);
+  BOOST_CHECK_EQUAL(counts.size(), 1);
+  /* and then nothing */
+  counts.clear();
+  BOOST_CHECK_EQUAL(hh.addTo(counts, 310), 0);
+  BOOST_CHECK_EQUAL(counts.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_Rings_ShardCapacity) {
+  /* the capacity is split between the shards, but each shard holds at least one entry */
+  Rings rings(1000, 3);
+  BOOST_CHECK_EQUAL(rings.getCapacity(), 1000);
+  BOOST_CHECK_EQUAL(rings.getShardCapacity(), 333);
+
+  rings.setCapacity(2, 10);
+  BOOST_CHECK_EQUAL(rings.getCapacity(), 2);
+  BOOST_CHECK_EQUAL(rings.getShardCapacity(), 1);
+  BOOST_CHECK_EQUAL(rings.getNumberOfShards(), 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_Rings_HeavyHitters) {
+  const size_t capacity = 10;
+  const size_t numberOfShards = 1;
+  Rings rings(capacity, numberOfShards);
+  rings.setHeavyHittersParameters(5, 60, 2);
+
+  struct timespec now;
+  gettime(&now);
+  struct dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+
+  for (size_t idx = 0; idx < 100; idx++) {
+    rings.insertQuery(now, ComboAddress("192.0.2.1"), DNSName("www.powerdns.com."), QType::A, 42, dh);
+    if (idx % 4 == 0) {
+      rings.insertQuery(now, ComboAddress("192.0.2.2"), DNSName("www" + std::to_string(idx) + ".example.com."), QType::A, 42, dh);
+    }
+  }
+
+  uint64_t total = 0;
+  double elapsed = 0;
+  auto clients = rings.getTopClients(10, total, elapsed);
+  BOOST_CHECK_EQUAL(total, 125);
+  BOOST_CHECK_GE(elapsed, 60.0);
+  BOOST_CHECK_LT(elapsed, 120.0);
+  BOOST_REQUIRE_EQUAL(clients.size(), 2);
+  BOOST_CHECK_EQUAL(clients.at(0).first.toString(), "192.0.2.1");
+  BOOST_CHECK_EQUAL(clients.at(0).second, 100);
+  BOOST_CHECK_EQUAL(clients.at(1).first.toString(), "192.0.2.2");
+  BOOST_CHECK_EQUAL(clients.at(1).second, 25);
+
+  auto names = rings.getTopQueries(1, false, total, elapsed);
+  BOOST_CHECK_EQUAL(total, 125);
+  BOOST_REQUIRE_EQUAL(names.size(), 1);
+  BOOST_CHECK_EQUAL(names.at(0).first, DNSName("www.powerdns.com."));
+  BOOST_CHECK_EQUAL(names.at(0).second, 100);
+
+  auto suffixes = rings.getTopQueries(10, true, total, elapsed);
+  BOOST_REQUIRE_EQUAL(suffixes.size(), 2);
+  BOOST_CHECK_EQUAL(suffixes.at(0).first, DNSName("powerdns.com."));
+  BOOST_CHECK_EQUAL(suffixes.at(0).second, 100);
+  BOOST_CHECK_EQUAL(suffixes.at(1).first, DNSName("example.com."));
+  BOOST_CHECK_EQUAL(suffixes.at(1).second, 25);
+
+  /* suffixes are case-insensitive, and the name of a suffix is still known after a lot of other ones went through the summaries */
+  for (size_t idx = 0; idx < 100; idx++) {
+    rings.insertQuery(now, ComboAddress("192.0.2.3"), DNSName("www.example" + std::to_string(idx) + ".net."), QType::A, 42, dh);
+    rings.insertQuery(now, ComboAddress("192.0.2.3"), DNSName("WWW.PowerDNS.COM."), QType::A, 42, dh);
+  }
+  suffixes = rings.getTopQueries(1, true, total, elapsed);
+  BOOST_CHECK_EQUAL(total, 325);
+  BOOST_REQUIRE_EQUAL(suffixes.size(), 1);
+  BOOST_CHECK_EQUAL(suffixes.at(0).first, DNSName("powerdns.com."));
+  BOOST_CHECK_EQUAL(suffixes.at(0).second, 200);
+
+  /* disabled */
+  rings.setHeavyHittersParameters(0, 60, 2);
+  rings.insertQuery(now, ComboAddress("192.0.2.1"), DNSName("www.powerdns.com."), QType::A, 42, dh);
+  clients = rings.getTopClients(10, total, elapsed);
+  BOOST_CHECK_EQUAL(total, 0);
+  BOOST_CHECK_EQUAL(clients.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_Rings_Counters) {
+  const size_t capacity = 10;
+  const size_t numberOfShards = 1;
+  const size_t window = 10;
+  /* 10 entries in each one-second bucket, independently of the size of the rings */
+  const size_t bucketCapacity = 10;
+  Rings rings(capacity, numberOfShards, window, bucketCapacity * (window + 1));
+  BOOST_CHECK_EQUAL(rings.getCountersWindow(), window);
+  BOOST_CHECK_EQUAL(rings.getCountersBucketCapacity(), bucketCapacity);
+
+  const DNSName qname("rings.powerdns.com.");
+  const ComboAddress server("192.0.2.42:53");
+  struct timespec now;
+  gettime(&now);
+  struct dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  dh.rcode = RCode::NXDomain;
+
+  /* 5 queries per second over the last 3 seconds for 192.0.2.1, the port does not matter */
+  for (time_t second = 0; second < 3; second++) {
+    struct timespec when = now;
+    when.tv_sec -= second;
+    for (size_t idx = 0; idx < 5; idx++) {
+      rings.insertQuery(when, ComboAddress("192.0.2.1:" + std::to_string(1024 + idx)), qname, QType::A, 42, dh);
+      rings.insertResponse(when, ComboAddress("192.0.2.1"), qname, QType::A, 1000, 100, dh, server);
+    }
+  }
+  /* one AAAA query from 192.0.2.2, 30 seconds ago, outside of the window */
+  struct timespec old = now;
+  old.tv_sec -= 30;
+  rings.insertQuery(old, ComboAddress("192.0.2.2"), qname, QType::AAAA, 42, dh);
+
+  double elapsed = 0;
+  auto counters = rings.getCounters(Rings::Counter::Queries, 0, 1, elapsed);
+  BOOST_REQUIRE_EQUAL(counters.size(), 1);
+  BOOST_CHECK_EQUAL(counters.at(ComboAddress("192.0.2.1")), 10);
+  BOOST_CHECK_GE(elapsed, 1.0);
+  BOOST_CHECK_LT(elapsed, 2.0);
+
+  counters = rings.getCounters(Rings::Counter::Queries, 0, 5, elapsed);
+  BOOST_CHECK_EQUAL(counters.at(ComboAddress("192.0.2.1")), 15);
+
+  counters = rings.getCounters(Rings::Counter::QType, QType::A, 0, elapsed);
+  BOOST_REQUIRE_EQUAL(counters.size(), 1);
+  BOOST_CHECK_EQUAL(counters.at(ComboAddress("192.0.2.1")), 15);
+  /* since the oldest entry */
+  BOOST_CHECK_GE(elapsed, 2.0);
+  BOOST_CHECK_LT(elapsed, 3.0);
+
+  counters = rings.getCounters(Rings::Counter::QType, QType::AAAA, 0, elapsed);
+  BOOST_CHECK_EQUAL(counters.size(), 0);
+
+  counters = rings.getCounters(Rings::Counter::RCode, RCode::NXDomain, 0, elapsed);
+  BOOST_CHECK_EQUAL(counters.at(ComboAddress("192.0.2.1")), 15);
+  counters = rings.getCounters(Rings::Counter::RCode, RCode::ServFail, 0, elapsed);
+  BOOST_CHECK_EQUAL(counters.size(), 0);
+
+  counters = rings.getCounters(Rings::Counter::ResponseBytes, 0, 0, elapsed);
+  BOOST_CHECK_EQUAL(counters.at(ComboAddress("192.0.2.1")), 15 * 100);
+
+  /* a busy client, then a lot of new ones filling the current bucket: 192.0.2.1 already uses
+     one entry for its A queries, the total number of queries being computed from these, 203.0.113.1 one more */
+  for (size_t idx = 0; idx < 50; idx++) {
+    rings.insertQuery(now, ComboAddress("203.0.113.1"), qname, QType::A, 42, dh);
+  }
+  const size_t newClients = bucketCapacity * 2;
+  for (size_t idx = 0; idx < newClients; idx++) {
+    rings.insertQuery(now, ComboAddress("198.51.100." + std::to_string(idx + 1)), qname, QType::A, 42, dh);
+  }
+
+  /* the busy client is still there, the new ones took the place of the clients with the lowest counts
+     instead of being ignored, so no query is lost: 5 from the previous second, 5 + 50 + 20 from this one */
+  counters = rings.getCounters(Rings::Counter::Queries, 0, 1, elapsed);
+  BOOST_CHECK_LE(counters.size(), bucketCapacity);
+  BOOST_REQUIRE_EQUAL(counters.count(ComboAddress("203.0.113.1")), 1);
+  BOOST_CHECK_GE(counters.at(ComboAddress("203.0.113.1")), 50);
+  BOOST_CHECK_EQUAL(counters.count(ComboAddress("198.51.100." + std::to_string(newClients))), 1);
+  uint64_t sum = 0;
+  for (const auto& entry : counters) {
+    sum += entry.second;
+  }
+  BOOST_CHECK_EQUAL(sum, 5 + 5 + 50 + newClients);
+
+  /* a counter not seen yet during this second gets room as well */
+  rings.insertQuery(now, ComboAddress("198.51.100.254"), qname, QType::AAAA, 42, dh);
+  counters = rings.getCounters(Rings::Counter::QType, QType::AAAA, 1, elapsed);
+  BOOST_REQUIRE_EQUAL(counters.size(), 1);
+  BOOST_CHECK_EQUAL(counters.count(ComboAddress("198.51.100.254")), 1);
+  /* but the bucket is still bounded */
+  size_t entries = counters.size();
+  entries += rings.getCounters(Rings::Counter::QType, QType::A, 0, elapsed).size();
+  /* plus the A queries of 192.0.2.1 in the previous buckets */
+  BOOST_CHECK_LE(entries, bucketCapacity + 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_Rings_Threaded) {
+  const size_t capacity = 1000;
+  const size_t numberOfShards = 4;
+  const size_t numberOfWriters = 4;
+  const size_t entriesPerWriter = 5000;
+  Rings rings(capacity, numberOfShards);
+
+  const DNSName qname("rings.powerdns.com.");
+  std::atomic<bool> done(false);
+  std::thread reader(ringReaderThread, std::ref(rings), std::ref(done), capacity, QType::AAAA);
+
+  std::vector<std::thread> writers;
+  for (size_t idx = 0; idx < numberOfWriters; idx++) {
+    writers.push_back(std::thread(ringWriterThread, std::ref(rings), entriesPerWriter, qname, QType::AAAA, 42, ComboAddress("192.0.2." + std::to_string(idx + 1))));
+  }
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  done = true;
+  reader.join();
+
+  /* every writer thread got its own shard and filled it */
+  size_t total = 0;
+  rings.forEachQuery([&total](const Rings::Query& q) {
+      total++;
+    });
+  BOOST_CHECK_EQUAL(total, capacity);
+  BOOST_CHECK_EQUAL(rings.numDistinctRequestors(), numberOfWriters);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
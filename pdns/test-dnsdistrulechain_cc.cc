@@ -0,0 +1,280 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-rulechain.hh"
+#include "dnsrulactions.hh"
+#include "dnswriter.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistrulechain_cc)
+
+static std::shared_ptr<DNSRule> makeSuffixRule(const std::string& suffix)
+{
+  SuffixMatchNode smn;
+  smn.add(DNSName(suffix));
+  return std::make_shared<SuffixMatchNodeRule>(smn);
+}
+
+static std::shared_ptr<DNSRule> makeNetmaskRule(const std::string& mask, bool source=true)
+{
+  NetmaskGroup nmg;
+  nmg.addMask(mask);
+  return std::make_shared<NetmaskGroupRule>(nmg, source);
+}
+
+static CompiledRuleChain::rulactions_t makeRulactions(const std::vector<std::shared_ptr<DNSRule> >& rules)
+{
+  CompiledRuleChain::rulactions_t rulactions;
+  for (const auto& rule : rules) {
+    rulactions.push_back({rule, nullptr});
+  }
+  return rulactions;
+}
+
+/* holds everything a DNSQuestion points to */
+struct TestQuery
+{
+  TestQuery(const std::string& name, uint16_t type, const std::string& source="192.0.2.1"): qname(name), remote(source), local("192.0.2.254:53")
+  {
+    DNSPacketWriter pw(packet, qname, type);
+    dq = std::unique_ptr<DNSQuestion>(new DNSQuestion(&qname, type, QClass::IN, &local, &remote, reinterpret_cast<struct dnsheader*>(packet.data()), packet.size(), packet.size(), false));
+  }
+
+  std::vector<uint8_t> packet;
+  DNSName qname;
+  ComboAddress remote;
+  ComboAddress local;
+  std::unique_ptr<DNSQuestion> dq;
+};
+
+/* the indexes of the rules matching, as seen by the compiled chain */
+static std::vector<size_t> getMatching(const CompiledRuleChain& chain, const CompiledRuleChain::rulactions_t& rulactions, const DNSQuestion& dq)
+{
+  std::vector<size_t> result;
+  chain.forEachMatchingRule(dq, [&result, &rulactions](const CompiledRuleChain::rulaction_t& rulaction) {
+      for (size_t idx = 0; idx < rulactions.size(); idx++) {
+        if (rulactions.at(idx).first == rulaction.first) {
+          result.push_back(idx);
+        }
+      }
+      return true;
+    });
+  return result;
+}
+
+/* the indexes of the rules matching, calling each rule in order */
+static std::vector<size_t> getExpected(const CompiledRuleChain::rulactions_t& rulactions, const DNSQuestion& dq)
+{
+  std::vector<size_t> result;
+  for (size_t idx = 0; idx < rulactions.size(); idx++) {
+    if (rulactions.at(idx).first->matches(&dq)) {
+      result.push_back(idx);
+    }
+  }
+  return result;
+}
+
+static void checkMatching(const CompiledRuleChain& chain, const CompiledRuleChain::rulactions_t& rulactions, const TestQuery& query, const std::vector<size_t>& expected)
+{
+  const auto matching = getMatching(chain, rulactions, *query.dq);
+  BOOST_CHECK(matching == getExpected(rulactions, *query.dq));
+  BOOST_CHECK(matching == expected);
+}
+
+BOOST_AUTO_TEST_CASE(test_MixedRulesInterleaved) {
+  const auto rulactions = makeRulactions({
+      std::make_shared<QTypeRule>(QType::A),
+      makeSuffixRule("powerdns.com."),
+      makeSuffixRule("example.com."),
+      makeNetmaskRule("192.0.2.0/24"),
+      makeNetmaskRule("192.0.2.0/25"),
+      /* destination, not merged with the previous ones */
+      makeNetmaskRule("192.0.2.0/24", false),
+      std::make_shared<QTypeRule>(QType::AAAA),
+      makeSuffixRule("powerdns.com."),
+      std::make_shared<TCPRule>(false),
+      std::make_shared<AllRule>()
+    });
+  CompiledRuleChain chain(rulactions);
+  /* the two suffix rules are merged, as are the first two netmask ones */
+  BOOST_CHECK_EQUAL(chain.getProgramSize(), rulactions.size() - 2);
+
+  checkMatching(chain, rulactions, TestQuery("www.powerdns.com.", QType::A), {0, 1, 3, 4, 5, 7, 8, 9});
+  checkMatching(chain, rulactions, TestQuery("www.example.com.", QType::AAAA, "192.0.2.200"), {2, 3, 5, 6, 8, 9});
+  checkMatching(chain, rulactions, TestQuery("www.example.net.", QType::MX, "198.51.100.1"), {5, 8, 9});
+}
+
+BOOST_AUTO_TEST_CASE(test_MergedGroupFirstMatchNotFirstRule) {
+  const auto rulactions = makeRulactions({
+      makeSuffixRule("example.com."),
+      makeSuffixRule("powerdns.com."),
+      makeSuffixRule("example.net."),
+      makeSuffixRule("com."),
+      std::make_shared<QTypeRule>(QType::A)
+    });
+  CompiledRuleChain chain(rulactions);
+  BOOST_CHECK_EQUAL(chain.getProgramSize(), 2);
+
+  TestQuery query("www.powerdns.com.", QType::A);
+  checkMatching(chain, rulactions, query, {1, 3, 4});
+
+  /* stopping at the first match, as the action loop does, gives the second rule of the group */
+  std::vector<std::shared_ptr<DNSRule> > visited;
+  chain.forEachMatchingRule(*query.dq, [&visited](const CompiledRuleChain::rulaction_t& rulaction) {
+      visited.push_back(rulaction.first);
+      return false;
+    });
+  BOOST_REQUIRE_EQUAL(visited.size(), 1);
+  BOOST_CHECK(visited.at(0) == rulactions.at(1).first);
+
+  /* same thing for a merged netmask group */
+  const auto nmgRulactions = makeRulactions({
+      makeNetmaskRule("198.51.100.0/24"),
+      makeNetmaskRule("192.0.2.128/25"),
+      makeNetmaskRule("192.0.2.0/24")
+    });
+  CompiledRuleChain nmgChain(nmgRulactions);
+  BOOST_CHECK_EQUAL(nmgChain.getProgramSize(), 1);
+  checkMatching(nmgChain, nmgRulactions, TestQuery("www.powerdns.com.", QType::A, "192.0.2.200"), {1, 2});
+  checkMatching(nmgChain, nmgRulactions, TestQuery("www.powerdns.com.", QType::A, "192.0.2.1"), {2});
+}
+
+BOOST_AUTO_TEST_CASE(test_WrappersNotMerged) {
+  std::shared_ptr<DNSRule> powerdns = makeSuffixRule("powerdns.com.");
+  const auto rulactions = makeRulactions({
+      makeSuffixRule("powerdns.com."),
+      std::make_shared<NotRule>(powerdns),
+      std::make_shared<AndRule>(std::vector<std::pair<int, std::shared_ptr<DNSRule> > >({{1, powerdns}, {2, std::make_shared<QTypeRule>(QType::A)}})),
+      makeSuffixRule("example.com."),
+      std::make_shared<NotRule>(powerdns),
+      makeNetmaskRule("192.0.2.0/24")
+    });
+  CompiledRuleChain chain(rulactions);
+  /* neither the wrappers nor the rules around them are merged */
+  BOOST_CHECK_EQUAL(chain.getProgramSize(), rulactions.size());
+
+  checkMatching(chain, rulactions, TestQuery("www.powerdns.com.", QType::A), {0, 2, 5});
+  checkMatching(chain, rulactions, TestQuery("www.powerdns.com.", QType::AAAA), {0, 5});
+  checkMatching(chain, rulactions, TestQuery("www.example.com.", QType::A, "198.51.100.1"), {1, 3, 4});
+}
+
+BOOST_AUTO_TEST_CASE(test_RecompiledAfterChange) {
+  GlobalStateHolder<CompiledRuleChain::rulactions_t> rulactions;
+  rulactions.setState(makeRulactions({ makeSuffixRule("powerdns.com.") }));
+  auto local = rulactions.getLocal();
+
+  TestQuery query("www.example.com.", QType::A);
+  auto chain = getCompiledRuleChain(local);
+  BOOST_REQUIRE(chain);
+  BOOST_CHECK_EQUAL(chain->getProgramSize(), 1);
+  BOOST_CHECK(getMatching(*chain, *local, *query.dq).empty());
+  /* compiled only once */
+  BOOST_CHECK(getCompiledRuleChain(local) == chain);
+
+  /* the new rule is adjacent to the existing one, and gets merged with it */
+  rulactions.modify([](CompiledRuleChain::rulactions_t& rules) {
+      rules.push_back({makeSuffixRule("example.com."), nullptr});
+    });
+  auto updated = getCompiledRuleChain(local);
+  BOOST_REQUIRE(updated);
+  BOOST_CHECK(updated != chain);
+  BOOST_CHECK_EQUAL(updated->getProgramSize(), 1);
+  BOOST_CHECK(getMatching(*updated, *local, *query.dq) == std::vector<size_t>({1}));
+  BOOST_CHECK(getCompiledRuleChain(local) == updated);
+
+  rulactions.modify([](CompiledRuleChain::rulactions_t& rules) {
+      rules.push_back({std::make_shared<QTypeRule>(QType::A), nullptr});
+    });
+  updated = getCompiledRuleChain(local);
+  BOOST_CHECK_EQUAL(updated->getProgramSize(), 2);
+  BOOST_CHECK(getMatching(*updated, *local, *query.dq) == std::vector<size_t>({1, 2}));
+}
+
+#ifdef HAVE_RE2
+BOOST_AUTO_TEST_CASE(test_RegexSetSemantics) {
+  /* unanchored and case-insensitive, unlike RE2Rule */
+  auto set = std::make_shared<const RegexSet>(std::vector<std::string>({"ads[0-9]*\\.example", "^www\\.powerdns\\.com$"}));
+  RegexSetRule anyRule(set);
+  RegexSetRule adsRule(set, 0);
+  RegexSetRule wwwRule(set, 1);
+  RE2Rule re2Rule("ads[0-9]*\\.example");
+
+  TestQuery ads("tracker.ADS42.example.net.", QType::A);
+  BOOST_CHECK(anyRule.matches(ads.dq.get()));
+  BOOST_CHECK(adsRule.matches(ads.dq.get()));
+  BOOST_CHECK(!wwwRule.matches(ads.dq.get()));
+  BOOST_CHECK(!re2Rule.matches(ads.dq.get()));
+
+  TestQuery exact("ads42.example.", QType::A);
+  BOOST_CHECK(adsRule.matches(exact.dq.get()));
+  BOOST_CHECK(re2Rule.matches(exact.dq.get()));
+
+  TestQuery www("WWW.PowerDNS.com.", QType::A);
+  BOOST_CHECK(wwwRule.matches(www.dq.get()));
+  TestQuery wwwSub("www.powerdns.com.example.", QType::A);
+  BOOST_CHECK(!wwwRule.matches(wwwSub.dq.get()));
+  BOOST_CHECK(!anyRule.matches(wwwSub.dq.get()));
+
+  /* the name is matched in the escaped form of DNSName::toStringNoDot() */
+  for (const auto& name : {"a\\.b.ex\\032ample\\\\.c!d~e\\255.", "."}) {
+    TestQuery escaped(name, QType::A);
+    auto escapedSet = std::make_shared<const RegexSet>(std::vector<std::string>({"^" + RE2::QuoteMeta(escaped.qname.toStringNoDot()) + "$"}));
+    BOOST_CHECK(RegexSetRule(escapedSet).matches(escaped.dq.get()));
+    BOOST_CHECK(RegexSetRule(escapedSet, 0).matches(escaped.dq.get()));
+    BOOST_CHECK(!RegexSetRule(escapedSet).matches(www.dq.get()));
+  }
+
+  BOOST_CHECK_THROW(std::make_shared<const RegexSet>(std::vector<std::string>()), std::runtime_error);
+  BOOST_CHECK_THROW(std::make_shared<const RegexSet>(std::vector<std::string>({"("})), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_RegexSetRulesMerged) {
+  auto set = std::make_shared<const RegexSet>(std::vector<std::string>({"^ads\\.", "[0-9]{5,}", "\\.cn$"}));
+  auto otherSet = std::make_shared<const RegexSet>(std::vector<std::string>({"powerdns"}));
+  const auto rulactions = makeRulactions({
+      std::make_shared<RegexSetRule>(set, 0),
+      std::make_shared<RegexSetRule>(set, 1),
+      std::make_shared<RegexSetRule>(set, 2),
+      std::make_shared<RegexSetRule>(set),
+      /* a different set is not merged */
+      std::make_shared<RegexSetRule>(otherSet, 0),
+      std::make_shared<QTypeRule>(QType::A),
+      std::make_shared<RegexSetRule>(set, 1)
+    });
+  CompiledRuleChain chain(rulactions);
+  BOOST_CHECK_EQUAL(chain.getProgramSize(), 4);
+
+  checkMatching(chain, rulactions, TestQuery("www12345.example.cn.", QType::A), {1, 2, 3, 5, 6});
+  checkMatching(chain, rulactions, TestQuery("ads.powerdns.com.", QType::AAAA), {0, 3, 4});
+  checkMatching(chain, rulactions, TestQuery("www.example.com.", QType::AAAA), {});
+}
+
+BOOST_AUTO_TEST_CASE(test_RegexSetGroupReentrant) {
+  auto set = std::make_shared<const RegexSet>(std::vector<std::string>({"first", "second"}));
+  const auto rulactions = makeRulactions({
+      std::make_shared<RegexSetRule>(set, 0),
+      std::make_shared<RegexSetRule>(set, 1)
+    });
+  CompiledRuleChain chain(rulactions);
+  BOOST_CHECK_EQUAL(chain.getProgramSize(), 1);
+
+  TestQuery outer("first.second.powerdns.com.", QType::A);
+  TestQuery inner("second.powerdns.com.", QType::A);
+  /* evaluating the chain for another query from the visitor, as a Lua action might,
+     does not change the rules matching the first one */
+  std::vector<size_t> matching;
+  std::vector<size_t> innerMatching;
+  chain.forEachMatchingRule(*outer.dq, [&](const CompiledRuleChain::rulaction_t& rulaction) {
+      matching.push_back(rulaction.first == rulactions.at(0).first ? 0 : 1);
+      if (innerMatching.empty()) {
+        innerMatching = getMatching(chain, rulactions, *inner.dq);
+      }
+      return true;
+    });
+  BOOST_CHECK(matching == std::vector<size_t>({0, 1}));
+  BOOST_CHECK(innerMatching == std::vector<size_t>({1}));
+}
+#endif /* HAVE_RE2 */
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,412 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-tcp-downstream.hh"
+#include "dnswriter.hh"
+#include "iputils.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdisttcp_cc)
+
+class MockTCPQuerySender : public TCPQuerySender
+{
+public:
+  bool handleDownstreamResponse(std::vector<uint8_t>& response, const struct timeval& now) override
+  {
+    d_responses.push_back(response);
+    return true;
+  }
+
+  void handleDownstreamFailure(const struct timeval& now) override
+  {
+    d_failures++;
+  }
+
+  std::vector<std::vector<uint8_t> > d_responses;
+  size_t d_failures{0};
+};
+
+static int getListeningSocket(ComboAddress& local)
+{
+  int fd = SSocket(AF_INET, SOCK_STREAM, 0);
+  local = ComboAddress("127.0.0.1", 0);
+  SBind(fd, local);
+  SListen(fd, 16);
+  socklen_t len = local.getSocklen();
+  BOOST_REQUIRE_EQUAL(getsockname(fd, reinterpret_cast<struct sockaddr*>(&local), &len), 0);
+  return fd;
+}
+
+static int acceptBackendConnection(int listener)
+{
+  int fd = accept(listener, nullptr, nullptr);
+  BOOST_REQUIRE_GE(fd, 0);
+  /* don't hang forever if a query never shows up */
+  struct timeval tv{2, 0};
+  BOOST_REQUIRE_EQUAL(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)), 0);
+  return fd;
+}
+
+/* returns false if no connection is waiting to be accepted */
+static bool hasPendingConnection(int listener)
+{
+  setNonBlocking(listener);
+  int fd = accept(listener, nullptr, nullptr);
+  setBlocking(listener);
+  if (fd >= 0) {
+    close(fd);
+    return true;
+  }
+  return false;
+}
+
+static std::vector<uint8_t> makeQuery(uint16_t id)
+{
+  std::vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, DNSName("powerdns.com."), QType::A);
+  pw.getHeader()->id = htons(id);
+  pw.getHeader()->rd = 1;
+
+  std::vector<uint8_t> query;
+  query.push_back(packet.size() / 256);
+  query.push_back(packet.size() % 256);
+  query.insert(query.end(), packet.begin(), packet.end());
+  return query;
+}
+
+static uint16_t getID(const std::vector<uint8_t>& packet, size_t offset=0)
+{
+  return ntohs(reinterpret_cast<const struct dnsheader*>(&packet.at(offset))->id);
+}
+
+/* reads a length-prefixed query from the backend side of a connection */
+static std::vector<uint8_t> readQuery(int fd)
+{
+  std::vector<uint8_t> buffer(sizeof(uint16_t));
+  BOOST_REQUIRE_EQUAL(recv(fd, buffer.data(), buffer.size(), MSG_WAITALL), static_cast<ssize_t>(buffer.size()));
+  uint16_t len = (buffer.at(0) << 8) | buffer.at(1);
+  buffer.resize(len);
+  BOOST_REQUIRE_EQUAL(recv(fd, buffer.data(), buffer.size(), MSG_WAITALL), static_cast<ssize_t>(len));
+  return buffer;
+}
+
+/* answers a query read by readQuery(), keeping the ID it was sent with */
+static void sendResponse(int fd, std::vector<uint8_t> query)
+{
+  reinterpret_cast<struct dnsheader*>(query.data())->qr = 1;
+  std::vector<uint8_t> response;
+  response.push_back(query.size() / 256);
+  response.push_back(query.size() % 256);
+  response.insert(response.end(), query.begin(), query.end());
+  BOOST_REQUIRE_EQUAL(send(fd, response.data(), response.size(), 0), static_cast<ssize_t>(response.size()));
+}
+
+template<typename T> static void runUntil(FDMultiplexer& mplexer, T condition)
+{
+  struct timeval now;
+  for (size_t idx = 0; idx < 20 && !condition(); idx++) {
+    mplexer.run(&now);
+  }
+  BOOST_REQUIRE(condition());
+}
+
+static std::unique_ptr<FDMultiplexer> getMultiplexer()
+{
+  BOOST_REQUIRE(!FDMultiplexer::getMultiplexerMap().empty());
+  return std::unique_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerMap().begin()->second());
+}
+
+static size_t getPoolSize(downstreamtcpconnections_t& pool, const std::shared_ptr<DownstreamState>& ds)
+{
+  return pool[ds.get()].size();
+}
+
+BOOST_AUTO_TEST_CASE(test_PipeliningOutOfOrder) {
+  ComboAddress backendAddr;
+  int listener = getListeningSocket(backendAddr);
+  auto ds = std::make_shared<DownstreamState>(backendAddr);
+  auto mplexer = getMultiplexer();
+  downstreamtcpconnections_t pool;
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  auto sender1 = std::make_shared<MockTCPQuerySender>();
+  auto sender2 = std::make_shared<MockTCPQuerySender>();
+  /* both clients use the same ID, the connection has to tell the responses apart */
+  auto conn = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  conn->queueQuery(sender1, makeQuery(4242), now);
+  BOOST_CHECK(getDownstreamConnection(*mplexer, pool, ds, true, now) == conn);
+  conn->queueQuery(sender2, makeQuery(4242), now);
+  BOOST_CHECK_EQUAL(conn->getPendingCount(), 2);
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 1);
+
+  int backend = acceptBackendConnection(listener);
+  struct timeval tv;
+  mplexer->run(&tv);
+  auto query1 = readQuery(backend);
+  auto query2 = readQuery(backend);
+  BOOST_CHECK(getID(query1) != getID(query2));
+  BOOST_CHECK(!hasPendingConnection(listener));
+
+  /* answer the second query first */
+  sendResponse(backend, query2);
+  runUntil(*mplexer, [&sender2]() { return sender2->d_responses.size() == 1; });
+  BOOST_CHECK_EQUAL(sender1->d_responses.size(), 0);
+  BOOST_CHECK_EQUAL(getID(sender2->d_responses.at(0)), 4242);
+  BOOST_CHECK_EQUAL(conn->getPendingCount(), 1);
+
+  sendResponse(backend, query1);
+  runUntil(*mplexer, [&sender1]() { return sender1->d_responses.size() == 1; });
+  BOOST_CHECK_EQUAL(getID(sender1->d_responses.at(0)), 4242);
+  BOOST_CHECK_EQUAL(conn->getPendingCount(), 0);
+  BOOST_CHECK_EQUAL(sender1->d_failures + sender2->d_failures, 0);
+
+  close(backend);
+  close(listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_ConnectionReuse) {
+  ComboAddress backendAddr;
+  int listener = getListeningSocket(backendAddr);
+  auto ds = std::make_shared<DownstreamState>(backendAddr);
+  auto mplexer = getMultiplexer();
+  downstreamtcpconnections_t pool;
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  auto sender = std::make_shared<MockTCPQuerySender>();
+  auto conn = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  conn->queueQuery(sender, makeQuery(1), now);
+  int backend = acceptBackendConnection(listener);
+  struct timeval tv;
+  mplexer->run(&tv);
+  sendResponse(backend, readQuery(backend));
+  runUntil(*mplexer, [&sender]() { return sender->d_responses.size() == 1; });
+
+  /* the idle connection is still there and gets the next query */
+  BOOST_CHECK(conn->canAcceptQuery());
+  BOOST_CHECK(getDownstreamConnection(*mplexer, pool, ds, true, now) == conn);
+  conn->queueQuery(sender, makeQuery(2), now);
+  mplexer->run(&tv);
+  sendResponse(backend, readQuery(backend));
+  runUntil(*mplexer, [&sender]() { return sender->d_responses.size() == 2; });
+  BOOST_CHECK_EQUAL(getID(sender->d_responses.at(1)), 2);
+  BOOST_CHECK(!hasPendingConnection(listener));
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 1);
+
+  close(backend);
+  close(listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_MaxPipelinedQueries) {
+  ComboAddress backendAddr;
+  int listener = getListeningSocket(backendAddr);
+  auto ds = std::make_shared<DownstreamState>(backendAddr);
+  auto mplexer = getMultiplexer();
+  downstreamtcpconnections_t pool;
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  const auto maxPipelined = g_maxTCPPipelinedQueries;
+  g_maxTCPPipelinedQueries = 1;
+
+  auto sender = std::make_shared<MockTCPQuerySender>();
+  auto conn1 = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  conn1->queueQuery(sender, makeQuery(1), now);
+  BOOST_CHECK(!conn1->canAcceptQuery());
+  auto conn2 = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  BOOST_CHECK(conn1 != conn2);
+  conn2->queueQuery(sender, makeQuery(2), now);
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 2);
+
+  g_maxTCPPipelinedQueries = maxPipelined;
+
+  int backend1 = acceptBackendConnection(listener);
+  int backend2 = acceptBackendConnection(listener);
+  struct timeval tv;
+  mplexer->run(&tv);
+  sendResponse(backend1, readQuery(backend1));
+  sendResponse(backend2, readQuery(backend2));
+  runUntil(*mplexer, [&sender]() { return sender->d_responses.size() == 2; });
+  BOOST_CHECK_EQUAL(sender->d_failures, 0);
+
+  close(backend1);
+  close(backend2);
+  close(listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_MaxIdleConnections) {
+  ComboAddress backendAddr;
+  int listener = getListeningSocket(backendAddr);
+  auto ds = std::make_shared<DownstreamState>(backendAddr);
+  auto mplexer = getMultiplexer();
+  downstreamtcpconnections_t pool;
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  const auto maxPipelined = g_maxTCPPipelinedQueries;
+  const auto maxIdle = g_maxIdleTCPConnectionsPerDownstream;
+  g_maxTCPPipelinedQueries = 1;
+  g_maxIdleTCPConnectionsPerDownstream = 1;
+
+  /* two connections busy at the same time */
+  auto sender = std::make_shared<MockTCPQuerySender>();
+  auto conn1 = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  conn1->queueQuery(sender, makeQuery(1), now);
+  auto conn2 = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  conn2->queueQuery(sender, makeQuery(2), now);
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 2);
+  g_maxTCPPipelinedQueries = maxPipelined;
+
+  int backend1 = acceptBackendConnection(listener);
+  int backend2 = acceptBackendConnection(listener);
+  struct timeval tv;
+  mplexer->run(&tv);
+  sendResponse(backend1, readQuery(backend1));
+  sendResponse(backend2, readQuery(backend2));
+  runUntil(*mplexer, [&sender]() { return sender->d_responses.size() == 2; });
+  BOOST_CHECK_EQUAL(sender->d_failures, 0);
+
+  /* only one of them is kept once they are both idle */
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 1);
+  BOOST_CHECK(conn1->canAcceptQuery() != conn2->canAcceptQuery());
+
+  g_maxIdleTCPConnectionsPerDownstream = maxIdle;
+  close(backend1);
+  close(backend2);
+  close(listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_IdleTimeout) {
+  ComboAddress backendAddr;
+  int listener = getListeningSocket(backendAddr);
+  auto ds = std::make_shared<DownstreamState>(backendAddr);
+  auto mplexer = getMultiplexer();
+  downstreamtcpconnections_t pool;
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  auto sender = std::make_shared<MockTCPQuerySender>();
+  auto conn = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  conn->queueQuery(sender, makeQuery(1), now);
+  int backend = acceptBackendConnection(listener);
+  struct timeval tv;
+  mplexer->run(&tv);
+  sendResponse(backend, readQuery(backend));
+  runUntil(*mplexer, [&sender]() { return sender->d_responses.size() == 1; });
+
+  /* the idle connection is kept until its maximum idle time has passed */
+  struct timeval later = now;
+  later.tv_sec += g_tcpDownstreamMaxIdleTime - 1;
+  BOOST_CHECK_EQUAL(mplexer->getTimeouts(later).size(), 0);
+  later.tv_sec += 2;
+  BOOST_REQUIRE_EQUAL(mplexer->getTimeouts(later).size(), 1);
+  conn->handleTimeout(later);
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 0);
+  BOOST_CHECK(!conn->canAcceptQuery());
+  BOOST_CHECK_EQUAL(sender->d_failures, 0);
+  char c;
+  BOOST_CHECK_EQUAL(recv(backend, &c, sizeof(c), 0), 0);
+
+  close(backend);
+  close(listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_IdleConnectionHalfClosedByBackend) {
+  ComboAddress backendAddr;
+  int listener = getListeningSocket(backendAddr);
+  auto ds = std::make_shared<DownstreamState>(backendAddr);
+  auto mplexer = getMultiplexer();
+  downstreamtcpconnections_t pool;
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  auto sender = std::make_shared<MockTCPQuerySender>();
+  auto conn = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  conn->queueQuery(sender, makeQuery(1), now);
+  int backend = acceptBackendConnection(listener);
+  struct timeval tv;
+  mplexer->run(&tv);
+  sendResponse(backend, readQuery(backend));
+  runUntil(*mplexer, [&sender]() { return sender->d_responses.size() == 1; });
+
+  /* the backend stops sending on an idle connection: it should be dropped from the pool
+     without anyone being told about a failure */
+  BOOST_REQUIRE_EQUAL(shutdown(backend, SHUT_WR), 0);
+  runUntil(*mplexer, [&pool, &ds]() { return getPoolSize(pool, ds) == 0; });
+  BOOST_CHECK(!conn->canAcceptQuery());
+  BOOST_CHECK_EQUAL(sender->d_failures, 0);
+
+  /* and the next query gets a new connection */
+  auto conn2 = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  BOOST_CHECK(conn2 != conn);
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 1);
+
+  close(backend);
+  close(listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_BackendClosesWithPendingQueries) {
+  ComboAddress backendAddr;
+  int listener = getListeningSocket(backendAddr);
+  auto ds = std::make_shared<DownstreamState>(backendAddr);
+  auto mplexer = getMultiplexer();
+  downstreamtcpconnections_t pool;
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  auto sender1 = std::make_shared<MockTCPQuerySender>();
+  auto sender2 = std::make_shared<MockTCPQuerySender>();
+  auto conn = getDownstreamConnection(*mplexer, pool, ds, true, now);
+  conn->queueQuery(sender1, makeQuery(1), now);
+  conn->queueQuery(sender2, makeQuery(2), now);
+  int backend = acceptBackendConnection(listener);
+  struct timeval tv;
+  mplexer->run(&tv);
+  auto query1 = readQuery(backend);
+  readQuery(backend);
+
+  /* only the first one gets answered before the backend goes away */
+  sendResponse(backend, query1);
+  BOOST_REQUIRE_EQUAL(shutdown(backend, SHUT_WR), 0);
+  runUntil(*mplexer, [&sender2]() { return sender2->d_failures == 1; });
+  BOOST_CHECK_EQUAL(sender1->d_responses.size(), 1);
+  BOOST_CHECK_EQUAL(sender1->d_failures, 0);
+  BOOST_CHECK_EQUAL(sender2->d_responses.size(), 0);
+  BOOST_CHECK_EQUAL(conn->getPendingCount(), 0);
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 0);
+
+  close(backend);
+  close(listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_NonReusableConnection) {
+  ComboAddress backendAddr;
+  int listener = getListeningSocket(backendAddr);
+  auto ds = std::make_shared<DownstreamState>(backendAddr);
+  auto mplexer = getMultiplexer();
+  downstreamtcpconnections_t pool;
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  auto sender = std::make_shared<MockTCPQuerySender>();
+  auto conn = getDownstreamConnection(*mplexer, pool, ds, false, now);
+  BOOST_CHECK(!conn->canAcceptQuery());
+  BOOST_CHECK_EQUAL(getPoolSize(pool, ds), 0);
+  conn->queueQuery(sender, makeQuery(1), now);
+  int backend = acceptBackendConnection(listener);
+  struct timeval tv;
+  mplexer->run(&tv);
+  sendResponse(backend, readQuery(backend));
+  runUntil(*mplexer, [&sender]() { return sender->d_responses.size() == 1; });
+
+  /* the connection is closed once the last response has been received */
+  char c;
+  BOOST_CHECK_EQUAL(recv(backend, &c, sizeof(c), 0), 0);
+
+  close(backend);
+  close(listener);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
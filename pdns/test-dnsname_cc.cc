@@ -173,6 +173,15 @@ BOOST_AUTO_TEST_CASE(test_trim) {
 
   DNSName root(".");
   BOOST_CHECK_EQUAL(root.countLabels(), 0);
+
+  DNSName name("www.PowerDNS.com.");
+  BOOST_CHECK_EQUAL(name.getLastLabels(2).toString(), "PowerDNS.com.");
+  BOOST_CHECK_EQUAL(name.getLastLabels(3), name);
+  BOOST_CHECK_EQUAL(name.getLastLabels(4), name);
+  BOOST_CHECK_EQUAL(name.getLastLabels(0), root);
+  BOOST_CHECK_EQUAL(name.toString(), "www.PowerDNS.com.");
+  BOOST_CHECK_EQUAL(root.getLastLabels(1), root);
+  BOOST_CHECK(DNSName().getLastLabels(1).empty());
 }
 
 BOOST_AUTO_TEST_CASE(test_toolong) {
@@ -489,8 +498,20 @@ BOOST_AUTO_TEST_CASE(test_suffixmatch) {
 
   BOOST_CHECK(!smn.check(DNSName("www.news.gov.uk.")));
 
+  smn.add(DNSName("bbc.co.uk.")); // parent of an existing entry
+  BOOST_CHECK(smn.check(DNSName("bbc.co.uk.")));
+  BOOST_CHECK(smn.check(DNSName("images.bbc.co.uk.")));
+  BOOST_CHECK(!smn.check(DNSName("co.uk.")));
+
+  SuffixMatchNode smn2;
+  smn2.add(DNSName("uk."));
+  smn2.add(DNSName("news.bbc.co.uk."));
+  BOOST_CHECK(smn2.check(DNSName("images.bbc.co.uk.")));
+  BOOST_CHECK(smn2.check(DNSName("bbc.co.uk.")));
+
   smn.add(g_rootdnsname); // block the root
   BOOST_CHECK(smn.check(DNSName("a.root-servers.net.")));
+  BOOST_CHECK(smn.check(DNSName("www.news.gov.uk.")));
 }
 
 
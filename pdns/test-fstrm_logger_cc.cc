@@ -0,0 +1,269 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <fstream>
+#include <thread>
+#include <boost/test/unit_test.hpp>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fstrm_logger.hh"
+#include "misc.hh"
+
+BOOST_AUTO_TEST_SUITE(fstrm_logger_cc)
+
+static const std::string s_contentType("protobuf:dnstap.Dnstap");
+
+static void appendUInt32(std::string& out, uint32_t value)
+{
+  value = htonl(value);
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/* reads the frames from a buffer, a control frame being returned as its type followed by its fields */
+class FrameReader
+{
+public:
+  FrameReader(const std::string& data): d_data(data)
+  {
+  }
+  bool done() const
+  {
+    return d_pos >= d_data.size();
+  }
+  uint32_t getUInt32()
+  {
+    uint32_t value;
+    BOOST_REQUIRE_LE(d_pos + sizeof(value), d_data.size());
+    memcpy(&value, d_data.data() + d_pos, sizeof(value));
+    d_pos += sizeof(value);
+    return ntohl(value);
+  }
+  std::string getFrame(bool& control)
+  {
+    uint32_t length = getUInt32();
+    control = length == 0;
+    if (control) {
+      length = getUInt32();
+    }
+    BOOST_REQUIRE_LE(d_pos + length, d_data.size());
+    const std::string result = d_data.substr(d_pos, length);
+    d_pos += length;
+    return result;
+  }
+private:
+  const std::string d_data;
+  size_t d_pos{0};
+};
+
+static std::string makeControlFrame(uint32_t type, const std::vector<std::string>& contentTypes)
+{
+  std::string fields;
+  appendUInt32(fields, type);
+  for (const auto& contentType : contentTypes) {
+    appendUInt32(fields, 1);
+    appendUInt32(fields, contentType.size());
+    fields.append(contentType);
+  }
+  std::string frame;
+  appendUInt32(frame, 0);
+  appendUInt32(frame, fields.size());
+  return frame + fields;
+}
+
+/* reads the next frame from a socket, an empty string meaning that the connection has been closed */
+static std::string readFrame(int fd, bool& control)
+{
+  uint32_t length;
+  if (read(fd, &length, sizeof(length)) != sizeof(length)) {
+    return std::string();
+  }
+  control = length == 0;
+  if (control) {
+    readn2(fd, &length, sizeof(length));
+  }
+  std::string frame(ntohl(length), '\0');
+  if (!frame.empty()) {
+    readn2(fd, &frame.at(0), frame.size());
+  }
+  return frame;
+}
+
+static void waitForSent(const BatchedLogger& logger, uint64_t expected)
+{
+  for (size_t idx = 0; idx < 500 && logger.getSent() < expected; idx++) {
+    usleep(10000);
+  }
+  BOOST_REQUIRE_EQUAL(logger.getSent(), expected);
+}
+
+BOOST_AUTO_TEST_CASE(test_FileLogger) {
+  char path[] = "/tmp/pdns-test-fstrm.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    BOOST_FAIL("Unable to generate a temporary file");
+  }
+  /* the existing content is truncated */
+  BOOST_REQUIRE_EQUAL(write(fd, "garbage", 7), 7);
+  close(fd);
+
+  {
+    FrameStreamLogger logger(path, true, s_contentType, 2, 10);
+    /* only one logger per path */
+    BOOST_CHECK_THROW(FrameStreamLogger(path, true, s_contentType, 2, 10), std::runtime_error);
+    BOOST_CHECK_THROW(FrameStreamLogger(path, false, s_contentType, 2, 10), std::runtime_error);
+
+    logger.queueData("first");
+    logger.queueData("second message");
+    waitForSent(logger, 2);
+  }
+
+  std::ifstream ifs(path);
+  const std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+  unlink(path);
+
+  FrameReader reader(content);
+  bool control = false;
+  BOOST_CHECK(reader.getFrame(control) == makeControlFrame(2, {s_contentType}).substr(2 * sizeof(uint32_t)));
+  BOOST_CHECK(control);
+  BOOST_CHECK_EQUAL(reader.getFrame(control), "first");
+  BOOST_CHECK(!control);
+  BOOST_CHECK_EQUAL(reader.getFrame(control), "second message");
+  BOOST_CHECK(!control);
+  BOOST_CHECK(reader.getFrame(control) == makeControlFrame(3, {}).substr(2 * sizeof(uint32_t)));
+  BOOST_CHECK(control);
+  BOOST_CHECK(reader.done());
+}
+
+/* a Frame Streams reader listening on a unix socket */
+class UnixSocketReader
+{
+public:
+  UnixSocketReader()
+  {
+    char dir[] = "/tmp/pdns-test-fstrm.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+      BOOST_FAIL("Unable to generate a temporary directory");
+    }
+    d_dir = dir;
+    d_path = d_dir + "/socket";
+    struct sockaddr_un addr;
+    BOOST_REQUIRE_EQUAL(makeUNsockaddr(d_path, &addr), 0);
+    d_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    BOOST_REQUIRE_GE(d_socket, 0);
+    BOOST_REQUIRE_EQUAL(bind(d_socket, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)), 0);
+    BOOST_REQUIRE_EQUAL(listen(d_socket, 1), 0);
+  }
+  ~UnixSocketReader()
+  {
+    if (d_thread.joinable()) {
+      d_thread.join();
+    }
+    if (d_socket >= 0) {
+      close(d_socket);
+    }
+    unlink(d_path.c_str());
+    rmdir(d_dir.c_str());
+  }
+  /* accept a single connection, answer READY with an ACCEPT for these content types
+     and record every frame received until the connection is closed */
+  void run(const std::vector<std::string>& acceptedContentTypes)
+  {
+    d_thread = std::thread([this, acceptedContentTypes]() {
+        int conn = accept(d_socket, nullptr, nullptr);
+        close(d_socket);
+        d_socket = -1;
+        if (conn < 0) {
+          return;
+        }
+        struct timeval tv{5, 0};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        try {
+          for (;;) {
+            bool control = false;
+            const auto frame = readFrame(conn, control);
+            if (frame.empty()) {
+              break;
+            }
+            d_frames.push_back({control, frame});
+            if (control && frame.size() >= sizeof(uint32_t)) {
+              const uint32_t type = ntohl(*reinterpret_cast<const uint32_t*>(frame.data()));
+              std::string answer;
+              if (type == 4) {
+                answer = makeControlFrame(1, acceptedContentTypes);
+              }
+              else if (type == 3) {
+                answer = makeControlFrame(5, {});
+              }
+              if (!answer.empty()) {
+                writen2(conn, answer.data(), answer.size());
+              }
+            }
+          }
+        }
+        catch(const std::exception& e) {
+        }
+        close(conn);
+      });
+  }
+  void join()
+  {
+    d_thread.join();
+  }
+
+  std::vector<std::pair<bool, std::string>> d_frames;
+  std::string d_path;
+
+private:
+  std::string d_dir;
+  std::thread d_thread;
+  int d_socket{-1};
+};
+
+BOOST_AUTO_TEST_CASE(test_UnixSocketHandshake) {
+  UnixSocketReader reader;
+  /* our content type does not have to be the first one */
+  reader.run({"protobuf:other", s_contentType});
+
+  {
+    FrameStreamLogger logger(reader.d_path, false, s_contentType, 2, 10);
+    BOOST_CHECK_THROW(FrameStreamLogger(reader.d_path, false, s_contentType, 2, 10), std::runtime_error);
+    logger.queueData("first");
+    logger.queueData("second message");
+    waitForSent(logger, 2);
+  }
+  reader.join();
+
+  const auto& frames = reader.d_frames;
+  BOOST_REQUIRE_EQUAL(frames.size(), 5);
+  /* READY, START, the data, then STOP */
+  BOOST_CHECK(frames.at(0).first);
+  BOOST_CHECK(frames.at(0).second == makeControlFrame(4, {s_contentType}).substr(2 * sizeof(uint32_t)));
+  BOOST_CHECK(frames.at(1).first);
+  BOOST_CHECK(frames.at(1).second == makeControlFrame(2, {s_contentType}).substr(2 * sizeof(uint32_t)));
+  BOOST_CHECK(!frames.at(2).first);
+  BOOST_CHECK_EQUAL(frames.at(2).second, "first");
+  BOOST_CHECK(!frames.at(3).first);
+  BOOST_CHECK_EQUAL(frames.at(3).second, "second message");
+  BOOST_CHECK(frames.at(4).first);
+  BOOST_CHECK(frames.at(4).second == makeControlFrame(3, {}).substr(2 * sizeof(uint32_t)));
+}
+
+BOOST_AUTO_TEST_CASE(test_UnixSocketContentTypeNotAccepted) {
+  UnixSocketReader reader;
+  reader.run({"protobuf:other"});
+
+  {
+    FrameStreamLogger logger(reader.d_path, false, s_contentType, 2, 10);
+  }
+  reader.join();
+
+  /* the connection is closed right after the ACCEPT, without a START */
+  const auto& frames = reader.d_frames;
+  BOOST_REQUIRE_EQUAL(frames.size(), 1);
+  BOOST_CHECK(frames.at(0).first);
+  BOOST_CHECK(frames.at(0).second == makeControlFrame(4, {s_contentType}).substr(2 * sizeof(uint32_t)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
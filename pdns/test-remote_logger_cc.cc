@@ -0,0 +1,177 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <thread>
+#include <boost/test/unit_test.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "iputils.hh"
+#include "remote_logger.hh"
+
+BOOST_AUTO_TEST_SUITE(remote_logger_cc)
+
+/* sends to one end of a socket pair, the test reading from the other one */
+class TestLogger : public BatchedLogger
+{
+public:
+  TestLogger(uint64_t maxQueuedEntries, uint8_t lengthPrefixSize, int sendBufferSize=0): BatchedLogger(5, maxQueuedEntries, 1, lengthPrefixSize), d_sendBufferSize(sendBufferSize)
+  {
+    BOOST_REQUIRE(reconnect());
+  }
+  ~TestLogger()
+  {
+    stop();
+    if (d_peer >= 0) {
+      close(d_peer);
+    }
+  }
+  /* the messages queued before are sent in a single batch, if they fit */
+  void run()
+  {
+    start(false);
+  }
+  std::string toString() override
+  {
+    return "test";
+  }
+  int getPeer() const
+  {
+    return d_peer;
+  }
+
+private:
+  bool reconnect() override
+  {
+    if (d_socket >= 0) {
+      return false;
+    }
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      return false;
+    }
+    d_socket = fds[0];
+    d_peer = fds[1];
+    if (d_sendBufferSize > 0) {
+      setsockopt(d_socket, SOL_SOCKET, SO_SNDBUF, &d_sendBufferSize, sizeof(d_sendBufferSize));
+    }
+    /* so that writev() only writes what fits into the buffer */
+    setNonBlocking(d_socket);
+    struct timeval tv{5, 0};
+    setsockopt(d_peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return true;
+  }
+
+  int d_sendBufferSize;
+  int d_peer{-1};
+};
+
+static void readExactly(int fd, char* buffer, size_t size)
+{
+  size_t pos = 0;
+  while (pos < size) {
+    ssize_t got = read(fd, buffer + pos, size - pos);
+    BOOST_REQUIRE_GT(got, 0);
+    pos += got;
+  }
+}
+
+static std::string readMessage(int fd, uint8_t lengthPrefixSize)
+{
+  unsigned char prefix[sizeof(uint32_t)];
+  readExactly(fd, reinterpret_cast<char*>(prefix), lengthPrefixSize);
+  size_t size = 0;
+  for (size_t idx = 0; idx < lengthPrefixSize; idx++) {
+    size = (size << 8) | prefix[idx];
+  }
+  std::string result(size, '\0');
+  readExactly(fd, &result.at(0), size);
+  return result;
+}
+
+static void waitForSent(const BatchedLogger& logger, uint64_t expected)
+{
+  for (size_t idx = 0; idx < 500 && logger.getSent() < expected; idx++) {
+    usleep(10000);
+  }
+  BOOST_REQUIRE_EQUAL(logger.getSent(), expected);
+}
+
+BOOST_AUTO_TEST_CASE(test_FullRing) {
+  TestLogger logger(4, sizeof(uint16_t));
+
+  /* nothing is sent yet, so only the first four messages fit */
+  for (size_t idx = 0; idx < 6; idx++) {
+    logger.queueData("message " + std::to_string(idx));
+  }
+  BOOST_CHECK_EQUAL(logger.getQueued(), 4);
+  BOOST_CHECK_EQUAL(logger.getDropped(), 2);
+
+  logger.run();
+  for (size_t idx = 0; idx < 4; idx++) {
+    BOOST_CHECK_EQUAL(readMessage(logger.getPeer(), sizeof(uint16_t)), "message " + std::to_string(idx));
+  }
+  waitForSent(logger, 4);
+
+  /* the ring has room again */
+  logger.queueData("message 6");
+  BOOST_CHECK_EQUAL(readMessage(logger.getPeer(), sizeof(uint16_t)), "message 6");
+  waitForSent(logger, 5);
+  BOOST_CHECK_EQUAL(logger.getQueued(), 5);
+  BOOST_CHECK_EQUAL(logger.getDropped(), 2);
+
+  /* an empty message is skipped */
+  logger.queueData("");
+  logger.queueData("message 7");
+  BOOST_CHECK_EQUAL(readMessage(logger.getPeer(), sizeof(uint16_t)), "message 7");
+  waitForSent(logger, 6);
+  BOOST_CHECK_EQUAL(logger.getDropped(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(test_Wraparound) {
+  TestLogger logger(4, sizeof(uint32_t));
+  logger.run();
+
+  /* three messages at a time in a ring of four, so every slot is used at every position */
+  size_t sent = 0;
+  for (size_t round = 0; round < 25; round++) {
+    for (size_t idx = 0; idx < 3; idx++) {
+      logger.queueData(std::string(round * 3 + idx + 1, 'a' + idx));
+    }
+    for (size_t idx = 0; idx < 3; idx++) {
+      BOOST_CHECK_EQUAL(readMessage(logger.getPeer(), sizeof(uint32_t)), std::string(round * 3 + idx + 1, 'a' + idx));
+    }
+    sent += 3;
+    waitForSent(logger, sent);
+  }
+  BOOST_CHECK_EQUAL(logger.getQueued(), sent);
+  BOOST_CHECK_EQUAL(logger.getDropped(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_PartialWrites) {
+  /* a batch much larger than the socket buffer, so that writev() is cut in the middle of messages */
+  TestLogger logger(64, sizeof(uint16_t), 4096);
+  const size_t count = 32;
+  for (size_t idx = 0; idx < count; idx++) {
+    std::string message(10000 + idx, 'a' + (idx % 26));
+    message.at(0) = 'S';
+    message.at(message.size() - 1) = 'E';
+    logger.queueData(message);
+  }
+  BOOST_CHECK_EQUAL(logger.getQueued(), count);
+  logger.run();
+
+  for (size_t idx = 0; idx < count; idx++) {
+    const auto message = readMessage(logger.getPeer(), sizeof(uint16_t));
+    BOOST_REQUIRE_EQUAL(message.size(), 10000 + idx);
+    BOOST_CHECK_EQUAL(message.at(0), 'S');
+    BOOST_CHECK_EQUAL(message.at(message.size() - 1), 'E');
+    BOOST_CHECK_EQUAL(message.find_first_not_of('a' + (idx % 26), 1), message.size() - 1);
+    /* give the worker the time to hit a full buffer */
+    usleep(1000);
+  }
+  waitForSent(logger, count);
+  BOOST_CHECK_EQUAL(logger.getDropped(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()